@@ -80,7 +80,7 @@
 //
 // Compile with:
 //
-// gcc `pkg-config --cflags gtk+-3.0` -Wall -o pardcap pardcap.c `pkg-config --libs gtk+-3.0` -lm -lpng -ljpeg -lpulse-simple -lpulse
+// gcc `pkg-config --cflags gtk+-3.0` -Wall -o pardcap pardcap.c `pkg-config --libs gtk+-3.0` -lm -lpng -ljpeg -lpulse-simple -lpulse -lpthread
 
 // Required Libs:
 //
@@ -152,6 +152,18 @@ int Use_audio;
 #include <jpeglib.h>
 #include <jerror.h>
 #include <setjmp.h> // To trap fatal errors from jpeglib
+// libjpeg-turbo (1.5 on) can decode just part of a frame, which the
+// full resolution tile preview uses (see jpeg_convert). Its version
+// number macro came in with 1.5 too, so older ones are left out.
+#if defined(LIBJPEG_TURBO_VERSION_NUMBER) && LIBJPEG_TURBO_VERSION_NUMBER >= 1005000
+#define JPEG_PARTIAL_DECODE
+#endif
+// Return codes from jpeg_decode():
+#define JDEC_OK      0 // Decoded
+#define JDEC_FAILED  1 // libjpeg gave up on it
+#define JDEC_HEADER  2 // Bad header
+#define JDEC_DIMS    3 // Not the current image size
+#define JDEC_CHANS   4 // Not 3 colour channels
 
 // The following is an extension of the default jpeg error handler used
 // to allow us to intercept a fatal 'exit(1)' error from libjpeg. This
@@ -200,8 +212,38 @@ my_error_exit (j_common_ptr cinfo)
 #include <sys/time.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
+#include <sys/timerfd.h> // Frame clock for the virtual frame sources
+#include <sys/epoll.h>   // One capture loop for several cameras
 #include <linux/videodev2.h>
 
+// This is needed for the capture thread that keeps the v4l2 buffer
+// queue serviced independently of the GUI
+#include <pthread.h>
+
+// SSE4.1 and AVX2 versions of the full-frame YUYV conversion are built
+// on x86 and one is picked at run time if the CPU has it (see
+// select_yuyv_kernel). Other machines (e.g. Raspberry Pi) use the plain
+// C version.
+#if defined(__x86_64__) || defined(__i386__)
+#define YUYV_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+// The full-size frame stores (Frm[r,g,b]), the dark and flat field
+// images and the preview masters are doubles unless built with
+// -DPARD_FLOAT32, in which case they are floats. That halves the RAM
+// they take (and the memory traffic of every full-frame pass), which
+// matters on small machines. The average stores (Av[r,g,b]) and the
+// frame sums stay double whatever. Raw doubles files are always read
+// and written as doubles.
+#ifdef PARD_FLOAT32
+typedef float fpix_t;
+#define FPIX_NAME "float32"
+#else
+typedef double fpix_t;
+#define FPIX_NAME "double"
+#endif
+
 // Camera defs
 typedef struct {
     char cs_opened;
@@ -214,6 +256,15 @@ typedef struct {
 #ifndef V4L2_PIX_FMT_H264
 #define V4L2_PIX_FMT_H264     v4l2_fourcc('H', '2', '6', '4')
 #endif
+#ifndef V4L2_PIX_FMT_Y10
+#define V4L2_PIX_FMT_Y10      v4l2_fourcc('Y', '1', '0', ' ')
+#endif
+#ifndef V4L2_PIX_FMT_Y12
+#define V4L2_PIX_FMT_Y12      v4l2_fourcc('Y', '1', '2', ' ')
+#endif
+#ifndef V4L2_PIX_FMT_Y16
+#define V4L2_PIX_FMT_Y16      v4l2_fourcc('Y', '1', '6', ' ')
+#endif
 
 // Here is how the camera (video device) status behaves.
 //
@@ -313,6 +364,22 @@ typedef struct {
 #define BMP 2 // 24bpp colour BMP file
 #define WORDSZ    4
 
+// A view of an image for the file writers. The samples can be bytes,
+// frame store values or doubles, interleaved or in separate planes, so
+// the writers can take them from wherever they already are and turn
+// them into the bytes each format wants a row at a time (see iv_row).
+#define IV_U8     0 // unsigned char samples
+#define IV_FPIX   1 // fpix_t samples, clipped to [0-255] when written
+#define IV_DOUBLE 2 // double samples, clipped to [0-255] when written
+typedef struct {
+    int wd,ht;            // Size in pixels
+    int nchan;            // 1 (grey) or 3 (colour)
+    int type;             // IV_U8, IV_FPIX or IV_DOUBLE
+    const void *plane[3]; // First R, G and B (or grey) sample
+    size_t step;          // Samples from one pixel to the next
+    size_t stride;        // Samples from one row to the next
+} ImgView;
+
 
 
 // Dark field subtraction
@@ -322,7 +389,7 @@ int dffile_loaded;          // Lets functions know if a dark field
 int DFht,DFwd;              // The dimensions of the currently loaded
                             // dark field image - to check if they are
                             // identical to the current main image.
-double *DF_Image;           // To hold the dark field reference image. 
+fpix_t *DF_Image;           // To hold the dark field reference image. 
 int dfcorr_status;          // Lets the program know whether the user
                             // has ticked the box for DF correction to
                             // be applied. Other conditions need to be
@@ -362,7 +429,7 @@ int fffile_loaded;          // Lets functions know if a flat field
 int FFht,FFwd;              // The dimensions of the currently loaded
                             // flat field image - to check if they are
                             // identical to the current main image. 
-double *FF_Image;           // The raw doubles version of flat field.
+fpix_t *FF_Image;           // The raw doubles version of flat field.
 int ffcorr_status;          // Lets the program know whether the user
                             // has ticked the box for FF correction to
                             // be applied. Other conditions need to be
@@ -444,6 +511,7 @@ int csetfile_loaded;        // Lets functions know if a settings file is
 #define CCHAN_R 2
 #define CCHAN_G 3
 #define CCHAN_B 4
+#define CCHAN_MOSAIC 5 // FITS only: the Bayer mosaic (see write_fits)
 
 // Camera and v4l2-related
 
@@ -469,6 +537,16 @@ enum io_method {
 struct buffer {
         void   *start;
         size_t  length;
+        int     dmabuf_fd;  // DMABUF export of this buffer (-1 if none)
+        // Lease state - shared by the capture thread and the consumers:
+        int     state;      // LEASE_QUEUED, LEASE_HELD or LEASE_RETIRED
+        int     refs;       // Number of consumers reading it right now
+        unsigned long seq;  // Sequence number of the frame it holds
+        size_t  bytesused;  // Size of that frame
+        unsigned int vseq;  // The driver's sequence number for it
+        long long mono_us;  // Its monotonic timestamp (microseconds)
+        long long wall_us;  // and UTC time (microseconds since epoch)
+        struct v4l2_buffer vbuf; // As dequeued, for re-queuing it
 };
 static char            *Dev_Name;
 static int             DevNum = 0;
@@ -483,6 +561,196 @@ static int skipframe,skiplim=0;
 static int frame_timeout_sec;  // Time to wait before giving
 static int frame_timeout_usec; // up on getting a frame.
 
+// Virtual frame sources. The -s command line option can select one of
+// these in place of a V4L2 device so the whole capture pipeline can be
+// run (and timed) without a camera. They look like a read i/o only
+// V4L2 device to the rest of the program - see vsrc_ioctl().
+#define VSRC_NONE   0  // A real V4L2 device (Dev_Name)
+#define VSRC_SYNTH  1  // Generated YUYV or MJPEG test pattern
+#define VSRC_REPLAY 2  // Frames replayed from recorded file(s)
+#define VSRC_PHASES 8  // Positions of the moving box in the test pattern
+#define VSRC_MAXDIM 16384 // Largest virtual frame width or height
+#define VSRC_PROBE_SIZE ((size_t)1 << 24) // Largest first MJPEG replay frame
+static int Vsrc_type = VSRC_NONE;
+static char Vsrc_spec[PATH_MAX];  // The -s argument (used as Dev_Name)
+static char Vsrc_file[PATH_MAX];  // Replay file name or numbered pattern
+static int Vsrc_numbered;         // 1 if Vsrc_file is a %d pattern
+static int Vsrc_first_idx,Vsrc_file_idx; // First and current file number
+static FILE *Vsrc_fp = NULL;      // Replay file being read
+static unsigned int Vsrc_fmt;     // Replay pixel format (as recorded)
+static unsigned int Vsrc_wd,Vsrc_ht; // Replay size or default synth size
+static double Vsrc_rate = 30.0;   // Frames per second
+static unsigned int Vsrc_cur_fmt,Vsrc_cur_wd,Vsrc_cur_ht; // As set by S_FMT
+static int Vsrc_ready;            // Test pattern made for current format
+static unsigned char *Vsrc_bg = NULL; // YUYV test pattern minus the box
+static unsigned char *Vsrc_jpg[VSRC_PHASES]; // MJPEG test pattern frames
+static unsigned long Vsrc_jpgsz[VSRC_PHASES];
+static unsigned long long Vsrc_ticks; // Frame periods since opening
+static enum io_method Vsrc_dev_io;  // io to restore for a real device
+
+// Capture thread and buffer leases.
+// While the camera is streaming, a dedicated thread runs the v4l2
+// DQBUF/QBUF loop continuously so a busy GUI no longer leaves the driver
+// queue unserviced. Each frame it dequeues is published, in place, by
+// giving it the next sequence number and marking its buffer as HELD.
+// The live preview and the grab (averaging / save) stages are consumers
+// that each keep their own cursor and take out a lease (a reference
+// count) on the buffer holding the frame they want. They read the
+// camera memory directly - no copy is made.
+// The capture thread keeps the newest Cap_hold_max frames HELD: half of
+// the buffers the driver actually gave (up to CAP_HOLD_FRAMES), leaving
+// the rest, and at least CAP_MIN_QUEUED, queued with it. An older frame
+// is RETIRED and re-queued as soon as no consumer holds a lease on it.
+// So a consumer may fall up to Cap_hold_max frames behind without
+// losing any - 2 with the default 4 buffers, 16 with 32. More buffers
+// (Gb_Buffers) buy more of both.
+// No locks are used: a consumer increments the count then checks the
+// buffer is still HELD with the sequence number it wanted, while the
+// thread marks a buffer RETIRED then checks the count, so at least one
+// side always sees the other (both use sequentially consistent atomics).
+#define CAP_MIN_QUEUED  2 // Buffers to leave queued with the driver
+#define CAP_HOLD_FRAMES 16 // Most frames held for consumers
+#define LEASE_QUEUED    0 // Buffer is with the driver (or free for read i/o)
+#define LEASE_HELD      1 // Buffer holds a published frame
+#define LEASE_RETIRED   2 // To be re-queued once no consumer holds it
+#define READ_NBUFS      4 // Number of buffers to use for read i/o
+// Limits and timing for the adaptive buffer queue depth (Gb_Buffers=0):
+#define NBUF_MIN        3 // Fewest buffers adaptive mode will shrink to
+#define NBUF_MAX       32 // Most buffers adaptive mode will grow to
+#define NBUF_START      4 // Where adaptive mode starts from
+#define NBUF_DEFAULT    4 // Gb_Buffers if not set otherwise
+#define NBUF_QUIET_SECS 120 // Gap-free live preview time before shrinking
+#define NBUF_SETTLE_SECS 3 // Gaps this soon after (re)starting are ignored
+static unsigned int    Cap_nbuf_adapt = NBUF_START; // Adaptive depth now
+static unsigned int    Cap_nbuf_floor = NBUF_MIN;   // Shallowest depth not
+                                                    // yet seen to drop frames
+static int             Cap_nbuf_shrunk = 0; // Shrunk since the last growth
+static unsigned int    Cap_nbuf_drvmax = NBUF_MAX; // Most the driver gives
+static unsigned long   Cap_seq_gaps = 0;   // Frames the driver skipped
+                                           // (gaps in v4l2 sequence no.)
+static unsigned int    Cap_last_vseq;      // Last v4l2 sequence number
+static int             Cap_vseq_valid;     // Cap_last_vseq has been set
+static unsigned long   Cap_gaps_seen = 0;  // Cap_seq_gaps when last checked
+static time_t          Cap_last_adapt;     // Time of last gap or resize
+// Per-frame timing. Each frame is tagged with its v4l2 sequence number
+// and the driver's timestamp, from which its UTC time is worked out.
+// The capture thread also keeps smoothed figures for the inter-frame
+// interval (hence the achieved frame rate) and its jitter.
+static long long       Cap_last_mono_us;   // Timestamp of previous frame
+static double          Cap_mean_dt_us;     // Smoothed inter-frame interval
+static double          Cap_jitter_us;      // Smoothed |interval - mean|
+// What went into the most recent grab (for the series log and the FITS
+// header):
+static long long       Obs_wall_us;        // UTC time of its first frame
+static long long       Obs_mono_us;        // and its monotonic timestamp
+static unsigned int    Obs_first_vseq;     // Driver sequence numbers of
+static unsigned int    Obs_last_vseq;      // its first and last frames
+static unsigned long   Obs_dropped;        // Frames lost during it
+static unsigned long   Obs_gaps_start;     // Cap_seq_gaps when it began
+static unsigned int    Cap_hold_max;       // Max. frames held for consumers
+static unsigned long   Cap_head = 0;       // Sequence number of the most
+                                           // recently published frame
+static pthread_t       Cap_thread;
+static int             Cap_thread_up = 0;  // Thread has been created
+static int             Cap_thread_run = 0; // Thread loops while this is 1
+static int             Cap_thread_err = 0; // GRAB_ERR_ code latched by
+                                           // the thread if it had to stop
+static int             Cap_thread_errno;   // errno that went with it
+static int             Cap_err_reported;   // So the user is told once only
+static unsigned long   Cap_prev_seq = 0;   // Preview cursor: last frame shown
+static unsigned long   Cap_grab_seq = 0;   // Grab cursor: next frame wanted
+static unsigned long   Cap_dropped = 0;    // Frames the grab consumer
+                                           // lost because they were
+                                           // re-queued before it got there
+static int             Cap_epfd = -1;      // epoll set the thread waits on
+static int             Cap_fresh_only = 0; // Hold only the newest frame
+                                           // (see wait_for_fresh_frame)
+static long long       Cap_ctrl_us = 0;    // Monotonic time a camera
+                                           // control was last set
+
+// Re-opening the camera when it is lost part way through a capture
+// (e.g. a USB glitch) so long series are not ended by it. See
+// reopen_camera(). Only errors that mean the device has gone count
+// (see camera_gone()); a slow or busy camera is not re-opened.
+#define REOPEN_TRIES     8 // Default attempts before giving up
+#define REOPEN_WAIT_MIN  1 // Seconds before the first attempt ...
+#define REOPEN_WAIT_MAX 60 // ... doubling after each failure up to this
+#define REOPEN_PER_GRAB  2 // Re-opens allowed for any one capture
+int Reopen_tries = REOPEN_TRIES; // 0 means never try
+static int Cam_reopening = 0;    // No popups while this is set - nobody
+                                 // may be there to dismiss them.
+static char Cam_card[32];        // The main camera's card name and bus as
+static char Cam_bus[32];         // last initialised, to find it again if it
+                                 // comes back as a different /dev/video node
+
+// Additional cameras. Up to MAX_AUXCAMS more V4L2 devices (given with
+// the -c command line option) stream alongside the main camera. The
+// capture thread services them all from one epoll set. Each has its own
+// pipeline context: format and size, the number of frames averaged per
+// saved image and a save root. Whenever the main camera saves an image,
+// each of them saves one too (as an RGB PNG file with the same frame
+// number) so the images from all cameras on the rig can be matched up.
+// While the main camera grabs an image that will be saved, and until
+// the saves are done, the capture thread keeps the last AUX_RING frames
+// of each in a ring (otherwise it just keeps back the newest frame in
+// its driver buffer) and a save worker thread per camera makes its image
+// from the frame nearest in time to the main camera's, so the GUI never
+// waits for them. What became of each save is reported (and put in the series
+// log) from the GUI thread by auxcam_report().
+// Calibration (dark, flat and mask) and the preview are for the main
+// camera only.
+#define MAX_AUXCAMS    3
+#define AUX_NBUFS      4          // Driver buffers per additional camera
+#define AUX_RING       8          // Newest frames kept per additional camera
+#define AUX_JOBS       4          // Saves that can be waiting per camera
+#define AUX_PRIMARY    0xFFFFFFFF // epoll tag for the main camera
+struct auxjob {                   // A save for an additional camera
+        int     fnum;             // Image number
+        long long t_us;           // Monotonic time of the main camera's
+                                  // frame (0 for the newest frame)
+        char    fname[PATH_MAX+32]; // File to save to
+        int     failed;           // What became of it (for auxcam_report)
+        char    txt[PATH_MAX+192];
+};
+struct auxcam {
+        char    name[PATH_MAX];   // Device e.g. /dev/video2
+        char    root[PATH_MAX];   // Save root ("" means <ImRoot>_camN)
+        unsigned int fmt,wd,ht;   // Pixel format and frame size
+        int     navg;             // Frames averaged per saved image
+        int     fd;
+        struct buffer *bufs;
+        unsigned int nbufs;
+        int     running;          // Streaming and in the epoll set
+        int     failed;           // Stopped by an error (not restarted)
+        int     err_errno;        // errno for that error
+        int     held;             // Driver buffer of the newest frame when
+        unsigned int held_bytes;  // it is not copied to the ring (-1 for
+        long long held_us;        // none), its size and timestamp
+        // The rest is shared with the capture thread and the save worker
+        // and guarded by lock:
+        pthread_mutex_t lock;
+        pthread_cond_t cond;      // Signalled for new frames and jobs
+        unsigned char *ring[AUX_RING]; // Copies of the newest frames (frame
+        size_t  ring_size[AUX_RING];   // n is in ring[n%AUX_RING]) with
+        long long ring_us[AUX_RING];   // their sizes and timestamps
+        unsigned long frames;     // Frames put in the ring
+        int     armed;            // Keep frames for a save about to be asked for
+        unsigned long dropped;    // Gaps in the driver sequence numbers
+        unsigned int last_vseq;
+        int     vseq_valid;
+        long long last_mono_us;
+        double  mean_dt_us,jitter_us; // As Cap_mean_dt_us, Cap_jitter_us
+        pthread_t worker;         // The save worker
+        int     worker_up,worker_run;
+        struct auxjob jobs[AUX_JOBS]; // Save jobs, job n in jobs[n%AUX_JOBS]:
+        unsigned long jobs_queued,jobs_done,jobs_reported; // counts of jobs
+                                  // asked for, done by the worker and
+                                  // reported by auxcam_report()
+        unsigned long failures;   // Saves that failed
+};
+static struct auxcam Auxcams[MAX_AUXCAMS];
+static int N_auxcams = 0;
+
 // General
 #define FOREVER for(;;)
 #define MAX_CMDLEN 512  // Maximum length for a command string.
@@ -504,6 +772,97 @@ double *lut_yR,*lut_yG,*lut_yB,*lut_crR,*lut_crG,*lut_cbG,*lut_cbB;
 double Gain_conv,Bias_conv; 
 // Whether the YUYV to RGB conversion luts have been calloced or not:
 int luts_alloced = 0; 
+// The same conversion in fixed point (YFX_SHIFT fractional bits) for the
+// full-frame YUYV kernels - see yuyv_frames_c(). Also set up by
+// calculate_yuyv_luts().
+#define YFX_SHIFT 14
+static struct {
+  int ky,kcrR,kcrG,kcbG,kcbB; // Gain_conv folded into the coefficients
+  int conr,cong,conb;         // and Bias_conv into the constants
+  int ok;                     // 0 if they are too big for 32 bit sums
+} Yfx;
+// And in double precision, for converting the mean Y, Cb and Cr of an
+// integer average (see band_average_int):
+static struct {
+  double ky,kcrR,kcrG,kcbG,kcbB,conr,cong,conb;
+} Ydbl;
+// The full-frame YUYV kernel for this CPU (see select_yuyv_kernel):
+typedef void (*yuyv_kernel_t)(const unsigned short *, int, const unsigned char *, fpix_t *, fpix_t *, fpix_t *, long long *);
+static yuyv_kernel_t Yuyv_kernel = NULL;
+static const char *Yuyv_kernel_name = "C";
+// Row band workers for the full-frame passes (see run_bands):
+#define BAND_COUNT       64 // Most bands an image is cut into
+#define BAND_MAX_THREADS 64 // Most threads (workers + caller) to use
+int Band_threads = 0;       // Threads to use (-j option), 0 = 1 per core
+typedef void (*band_fn_t)(int, int, int, void *);
+#define FUSE_CHUNK      512 // Pixels band_frame converts at a time
+struct band_job {
+  const unsigned short *p;  // YUYV frame for band_frame and band_sums
+  int dark,flat;            // Do dark and/or flat field correction
+  int scale;                // Scale by k (mean scaling)
+  double k[3];              // Mean scaling factors
+  int accumulate;           // Add to Av[r,g,b], else put in Frm
+};
+static struct {
+  pthread_t tid[BAND_MAX_THREADS];
+  int nworkers;             // Worker threads running (besides the caller)
+  int up;                   // Pool has been started
+  pthread_mutex_t lock;
+  pthread_cond_t go,done;
+  unsigned long job;        // Goes up by one for each job
+  int busy;                 // Workers working on a job
+  int quit;                 // Set to tell the workers to finish
+  band_fn_t fn;             // The current job ...
+  void *arg;
+  int nbands,rows;          // ... its number of bands, rows per band
+  int next;                 // and next band to be taken
+} Bands;
+static struct {
+  long long isum[3];        // Fixed point sums from the YUYV kernels
+  double dsum[3];           // Other sums
+  int grow[3];              // Row+1 of the greens in each Band_grn row
+                            // (0 for none yet this frame)
+} Band_part[BAND_COUNT];    // Per band sums (for the frame means)
+static struct {
+  double *g;                // 3 rows of BAYER_EDGE greens (see
+  int wd;                   // bayer_green_row) and the width they are for
+} Band_grn[BAND_COUNT];
+// MJPEG decode workers for multi-frame averages. The grab stage copies
+// each compressed frame into the next free slot (giving the capture
+// buffer straight back) and any idle worker decodes it into the slot's
+// own full size RGB block. The frames are then added to the average in
+// the order they were taken (see mjdec_next).
+#define MJDEC_MAX_WORKERS 16 // Most decode worker threads
+#define MJDEC_MAX_SLOTS   (MJDEC_MAX_WORKERS+2)
+#define MJSLOT_FREE   0 // Slot states: empty,
+#define MJSLOT_QUEUED 1 // holding a frame to be decoded,
+#define MJSLOT_BUSY   2 // being decoded
+#define MJSLOT_DONE   3 // or decoded (or failed, see err)
+struct mjdec_slot {
+  unsigned char *jpg;       // Copy of the compressed frame
+  size_t jpgalloc;          // Bytes allocated to jpg
+  int size;                 // Bytes in the frame
+  int luma;                 // Decode just the luma (see Mjpeg_luma)
+  unsigned char *rgb;       // The decoded frame (RGBsize bytes)
+  int wd;                   // Width of its rows (see jpeg_decode)
+  int err;                  // JDEC_ code from decoding it
+  int state;                // MJSLOT_ value
+  unsigned long seq;        // Frame number within the average
+};
+static struct {
+  pthread_t tid[MJDEC_MAX_WORKERS];
+  int nworkers;             // Worker threads running
+  int up;                   // Pool has been started
+  pthread_mutex_t lock;     // Guards the slot states
+  pthread_cond_t go;        // Signalled when a frame is queued
+  int quit;                 // Set to tell the workers to finish
+  int nslots;               // Slots in use for this average
+  int nalloc;               // Slots that have an RGB block ...
+  int rgbsize;              // ... of this many bytes (RGBsize when got)
+  unsigned long nsub;       // Frames handed to the workers so far
+  unsigned long nacc;       // Frames taken for the average so far
+  struct mjdec_slot slot[MJDEC_MAX_SLOTS];
+} Mjdec;
 // To store the full-size colour converted camera image (also used for
 // Y-only image):
 unsigned char *RGBimg; 
@@ -559,16 +918,21 @@ int preview_stored; // Flag that lets us know if a preview image was
 int Preview_changed; // Lets us know we need to update preview
                      // parameters after an 'Apply' settings click.
 
-#define PREVINTMAX 20 // Maximum No. of frames for integration.
+#define PREVINTMAX 500 // Maximum No. of frames for integration.
                     
 unsigned char *PreviewImg,*PreviewRow;
-int           *PreviewBuff[PREVINTMAX];
+// The last Preview_integral Y preview frames (PreviewIDX is the oldest,
+// next to be replaced) and, in PreviewSum, their running sum (see
+// preview_integrate)
+unsigned char *PreviewBuff[PREVINTMAX];
+int            PreviewBuff_n=1; // How many of them are full size
+int           *PreviewSum;
 int            PreviewImg_size,PreviewImg_rgb_size;
 int            PreviewHt,PreviewWd,PreviewWd_stride;
 int            Preview_impossible,Need_to_preview;
 int            Preview_integral,Preview_bias,PreviewIDX;
-double        *Preview_dark; // Master dark for live preview
-double        *Preview_flat; // Master flat for live preview
+fpix_t        *Preview_dark; // Master dark for live preview
+fpix_t        *Preview_flat; // Master flat for live preview
 unsigned char *Preview_ColDark; // Dark field for colour live preview
 int            PrevCorr_BtnStatus = 0; // Preview correction btn state
 int            PrevDark_Loaded = 0; // Whether a preview dark is loaded
@@ -603,9 +967,28 @@ int  fpx_max=10;
 // Variables for subsampling down monochrome images to preview size:
 int Prev_startrow,Prev_startcol; // For centering the preview image
 int Prev_endrow,Prev_endcol;     // For blanking boundaries
+int Prev_nrows,Prev_ncols;       // How many preview rows and cols have
+                                 // sample points (the first ones, as
+                                 // SSrow and SScol are -1 after those)
+int Prev_mskstart;               // Mask index of the first sample point
+int Prev_mskrowstep,Prev_mskcolstep; // and the steps to the next row and
+                                 // col (backwards if flipped that way)
 int Img_startrow,Img_startcol; // For selecting tile of full scale image
 int *SSrow,*SScol; // Subsampling index arrays
 double Prev_scaledim; // Calculate preview sampling and tile centering.
+// MJPEG frames decoded only for the preview are scaled down by libjpeg
+// (in its IDCT) by 1/Jpeg_prev_denom, the largest of 1/2, 1/4 or 1/8 no
+// smaller than the preview's own scale. SSrow_j and SScol_j are SSrow
+// and SScol for a decode scaled like that (Jpeg_prev_wd pixels wide),
+// Jpeg_rgbimg_denom is the scale RGBimg was last decoded at and
+// Jpeg_rgbimg_wd its width. The two must agree for SSrow_j and SScol_j
+// to be used on it.
+int *SSrow_j,*SScol_j;
+int Jpeg_prev_denom=1,Jpeg_prev_wd,Jpeg_rgbimg_denom=1,Jpeg_rgbimg_wd;
+// The rows [0] to [1]-1 and columns [2] to [3]-1 of the full frame that
+// a full resolution tile preview shows (all 0 when there is no tile).
+// Only these are decoded from MJPEG frames for the preview.
+int Jpeg_prev_tile[4];
 
 // These enable the preview of a tile crop window from the full-sized
 // captured image (as opposed to a scaled down subsample):             
@@ -719,10 +1102,16 @@ int windex_rmski;            // Corrections mask label
 int windex_pmski;            // Preview mask label
 int windex_pcdi;             // Preview colour dark label
 int windex_to,windex_rt;   // Frame grabber timeout and no. of retries. 
+int windex_nb;             // Number of v4l2 capture buffers
 int windex_srn,windex_srd; // Image series controls.
 int windex_sad;            // Save as raw doubles 
 int windex_fit;            // Save as FITS (with pixels as doubles) 
 int windex_smf;            // Scale mean of each frame to first
+int windex_fsh;            // Grab the freshest frame
+int windex_jly;            // Y-only saves from MJPEG as JPEG luma
+int windex_new13;          // Number of widgets added since version 1.2
+                           // settings files (nb, fsh and jly), so those
+                           // files can still be loaded.
 int windex_del;            // Delayed start to capture
 int windex_jpg;            // JPEG save as quality for averaged images
                            // (does not apply to single frames directly
@@ -765,6 +1154,23 @@ int Save_as_FITS=0;        // Save the image in FITS format (in
                            // the image capture and processing settings
                            // than the external header saved with the
                            // raw doubles option.
+int Fits_bitpix=-64;       // BITPIX of saved FITS files: -64 (doubles),
+                           // -32 (floats) or 16 (integers in the
+                           // camera's own sample units, see
+                           // camfmt_scale), set with --bitpix
+
+// How the frames of Bayer streams are demosaiced, set with --bayer:
+#define BAYER_BILINEAR 0 // Each missing colour is the mean of its
+                         // nearest neighbours of that colour
+#define BAYER_EDGE     1 // Green is interpolated along, not across,
+                         // edges and red and blue follow it (see
+                         // bayer_green)
+int Bayer_demosaic=BAYER_BILINEAR;
+int Bayer_mosaic_fits=0;   // 1 to save the undemosaiced mosaic as a
+                           // FITS file too (when saving FITS in colour)
+// What a site of a Bayer frame with pattern cfa (see camfmt_bayer) is:
+// 0 red, 1 green in a red row, 2 green in a blue row or 3 blue.
+#define BAYER_SITE(cfa,row,col) (((((row)&1)<<1)|((col)&1))^(cfa))
 
 int Selected_Ht,Selected_Wd; // The image dimensions selected from the
                              // combo list, prior to them being applied.
@@ -779,13 +1185,25 @@ unsigned int ctrl_id[MAX_CAM_SETTINGS],cswt_id[MAX_CAM_SETTINGS];
 
 // Frame stores to hold the captured and decoded image prior to any
 // further processing such as dark field and flat field corrections.
-double *Frmr,*Frmg,*Frmb;
+fpix_t *Frmr,*Frmg,*Frmb;
 int Frame_status=0; // Let us know if frame stores are alloced.
 #define FRM_ALLOCED 1
 #define FRM_FREED   0
 
 // Accumulators to hold multiframe average images.
 double *Avr,*Avg,*Avb; 
+// When an average has no dark field, flat field or mean scaling to do
+// these are used instead: the camera's samples (the YUYV bytes, just
+// the Y ones for a Y-only image, the decoded RGB for MJPEG, or the
+// monochrome samples or NV12 Y plane) are added up exactly as unsigned
+// shorts, or unsigned ints if there are more than 257 frames or the
+// samples are deeper than 8 bits, and only converted at the end.
+void *Avi;                 // The sums
+int Avi_wide=0;            // 1 if they are unsigned ints
+int Avi_active=0;          // 1 if Avi is in use for this average
+int Av_luma=0;             // 1 if this average adds up just the luma of
+                           // MJPEG frames (see jpeg_luma_wanted)
+int Av_added=0;            // Frames actually added to the average so far
 
 // The mean to shift each frame to before accumulating them into the
 // multi-frame average accumulators
@@ -802,6 +1220,15 @@ int Accumulator_status=0; // Let us know if accumulators are alloced.
 // Number of seconds to wait to a frame from the frame grabber while
 // capturing (not preview) and the number of times to retry
 int Gb_Timeout=360, Gb_Retry=100;
+// Number of v4l2 buffers to ask the driver for (shared between those
+// queued with it and those held for consumers, see Cap_hold_max). A
+// deeper queue rides out longer stalls (e.g. 30 fps MJPEG while saving
+// FITS) but a shallow one has less latency. 0 means 'adaptive' - see
+// adapt_buffer_depth().
+int Gb_Buffers=NBUF_DEFAULT;
+// 1 to grab the freshest frame rather than the next one to arrive - see
+// wait_for_fresh_frame().
+int Gb_Freshest=0;
 
 // Settings for image series (including time-lapse).
 // Number of images to capture in a series and time delay between each
@@ -825,6 +1252,29 @@ char Ser_name[FILENAME_MAX],Ser_logname[FILENAME_MAX+64];
 // Function to re-size memory storage for pointers
 int resize_memblk(void **,size_t, size_t,char *);
 
+// The large blocks touched on every frame (read and userptr capture
+// buffers, RGBimg and the Frmr/g/b frame stores) come from big_alloc()
+// rather than malloc/calloc. They are always page aligned and can also
+// be backed by huge pages, so a 5 MP frame is a few TLB entries rather
+// than thousands, and locked into RAM so they are never paged out (see
+// the -m command line option).
+#define BIGMEM_PAGE   0 // Page aligned heap memory (the default)
+#define BIGMEM_THP    1 // As above but advised as transparent huge pages
+#define BIGMEM_HUGE   2 // Mapped from the reserved huge page pool
+#define BIGMEM_MAXBLK 64 // Most blocks big_alloc() keeps track of
+int Bigmem_mode = BIGMEM_PAGE;
+int Bigmem_pin = 0;     // 1 to mlock() the blocks
+static struct bigblk {
+  void   *start;
+  size_t length;  // Bytes allocated (or mapped)
+  int    mapped;  // 1 if from mmap, 0 if from the heap
+  int    locked;  // 1 if mlock()ed
+} Bigblk[BIGMEM_MAXBLK];
+static int Bigmem_warned = 0; // So each fallback is reported once only
+void *big_alloc(size_t, char *);
+void big_free(void *);
+int resize_bigblk(void **,size_t, size_t,char *);
+
 // The format to use when saving a captured full frame image to disk:
 int saveas_fmt; 
 // Values for saveas_fmt
@@ -838,18 +1288,57 @@ int Nsafs=8;
 #define SAF_BMP  5 // Full colour RGB array saved in 24bpp BMP format
 #define SAF_PNG  6 // Full colour PNG file
 #define SAF_JPG  7 // Full colour JPEG file
+// 1 to make Y-only (SAF_YP5 and SAF_BM8) images from an MJPEG stream by
+// decoding just the luma (Y) of each JPEG frame, rather than decoding
+// it to RGB and taking (R+G+B)/3 - see jpeg_convert(). This is much
+// quicker but it is the JPEG's own Y (0.299R + 0.587G + 0.114B), so the
+// values are not the same as those of the (R+G+B)/3 images.
+int Mjpeg_luma=0;
+// 1 while RGBimg holds a luma-only JPEG decode (one byte per pixel)
+int Jpeg_luma_rgbimg=0;
+// 1 if the last JPEG decode into RGBimg worked (if not, what is there is
+// not a frame and must not go into an average)
+int Jpeg_rgbimg_ok=0;
+// 1 while process_image() is given an MJPEG frame that has already been
+// decoded into RGBimg by a decode worker (see mjdec_take)
+int Mjpeg_predecoded=0;
 
 // The format used by the data stream from the camera:
 unsigned int CamFormat;
 int FormatForbidden;
 
 // Values for camfmt_options
-const char *camfmt_options[] = {"Raw YUYV","MJPEG"};
-int Ncamfs=2;
+const char *camfmt_options[] = {"Raw YUYV","MJPEG","GREY","Y10","Y12","Y16","NV12",
+   "Bayer RGGB","Bayer GRBG","Bayer GBRG","Bayer BGGR",
+   "Bayer RGGB10","Bayer GRBG10","Bayer GBRG10","Bayer BGGR10"};
+int Ncamfs=15;
 #define CAF_YUYV   0 // Raw YUYV 16 bpp array
 #define CAF_MJPEG  1 // Y-only (greyscale) 8bpp pgm p5 format
-#define CAF_ALLOK  3 // For the FormatForbidden flag
-#define CAF_ALLBAD 4 // For the FormatForbidden flag
+#define CAF_GREY   2 // Monochrome, 8 bits per pixel
+#define CAF_Y10    3 // Monochrome, 10 bits in each 16 bit (LE) word
+#define CAF_Y12    4 // Monochrome, 12 bits in each 16 bit (LE) word
+#define CAF_Y16    5 // Monochrome, 16 bits per pixel (LE)
+#define CAF_NV12   6 // Y plane then half size interleaved CbCr plane
+#define CAF_BAYER8 7 // The 4 Bayer (raw colour filter array) patterns
+                     // with 8 bits per pixel, then ...
+#define CAF_BAYER10 11 // ... the same with 10 bits in each 16 bit
+                       // (LE) word
+// The V4L2 pixel format of each, and the tag for its raw frame files:
+const unsigned int camfmt_fourcc[] = {V4L2_PIX_FMT_YUYV,V4L2_PIX_FMT_MJPEG,
+   V4L2_PIX_FMT_GREY,V4L2_PIX_FMT_Y10,V4L2_PIX_FMT_Y12,V4L2_PIX_FMT_Y16,V4L2_PIX_FMT_NV12,
+   V4L2_PIX_FMT_SRGGB8,V4L2_PIX_FMT_SGRBG8,V4L2_PIX_FMT_SGBRG8,V4L2_PIX_FMT_SBGGR8,
+   V4L2_PIX_FMT_SRGGB10,V4L2_PIX_FMT_SGRBG10,V4L2_PIX_FMT_SGBRG10,V4L2_PIX_FMT_SBGGR10};
+const char *camfmt_rawtag[] = {"yuyv","mjpeg","grey","y10","y12","y16","nv12",
+   "rggb8","grbg8","gbrg8","bggr8","rggb10","grbg10","gbrg10","bggr10"};
+// FormatForbidden has a CAF_BIT for each format the camera can't do
+#define CAF_BIT(caf) (1<<(caf))
+#define CAF_ALLOK  0    // For the FormatForbidden flag
+#define CAF_ALLBAD 0x7fff // For the FormatForbidden flag (all Ncamfs bits)
+// Samples from the Y10, Y12 and Y16 streams are scaled into the same
+// 0-255 range as the 8-bit ones as they are converted (see
+// camfmt_scale) but are kept as fractions in the frame stores, the
+// averages and the raw doubles and FITS files, so none of their depth
+// is lost.
 
 
 // Values for col_conv_type
@@ -870,6 +1359,8 @@ GtkWidget *Win_main;
 GtkWidget *dlg_choice,*dlg_info;
 GtkWidget *chk_preview_central,*chk_cam_yonly,*chk_useffcor;
 GtkWidget *chk_scale_means;
+GtkWidget *chk_freshest;
+GtkWidget *chk_jpeg_luma;
 GtkWidget *chk_usehcr,*chk_usehcg,*chk_usehcb;
 GtkWidget *chk_useppi,*chk_useppl,*chk_usefls,*chk_useflv;
 GtkWidget *chk_usefph,*chk_usefpv;
@@ -897,6 +1388,7 @@ GtkWidget *prev_int_label,*prev_bias_label;
 GtkWidget *Grid_prevstats;
 GtkWidget *PrevSt_sat_r,*PrevSt_sat_g,*PrevSt_sat_b; // Saturation related
 GtkWidget *PrevSt_sum_r,*PrevSt_sum_g,*PrevSt_sum_b; // Summary stats
+GtkWidget *PrevSt_capture; // Capture queue stats
 GtkWidget *Prev_btn_hgm,*Prev_btn_focus;
 GtkWidget *lab_stats_title2;
 
@@ -951,8 +1443,9 @@ int change_image_dimensions(void);
                           // to set the preview choice
 
 
-int raw_to_pgm(char *fname, int ht, int wd,void *data);
-int raw_to_ppm(char *fname, int ht, int wd,void *data);
+int raw_to_pgm(char *fname, const ImgView *iv);
+int raw_to_ppm(char *fname, const ImgView *iv);
+unsigned char uchar_from_d(double);
 
 // I channel all messages to user via this one function. It allows me to
 // control whether a GUI popup box should be used and/or whether the
@@ -974,11 +1467,24 @@ FILE* fplog = NULL;           // For the log file - always set to NULL
                               // open.
 int Log_wanted = 0; // A global to let us know if log entries to a file
                     // are to be attempted.
+int Headless = 0;   // Set by the --headless option: capture the series
+                    // a settings file describes without the GUI, then
+                    // exit with one of the HLS_ codes below.
+int Headless_corr;  // Corrections a headless settings file asks for
+#define HLC_DF  1   // Dark field subtraction
+#define HLC_FF  2   // Flat field division
+#define HLC_MSK 4   // Corrections mask
+// Exit status of a headless run
+#define HLS_OK      0 // Every image was captured and saved
+#define HLS_ESETS   1 // The settings file could not be read or applied
+#define HLS_ECAM    2 // The camera could not be started
+#define HLS_EGRAB   3 // One or more images failed to capture
 
 static int grab_image(void);
 
 static void btn_cam_save_click(GtkWidget *,gpointer);
 static int set_dims_as_per_selected(void);
+static void mjdec_free_slots(void);
 void nullify_flatfield(void);
 static int init_flatfield_image(int);
 void nullify_darkfield(void);
@@ -989,12 +1495,16 @@ int test_selected_msk_filename(char *);
 int test_selected_pmsk_filename(char *);
 int test_selected_pcd_filename(char *);
 
+static int xioctl(int, int, void *);
 static int open_device(void);
 static int init_device(void);
 static int uninit_device(void);
 static int close_device(void);
 static int start_streaming(void);
 static int stop_streaming(void);
+static int auxcam_save_all(int);
+static int auxcam_report(void);
+static void auxcam_arm_all(int);
 static int calculate_preview_params(void);
 static void change_cam_status(int, char);
 static void toggled_cam_preview(GtkWidget *,gpointer);
@@ -1004,7 +1514,7 @@ int update_preview_settings(int);
 int set_camera_control(unsigned int, int, char *);
 int get_camera_control(unsigned int, int *);
 static void calculate_yuyv_luts(void);
-int raw_to_bmp(unsigned int,unsigned int, unsigned char **, char *,int); 
+int raw_to_bmp(const ImgView *, char *); 
 int try_running_camera(void);
 
 
@@ -1163,11 +1673,11 @@ int enumerate_camera_settings(void)
  returnval=CSE_SUCCESS;
    
  vd_queryctrl.id = V4L2_CTRL_FLAG_NEXT_CTRL;
- while (0 == ioctl(fd, VIDIOC_QUERYCTRL, &vd_queryctrl)) {
+ while (0 == xioctl(fd, VIDIOC_QUERYCTRL, &vd_queryctrl)) {
       if (!(vd_queryctrl.flags & V4L2_CTRL_FLAG_DISABLED)) {
          // Query the vd_control and get current value, name and ranges
          vd_control.id = vd_queryctrl.id;
-         if (0 == ioctl(fd, VIDIOC_G_CTRL, &vd_control)) currval=vd_control.value;
+         if (0 == xioctl(fd, VIDIOC_G_CTRL, &vd_control)) currval=vd_control.value;
          else {
                // There will be an error for title nodes - you can't get
                // or set their values - so don't include these in true
@@ -1208,7 +1718,7 @@ int enumerate_cs_menu(unsigned int id,unsigned int sdx)
     vd_querymenu.id = id;
 
     for (vd_querymenu.index = vd_queryctrl.minimum; vd_querymenu.index <= vd_queryctrl.maximum; vd_querymenu.index++){
-       if (0 == ioctl(fd, VIDIOC_QUERYMENU, &vd_querymenu)){
+       if (0 == xioctl(fd, VIDIOC_QUERYMENU, &vd_querymenu)){
             sprintf(ctrl_name,"%s", vd_querymenu.name);
             nomlen=strlen(ctrl_name); nomlen++;
             if((CSlist[sdx].miname[CSlist[sdx].num_menuitems]=(char *)malloc(nomlen))==NULL){
@@ -1241,8 +1751,8 @@ int print_cs_file(const char *fname)
  
  fp=fopen(fname,"wb");
  if(fp==NULL){ show_message("Failed to open file for writing camera settings.","File Save FAILED: ",MT_ERR,1); return 1;}
- // Write a header to identify this file format (current version is 1.2)
- fprintf(fp,"PCamSet 1.2 %u %d\n\n",NCSs,windex);
+ // Write a header to identify this file format (current version is 1.3)
+ fprintf(fp,"PCamSet 1.3 %u %d\n\n",NCSs,windex);
  // Now loop through the camera settings with their current values
  for(sdx=0;sdx<NCSs;sdx++){
    fprintf(fp,"\nidx:  %u\n",sdx);
@@ -1403,7 +1913,7 @@ int test_framerate_resolutions(unsigned int lwd, unsigned int lht, unsigned int
    // Test the supplied lwd andlht combination against those supported
    // by the camera for image stream of cfmt
    selectedfdx = 0;
-   while(0 == ioctl(fd, VIDIOC_ENUM_FRAMESIZES, &frmsizeenum)){
+   while(0 == xioctl(fd, VIDIOC_ENUM_FRAMESIZES, &frmsizeenum)){
          if(lwd==frmsizeenum.discrete.width && lht==frmsizeenum.discrete.height) selectedfdx++;
          fdx++; // index of next frame size to query  
          frmsizeenum.index=fdx;
@@ -1561,6 +2071,167 @@ int resize_memblk(void **ptr,size_t blocksz, size_t unitsize, char *pname)
  return 0;
 }
 
+static size_t bigmem_hugesz(void)
+// The system's default huge page size (as used by MAP_HUGETLB) in bytes,
+// read once from /proc/meminfo. 2 MB is assumed if it can't be read.
+{
+ static size_t hugesz = 0;
+ FILE *fp;
+ char line[128];
+ unsigned long kb;
+
+ if(hugesz) return hugesz;
+ hugesz = 2048*1024;
+ fp = fopen("/proc/meminfo","r");
+ if(fp == NULL) return hugesz;
+ while(fgets(line,128,fp) != NULL)
+   if(sscanf(line,"Hugepagesize: %lu kB",&kb) == 1 && kb){
+     hugesz = (size_t)kb*1024;
+     break;
+    }
+ fclose(fp);
+ return hugesz;
+}
+
+void *big_alloc(size_t nbytes, char *pname)
+// Get a zeroed, page aligned block of nbytes for one of the large
+// stores, backed by huge pages and/or locked into RAM as per
+// Bigmem_mode and Bigmem_pin. If huge pages or locking can't be had
+// the user is told (once) and the block is got without them.
+// The block MUST be given back with big_free(), not free().
+// Returns NULL if no memory could be got at all.
+{
+ char emsg[256];
+ size_t pagesz, hugesz, align, length;
+ void *ptr = NULL;
+ int idx, mapped = 0;
+
+ if(nbytes == 0) nbytes = 1;
+ pagesz = (size_t)sysconf(_SC_PAGESIZE);
+ hugesz = bigmem_hugesz();
+ for(idx=0;idx<BIGMEM_MAXBLK;idx++) if(Bigblk[idx].start == NULL) break;
+ if(idx == BIGMEM_MAXBLK){ // Can't track it so keep it plain
+   if(posix_memalign(&ptr, pagesz, nbytes)) return NULL;
+   memset(ptr, 0, nbytes);
+   return ptr;
+  }
+
+ length = (nbytes + pagesz - 1) / pagesz * pagesz;
+ if(Bigmem_mode == BIGMEM_HUGE){
+   // Anonymous mappings come zeroed. The length must be a whole number
+   // of huge pages for munmap.
+   length = (nbytes + hugesz - 1) / hugesz * hugesz;
+   ptr = mmap(NULL, length, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+   if(ptr == MAP_FAILED){
+     ptr = NULL;
+     if(!(Bigmem_warned & 1)){
+       sprintf(emsg,"No huge pages for %s (%s).\nReserve some via /proc/sys/vm/nr_hugepages. Using transparent huge pages instead.",pname,strerror(errno));
+       show_message(emsg,"Memory Warning: ",MT_ERR,0);
+       Bigmem_warned |= 1;
+      }
+     length = (nbytes + pagesz - 1) / pagesz * pagesz;
+    } else mapped = 1;
+  }
+ if(ptr == NULL){
+   // Blocks of a huge page or more are aligned to one so the kernel can
+   // back them with transparent huge pages if asked.
+   align = (Bigmem_mode != BIGMEM_PAGE && nbytes >= hugesz) ? hugesz : pagesz;
+   if(posix_memalign(&ptr, align, length)) return NULL;
+   if(Bigmem_mode != BIGMEM_PAGE) madvise(ptr, length, MADV_HUGEPAGE);
+   memset(ptr, 0, length); // Also faults every page in now, not per frame
+  }
+
+ Bigblk[idx].start = ptr;
+ Bigblk[idx].length = length;
+ Bigblk[idx].mapped = mapped;
+ Bigblk[idx].locked = 0;
+ if(Bigmem_pin){
+   if(mlock(ptr, length)){
+     if(!(Bigmem_warned & 2)){
+       sprintf(emsg,"Could not lock %s into RAM (%s).\nRaise the locked memory limit (ulimit -l) to allow this.",pname,strerror(errno));
+       show_message(emsg,"Memory Warning: ",MT_ERR,0);
+       Bigmem_warned |= 2;
+      }
+    } else Bigblk[idx].locked = 1;
+  }
+ return ptr;
+}
+
+void big_free(void *ptr)
+// Give back a block got from big_alloc(). Blocks that big_alloc() did
+// not hand out (e.g. the 1 unit starter blocks calloc'ed in main) are
+// simply freed.
+{
+ int idx;
+
+ if(ptr == NULL) return;
+ for(idx=0;idx<BIGMEM_MAXBLK;idx++) if(Bigblk[idx].start == ptr) break;
+ if(idx == BIGMEM_MAXBLK){
+   free(ptr);
+   return;
+  }
+ if(Bigblk[idx].locked) munlock(ptr, Bigblk[idx].length);
+ if(Bigblk[idx].mapped) munmap(ptr, Bigblk[idx].length);
+ else free(ptr);
+ Bigblk[idx].start = NULL;
+}
+
+int resize_bigblk(void **ptr,size_t blocksz, size_t unitsize, char *pname)
+// As resize_memblk() but for the large stores got with big_alloc().
+{
+ char emsg[256];
+
+ if(*ptr==NULL) return 1; // See resize_memblk()
+ big_free(*ptr); *ptr=NULL;
+ *ptr=big_alloc(blocksz*unitsize,pname);
+ if(*ptr==NULL){
+    sprintf(emsg,"Failed to get %zu memory units for %s.",blocksz,pname);
+    show_message(emsg,"Memory Error: ",MT_ERR,1);
+    *ptr=big_alloc(unitsize,pname);
+    if(*ptr==NULL){
+      sprintf(emsg,"Could not get even re-initialise %s. This is a serious memory error.\nPlease save your work and exit ASAP because the program may crash at any time without further notice.",pname);
+      show_message(emsg,"Memory Error: ",MT_ERR,1);
+      return 1;
+    } 
+    return 1;
+  }
+ return 0;
+}
+
+int bigmem_parse_spec(const char *spec)
+// Set how the large stores are allocated from the -m command line
+// argument spec: one of page, thp or huge, optionally followed by
+// ,pin (or just pin for page aligned, locked blocks). e.g. huge,pin
+// This is called before the GUI is up so errors go to stderr.
+// Returns 0 on success, 1 on error.
+{
+ char buf[32],*pin;
+
+ if(strlen(spec) >= 32) goto bad_spec;
+ sprintf(buf,"%s",spec);
+ pin = strchr(buf,',');
+ if(pin != NULL) *pin++ = '\0';
+ if(!strcmp(buf,"pin") && pin == NULL){
+   Bigmem_mode = BIGMEM_PAGE;
+   Bigmem_pin = 1;
+   return 0;
+  }
+ if(!strcmp(buf,"page")) Bigmem_mode = BIGMEM_PAGE;
+  else if(!strcmp(buf,"thp")) Bigmem_mode = BIGMEM_THP;
+   else if(!strcmp(buf,"huge")) Bigmem_mode = BIGMEM_HUGE;
+    else goto bad_spec;
+ if(pin != NULL){
+   if(strcmp(pin,"pin")) goto bad_spec;
+   Bigmem_pin = 1;
+  }
+ return 0;
+
+bad_spec:
+ fprintf(stderr,"\nUnknown memory mode: %s (use page, thp or huge, optionally with ,pin)\n",spec);
+ return 1;
+}
+
 int arg_count(char *line)
 {
     int numtok, len, idx;
@@ -1872,9 +2543,11 @@ int csetfile_check(FILE *fp, unsigned int *linenum, char *errmsg)
                sprintf(errmsg, "Not a valid PARDUS settings file. It does not begin with PCamSet.");
                returnvalue = PCHK_E_FORMAT; break;
               }
-            // The current version is 1.2
-            if (strcmp(argstr2, "1.2")) {
-               sprintf(errmsg, "%s: The chosen settings file version ('%s') is incompatible with the version used by this program (1.2).", argstr1, argstr2);
+            // The current version is 1.3. Version 1.2 files are the
+            // same but without the settings added since (which are
+            // optional anyway) and so with fewer widgets.
+            if (strcmp(argstr2, "1.3") && strcmp(argstr2, "1.2")) {
+               sprintf(errmsg, "%s: The chosen settings file version ('%s') is incompatible with the version used by this program (1.3).", argstr1, argstr2);
                returnvalue = PCHK_E_FORMAT; break;
               }
             // The number after this is the number of used camera
@@ -1889,8 +2562,10 @@ int csetfile_check(FILE *fp, unsigned int *linenum, char *errmsg)
             // store the settings in the GUI.
             // This must equal the global windex value of the current
             // camera else the settings in the file are not compatible:
+            // There are no such widgets in headless mode.
             inum1 = atoi(argstr4);
-            if(inum1!=windex){
+            if(!strcmp(argstr2, "1.2")) inum1+=windex_new13;
+            if(!Headless && inum1!=windex){
                sprintf(errmsg, "%s: '%s' is not equal to the current number of camera control entry boxes (%d).", argstr1, argstr4, windex);
                returnvalue = PCHK_E_FORMAT; break;
               }
@@ -2185,15 +2860,13 @@ int csetfile_check(FILE *fp, unsigned int *linenum, char *errmsg)
               break; // pcs_argc_check ensures we not get here.
             }
             // Now check that corresponds to an available format:
-            switch(camfmt_from_string(argstr5)){
-              case CAF_YUYV: cfmt=V4L2_PIX_FMT_YUYV; break;
-              case CAF_MJPEG: cfmt=V4L2_PIX_FMT_MJPEG; break;
-              default:
+            idx=camfmt_from_string(argstr5);
+            if(idx<0){
                sprintf(errmsg, "%s: Stream format '%s' is not available.", argstr1, argstr5);
                returnvalue = PCHK_E_SYNTAX;
                break;
               }
-            if(returnvalue == PCHK_E_SYNTAX) break;
+            cfmt=camfmt_fourcc[idx];
             cfmt_selected=1; // So we know a camera format is requested.
           }
         else if (!strcmp(argstr1, "windex_safmt")) {
@@ -2313,6 +2986,27 @@ int csetfile_check(FILE *fp, unsigned int *linenum, char *errmsg)
                break;
               }
           }
+        else if (!strcmp(argstr1, "windex_nb")) {
+            // windex_nb <INT>
+            if(pcs_argc_check(argcount, 2, 2, 0, argstr1, errmsg)){
+               returnvalue = PCHK_E_SYNTAX;
+               break; 
+              }
+            // Must be an integer:
+            sscanf(line, "%s %s", argstr1,argstr2);
+            if (is_not_integer(argstr2)) {
+                returnvalue = PCHK_E_SYNTAX;
+                sprintf(errmsg, "%s: '%s' is not an integer.", argstr1, argstr2);
+                break;
+               }
+            inum1=atoi(argstr2); // Get the value and check its range:
+            // (0 means adaptive, otherwise at least 2 buffers are needed)
+            if(cs_int_range_check(-1, NBUF_MAX+1,"Capture buffers", inum1,0) || inum1==1){ 
+               returnvalue = PCHK_E_SYNTAX; 
+               sprintf(errmsg, "%s: A value of '%s' is not supported.", argstr1, argstr2);
+               break;
+              }
+          }
         else if (!strcmp(argstr1, "windex_srn")) {
             // windex_srn <INT>
             if(pcs_argc_check(argcount, 2, 2, 0, argstr1, errmsg)){
@@ -2491,6 +3185,34 @@ int csetfile_check(FILE *fp, unsigned int *linenum, char *errmsg)
                 break;
                }
           }
+        else if (!strcmp(argstr1, "windex_fsh")) {
+            // windex_fsh <Yes/No>
+            if(pcs_argc_check(argcount, 2, 2, 0, argstr1, errmsg)){
+               returnvalue = PCHK_E_SYNTAX;
+               break; 
+              }
+            // Must be Yes or No:
+            sscanf(line, "%s %s", argstr1,argstr2);
+            if (is_not_yesno(argstr2)) {
+                returnvalue = PCHK_E_SYNTAX;
+                sprintf(errmsg, "%s: '%s' is not 'Yes' or 'No' (case sensitive).", argstr1, argstr2);
+                break;
+               }
+          }
+        else if (!strcmp(argstr1, "windex_jly")) {
+            // windex_jly <Yes/No>
+            if(pcs_argc_check(argcount, 2, 2, 0, argstr1, errmsg)){
+               returnvalue = PCHK_E_SYNTAX;
+               break; 
+              }
+            // Must be Yes or No:
+            sscanf(line, "%s %s", argstr1,argstr2);
+            if (is_not_yesno(argstr2)) {
+                returnvalue = PCHK_E_SYNTAX;
+                sprintf(errmsg, "%s: '%s' is not 'Yes' or 'No' (case sensitive).", argstr1, argstr2);
+                break;
+               }
+          }
         else if (!strcmp(argstr1, "windex_lsr")) {
             // windex_lsr <INT>
             if(pcs_argc_check(argcount, 2, 2, 0, argstr1, errmsg)){
@@ -3057,8 +3779,19 @@ int csetfile_load(FILE *fp, unsigned int *linenum, char *errmsg)
         if (line_status == PCS_SKIP) continue; 
         // If this is a menu item line, skip it.   
         if (mdx > 0){mdx--; continue;} 
-        // The first line has the magic word, etc. and can be skipped:
-        if (*linenum == 1) continue;
+        // The first line has the magic word, etc. and can be skipped,
+        // unless it is a version 1.2 file. Those do not have the
+        // settings added since so set them to their defaults.
+        if (*linenum == 1) {
+            sscanf(line, "%s %s", argstr1, argstr2);
+            if (!strcmp(argstr2, "1.2")) {
+               sprintf(argstr2, "%d", NBUF_DEFAULT);
+               put_entry_txt(argstr2,CamsetWidget[windex_nb]);
+               gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (chk_freshest), FALSE);
+               gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (chk_jpeg_luma), FALSE);
+              }
+            continue;
+          }
 
         // If we have got to here we know that this is not a comment,
         // not a blank line and not the first line. We also know that
@@ -3190,6 +3923,11 @@ int csetfile_load(FILE *fp, unsigned int *linenum, char *errmsg)
             sscanf(line, "%s %s", argstr1,argstr2);
             put_entry_txt(argstr2,CamsetWidget[windex_rt]);
           }
+        else if (!strcmp(argstr1, "windex_nb")) {
+            // windex_nb <INT>
+            sscanf(line, "%s %s", argstr1,argstr2);
+            put_entry_txt(argstr2,CamsetWidget[windex_nb]);
+          }
         else if (!strcmp(argstr1, "windex_srn")) {
             // windex_srn <INT>
             sscanf(line, "%s %s", argstr1,argstr2);
@@ -3255,6 +3993,20 @@ int csetfile_load(FILE *fp, unsigned int *linenum, char *errmsg)
              gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (chk_scale_means), TRUE);
              else gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (chk_scale_means), FALSE);
           }
+        else if (!strcmp(argstr1, "windex_fsh")) {
+            // windex_fsh <Yes/No>
+            sscanf(line, "%s %s", argstr1,argstr2);
+            if(!strcmp(argstr2,"Yes"))
+             gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (chk_freshest), TRUE);
+             else gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (chk_freshest), FALSE);
+          }
+        else if (!strcmp(argstr1, "windex_jly")) {
+            // windex_jly <Yes/No>
+            sscanf(line, "%s %s", argstr1,argstr2);
+            if(!strcmp(argstr2,"Yes"))
+             gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (chk_jpeg_luma), TRUE);
+             else gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (chk_jpeg_luma), FALSE);
+          }
         else if (!strcmp(argstr1, "windex_lsr")) {
             // windex_lsr <INT>
             sscanf(line, "%s %s", argstr1,argstr2);
@@ -3500,6 +4252,218 @@ int csetfile_load(FILE *fp, unsigned int *linenum, char *errmsg)
     return returnvalue;
 }
 
+int csetfile_load_headless(FILE *fp, unsigned int *linenum, char *errmsg)
+// The headless (--headless) counterpart of csetfile_load. There are no
+// settings window widgets to fill in and no 'Apply' button to press so
+// this applies each setting directly as it is read - camera controls to
+// the camera and the custom settings to their globals - with the same
+// range checks that btn_cs_apply_click uses. Settings that only affect
+// the live preview are skipped. Which corrections (dark field, flat
+// field, mask) are wanted is left in Headless_corr for run_headless()
+// to act upon once the image dimensions are settled.
+// The file must first be checked with csetfile_check.
+// *fp is a pointer to the file and must be open and at the beginning.
+// *linenum will contain the line number of the first error encountered.
+// *errmsg will contain a textual explanantion of any error encountered.
+// Returns PCHK_ALL_GOOD if there are no errors or one of the #defined
+// PCHK_ error codes.
+{
+    int   returnvalue, argcount, inum1, mdx, line_status, cidx, ival;
+    int   esdx, ctdx, MFval, retval, requestedfmt;
+    unsigned int MFid;
+    char  line[MAX_CMDLEN], argstr1[64], argstr2[64];
+    char  argstr3[64], argstr5[256], cname[64];
+    char  imsg[MAX_CMDLEN+32];
+
+    mdx=0;     // Menu items = number of lines to skip
+    esdx=0;    // Number of file names that could not be set
+    ctdx=0;    // Number of camera controls that could not be set
+    inum1=0;   // The ID of the current camera control
+    MFval=-1;  // Manual focus value to retry once auto focus is set
+    MFid=0;
+    Headless_corr=0;
+ 
+    *linenum = 0;
+    returnvalue = PCHK_TERMINUS; // Ensures improper termination flag is
+                                 // returned if the file ends before the
+                                 // proper exit signal is picked up.
+
+    show_message("Loading settings file ...\n", "FYI: ", MT_INFO, 0);
+
+    while (!feof(fp)) {
+    
+        // Read next source code line
+        line_status = read_pcs_line(fp, line, linenum, &argcount, argstr1); 
+        // If end of file, break out of while loop
+        if (line_status == PCS_NULL) break; 
+        // If this is a non-coding line, skip it.   
+        if (line_status == PCS_SKIP) continue; 
+        // If this is a menu item line, skip it.   
+        if (mdx > 0){mdx--; continue;} 
+        // The first line has the magic word, etc. and can be skipped:
+        if (*linenum == 1) continue;
+
+        sprintf(imsg, "\t[%3d]: %s\n", *linenum, line);
+        show_message(imsg, "", MT_INFO, 0);
+        sscanf(line, "%s %s", argstr1, argstr2);
+        if (!strcmp(argstr1, "ctrl:")) {
+            // ctrl: <INT>
+            inum1=atoi(argstr2);
+          }
+        else if (!strcmp(argstr1, "curr:")) {
+            // curr: <INT>
+            // Headings have no value to set
+            cidx=ncsidx_from_ctrl_id(inum1);
+            if(cidx<0) continue;
+            if(CSlist[cidx].minimum==0 && CSlist[cidx].maximum==0 && CSlist[cidx].step==0) continue;
+            ival=atoi(argstr2);
+            if(check_camera_setting((unsigned int)inum1, ival, &cidx)!=CSC_OK){
+               sprintf(imsg,"Value %d for control %s is out of range",ival,CSlist[cidx].name);
+               show_message(imsg,"Warning: ",MT_ERR,0);
+               ctdx++;
+               continue;
+              }
+            retval=set_camera_control((unsigned int)inum1, ival, cname);
+            if(retval==2){ // Manual focus may need auto focus off first
+               MFval=ival;
+               MFid=(unsigned int)inum1;
+              } else if(retval){
+               sprintf(imsg,"Failed to set control %s to value %d (VIDIOC_S_CTRL)",cname,ival);
+               show_message(imsg,"Warning: ",MT_ERR,0);
+               ctdx++;
+              } else CSlist[cidx].currval=ival;
+          }
+        else if (!strcmp(argstr1, "mdx:")) { // Need this to skip menus
+            mdx=atoi(argstr2); // Get the number of menu items
+          }
+        else if (!strcmp(argstr1, "windex_sz")) {
+            // windex_sz <width> <x> <height> <at> <framerate> <fps>
+            sscanf(line, "%s %d %*s %d", argstr1,&Selected_Wd,&Selected_Ht);
+          }
+        else if (!strcmp(argstr1, "windex_camfmt")) {
+            // windex_camfmt <string1> [<string2>]
+            if(argcount==3){
+                sscanf(line, "%s %s %s", argstr1, argstr2, argstr3);
+                sprintf(argstr5,"%s %s",argstr2, argstr3);
+              } else sprintf(argstr5,"%s",argstr2);
+            requestedfmt=camfmt_from_string(argstr5);
+            if(requestedfmt<0) requestedfmt=CAF_YUYV;
+            if(FormatForbidden & CAF_BIT(requestedfmt)){
+              show_message("The camera stream format requested is not supported by your camera.","FYI: ",MT_INFO,0);
+             } else CamFormat = camfmt_fourcc[requestedfmt];
+          }
+        else if (!strcmp(argstr1, "windex_safmt")) {
+            // windex_safmt <string1> [<string2>]
+            if(argcount==3){
+                sscanf(line, "%s %s %s", argstr1, argstr2, argstr3);
+                sprintf(argstr5,"%s %s",argstr2, argstr3);
+              } else sprintf(argstr5,"%s",argstr2);
+            saveas_fmt = saveas_from_string(argstr5);
+          }
+        else if (!strcmp(argstr1, "windex_imroot")) {
+            sprintf(ImRoot,"%s",argstr2);
+          }
+        else if (!strcmp(argstr1, "windex_fno")) {
+            if(is_not_integer(argstr2)){
+               show_message("The value for 'File frame number start from' is not a valid integer and will not be set","Warning: ",MT_ERR,0);
+              } else frame_number = atoi(argstr2);
+          }
+        else if (!strcmp(argstr1, "windex_gn")) {
+            Gain_conv = atof(argstr2);
+          }
+        else if (!strcmp(argstr1, "windex_bs")) {
+            Bias_conv = atof(argstr2);
+          }
+        else if (!strcmp(argstr1, "windex_del")) {
+            ival=atoi(argstr2);
+            if(!cs_int_range_check(-1, 172801,"Delay first capture by (s)", ival,1))
+                Delayed_start_seconds = (double)ival;
+            Delayed_start_on = (Delayed_start_seconds>=1.0) ? 1 : 0;
+          }
+        else if (!strcmp(argstr1, "windex_avd")) {
+            ival=atoi(argstr2);
+            if(!cs_int_range_check(0, 4097,"Frame averaging (number of frames)", ival,1)) Av_denom = ival;
+          }
+        else if (!strcmp(argstr1, "windex_to")) {
+            ival=atoi(argstr2);
+            if(!cs_int_range_check(3, 361,"Grabber timeout (seconds)", ival,1)) Gb_Timeout = ival;
+          }
+        else if (!strcmp(argstr1, "windex_rt")) {
+            ival=atoi(argstr2);
+            if(!cs_int_range_check(-1, 4097,"Frame capture (number of retries)", ival,1)) Gb_Retry = ival;
+          }
+        else if (!strcmp(argstr1, "windex_nb")) {
+            ival=atoi(argstr2);
+            if(!cs_int_range_check(-1, NBUF_MAX+1,"Capture buffers (0 = adaptive)", ival,1) && ival!=1) Gb_Buffers = ival;
+          }
+        else if (!strcmp(argstr1, "windex_srn")) {
+            ival=atoi(argstr2);
+            if(!cs_int_range_check(0, 604801,"Series (number of images)", ival,1)) Ser_Number = ival;
+          }
+        else if (!strcmp(argstr1, "windex_srd")) {
+            ival=atoi(argstr2);
+            if(!cs_int_range_check(-1, 86401,"Min. interval for series (s)", ival,1)) Ser_Delay = ival;
+          }
+        else if (!strcmp(argstr1, "windex_jpg")) {
+            ival=atoi(argstr2);
+            if(!cs_int_range_check(0, 101,"JPEG save quality", ival,1)) JPG_Quality = ival;
+          }
+        else if (!strcmp(argstr1, "windex_sad")) {
+            Save_raw_doubles = strcmp(argstr2,"Yes") ? 0 : 1;
+          }
+        else if (!strcmp(argstr1, "windex_fit")) {
+            Save_as_FITS = strcmp(argstr2,"Yes") ? 0 : 1;
+          }
+        else if (!strcmp(argstr1, "windex_smf")) {
+            Av_scalemean = strcmp(argstr2,"Yes") ? 0 : 1;
+          }
+        else if (!strcmp(argstr1, "windex_fsh")) {
+            Gb_Freshest = strcmp(argstr2,"Yes") ? 0 : 1;
+          }
+        else if (!strcmp(argstr1, "windex_jly")) {
+            Mjpeg_luma = strcmp(argstr2,"Yes") ? 0 : 1;
+          }
+        else if (!strcmp(argstr1, "windex_ud")) {
+            if(!strcmp(argstr2,"Yes")) Headless_corr |= HLC_DF;
+          }
+        else if (!strcmp(argstr1, "windex_uf")) {
+            if(!strcmp(argstr2,"Yes")) Headless_corr |= HLC_FF;
+          }
+        else if (!strcmp(argstr1, "windex_um")) {
+            if(!strcmp(argstr2,"Yes")) Headless_corr |= HLC_MSK;
+          }
+        else if (!strcmp(argstr1, "windex_rdfi")) {
+            if(strcmp(argstr2,"[None]") && test_selected_df_filename(argstr2)) esdx++;
+          }
+        else if (!strcmp(argstr1, "windex_rffi")) {
+            if(strcmp(argstr2,"[None]") && test_selected_ff_filename(argstr2)) esdx++;
+          }
+        else if (!strcmp(argstr1, "windex_rmski")) {
+            if(strcmp(argstr2,"[None]") && test_selected_msk_filename(argstr2)) esdx++;
+          }
+        else if (!strcmp(argstr1, "exit")) {
+            sprintf(errmsg, "%d camera control(s) and %d file name(s) could not be set.",ctdx,esdx);
+            returnvalue = PCHK_ALL_GOOD; break;
+        } 
+        // Anything else is either unused here or only affects the
+        // live preview, which is not shown in headless mode.
+
+    } // End of master 'While' loop.
+
+  // Manual focus will not set while auto focus is on and auto focus
+  // comes after it in the list, so have another go now:
+  if(MFval>=0 && set_camera_control(MFid, MFval, cname)){
+     sprintf(imsg,"Failed to set control %s to value %d (VIDIOC_S_CTRL)",cname,MFval);
+     show_message(imsg,"Warning: ",MT_ERR,0);
+    }
+
+  // Update the colour conversion LUTs in case Gain_conv or Bias_conv
+  // were changed.
+  calculate_yuyv_luts(); 
+
+    return returnvalue;
+}
+
 int append_cs_file(const char *fname)
 // Appends the current list of settings values to disk as a plain text
 // file using fname as the name of the file. This retrieves and stores
@@ -3551,6 +4515,9 @@ int append_cs_file(const char *fname)
  fprintf(fp,"# Frame catpure (number of retries)\n");
  fprintf(fp,"windex_rt %s\n\n",gtk_label_get_text(GTK_LABEL(CamsetWidget[windex_rt+1])));
 
+ fprintf(fp,"# Capture buffers (0 = adaptive)\n");
+ fprintf(fp,"windex_nb %s\n\n",gtk_label_get_text(GTK_LABEL(CamsetWidget[windex_nb+1])));
+
  fprintf(fp,"# Series (number of images)\n");
  fprintf(fp,"windex_srn %s\n\n",gtk_label_get_text(GTK_LABEL(CamsetWidget[windex_srn+1])));
 
@@ -3584,6 +4551,12 @@ int append_cs_file(const char *fname)
  fprintf(fp,"# Scale mean of each frame to first?\n");
  fprintf(fp,"windex_smf %s\n\n",gtk_label_get_text(GTK_LABEL(CamsetWidget[windex_smf])));
 
+ fprintf(fp,"# Grab freshest frame?\n");
+ fprintf(fp,"windex_fsh %s\n\n",gtk_label_get_text(GTK_LABEL(CamsetWidget[windex_fsh])));
+
+ fprintf(fp,"# Y-only saves from MJPEG as JPEG luma?\n");
+ fprintf(fp,"windex_jly %s\n\n",gtk_label_get_text(GTK_LABEL(CamsetWidget[windex_jly])));
+
  fprintf(fp,"# Lower saturation limit (Red/grey)\n");
  fprintf(fp,"windex_lsr %s\n\n",gtk_label_get_text(GTK_LABEL(CamsetWidget[windex_lsr+1])));
 
@@ -3735,24 +4708,80 @@ int camfmt_from_string(char *fmt)
  return -1;
 }
 
-int preview_lut_from_string(char *lut)
-// Get the ID index of the currently selected preview LUT.
-// Return -1 on failure.
+static int camfmt_index(unsigned int fourcc)
+// Get the ID index of V4L2 pixel format fourcc.
+// Return -1 if it is not one this program can use.
 {
  int idx;
- 
- for(idx=0;idx<Nplut;idx++)
-  if(!strcmp(lut,Preview_LUT_options[idx])) return idx;
- 
+
+ for(idx=0;idx<Ncamfs;idx++)
+  if(fourcc==camfmt_fourcc[idx]) return idx;
+
  return -1;
 }
 
-int saveas_from_string(char *fmt)
-// Get the ID index of the currently selected save-as format.
-//Return -1 on failure.
+static int camfmt_mono(void)
+// 1 if the camera stream is one of the monochrome formats (GREY, Y10,
+// Y12 or Y16)
 {
- int idx;
- 
+ return CamFormat==V4L2_PIX_FMT_GREY || CamFormat==V4L2_PIX_FMT_Y10 ||
+        CamFormat==V4L2_PIX_FMT_Y12 || CamFormat==V4L2_PIX_FMT_Y16;
+}
+
+static int camfmt_bayer(void)
+// The colour filter array pattern of a Bayer camera stream as the
+// row and column parity of its red sites (bit 1 and bit 0), so 0 for
+// RGGB, 1 for GRBG, 2 for GBRG and 3 for BGGR. Or -1 if the stream is
+// not a Bayer one.
+{
+ int idx = camfmt_index(CamFormat);
+
+ if(idx>=CAF_BAYER10) return idx-CAF_BAYER10;
+ if(idx>=CAF_BAYER8) return idx-CAF_BAYER8;
+ return -1;
+}
+
+static int camfmt_bits(void)
+// Bits per sample of the camera stream (8 for all but Y10, Y12, Y16 and
+// the 10 bit Bayer formats)
+{
+ switch(CamFormat){
+   case V4L2_PIX_FMT_SRGGB10:
+   case V4L2_PIX_FMT_SGRBG10:
+   case V4L2_PIX_FMT_SGBRG10:
+   case V4L2_PIX_FMT_SBGGR10:
+   case V4L2_PIX_FMT_Y10: return 10;
+   case V4L2_PIX_FMT_Y12: return 12;
+   case V4L2_PIX_FMT_Y16: return 16;
+   default: return 8;
+  }
+}
+
+static double camfmt_scale(void)
+// What the camera stream's samples are multiplied by to put them in the
+// range 0-255 (1 for 8-bit samples)
+{
+ return 255.0/(double)((1<<camfmt_bits())-1);
+}
+
+int preview_lut_from_string(char *lut)
+// Get the ID index of the currently selected preview LUT.
+// Return -1 on failure.
+{
+ int idx;
+ 
+ for(idx=0;idx<Nplut;idx++)
+  if(!strcmp(lut,Preview_LUT_options[idx])) return idx;
+ 
+ return -1;
+}
+
+int saveas_from_string(char *fmt)
+// Get the ID index of the currently selected save-as format.
+//Return -1 on failure.
+{
+ int idx;
+ 
  for(idx=0;idx<Nsafs;idx++)
   if(!strcmp(fmt,safmt_options[idx])) return idx;
  
@@ -3925,15 +4954,72 @@ int get_pgm(char *fname, unsigned char **cptr,  int *ht,  int *wd)
  return 0;
 }
 
-int raw_to_pgm(char *fname, int ht, int wd,void *data)
+static const unsigned char *iv_row(const ImgView *iv, int y, unsigned char *row, int bgr)
+// Row y of the image in iv as bytes: R,G,B (B,G,R if bgr) for colour or
+// one per pixel for grey. If iv already holds the row like that it is
+// returned as it is, otherwise it is made up in row (which must have
+// room for nchan*wd bytes) and row is returned.
+{
+ const unsigned char *u8;
+ const fpix_t *fp;
+ const double *dp;
+ size_t off = (size_t)y*iv->stride;
+ int c,oc,x,pos;
+
+ u8 = (const unsigned char *)iv->plane[0] + off;
+ if(iv->type==IV_U8 && iv->step==(size_t)iv->nchan &&
+    (iv->nchan==1 || (!bgr && iv->plane[1]==(const void *)((const unsigned char *)iv->plane[0]+1) &&
+                              iv->plane[2]==(const void *)((const unsigned char *)iv->plane[0]+2)))) return u8;
+ for(c=0;c<iv->nchan;c++){
+    oc = (bgr && iv->nchan==3) ? 2-c : c; // Where channel c goes in row
+    switch(iv->type){
+      case IV_U8:
+        u8 = (const unsigned char *)iv->plane[c] + off;
+        for(x=0,pos=oc;x<iv->wd;x++,pos+=iv->nchan,u8+=iv->step) row[pos] = *u8;
+      break;
+      case IV_FPIX:
+        fp = (const fpix_t *)iv->plane[c] + off;
+        for(x=0,pos=oc;x<iv->wd;x++,pos+=iv->nchan,fp+=iv->step) row[pos] = uchar_from_d((double)*fp);
+      break;
+      default:
+        dp = (const double *)iv->plane[c] + off;
+        for(x=0,pos=oc;x<iv->wd;x++,pos+=iv->nchan,dp+=iv->step) row[pos] = uchar_from_d(*dp);
+      break;
+     }
+   }
+ return row;
+}
+
+static void frame_view(ImgView *iv, int mono)
+// Set iv to view the Frm[r,g,b] frame stores (just Frmr if mono), which
+// is where process_image() leaves the image to be saved.
+{
+ iv->wd = ImWidth;
+ iv->ht = ImHeight;
+ iv->nchan = mono ? 1 : 3;
+ iv->type = IV_FPIX;
+ iv->plane[0] = Frmr;
+ iv->plane[1] = Frmg;
+ iv->plane[2] = Frmb;
+ iv->step = 1;
+ iv->stride = (size_t)ImWidth;
+}
+
+int raw_to_pgm(char *fname, const ImgView *iv)
 // Write a PGM p5 formatted image to disk.
 {
  FILE *fp;
+ unsigned char *row;
+ int y;
  
+ row=(unsigned char *)malloc((size_t)iv->wd);
+ if(row==NULL){ show_message("No RAM to write PGM image.","File Save FAILED: ",MT_ERR,1); return 1;}
  fp=fopen(fname,"wb");
- if(fp==NULL){ show_message("Failed to open file for writing PGM image.","File Save FAILED: ",MT_ERR,1); return 1;}
- fprintf(fp,"P5\n# pgm, binary, 8bpp\n%u %u\n255\n",(unsigned int)wd,(unsigned int)ht);
- fwrite(data,sizeof(unsigned char),(size_t)(ht*wd), fp);  fflush(fp);  fclose(fp);
+ if(fp==NULL){ show_message("Failed to open file for writing PGM image.","File Save FAILED: ",MT_ERR,1); free(row); return 1;}
+ fprintf(fp,"P5\n# pgm, binary, 8bpp\n%u %u\n255\n",(unsigned int)iv->wd,(unsigned int)iv->ht);
+ for(y=0;y<iv->ht;y++) fwrite(iv_row(iv,y,row,0),sizeof(unsigned char),(size_t)iv->wd, fp);
+ fflush(fp);  fclose(fp);
+ free(row);
  return 0;
 }
 
@@ -3958,18 +5044,22 @@ int get_ppm(char *fname, unsigned char **cptrRGB)
  return 0;
 }
 
-int raw_to_ppm(char *fname, int ht, int wd,void *data)
+int raw_to_ppm(char *fname, const ImgView *iv)
 // Write a PPM p6 formatted image to disk.
 {
- int y,pos,y_stride;
+ int y,y_stride;
+ unsigned char *row;
  FILE *fp;
 
+ y_stride=iv->wd*3;
+ row=(unsigned char *)malloc((size_t)y_stride);
+ if(row==NULL){ show_message("No RAM to write raw RGB image.","File Save FAILED: ",MT_ERR,1); return 1;}
  fp=fopen(fname,"wb");
- if(fp==NULL){ show_message("Failed to open file for writing raw RGB image.","File Save FAILED: ",MT_ERR,1); return 1;}
- fprintf(fp,"P6\n# ppmh.ppm (options ) binary encoded 24bpp r,g,b\n%u %u\n255\n",(unsigned int)wd,(unsigned int)ht);
- y_stride=wd*3;
- for(y=pos=0;y<ht;y++,pos+=y_stride) fwrite((void *)((unsigned char *)data+pos),sizeof(unsigned char),(size_t)y_stride,fp);
+ if(fp==NULL){ show_message("Failed to open file for writing raw RGB image.","File Save FAILED: ",MT_ERR,1); free(row); return 1;}
+ fprintf(fp,"P6\n# ppmh.ppm (options ) binary encoded 24bpp r,g,b\n%u %u\n255\n",(unsigned int)iv->wd,(unsigned int)iv->ht);
+ for(y=0;y<iv->ht;y++) fwrite(iv_row(iv,y,row,0),sizeof(unsigned char),(size_t)y_stride,fp);
  fflush(fp);  fclose(fp);
+ free(row);
  return 0;
 }
 
@@ -4061,13 +5151,14 @@ if(ImgHead.Bitcount==24){
  return 0;
 }
 
-int raw_to_bmp(unsigned int iht,unsigned int iwd, unsigned char **ptr, char *fname,int format) 
-// Write a BMP formatted image to disk.
+int raw_to_bmp(const ImgView *iv, char *fname) 
+// Write a BMP formatted image to disk: 8bpp greyscale for a one channel
+// view, 24bpp colour for a three channel one.
 {
  FILE *fpo;
- long int lsz;
- unsigned int x,y,pos,wspill,waw,wawsize,idx,ww3,nonwaw;
- unsigned char *pad,tmpbuff[3],cref[1024],cn;
+ unsigned int iht,iwd,y,wspill,waw,wawsize,idx,ww3;
+ unsigned char *pad,*row,cref[1024],cn;
+ int format;
  BMPHead ImgHead;
  char imsg[320];
  
@@ -4076,9 +5167,18 @@ int raw_to_bmp(unsigned int iht,unsigned int iwd, unsigned char **ptr, char *fna
 
 #define WORDSZ    4
 
+ iht=(unsigned int)iv->ht;
+ iwd=(unsigned int)iv->wd;
+ format=(iv->nchan==1) ? BM8 : BMP;
+ row=(unsigned char *)malloc((size_t)iwd*iv->nchan);
+ if(row==NULL){
+    show_message("raw_to_bmp: No RAM for a row of the image.","Error: ",MT_ERR,0);
+    return 1;
+   }
  if( (fpo=fopen(fname,"wb"))==NULL ){
     sprintf(imsg,"raw_to_bmp: Cannot write to file %s.",fname);
     show_message(imsg,"Error: ",MT_ERR,0);
+    free(row);
     return 1;
    }
  pad=NULL;
@@ -4089,7 +5189,7 @@ int raw_to_bmp(unsigned int iht,unsigned int iwd, unsigned char **ptr, char *fna
               wspill=WORDSZ-(iwd-waw);
               waw+=WORDSZ;
               pad=(unsigned char *)calloc((size_t)wspill,sizeof(unsigned char));
-              if(pad==NULL){fclose(fpo); return 1;}
+              if(pad==NULL){fclose(fpo); free(row); return 1;}
              } else {wspill=0; waw=iwd;}
           wawsize=waw*iht;
           for(idx=0,cn=0;idx<1024;idx+=4,cn++){
@@ -4127,12 +5227,9 @@ int raw_to_bmp(unsigned int iht,unsigned int iwd, unsigned char **ptr, char *fna
         fwrite(&(ImgHead.ClrsUsed), sizeof(uint32_t), 1, fpo);
         fwrite(&(ImgHead.ClImport), sizeof(uint32_t), 1, fpo);
           fwrite(cref,sizeof(unsigned char),1024,fpo);
-          pos=(iht-1)*iwd;
-          for(y=0;y<iht;y++,pos-=iwd){
-                for(x=0;x<iwd;x++){
-                      tmpbuff[0]=(*(*(unsigned char **)ptr+pos+x));
-                      fwrite(tmpbuff,sizeof(unsigned char),1,fpo);
-                     }
+          // BMP rows go from the bottom of the image up
+          for(y=iht;y-->0;){
+                 fwrite(iv_row(iv,(int)y,row,0),sizeof(unsigned char),(size_t)iwd,fpo);
                  if(wspill) fwrite(pad,sizeof(unsigned char),(size_t)wspill,fpo);
             }
         if(wspill) free(pad);        
@@ -4144,12 +5241,10 @@ int raw_to_bmp(unsigned int iht,unsigned int iwd, unsigned char **ptr, char *fna
               wspill=WORDSZ-(ww3-waw);
               waw+=WORDSZ;
               pad=(unsigned char *)calloc((size_t)wspill,sizeof(unsigned char));
-              if(pad==NULL){fclose(fpo); return 1;}
+              if(pad==NULL){fclose(fpo); free(row); return 1;}
            } else {wspill=0; waw=ww3;}
 
-        lsz=iht*ww3;
         wawsize=waw*iht;
-        nonwaw=ww3;
 
           ImgHead.Type=19778;
           ImgHead.Res1=0;
@@ -4182,10 +5277,9 @@ int raw_to_bmp(unsigned int iht,unsigned int iwd, unsigned char **ptr, char *fna
         fwrite(&(ImgHead.Ypixelsm), sizeof(uint32_t), 1, fpo);
         fwrite(&(ImgHead.ClrsUsed), sizeof(uint32_t), 1, fpo);
         fwrite(&(ImgHead.ClImport), sizeof(uint32_t), 1, fpo);
-        pos=lsz-nonwaw;
-      for(y=0;y<iht;y++,pos-=nonwaw){
-          
-           fwrite((*ptr+pos),sizeof(unsigned char),(size_t)nonwaw,fpo);
+      // Bottom row first and each pixel as B,G,R
+      for(y=iht;y-->0;){
+           fwrite(iv_row(iv,(int)y,row,1),sizeof(unsigned char),(size_t)ww3,fpo);
            if(wspill) fwrite(pad,sizeof(unsigned char),(size_t)wspill,fpo);
         }
 
@@ -4194,16 +5288,19 @@ int raw_to_bmp(unsigned int iht,unsigned int iwd, unsigned char **ptr, char *fna
      break;
     default:
      fclose(fpo);
+     free(row);
      show_message("raw_to_bmp: Pixel format not supported by this function.","Error ",MT_ERR,0);
      return 1;
  }
 
   fclose(fpo);
+  free(row);
   return 0;
  }
 
-int write_png_image(char* filename, int width, int height, unsigned char *img, char* title)
-// Write a PNG formatted image to disk.
+int write_png_image(char* filename, const ImgView *iv, char* title)
+// Write a PNG formatted image to disk (RGB, or greyscale for a one
+// channel view).
 {
    int code = 0;
    FILE *fp = NULL;
@@ -4247,8 +5344,8 @@ int write_png_image(char* filename, int width, int height, unsigned char *img, c
    png_init_io(png_ptr, fp);
 
    // Write header (8 bit colour depth)
-   png_set_IHDR(png_ptr, info_ptr, width, height,
-         8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+   png_set_IHDR(png_ptr, info_ptr, iv->wd, iv->ht,
+         8, (iv->nchan==1) ? PNG_COLOR_TYPE_GRAY : PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
          PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
 
    // Set title
@@ -4262,8 +5359,9 @@ int write_png_image(char* filename, int width, int height, unsigned char *img, c
 
    png_write_info(png_ptr, info_ptr);
    
-   // Allocate memory for one row (3 bytes per pixel - RGB)
-   row = (png_bytep) malloc(3 * width * sizeof(png_byte));
+   // Allocate memory for one row (3 bytes per pixel - RGB) in case
+   // the view does not already hold the rows as bytes
+   row = (png_bytep) malloc(iv->nchan * iv->wd * sizeof(png_byte));
    if (row == NULL) {
       show_message("Could not allocate row.","PNG Error: ",MT_ERR,0);
       code = 1;
@@ -4271,15 +5369,9 @@ int write_png_image(char* filename, int width, int height, unsigned char *img, c
    }
 
    // Write image data
-   int r,c,sz,ipos,w3;
-   sz=height*width;
-   w3=width*3;
-   ipos=0;
-   for (r=0 ; r<sz ; r+=width) {
-      for (c=0 ; c<w3 ; c++) {
-         row[c]= img[ipos++];
-      }
-      png_write_row(png_ptr, row);
+   int r;
+   for (r=0 ; r<iv->ht ; r++) {
+      png_write_row(png_ptr, (png_bytep)iv_row(iv, r, row, 0));
    }
 
    // End write
@@ -4295,20 +5387,26 @@ int write_png_image(char* filename, int width, int height, unsigned char *img, c
    return code;
 }
 
-int raw_to_jpeg(int ht, int wd, unsigned char **cptrgb, char *fname, int quality)
-// Save a raw rgb image as a JPEG file
+int raw_to_jpeg(const ImgView *iv, char *fname, int quality)
+// Save an rgb image as a JPEG file
 {
  FILE* fpo;
  struct jpeg_compress_struct info;
  struct jpeg_error_mgr err;
  unsigned char* lpRowBuffer[1];
- int w3;
+ unsigned char *row;
  char imsg[320];
  
+ row = (unsigned char *)malloc((size_t)iv->wd*3);
+ if(row == NULL) {
+    show_message("raw_to_jpeg: No RAM for a row of the image.","Error: ",MT_ERR,0);
+    return 1;
+  }
  fpo = fopen(fname, "wb");
  if(fpo == NULL) {
     sprintf(imsg,"raw_to_jpeg: Cannot write to file %s.",fname);
     show_message(imsg,"Error: ",MT_ERR,0);
+    free(row);
     return 1;
   }
 
@@ -4317,8 +5415,8 @@ int raw_to_jpeg(int ht, int wd, unsigned char **cptrgb, char *fname, int quality
 
  jpeg_stdio_dest(&info, fpo);
 
- info.image_width = (JDIMENSION)wd;
- info.image_height = (JDIMENSION)ht;
+ info.image_width = (JDIMENSION)iv->wd;
+ info.image_height = (JDIMENSION)iv->ht;
  info.input_components = 3;
  info.in_color_space = JCS_RGB;
 
@@ -4326,9 +5424,8 @@ int raw_to_jpeg(int ht, int wd, unsigned char **cptrgb, char *fname, int quality
  jpeg_set_quality(&info, quality, TRUE);
  jpeg_start_compress(&info, TRUE);
 
- w3=wd*3;
  while(info.next_scanline < info.image_height) {
-     lpRowBuffer[0] = (*cptrgb+(info.next_scanline * w3));
+     lpRowBuffer[0] = (unsigned char *)iv_row(iv, (int)info.next_scanline, row, 0);
      jpeg_write_scanlines(&info, lpRowBuffer, 1);
     }
 
@@ -4336,6 +5433,23 @@ int raw_to_jpeg(int ht, int wd, unsigned char **cptrgb, char *fname, int quality
  fclose(fpo);
 
  jpeg_destroy_compress(&info);
+ free(row);
+ return 0;
+}
+
+int utc_string_us(long long wall_us, char *str)
+// Write the UTC time wall_us (microseconds since the epoch) into str in
+// the FITS / ISO 8601 form YYYY-MM-DDThh:mm:ss.uuuuuu (str needs room
+// for 27 chars). Returns 0 on success, 1 on failure.
+{
+ time_t secs;
+ struct tm *dtinfo;
+
+ secs = (time_t)(wall_us/1000000LL);
+ dtinfo = gmtime(&secs);
+ if(dtinfo==NULL) return 1;
+ if(strftime(str,20,"%Y-%m-%dT%H:%M:%S",dtinfo)!=19) return 1;
+ sprintf(str+19,".%06lld",wall_us%1000000LL);
  return 0;
 }
 
@@ -4353,32 +5467,58 @@ int write_fits_cardimg(FILE *fp,char *fci)
  return 0;
 }
 
-int double_byteswap(size_t img_sz, void **img)
-// Performs byte-swapping for doubles.
-// Returns 0 on success, 1 on error.
+static void fits_pack_record(unsigned char *rec, const fpix_t *img, size_t npix, size_t bpp)
+// Put npix pixels from img into rec as big-endian doubles (bpp = 8),
+// floats (bpp = 4) or, for bpp = 2, as 16 bit integers in the camera's
+// sample units (rounded and clipped to 0 to 65535, less the BZERO of
+// 32768 that makes them fit signed FITS integers).
 {
- unsigned char *ctmp;
- size_t bpn,idx,ndx;
-
- bpn=sizeof(double);
-
- ctmp=(unsigned char *)calloc(bpn,sizeof(unsigned char));
- if(ctmp==NULL) return 1;
- img_sz*=bpn; 
- for(idx=0;idx<img_sz;idx+=bpn){
-    for(ndx=0;ndx<bpn;ndx++) ctmp[ndx]= *(*(unsigned char **)img+idx+ndx);
-    for(ndx=0;ndx<bpn;ndx++) *(*(unsigned char **)img+idx+bpn-ndx-1)=ctmp[ndx];
+ const double scale = camfmt_scale();
+ const int swap = (ntohl(0x12345678) == 0x78563412); // Little-endian
+ unsigned char *src;
+ size_t idx,ndx;
+ double dval;
+ float fval;
+
+ // The sample scale and byte order are the same for every pixel, so
+ // they are found once and each BITPIX has its own loop
+ if(bpp==2){
+   for(idx=0;idx<npix;idx++,rec+=2){
+      dval=round((double)img[idx]/scale);
+      dval=dval<0.0 ? 0.0 : (dval>65535.0 ? 65535.0 : dval);
+      ndx=(size_t)dval;
+      rec[0]=(unsigned char)((ndx>>8)^0x80); // Less 32768, big-endian
+      rec[1]=(unsigned char)(ndx&0xff);
+     }
+   return;
+  }
+ if(bpp==8){
+   src=(unsigned char *)&dval;
+   for(idx=0;idx<npix;idx++,rec+=8){
+      dval=(double)img[idx];
+      if(swap) for(ndx=0;ndx<8;ndx++) rec[ndx]=src[7-ndx];
+       else memcpy(rec,src,8);
+     }
+   return;
+  }
+ src=(unsigned char *)&fval;
+ for(idx=0;idx<npix;idx++,rec+=4){
+    fval=(float)img[idx];
+    if(swap) for(ndx=0;ndx<4;ndx++) rec[ndx]=src[3-ndx];
+     else memcpy(rec,src,4);
    }
- free(ctmp);
- return 0;
 }
 
 int write_fits(char *fname, int colchan, int is_avg)
-// Write the image raw doubles data in the img buffer as a FITS file.
+// Write the image data in the Frm stores as a FITS file of doubles,
+// floats or 16 bit integers (BITPIX -64, -32 or 16, see Fits_bitpix).
 // This may be useful for those who want to export the saved frames to
 // another program that may not be able to read my raw doubles foramt.
 // colchan is the colour channel to write out and must be one of
-// CCHAN_Y, CCHAN_R, CCHAN_G, CCHAN_B
+// CCHAN_Y, CCHAN_R, CCHAN_G, CCHAN_B or, for a Bayer stream demosaiced
+// in colour, CCHAN_MOSAIC: the colour of each pixel's own filter (which
+// the demosaic kernels leave as it was) so that is the undemosaiced
+// mosaic, with the same corrections and averaging as the rest.
 // is_avg must be 0 or 1 (1 means this is a multi-frame average). This
 // information is used to add information to the comments section of the
 // FITS file for good record keeping.
@@ -4388,10 +5528,15 @@ int write_fits(char *fname, int colchan, int is_avg)
  char fcardimg[81];
  char emsgdata[256];
  uint8_t padbyte;
- size_t len,nobj,idx,edx,bpp,bpr,pad,nrecords,prec,epad;
+ size_t len,nobj,idx,edx,bpp,bpr,nrecords,prec,epad;
  struct tm *dtinfo;
  time_t tnow;
- double *framepos,*img;
+ long hdrbytes;
+ fpix_t *framepos,*img;
+ fpix_t mos[2880/2]; // One record's worth of the mosaic
+ unsigned char rec[2880];
+ const char *cfaname[] = {"RGGB","GRBG","GBRG","BGGR"};
+ int cfa = camfmt_bayer() & 3;
  
  // Attempt to open the file for writing
  if( (fpo=fopen(fname,"wb"))==NULL ){
@@ -4402,8 +5547,8 @@ int write_fits(char *fname, int colchan, int is_avg)
  // Construct and write the FITS header 'card images'
  sprintf(fcardimg,"SIMPLE  =                    T / file does conform to FITS standard");
  if(write_fits_cardimg(fpo,fcardimg)) goto error_return_2;
- bpp=8*sizeof(double);
- sprintf(fcardimg,"BITPIX  =                  -%zu / number of bits per data pixel", bpp);
+ bpp=(Fits_bitpix==-32) ? 32 : (Fits_bitpix==16 ? 16 : 64);
+ sprintf(fcardimg,"BITPIX  = %20d / number of bits per data pixel", Fits_bitpix==16 ? 16 : -(int)bpp);
  if(write_fits_cardimg(fpo,fcardimg)) goto error_return_2;
  sprintf(fcardimg,"NAXIS   =                    2 / number of data axes");
  if(write_fits_cardimg(fpo,fcardimg)) goto error_return_2;
@@ -4426,6 +5571,15 @@ int write_fits(char *fname, int colchan, int is_avg)
  strcat(fcardimg," / length of data axis 2, height");
  if(write_fits_cardimg(fpo,fcardimg)) goto error_return_2;
 
+ // 16 bit data are unsigned, so they are offset to fit the signed FITS
+ // integers:
+ if(bpp==16){
+   sprintf(fcardimg,"BZERO   = %20d / offset data range to that of unsigned short",32768);
+   if(write_fits_cardimg(fpo,fcardimg)) goto error_return_2;
+   sprintf(fcardimg,"BSCALE  =                    1 / default scaling factor");
+   if(write_fits_cardimg(fpo,fcardimg)) goto error_return_2;
+  }
+
  // Set the colour channel info as a comment in the header and select
  // the appropriate data to use:
  switch(colchan)
@@ -4447,6 +5601,13 @@ int write_fits(char *fname, int colchan, int is_avg)
     sprintf(fcardimg,"COMMENT   Image data is the BLU channel");
     img=Frmb;
   break;
+  case CCHAN_MOSAIC:
+    // Other software looks for the pattern in BAYERPAT
+    sprintf(fcardimg,"BAYERPAT= \'%s\'               / Bayer pattern of the undemosaiced data",cfaname[cfa]);
+    if(write_fits_cardimg(fpo,fcardimg)) goto error_return_2;
+    sprintf(fcardimg,"COMMENT   Image data is the Bayer mosaic");
+    img=Frmg; // Not used: it is put together a record at a time, in mos
+  break;
   default: // This should not happen - programming error
        show_message("Unrecognised colour channel.","FITS Save FAILED: ",MT_ERR,1); 
        goto error_return_2;
@@ -4456,7 +5617,7 @@ int write_fits(char *fname, int colchan, int is_avg)
 
  // State if this is a single frame or multi-frame average
  if(is_avg==0) sprintf(fcardimg,"COMMENT   Image data represents a single frame capture");
- else sprintf(fcardimg,"COMMENT   Image data represents the mean average of %d frames",Av_limit);
+ else sprintf(fcardimg,"COMMENT   Image data represents the mean average of %d frames",Av_added);
  if(write_fits_cardimg(fpo,fcardimg)) goto error_return_2;
 
  // State if dark field correction was done
@@ -4496,6 +5657,12 @@ int write_fits(char *fname, int colchan, int is_avg)
  else sprintf(fcardimg,"COMMENT   Flat file: [None]");
  if(write_fits_cardimg(fpo,fcardimg)) goto error_return_2;
 
+ // Which camera frames went into it and how many were lost on the way
+ if(Obs_wall_us){
+   sprintf(fcardimg,"COMMENT   Camera frame sequence %u to %u (%lu dropped)",Obs_first_vseq,Obs_last_vseq,Obs_dropped);
+   if(write_fits_cardimg(fpo,fcardimg)) goto error_return_2;
+  }
+
  sprintf(fcardimg,"COMMENT   Image written by PARD Capture pardcap.c write_fits(...) function.");
  if(write_fits_cardimg(fpo,fcardimg)) goto error_return_2;
 
@@ -4510,15 +5677,26 @@ int write_fits(char *fname, int colchan, int is_avg)
    if(write_fits_cardimg(fpo,fcardimg)) goto error_return_2;
   }
 
+ // The time the (first) frame was captured, from the driver timestamp
+ if(Obs_wall_us && !utc_string_us(Obs_wall_us,emsgdata)){
+   sprintf(fcardimg,"DATE-OBS= \'%.26s\' / UTC time of (first) frame capture",emsgdata);
+   if(write_fits_cardimg(fpo,fcardimg)) goto error_return_2;
+  }
+
  sprintf(fcardimg,"END");
  if(write_fits_cardimg(fpo,fcardimg)) goto error_return_2;
 
- // Up to this point only 1200 bytes of header are written but we must
- // make the header block upto exact multiples of 2880 bytes (because
- // the header is a 'record' and FITS records are always 2880 bytes
- // long). So now we must pad the remaining 1680 bytes with blanks:
+ // Up to this point less than 2880 bytes of header are written but we
+ // must make the header block upto exact multiples of 2880 bytes
+ // (because the header is a 'record' and FITS records are always 2880
+ // bytes long). So now we must pad the remainder with blanks:
+ hdrbytes=ftell(fpo);
+ if(hdrbytes<0){
+    show_message("Could not get the FITS header length.","FITS write FAILED",MT_ERR,1); 
+    goto error_return_2;
+   }
  padbyte=32;
- for(edx=0;edx<1680;edx++){
+ for(edx=0;edx<(size_t)((2880-hdrbytes%2880)%2880);edx++){
      nobj=fwrite(&padbyte,sizeof(uint8_t),1,fpo);
      if(nobj!=1){
         sprintf(emsgdata, "Checksum error padding FITS header: pad=%zu (expected 1).",nobj);
@@ -4532,74 +5710,37 @@ int write_fits(char *fname, int colchan, int is_avg)
 
  bpp/=8;             // The number of bytes per pixel.
  bpr=2880/bpp;       // The numbers of pixels per record.
- pad=2880-(bpr*bpp); // The number of bytes to pad a record so it equals
-                     // 2880 bytes after bpr pixels have been written.
  len=(size_t)ImHeight*(size_t)ImWidth; // The number of pixels to write.
- nrecords=(len*bpp)/2880; // The number of full records to write.
- prec=(len*bpp)-(nrecords*2880); // The number of pixel bytes left to
-                                 // write after nrecords-worth of pixel
-                                 // bytes have been written.
- epad=2880-prec; // The number of bytes to pad any final incomplete
-                 // record.
- prec/=bpp; // The number of pixels to write on any final incomplete
-            // record.
-
- padbyte=0;
+ nrecords=(len+bpr-1)/bpr; // The number of records to write (the last
+                           // one may be incomplete and is padded with
+                           // zeros).
 
  framepos=img; // Start at the beginning of the frame store data
 
- // For little-endian CPUs (like Intel) you need to swap the byte order
- // of the pixel data before writing it to FITS, so check for this:
- if (ntohl(0x12345678) == 0x78563412) { // If little-endian ...
-   if(double_byteswap(len,(void **)&img)){
-      show_message("Byte-swapping of image pixel data failed","FITS write FAILED",MT_ERR,1); 
-      goto error_return_2;
-     }
-  }
-
- // Now the writing begins ...
- if(nrecords>0){ // If there are whole records-worth of pixels, write them:
-   for(idx=0;idx<nrecords;idx++){ // For each record ...
-      // First write the pixels:
-      nobj=fwrite(framepos,sizeof(double),bpr,fpo);
-      if(nobj<bpr){
-         sprintf(emsgdata, "Checksum error writing FITS data: nobj=%zu (expected %zu).",nobj,bpr);
-         show_message(emsgdata,"FITS write FAILED",MT_ERR,1); 
-         goto error_return_2;
-        }
-      framepos+=bpr;
-      // Then do any padding to ensure the record is 2880 bytes long:
-      if(pad>0){
-        for(edx=0;edx<pad;edx++){
-           nobj=fwrite(&padbyte,sizeof(uint8_t),1,fpo);
-           if(nobj!=1){
-            sprintf(emsgdata, "Checksum error writing FITS data: pad=%zu (expected 1).",nobj);
-            show_message(emsgdata,"FITS write FAILED",MT_ERR,1); 
-            goto error_return_2;
-           }
-          }
-        }
-     }
-  } // Done writing complete records
- // If there are any pixels left to write, write them:
- if(prec>0){
-      nobj=fwrite(framepos,sizeof(double),prec,fpo);
-      if(nobj<prec){
-         sprintf(emsgdata, "Checksum error writing final FITS data: nobj=%zu (expected %zu).",nobj,prec);
-         show_message(emsgdata,"FITS write FAILED",MT_ERR,1); 
-         goto error_return_2;
-        }
-      // Then do any padding to ensure the record is 2880 bytes long:
-      if(epad>0){
-        for(edx=0;edx<epad;edx++){
-           nobj=fwrite(&padbyte,sizeof(uint8_t),1,fpo);
-           if(nobj!=1){
-            sprintf(emsgdata, "Checksum error writing final FITS data: pad=%zu (expected 1).",nobj);
-            show_message(emsgdata,"FITS write FAILED",MT_ERR,1); 
-            goto error_return_2;
+ // Each record is made up in rec as big-endian doubles, floats or
+ // integers (as FITS requires) from the frame store, which is left
+ // untouched.
+ for(idx=0;idx<nrecords;idx++,framepos+=bpr){ // For each record ...
+    prec=(len-idx*bpr < bpr) ? len-idx*bpr : bpr; // Pixels in it
+    if(colchan==CCHAN_MOSAIC){
+      for(edx=0;edx<prec;edx++){
+         nobj=idx*bpr+edx; // The pixel
+         switch(BAYER_SITE(cfa,(int)(nobj/ImWidth),(int)(nobj%ImWidth))){
+            case 0: mos[edx]=Frmr[nobj]; break;
+            case 3: mos[edx]=Frmb[nobj]; break;
+            default: mos[edx]=Frmg[nobj]; break;
            }
-          }
         }
+      fits_pack_record(rec,mos,prec,bpp);
+     } else fits_pack_record(rec,framepos,prec,bpp);
+    epad=2880-prec*bpp;
+    if(epad>0) memset(rec+prec*bpp,0,epad);
+    nobj=fwrite(rec,sizeof(unsigned char),2880,fpo);
+    if(nobj<2880){
+       sprintf(emsgdata, "Checksum error writing FITS data: nobj=%zu (expected 2880).",nobj);
+       show_message(emsgdata,"FITS write FAILED",MT_ERR,1); 
+       goto error_return_2;
+      }
    }
 
  fclose(fpo);
@@ -4611,6 +5752,46 @@ int write_fits(char *fname, int colchan, int is_avg)
  return 1;
 }
 
+size_t fwrite_fpix(const fpix_t *img, size_t len, FILE *fp)
+// fwrite len pixels from a frame store to fp as raw doubles. Returns the
+// number written.
+{
+#ifdef PARD_FLOAT32
+ double dbuf[1024];
+ size_t done,n,idx,nobj;
+
+ for(done=0;done<len;done+=n){
+    n=(len-done < 1024) ? len-done : 1024;
+    for(idx=0;idx<n;idx++) dbuf[idx]=(double)img[done+idx];
+    nobj=fwrite(dbuf,sizeof(double),n,fp);
+    if(nobj<n) return done+nobj;
+   }
+ return len;
+#else
+ return fwrite(img,sizeof(double),len,fp);
+#endif
+}
+
+size_t fread_fpix(fpix_t *img, size_t len, FILE *fp)
+// fread len raw doubles from fp into a frame store (or dark, flat or
+// preview master image). Returns the number read.
+{
+#ifdef PARD_FLOAT32
+ double dbuf[1024];
+ size_t done,n,idx,nobj;
+
+ for(done=0;done<len;done+=n){
+    n=(len-done < 1024) ? len-done : 1024;
+    nobj=fread(dbuf,sizeof(double),n,fp);
+    for(idx=0;idx<nobj;idx++) img[done+idx]=(fpix_t)dbuf[idx];
+    if(nobj<n) return done+nobj;
+   }
+ return len;
+#else
+ return fread(img,sizeof(double),len,fp);
+#endif
+}
+
 int read_preview_master(char *fname, int corrtype)
 // Reads a preview image master dark frame image if corrtype = 1.
 // Reads a preview image master flat frame image if corrtype = 2.
@@ -4714,8 +5895,8 @@ int read_preview_master(char *fname, int corrtype)
  len=(size_t)PreviewHt*(size_t)PreviewWd;
 
  switch(corrtype){
-   case 1: nobj=fread((void *)Preview_dark,sizeof(double),len,fph); break;
-   case 2: nobj=fread((void *)Preview_flat,sizeof(double),len,fph); break;
+   case 1: nobj=fread_fpix(Preview_dark,len,fph); break;
+   case 2: nobj=fread_fpix(Preview_flat,len,fph); break;
   }
  
  if(nobj<len){
@@ -4814,7 +5995,7 @@ int write_rawdou(char *fname,int colchan)
   {
    case CCHAN_Y:
    case CCHAN_R:
-       nobj=fwrite(Frmr,sizeof(double),len,fpo);
+       nobj=fwrite_fpix(Frmr,len,fpo);
        if(nobj<len){
          sprintf(emsgdata, "Checksum error writing raw doubles (Y/R): nobj=%zu (expected %zu).",nobj,len);
         show_message(emsgdata,"Raw write FAILED",MT_ERR,1); 
@@ -4822,7 +6003,7 @@ int write_rawdou(char *fname,int colchan)
        }
    break;
    case CCHAN_G:
-       nobj=fwrite(Frmg,sizeof(double),len,fpo);
+       nobj=fwrite_fpix(Frmg,len,fpo);
        if(nobj<len){
          sprintf(emsgdata, "Checksum error writing raw doubles (G): nobj=%zu (expected %zu).",nobj,len);
         show_message(emsgdata,"Raw write FAILED",MT_ERR,1); 
@@ -4830,7 +6011,7 @@ int write_rawdou(char *fname,int colchan)
        }
    break;
    case CCHAN_B:
-       nobj=fwrite(Frmb,sizeof(double),len,fpo);
+       nobj=fwrite_fpix(Frmb,len,fpo);
        if(nobj<len){
          sprintf(emsgdata, "Checksum error writing raw doubles (B): nobj=%zu (expected %zu).",nobj,len);
         show_message(emsgdata,"Raw write FAILED",MT_ERR,1); 
@@ -5132,7 +6313,7 @@ int read_qih_file(char *fname,int *ht, int *wd, int *coltype)
  return 1;
 }
 
-int read_raw_doubles(char *fname,double **rdptr,int ht, int wd, int coltype)
+int read_raw_doubles(char *fname,fpix_t **rdptr,int ht, int wd, int coltype)
 // Reads a raw array of doubles (or 3 separate raw arrays of doubles)
 // into the memory storage pointed to by rdptr. This must be allocated
 // to have enough storage to hold the array(s).
@@ -5168,7 +6349,7 @@ int read_raw_doubles(char *fname,double **rdptr,int ht, int wd, int coltype)
          show_message("Cannot open raw file to read it (Y/I).",emsgtype,MT_ERR,1); 
          return 1;
         }
-       nobj=fread((*rdptr),sizeof(double),dfsize,fpr);
+       nobj=fread_fpix(*rdptr,dfsize,fpr);
        if(ferror(fpr)){
          show_message("File read error occurred when reading raw file (Y/I).",emsgtype,MT_ERR,1); 
          fclose(fpr);
@@ -5264,7 +6445,7 @@ int read_raw_doubles(char *fname,double **rdptr,int ht, int wd, int coltype)
       rgbpos=0;
       for(len=0;len<dfsize;len++,rgbpos+=3){
          // Red pixel
-         nobj=fread((*rdptr+rgbpos),sizeof(double),1,fpr);
+         nobj=fread_fpix(*rdptr+rgbpos,1,fpr);
          if(ferror(fpr)){
            show_message("File read error occurred when reading raw file (R).",emsgtype,MT_ERR,1); 
            goto error_return_fclose;
@@ -5275,7 +6456,7 @@ int read_raw_doubles(char *fname,double **rdptr,int ht, int wd, int coltype)
            goto error_return_fclose;
           }
          // Green pixel
-         nobj=fread((*rdptr+rgbpos+1),sizeof(double),1,fpg);
+         nobj=fread_fpix(*rdptr+rgbpos+1,1,fpg);
          if(ferror(fpg)){
            show_message("File read error occurred when reading raw file (G).",emsgtype,MT_ERR,1); 
            goto error_return_fclose;
@@ -5286,7 +6467,7 @@ int read_raw_doubles(char *fname,double **rdptr,int ht, int wd, int coltype)
            goto error_return_fclose;
           }
          // Blue pixel
-         nobj=fread((*rdptr+rgbpos+2),sizeof(double),1,fpb);
+         nobj=fread_fpix(*rdptr+rgbpos+2,1,fpb);
          if(ferror(fpb)){
            show_message("File read error occurred when reading raw file (B).",emsgtype,MT_ERR,1); 
            goto error_return_fclose;
@@ -5433,6 +6614,10 @@ int set_image_dims_to_VGA(void)
 
    Selected_Ht = 480;
    Selected_Wd = 640; 
+   if(Vsrc_type == VSRC_REPLAY){ // A replay only comes in one size
+     Selected_Ht = (int)Vsrc_ht;
+     Selected_Wd = (int)Vsrc_wd; 
+    }
   
   show_message("Attempting to reset dimensions to VGA:","FYI: ",MT_INFO,0);
   // Store the current values in case things go wrong and we need to
@@ -5679,7 +6864,7 @@ static int calculate_preview_params(void)
 // calls this function.
 {
  double scaleh,scalew;
- int idx,dooffs,imgpos;
+ int idx,dooffs,imgpos,jwd,scaled=0;
  
  // The preview area is fixed at PreviewHt x PreviewWd resolution so the
  // method of making a preview image depends on whether the user wants
@@ -5688,6 +6873,7 @@ static int calculate_preview_params(void)
  // to scale the whole full sized image to fit into the fixed previewing
  // area:
  
+ Jpeg_prev_tile[0]=Jpeg_prev_tile[1]=Jpeg_prev_tile[2]=Jpeg_prev_tile[3]=0;
  if(Preview_fullsize){
    // This tiling process is only relevant if the full frame image is
    // bigger in any dimension than fixed preview image rectangle. So
@@ -5710,6 +6896,10 @@ static int calculate_preview_params(void)
      if(imgpos>=ImWidth) imgpos=-1; // See note 1 below
      SScol[idx]=imgpos;
     }
+    Jpeg_prev_tile[0]=Img_startrow;
+    Jpeg_prev_tile[1]=(Img_startrow+PreviewHt<ImHeight) ? Img_startrow+PreviewHt : ImHeight;
+    Jpeg_prev_tile[2]=Img_startcol;
+    Jpeg_prev_tile[3]=(Img_startcol+PreviewWd<ImWidth) ? Img_startcol+PreviewWd : ImWidth;
 
    // Note 1. This overshoot should never happen now that I make checks for this
    // in the routine that checks the user's choice of start/row pos (chosen by
@@ -5726,6 +6916,7 @@ static int calculate_preview_params(void)
   } else {
  
   Scale_the_full_frame_into_the_preview_box:
+  scaled=1;
   // Find the subsampling scale factor for height and width
 
   scaleh = ((double)ImHeight/(double)PreviewHt);
@@ -5755,10 +6946,39 @@ static int calculate_preview_params(void)
   for(idx=dooffs=0;idx<PreviewHt;idx++) if(SSrow[idx]<0){dooffs=1; break;}
   if(dooffs) Prev_startrow=(PreviewHt-idx)/2; else Prev_startrow=0;
   Prev_startrow*=PreviewWd_stride;
+  Prev_nrows=idx;
   
   for(idx=dooffs=0;idx<PreviewWd;idx++) if(SScol[idx]<0){dooffs=1; break;}
   if(dooffs) Prev_startcol=(PreviewWd-idx)/2; else Prev_startcol=0;
   Prev_startcol*=3;
+  Prev_ncols=idx;
+
+ // Flip the preview as required by reversing the order of the sample
+ // points so the preview is made flipped in the first place. The mask,
+ // the preview dark and flat and the Y integration buffers are not
+ // flipped, so they are looked up at the pixel each sample point would
+ // go to unflipped (Prev_mskstart plus the row and col steps).
+ Prev_mskstart=Prev_startrow/3+Prev_startcol/3;
+ Prev_mskrowstep=PreviewWd;
+ Prev_mskcolstep=1;
+ if(prev_flip_v){
+   for(idx=0;idx<Prev_nrows/2;idx++){
+      imgpos=SSrow[idx];
+      SSrow[idx]=SSrow[Prev_nrows-1-idx];
+      SSrow[Prev_nrows-1-idx]=imgpos;
+     }
+   Prev_mskstart+=(Prev_nrows-1)*PreviewWd;
+   Prev_mskrowstep=-PreviewWd;
+  }
+ if(prev_flip_h){
+   for(idx=0;idx<Prev_ncols/2;idx++){
+      imgpos=SScol[idx];
+      SScol[idx]=SScol[Prev_ncols-1-idx];
+      SScol[Prev_ncols-1-idx]=imgpos;
+     }
+   Prev_mskstart+=Prev_ncols-1;
+   Prev_mskcolstep=-1;
+  }
  
  // Calculate the sample size for image preview stats
  calc_preview_base_stats();
@@ -5771,6 +6991,19 @@ static int calculate_preview_params(void)
    case V4L2_PIX_FMT_MJPEG:
      for(idx=0;idx<PreviewHt;idx++)SSrow[idx]*=3;
      for(idx=0;idx<PreviewWd;idx++)SScol[idx]*=3;
+     // Choose how far the preview decodes can be scaled down (not at
+     // all for a full resolution tile) and make the index arrays for
+     // them. Pixel (r,c) of the full frame is in pixel (r/d,c/d) of a
+     // decode scaled by 1/d.
+     Jpeg_prev_denom=1;
+     if(scaled)
+       while(Jpeg_prev_denom<8 && 2*Jpeg_prev_denom<=Prev_scaledim) Jpeg_prev_denom*=2;
+     jwd=(ImWidth+Jpeg_prev_denom-1)/Jpeg_prev_denom;
+     Jpeg_prev_wd=jwd;
+     for(idx=0;idx<PreviewHt;idx++)
+       SSrow_j[idx]=(SSrow[idx]<0) ? -1 : 3*jwd*((SSrow[idx]/ImWidth_stride)/Jpeg_prev_denom);
+     for(idx=0;idx<PreviewWd;idx++)
+       SScol_j[idx]=(SScol[idx]<0) ? -1 : 3*((SScol[idx]/3)/Jpeg_prev_denom);
    break;
    default:
    break;
@@ -5788,21 +7021,23 @@ static int set_dims_as_per_selected(void)
   ImWidth_stride = ImWidth*3;
   ImSize = ImHeight*ImWidth;
   // Allocate memory for the full size camera output image (also needed
-  // to grab images for the preview)
+  // to grab images for the preview). The MJPEG decode slots' blocks are
+  // the same size so they go too.
+  mjdec_free_slots();
   RGBsize = 3*ImSize;
-  if(resize_memblk((void **)&RGBimg,(size_t)RGBsize, sizeof(unsigned char),"RGBimg")){
+  if(resize_bigblk((void **)&RGBimg,(size_t)RGBsize, sizeof(unsigned char),"RGBimg")){
      show_message("No RAM for RGB image.","Error: ",MT_ERR,0);
      return 1;
    }
-  if(resize_memblk((void **)&Frmr,(size_t)ImSize, sizeof(double),"Frmr")){
+  if(resize_bigblk((void **)&Frmr,(size_t)ImSize, sizeof(fpix_t),"Frmr")){
      show_message("No RAM for Frmr image.","Error: ",MT_ERR,0);
      return 1;
    }
-  if(resize_memblk((void **)&Frmg,(size_t)ImSize, sizeof(double),"Frmg")){
+  if(resize_bigblk((void **)&Frmg,(size_t)ImSize, sizeof(fpix_t),"Frmg")){
      show_message("No RAM for Frmg image.","Error: ",MT_ERR,0);
      return 1;
    }
-  if(resize_memblk((void **)&Frmb,(size_t)ImSize, sizeof(double),"Frmb")){
+  if(resize_bigblk((void **)&Frmb,(size_t)ImSize, sizeof(fpix_t),"Frmb")){
      show_message("No RAM for Frmb image.","Error: ",MT_ERR,0);
      return 1;
    }
@@ -5853,6 +7088,218 @@ static void calculate_yuyv_luts(void)
     lut_cbB[ipos] = tkcbB*fval;
    } 
 
+ Ydbl.ky = tky; Ydbl.kcrR = tkcrR; Ydbl.kcrG = tkcrG;
+ Ydbl.kcbG = tkcbG; Ydbl.kcbB = tkcbB;
+ Ydbl.conr = conr; Ydbl.cong = cong; Ydbl.conb = conb;
+
+ // Fixed point versions for the full-frame kernels. They can only be
+ // used if no sum of three terms can overflow an int (otherwise the
+ // LUTs are used for full frames too).
+ fval = 255.0*(fabs(tky)+fabs(tkcrR)+fabs(tkcrG)+fabs(tkcbG)+fabs(tkcbB)) + fabs(conr)+fabs(cong)+fabs(conb);
+ Yfx.ok = (fval*(double)(1<<YFX_SHIFT) < 2.0e9);
+ if(Yfx.ok){
+   Yfx.ky   = (int)lround(tky*(double)(1<<YFX_SHIFT));
+   Yfx.kcrR = (int)lround(tkcrR*(double)(1<<YFX_SHIFT));
+   Yfx.kcrG = (int)lround(tkcrG*(double)(1<<YFX_SHIFT));
+   Yfx.kcbG = (int)lround(tkcbG*(double)(1<<YFX_SHIFT));
+   Yfx.kcbB = (int)lround(tkcbB*(double)(1<<YFX_SHIFT));
+   Yfx.conr = (int)lround(conr*(double)(1<<YFX_SHIFT));
+   Yfx.cong = (int)lround(cong*(double)(1<<YFX_SHIFT));
+   Yfx.conb = (int)lround(conb*(double)(1<<YFX_SHIFT));
+  }
+}
+
+static void yuyv_frames_c(const unsigned short *p, int npix, const unsigned char *mask,
+                          fpix_t *fr, fpix_t *fg, fpix_t *fb, long long *sums)
+// Convert npix (even) YUYV pixels from p into the Frmr/g/b style arrays
+// fr, fg and fb using the fixed point coefficients in Yfx, and add the
+// (fixed point) R, G and B of those under mask to sums[0], [1] and [2].
+// This is the reference for the SIMD versions below, which must give
+// exactly the same results: all the sums are done on ints and the only
+// conversion is that of an int to an fpix_t times 2^-YFX_SHIFT (exact
+// for doubles, and rounded the same way for floats).
+{
+ const double scale = 1.0/(double)(1<<YFX_SHIFT);
+ long long sr = 0, sg = 0, sb = 0;
+ int ipos,y,cb,cr,r,g,b,rc,gc,bc,m;
+
+ for(ipos=0;ipos<npix;ipos+=2){
+    cb = p[ipos] >> 8;
+    cr = p[ipos+1] >> 8;
+    // The colour terms are common to both pixels
+    rc = Yfx.kcrR*cr + Yfx.conr;
+    gc = Yfx.cong - Yfx.kcrG*cr - Yfx.kcbG*cb;
+    bc = Yfx.kcbB*cb + Yfx.conb;
+    // First pixel
+    y = Yfx.ky*(p[ipos] & 0xff);
+    r = y + rc; g = y + gc; b = y + bc;
+    fr[ipos] = (double)r*scale;
+    fg[ipos] = (double)g*scale;
+    fb[ipos] = (double)b*scale;
+    m = -(mask[ipos] != 0); // All ones under the mask (no branch)
+    sr += r & m; sg += g & m; sb += b & m;
+    // Second pixel
+    y = Yfx.ky*(p[ipos+1] & 0xff);
+    r = y + rc; g = y + gc; b = y + bc;
+    fr[ipos+1] = (double)r*scale;
+    fg[ipos+1] = (double)g*scale;
+    fb[ipos+1] = (double)b*scale;
+    m = -(mask[ipos+1] != 0);
+    sr += r & m; sg += g & m; sb += b & m;
+   }
+ sums[0] += sr; sums[1] += sg; sums[2] += sb;
+}
+
+#ifdef YUYV_X86_KERNELS
+// Both SIMD kernels take 8 pixels (16 bytes of YUYV) at a time: the Y
+// bytes are the even ones and the Cb,Cr pair of each 2 pixels is copied
+// to both. Whatever is left over at the end of the image goes through
+// yuyv_frames_c().
+
+__attribute__((target("sse4.1")))
+static void yuyv_frames_sse41(const unsigned short *p, int npix, const unsigned char *mask,
+                              fpix_t *fr, fpix_t *fg, fpix_t *fb, long long *sums)
+{
+ const __m128i lo8 = _mm_set1_epi16(0xff);
+ const __m128i cbdup = _mm_setr_epi8(1,-1,1,-1,5,-1,5,-1,9,-1,9,-1,13,-1,13,-1);
+ const __m128i crdup = _mm_setr_epi8(3,-1,3,-1,7,-1,7,-1,11,-1,11,-1,15,-1,15,-1);
+ const __m128i ky = _mm_set1_epi32(Yfx.ky), kcrR = _mm_set1_epi32(Yfx.kcrR);
+ const __m128i kcrG = _mm_set1_epi32(Yfx.kcrG), kcbG = _mm_set1_epi32(Yfx.kcbG);
+ const __m128i kcbB = _mm_set1_epi32(Yfx.kcbB), conr = _mm_set1_epi32(Yfx.conr);
+ const __m128i cong = _mm_set1_epi32(Yfx.cong), conb = _mm_set1_epi32(Yfx.conb);
+ const __m128i zero = _mm_setzero_si128();
+#ifdef PARD_FLOAT32
+ const __m128 scale = _mm_set1_ps(1.0f/(float)(1<<YFX_SHIFT));
+#else
+ const __m128d scale = _mm_set1_pd(1.0/(double)(1<<YFX_SHIFT));
+#endif
+ __m128i sr = zero, sg = zero, sb = zero;
+ __m128i v,y16,cb16,cr16,y,cb,cr,r,g,b,m,rgb[3];
+ long long part[2];
+ int ipos,h,c,k,mask4;
+ fpix_t *dst[3];
+
+ dst[0] = fr; dst[1] = fg; dst[2] = fb;
+ for(ipos=0;ipos+8<=npix;ipos+=8){
+    v = _mm_loadu_si128((const __m128i *)(p+ipos));
+    y16 = _mm_and_si128(v, lo8);
+    cb16 = _mm_shuffle_epi8(v, cbdup);
+    cr16 = _mm_shuffle_epi8(v, crdup);
+    for(h=0;h<2;h++){ // Two lots of 4 pixels as 32 bit ints
+       y  = _mm_cvtepi16_epi32(h ? _mm_srli_si128(y16,8)  : y16);
+       cb = _mm_cvtepi16_epi32(h ? _mm_srli_si128(cb16,8) : cb16);
+       cr = _mm_cvtepi16_epi32(h ? _mm_srli_si128(cr16,8) : cr16);
+       y = _mm_mullo_epi32(y, ky);
+       r = _mm_add_epi32(_mm_add_epi32(y, _mm_mullo_epi32(cr, kcrR)), conr);
+       g = _mm_sub_epi32(_mm_sub_epi32(_mm_add_epi32(y, cong), _mm_mullo_epi32(cr, kcrG)), _mm_mullo_epi32(cb, kcbG));
+       b = _mm_add_epi32(_mm_add_epi32(y, _mm_mullo_epi32(cb, kcbB)), conb);
+       rgb[0] = r; rgb[1] = g; rgb[2] = b;
+       for(c=0;c<3;c++){
+#ifdef PARD_FLOAT32
+          _mm_storeu_ps(dst[c]+ipos+4*h, _mm_mul_ps(_mm_cvtepi32_ps(rgb[c]), scale));
+#else
+          _mm_storeu_pd(dst[c]+ipos+4*h,   _mm_mul_pd(_mm_cvtepi32_pd(rgb[c]), scale));
+          _mm_storeu_pd(dst[c]+ipos+4*h+2, _mm_mul_pd(_mm_cvtepi32_pd(_mm_srli_si128(rgb[c],8)), scale));
+#endif
+         }
+       // Sums under the mask, widened to 64 bits
+       memcpy(&mask4, mask+ipos+4*h, 4);
+       m = _mm_cmpgt_epi32(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(mask4)), zero);
+       r = _mm_and_si128(r, m); g = _mm_and_si128(g, m); b = _mm_and_si128(b, m);
+       sr = _mm_add_epi64(sr, _mm_add_epi64(_mm_cvtepi32_epi64(r), _mm_cvtepi32_epi64(_mm_srli_si128(r,8))));
+       sg = _mm_add_epi64(sg, _mm_add_epi64(_mm_cvtepi32_epi64(g), _mm_cvtepi32_epi64(_mm_srli_si128(g,8))));
+       sb = _mm_add_epi64(sb, _mm_add_epi64(_mm_cvtepi32_epi64(b), _mm_cvtepi32_epi64(_mm_srli_si128(b,8))));
+      }
+   }
+ rgb[0] = sr; rgb[1] = sg; rgb[2] = sb;
+ for(k=0;k<3;k++){
+    _mm_storeu_si128((__m128i *)part, rgb[k]);
+    sums[k] += part[0] + part[1];
+   }
+ if(ipos<npix) yuyv_frames_c(p+ipos, npix-ipos, mask+ipos, fr+ipos, fg+ipos, fb+ipos, sums);
+}
+
+__attribute__((target("avx2")))
+static void yuyv_frames_avx2(const unsigned short *p, int npix, const unsigned char *mask,
+                             fpix_t *fr, fpix_t *fg, fpix_t *fb, long long *sums)
+{
+ const __m128i lo8 = _mm_set1_epi16(0xff);
+ const __m128i cbdup = _mm_setr_epi8(1,-1,1,-1,5,-1,5,-1,9,-1,9,-1,13,-1,13,-1);
+ const __m128i crdup = _mm_setr_epi8(3,-1,3,-1,7,-1,7,-1,11,-1,11,-1,15,-1,15,-1);
+ const __m256i ky = _mm256_set1_epi32(Yfx.ky), kcrR = _mm256_set1_epi32(Yfx.kcrR);
+ const __m256i kcrG = _mm256_set1_epi32(Yfx.kcrG), kcbG = _mm256_set1_epi32(Yfx.kcbG);
+ const __m256i kcbB = _mm256_set1_epi32(Yfx.kcbB), conr = _mm256_set1_epi32(Yfx.conr);
+ const __m256i cong = _mm256_set1_epi32(Yfx.cong), conb = _mm256_set1_epi32(Yfx.conb);
+ const __m256i zero = _mm256_setzero_si256();
+#ifdef PARD_FLOAT32
+ const __m256 scale = _mm256_set1_ps(1.0f/(float)(1<<YFX_SHIFT));
+#else
+ const __m256d scale = _mm256_set1_pd(1.0/(double)(1<<YFX_SHIFT));
+#endif
+ __m256i sr = zero, sg = zero, sb = zero;
+ __m256i y,cb,cr,r,g,b,m,rgb[3];
+ __m128i v;
+ long long part[4];
+ int ipos,c,k;
+ fpix_t *dst[3];
+
+ dst[0] = fr; dst[1] = fg; dst[2] = fb;
+ for(ipos=0;ipos+8<=npix;ipos+=8){
+    v = _mm_loadu_si128((const __m128i *)(p+ipos));
+    y  = _mm256_cvtepi16_epi32(_mm_and_si128(v, lo8));
+    cb = _mm256_cvtepi16_epi32(_mm_shuffle_epi8(v, cbdup));
+    cr = _mm256_cvtepi16_epi32(_mm_shuffle_epi8(v, crdup));
+    y = _mm256_mullo_epi32(y, ky);
+    r = _mm256_add_epi32(_mm256_add_epi32(y, _mm256_mullo_epi32(cr, kcrR)), conr);
+    g = _mm256_sub_epi32(_mm256_sub_epi32(_mm256_add_epi32(y, cong), _mm256_mullo_epi32(cr, kcrG)), _mm256_mullo_epi32(cb, kcbG));
+    b = _mm256_add_epi32(_mm256_add_epi32(y, _mm256_mullo_epi32(cb, kcbB)), conb);
+    rgb[0] = r; rgb[1] = g; rgb[2] = b;
+    for(c=0;c<3;c++){
+#ifdef PARD_FLOAT32
+       _mm256_storeu_ps(dst[c]+ipos, _mm256_mul_ps(_mm256_cvtepi32_ps(rgb[c]), scale));
+#else
+       _mm256_storeu_pd(dst[c]+ipos,   _mm256_mul_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(rgb[c])), scale));
+       _mm256_storeu_pd(dst[c]+ipos+4, _mm256_mul_pd(_mm256_cvtepi32_pd(_mm256_extracti128_si256(rgb[c],1)), scale));
+#endif
+      }
+    // Sums under the mask, widened to 64 bits
+    m = _mm256_cmpgt_epi32(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(mask+ipos))), zero);
+    r = _mm256_and_si256(r, m); g = _mm256_and_si256(g, m); b = _mm256_and_si256(b, m);
+    sr = _mm256_add_epi64(sr, _mm256_add_epi64(_mm256_cvtepi32_epi64(_mm256_castsi256_si128(r)), _mm256_cvtepi32_epi64(_mm256_extracti128_si256(r,1))));
+    sg = _mm256_add_epi64(sg, _mm256_add_epi64(_mm256_cvtepi32_epi64(_mm256_castsi256_si128(g)), _mm256_cvtepi32_epi64(_mm256_extracti128_si256(g,1))));
+    sb = _mm256_add_epi64(sb, _mm256_add_epi64(_mm256_cvtepi32_epi64(_mm256_castsi256_si128(b)), _mm256_cvtepi32_epi64(_mm256_extracti128_si256(b,1))));
+   }
+ rgb[0] = sr; rgb[1] = sg; rgb[2] = sb;
+ for(k=0;k<3;k++){
+    _mm256_storeu_si256((__m256i *)part, rgb[k]);
+    sums[k] += part[0] + part[1] + part[2] + part[3];
+   }
+ if(ipos<npix) yuyv_frames_c(p+ipos, npix-ipos, mask+ipos, fr+ipos, fg+ipos, fb+ipos, sums);
+}
+#endif
+
+static void select_yuyv_kernel(void)
+// Pick the fastest full-frame YUYV kernel this CPU can run. Setting the
+// environment variable PARDCAP_KERNEL to C, SSE4.1 or AVX2 limits the
+// choice (e.g. to compare them).
+{
+ const char *want = getenv("PARDCAP_KERNEL");
+
+ Yuyv_kernel = yuyv_frames_c;
+ Yuyv_kernel_name = "C";
+ if(want != NULL && !strcmp(want,"C")) return;
+#ifdef YUYV_X86_KERNELS
+ __builtin_cpu_init();
+ if(__builtin_cpu_supports("avx2") && (want == NULL || !strcmp(want,"AVX2"))){
+   Yuyv_kernel = yuyv_frames_avx2;
+   Yuyv_kernel_name = "AVX2";
+   return;
+  }
+ if(__builtin_cpu_supports("sse4.1")){
+   Yuyv_kernel = yuyv_frames_sse41;
+   Yuyv_kernel_name = "SSE4.1";
+  }
+#endif
 }
 
 unsigned char uchar_from_d(double dval)
@@ -5903,17 +7350,33 @@ void set_curr_lut(int reqLUT)
 
 }
 
-static int jpeg_convert(const unsigned char *p, int sz)
-// Decode image from the JPEG stream. Some of this code is based on the
-// libjpeg-turbo GitHub repository here:
-// https://github.com/leapmotion/libjpeg-turbo/blob/master/example.c
+static int jpeg_decode(const unsigned char *p, int sz, int luma, int denom, const int *tile, unsigned char *out, int *outwd)
+// Decode image from the JPEG stream into out (a full size RGBimg sized
+// block), as R,G,B or, if luma is set, as just the Y (luma) of the
+// JPEG, one byte per pixel. The luma-only decode skips the chroma
+// upsampling and colour conversion (see Mjpeg_luma). The image is
+// scaled down by 1/denom (1, 2, 4 or 8) as it is decoded, which cuts
+// the IDCT work by denom squared (see Jpeg_prev_denom). If tile is not
+// NULL only the rows and columns it gives (see Jpeg_prev_tile) are
+// decoded (if libjpeg can) and put where they are in the full size
+// image. *outwd is set to the width of the decoded rows once decoding
+// has begun (and is -1 if it never did).
+// No globals are changed and no messages given so this can be used by
+// the MJPEG decode workers (see Mjdec). jpeg_convert() is the wrapper
+// for the rest of the program. Returns a JDEC_ code.
+// Some of this code is based on the libjpeg-turbo GitHub repository
+// here: https://github.com/leapmotion/libjpeg-turbo/blob/master/example.c
 {
  struct jpeg_decompress_struct info;
  // struct jpeg_error_mgr err; // The default 'exit(1)' error handler
  struct my_error_mgr err; // Our custom error handler.
- int numComponents,retval;
+ int numComponents,retval,bpp;
  unsigned char* lpRowBuffer[1];
+#ifdef JPEG_PARTIAL_DECODE
+ JDIMENSION xoff,xwd;
+#endif
 
+ *outwd = -1;
   // We set up the normal JPEG error routines, then override error_exit.
   info.err = jpeg_std_error(&err.pub);
   err.pub.error_exit = my_error_exit;
@@ -5922,7 +7385,7 @@ static int jpeg_convert(const unsigned char *p, int sz)
     // If we get here, the JPEG code has signaled an error.
     // We need to clean up the JPEG object and return
     jpeg_destroy_decompress(&info);
-    return 1; // Let caller know an error occurred
+    return JDEC_FAILED; // Let caller know an error occurred
   }
  // The above code replaces this standard fatal 'exit(1)' error handler
  // info.err = jpeg_std_error(&err);
@@ -5931,39 +7394,317 @@ static int jpeg_convert(const unsigned char *p, int sz)
  retval = jpeg_read_header(&info, TRUE);
 
  if (retval != JPEG_HEADER_OK) {
-     show_message("Error reading (M)JPEG frame header. Cannot make a preview image.","JPEG Error: ",MT_ERR,1);
      jpeg_destroy_decompress(&info);
-     Preview_impossible=1;          // Abort preview attempt
-     return 1;
+     return JDEC_HEADER;
     }
     
+ // A YCbCr JPEG decoded as greyscale is just its Y channel
+ if(luma) info.out_color_space = JCS_GRAYSCALE;
+ info.scale_num = 1;
+ info.scale_denom = (unsigned int)denom;
  jpeg_start_decompress(&info); 
  numComponents = info.num_components;
- if(info.output_width!=(JDIMENSION)ImWidth || info.output_height!=(JDIMENSION)ImHeight){
-     show_message("Dimensions of (M)JPEG frame header don't match current dimension. Cannot make a preview image.","JPEG Error: ",MT_ERR,1);
+ if(info.image_width!=(JDIMENSION)ImWidth || info.image_height!=(JDIMENSION)ImHeight){
+     retval = JDEC_DIMS;
      goto Fail_return;
  }
  if(numComponents!=3){
-     show_message("(M)JPEG frame header does not have exactly 3 colour channels. Cannot make a preview image.","JPEG Error: ",MT_ERR,1);
+     retval = JDEC_CHANS;
      goto Fail_return;
  }
 
  // Read the decompressed image, one horizontal line at a time
+ bpp = luma ? 1 : 3;
+ *outwd = (int)info.output_width;
+#ifdef JPEG_PARTIAL_DECODE
+ if(tile!=NULL && denom==1){
+   // Decode only the iMCU columns that cover the tile (libjpeg may
+   // widen it to their edges) and skip the rows above it
+   xoff = (JDIMENSION)tile[2];
+   xwd = (JDIMENSION)(tile[3]-tile[2]);
+   jpeg_crop_scanline(&info, &xoff, &xwd);
+   if(tile[0]>0) jpeg_skip_scanlines(&info, (JDIMENSION)tile[0]);
+   while(info.output_scanline < (JDIMENSION)tile[1]) {
+        lpRowBuffer[0] = (unsigned char *)(&out[bpp*((size_t)ImWidth*info.output_scanline+xoff)]);
+        jpeg_read_scanlines(&info, lpRowBuffer, 1);
+      }
+   // The rows below the tile are not wanted
+   jpeg_abort_decompress(&info);
+   jpeg_destroy_decompress(&info);
+   return JDEC_OK;
+  }
+#endif
  while(info.output_scanline < info.output_height) {
-      lpRowBuffer[0] = (unsigned char *)(&RGBimg[3*info.output_width*info.output_scanline]);
+      lpRowBuffer[0] = (unsigned char *)(&out[bpp*info.output_width*info.output_scanline]);
       jpeg_read_scanlines(&info, lpRowBuffer, 1);
     }
 
  jpeg_finish_decompress(&info);
  jpeg_destroy_decompress(&info);
 
- return 0;
+ return JDEC_OK;
  
  Fail_return:
      jpeg_finish_decompress(&info);
      jpeg_destroy_decompress(&info);
-     Preview_impossible=1;          // Abort preview attempt
-     return 1;
+     return retval;
+}
+
+static void jpeg_decode_report(int code)
+// Tell the user why jpeg_decode() failed (libjpeg has already said why
+// for a JDEC_FAILED) and abort any preview attempt.
+{
+ switch(code){
+     case JDEC_HEADER:
+       show_message("Error reading (M)JPEG frame header. Cannot make a preview image.","JPEG Error: ",MT_ERR,1);
+     break;
+     case JDEC_DIMS:
+       show_message("Dimensions of (M)JPEG frame header don't match current dimension. Cannot make a preview image.","JPEG Error: ",MT_ERR,1);
+     break;
+     case JDEC_CHANS:
+       show_message("(M)JPEG frame header does not have exactly 3 colour channels. Cannot make a preview image.","JPEG Error: ",MT_ERR,1);
+     break;
+     default: return;
+  }
+ Preview_impossible=1;          // Abort preview attempt
+}
+
+static int jpeg_convert(const unsigned char *p, int sz, int luma, int denom, const int *tile)
+// Decode image from the JPEG stream into RGBimg (see jpeg_decode) and
+// note how it was decoded for colour_convert().
+// Returns 0 on success, 1 on error.
+{
+ int r,wd;
+
+ r = jpeg_decode(p,sz,luma,denom,tile,RGBimg,&wd);
+ Jpeg_rgbimg_ok = (r == JDEC_OK);
+ if(wd > 0){
+   Jpeg_luma_rgbimg = luma;
+   Jpeg_rgbimg_denom = denom;
+   Jpeg_rgbimg_wd = wd;
+  }
+ if(r == JDEC_OK) return 0;
+ jpeg_decode_report(r);
+ return 1;
+}
+
+static int jpeg_luma_wanted(void)
+// 1 if frames from the MJPEG stream being saved need only their luma
+// decoding: a Y-only save format with the 'JPEG luma' option on.
+{
+ return Mjpeg_luma && CamFormat==V4L2_PIX_FMT_MJPEG && (saveas_fmt==SAF_YP5 || saveas_fmt==SAF_BM8);
+}
+
+// The MJPEG decode workers (see Mjdec). The slots are used in turn so
+// frame n of an average is always in slot n % Mjdec.nslots and the grab
+// stage only waits for a frame to be decoded when it has nothing else
+// to do. The slots' RGB blocks are swapped with RGBimg as the frames are
+// added to the average, so no decoded frame is copied.
+
+static void *mjdec_worker(void *arg)
+// A decode worker thread. Decodes queued frames, earliest first, until
+// told to quit.
+{
+ struct mjdec_slot *sl;
+ int k,next;
+
+ pthread_mutex_lock(&Mjdec.lock);
+ FOREVER {
+     if(Mjdec.quit) break;
+     next = -1;
+     for(k=0;k<Mjdec.nslots;k++)
+        if(Mjdec.slot[k].state==MJSLOT_QUEUED &&
+           (next<0 || Mjdec.slot[k].seq<Mjdec.slot[next].seq)) next=k;
+     if(next<0){
+       pthread_cond_wait(&Mjdec.go, &Mjdec.lock);
+       continue;
+      }
+     sl = &Mjdec.slot[next];
+     sl->state = MJSLOT_BUSY;
+     pthread_mutex_unlock(&Mjdec.lock);
+     sl->err = jpeg_decode(sl->jpg,sl->size,sl->luma,1,NULL,sl->rgb,&sl->wd);
+     pthread_mutex_lock(&Mjdec.lock);
+     sl->state = MJSLOT_DONE;
+    }
+ pthread_mutex_unlock(&Mjdec.lock);
+ return NULL;
+}
+
+static int mjdec_state(struct mjdec_slot *sl)
+// The MJSLOT_ state of slot sl
+{
+ int state;
+
+ pthread_mutex_lock(&Mjdec.lock);
+ state = sl->state;
+ pthread_mutex_unlock(&Mjdec.lock);
+ return state;
+}
+
+static void mjdec_free_slots(void)
+// Give back the slots' memory. Only called between averages (when the
+// image size changes and on exit) so no worker is using them.
+{
+ int k;
+
+ for(k=0;k<Mjdec.nalloc;k++){
+    big_free(Mjdec.slot[k].rgb);
+    free(Mjdec.slot[k].jpg);
+    memset(&Mjdec.slot[k], 0, sizeof(struct mjdec_slot));
+   }
+ Mjdec.nalloc = Mjdec.nslots = 0;
+ Mjdec.rgbsize = 0;
+}
+
+static void mjdec_finish(void)
+// Drop any frames not yet decoded and wait for any being decoded. The
+// slots keep their memory for the next average (see mjdec_start) and
+// the workers are left waiting for it.
+{
+ int k,busy;
+
+ if(!Mjdec.up) return;
+ pthread_mutex_lock(&Mjdec.lock);
+ for(k=0;k<Mjdec.nslots;k++)
+    if(Mjdec.slot[k].state==MJSLOT_QUEUED) Mjdec.slot[k].state=MJSLOT_FREE;
+ FOREVER {
+     busy = 0;
+     for(k=0;k<Mjdec.nslots;k++) if(Mjdec.slot[k].state==MJSLOT_BUSY) busy=1;
+     if(!busy) break;
+     pthread_mutex_unlock(&Mjdec.lock);
+     usleep(500);
+     pthread_mutex_lock(&Mjdec.lock);
+   }
+ for(k=0;k<Mjdec.nslots;k++) Mjdec.slot[k].state = MJSLOT_FREE;
+ Mjdec.nslots = 0;
+ pthread_mutex_unlock(&Mjdec.lock);
+}
+
+static int mjdec_start(void)
+// Get ready to decode the frames of an MJPEG average in parallel: start
+// the workers (the first time only), one per core or Band_threads if
+// that was set with -j, and give each slot an RGB block (the first time
+// only for each image size). There is a slot for each worker to decode
+// into, one for the frame being added to the average and one to copy
+// the next frame into.
+// Returns 0 if ready, 1 if the frames will have to be decoded in turn
+// by the grab stage instead (no threads or memory for it).
+{
+ long ncpu;
+ int n,k;
+
+ if(!Mjdec.up){
+   pthread_mutex_init(&Mjdec.lock, NULL);
+   pthread_cond_init(&Mjdec.go, NULL);
+   Mjdec.up = 1;
+   Mjdec.nworkers = 0;
+   Mjdec.quit = 0;
+   n = Band_threads;
+   if(n < 1){
+     ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+     n = (ncpu > 0) ? (int)ncpu : 1;
+    }
+   if(n > MJDEC_MAX_WORKERS) n = MJDEC_MAX_WORKERS;
+   for(; Mjdec.nworkers < n; Mjdec.nworkers++)
+     if(pthread_create(&Mjdec.tid[Mjdec.nworkers], NULL, mjdec_worker, NULL)) break;
+  }
+ if(Mjdec.nworkers < 1) return 1;
+ if(Mjdec.rgbsize != RGBsize) mjdec_free_slots();
+ Mjdec.rgbsize = RGBsize;
+ for(k=Mjdec.nalloc;k<Mjdec.nworkers+2;k++){
+    Mjdec.slot[k].rgb = (unsigned char *)big_alloc((size_t)RGBsize,"an MJPEG decode slot");
+    if(Mjdec.slot[k].rgb == NULL) break;
+   }
+ Mjdec.nalloc = k;
+ pthread_mutex_lock(&Mjdec.lock);
+ Mjdec.nslots = k;
+ pthread_mutex_unlock(&Mjdec.lock);
+ Mjdec.nsub = Mjdec.nacc = 0;
+ // With fewer than two slots nothing could be decoded while a frame is
+ // being added to the average.
+ if(k < 2){
+   mjdec_finish();
+   return 1;
+  }
+ return 0;
+}
+
+static void mjdec_pool_stop(void)
+// Tell the decode workers to quit and wait for them
+{
+ int k;
+
+ if(!Mjdec.up) return;
+ mjdec_finish();
+ mjdec_free_slots();
+ pthread_mutex_lock(&Mjdec.lock);
+ Mjdec.quit = 1;
+ pthread_cond_broadcast(&Mjdec.go);
+ pthread_mutex_unlock(&Mjdec.lock);
+ for(k = 0; k < Mjdec.nworkers; k++) pthread_join(Mjdec.tid[k], NULL);
+ Mjdec.nworkers = 0;
+ Mjdec.up = 0;
+}
+
+static void mjdec_submit(const unsigned char *p, int size)
+// Copy the compressed frame p (of size bytes) into the next slot, which
+// must be free, and queue it for decoding. If there is no memory for
+// the copy the frame is passed on as one that failed to decode.
+{
+ struct mjdec_slot *sl;
+
+ sl = &Mjdec.slot[Mjdec.nsub % Mjdec.nslots];
+ if(sl->jpgalloc < (size_t)size){
+   free(sl->jpg);
+   sl->jpg = (unsigned char *)malloc((size_t)size);
+   sl->jpgalloc = (sl->jpg == NULL) ? 0 : (size_t)size;
+  }
+ if(sl->jpg != NULL) memcpy(sl->jpg, p, (size_t)size);
+ sl->size = size;
+ sl->luma = jpeg_luma_wanted();
+ pthread_mutex_lock(&Mjdec.lock);
+ sl->seq = Mjdec.nsub++;
+ if(sl->jpg == NULL){
+   sl->err = JDEC_FAILED;
+   sl->wd = -1;
+   sl->state = MJSLOT_DONE;
+  } else {
+   sl->state = MJSLOT_QUEUED;
+   pthread_cond_signal(&Mjdec.go);
+  }
+ pthread_mutex_unlock(&Mjdec.lock);
+}
+
+static void mjdec_take(struct mjdec_slot *sl)
+// Make the decoded frame in slot sl the one in RGBimg, ready for
+// process_image(), by swapping their blocks (both are RGBsize bytes got
+// with big_alloc).
+{
+ unsigned char *tmp;
+
+ tmp = RGBimg;
+ RGBimg = sl->rgb;
+ sl->rgb = tmp;
+ Jpeg_rgbimg_ok = (sl->err == JDEC_OK);
+ if(sl->wd > 0){
+   Jpeg_luma_rgbimg = sl->luma;
+   Jpeg_rgbimg_denom = 1;
+   Jpeg_rgbimg_wd = sl->wd;
+  }
+ if(sl->err != JDEC_OK){
+   jpeg_decode_report(sl->err);
+   show_message("Failed to decode the JPEG image from the camera.","Error: ",MT_ERR,0);
+  }
+ Mjpeg_predecoded = 1;
+}
+
+static void mjdec_release(struct mjdec_slot *sl)
+// Free slot sl for the next frame once it has been added to the average
+{
+ Mjpeg_predecoded = 0;
+ pthread_mutex_lock(&Mjdec.lock);
+ sl->state = MJSLOT_FREE;
+ pthread_mutex_unlock(&Mjdec.lock);
 }
 
 double Prev_Laplace(int colchan) 
@@ -5974,7 +7715,7 @@ double Prev_Laplace(int colchan)
 // preview image and will be displayed. If any other colour channel is used then
 // the actual preview image pixels will not be altered
 {
- int prow,pcol,endrow,endcol,rgbpos,prgbpos,pixcolour,mskpos;
+ int prow,pcol,endrow,endcol,rgbpos,prgbpos,pixcolour;
  int p1,p2,p3,p4,p5,p6,p7,p8,pc;
  double p,lc1,lc2,lc3; // Laplacian coefficients
  double accum,denom;
@@ -6011,12 +7752,10 @@ double Prev_Laplace(int colchan)
 
  // Perform the Laplacian convolution
 
- mskpos=rgbpos/3; // Skip the first used row+1 and first used col+1 (mask)
  for(prow=1;prow<endrow;prow++){ 
-    if(SSrow[prow]<0){mskpos+=PreviewWd;  rgbpos+=PreviewWd_stride; continue;}
-    mskpos++;          // Skip the first column (mask)
+    if(SSrow[prow]<0){rgbpos+=PreviewWd_stride; continue;}
     rgbpos+=pixcolour; // Skip the first column
-    for(pcol=1;pcol<endcol;pcol++,mskpos++,rgbpos+=3){
+    for(pcol=1;pcol<endcol;pcol++,rgbpos+=3){
          if(SScol[pcol]<0) continue;
          prgbpos=+rgbpos;    // Our centre pixel position (pc)
          pc=prgbpos;                 //
@@ -6041,9 +7780,10 @@ double Prev_Laplace(int colchan)
 
         // Calculate the autofocus parameter if we are on a non-zero pixel
          if(uy1>0){
-           // If we are using the mask, only do it if the mask pixel is on.
+           // If we are using the mask, only do it if the mask pixel is on
+           // (which is where this pixel would be unflipped).
            if(PrevStat.mask_status){
-             if(PrevStat.MaskIm[mskpos]){
+             if(PrevStat.MaskIm[Prev_mskstart+prow*Prev_mskrowstep+pcol*Prev_mskcolstep]){
                  accum+=p; 
                  denom++;
                }
@@ -6065,7 +7805,7 @@ double Prev_Laplace(int colchan)
  if(colchan==CCHAN_Y){
    rgbpos=Prev_startrow+Prev_startcol+PreviewWd_stride; // Offset by one row 
    for(prow=1;prow<endrow;prow++){ 
-      if(SSrow[prow]<0){mskpos+=PreviewWd;  rgbpos+=PreviewWd_stride; continue;}
+      if(SSrow[prow]<0){rgbpos+=PreviewWd_stride; continue;}
       rgbpos+=3; // Skip the first column
       for(pcol=1;pcol<endcol;pcol++,rgbpos+=3){
          if(SScol[pcol]<0) continue;
@@ -6080,72 +7820,6 @@ double Prev_Laplace(int colchan)
  return accum;
 }
 
-void Prev_Flip(void) 
-// Perform a horizontal and/or vertical flip on the preview image
-{
- int row,cpos,opos;
- int idx,fdx,psize;
- unsigned char tmpr,tmpg,tmpb;
-
- if(prev_flip_h && prev_flip_v){ // Flip in both horizontal and vertical
-
-       psize=PreviewImg_rgb_size/2;
-       for(idx=0,fdx=PreviewImg_rgb_size;idx<psize;idx+=3,fdx-=3){
-          tmpr=PreviewImg[idx];
-          tmpg=PreviewImg[idx+1];
-          tmpb=PreviewImg[idx+2];
-          PreviewImg[idx]=PreviewImg[fdx];
-          PreviewImg[fdx]=tmpr;
-          PreviewImg[idx+1]=PreviewImg[fdx+1];
-          PreviewImg[fdx+1]=tmpg;
-          PreviewImg[idx+2]=PreviewImg[fdx+2];
-          PreviewImg[fdx+2]=tmpb;
-        }
-
-  } else { // Flip either horizontally or vertically
-
-
- if(prev_flip_h){ // Flip horizontal
-       psize=PreviewWd_stride/2;
-       for(row=0;row<PreviewImg_rgb_size;row+=PreviewWd_stride){
-          for(idx=0,fdx=PreviewWd_stride;idx<psize;idx+=3,fdx-=3){
-             cpos=row+idx; opos=row+fdx;
-             tmpr=PreviewImg[cpos];
-             tmpg=PreviewImg[cpos+1];
-             tmpb=PreviewImg[cpos+2];
-             PreviewImg[cpos]=PreviewImg[opos];
-             PreviewImg[opos]=tmpr;
-             PreviewImg[cpos+1]=PreviewImg[opos+1];
-             PreviewImg[opos+1]=tmpg;
-             PreviewImg[cpos+2]=PreviewImg[opos+2];
-             PreviewImg[opos+2]=tmpb;
-           }
-         }
-   }
-
- if(prev_flip_v){ // Flip vertical
-       psize=PreviewImg_rgb_size/2;
-       for(idx=0;idx<PreviewWd_stride;idx+=3){
-          for(row=0;row<psize;row+=PreviewWd_stride){
-             cpos=row+idx; opos=PreviewImg_rgb_size-row+idx;
-             tmpr=PreviewImg[cpos];
-             tmpg=PreviewImg[cpos+1];
-             tmpb=PreviewImg[cpos+2];
-             PreviewImg[cpos]=PreviewImg[opos];
-             PreviewImg[opos]=tmpr;
-             PreviewImg[cpos+1]=PreviewImg[opos+1];
-             PreviewImg[opos+1]=tmpg;
-             PreviewImg[cpos+2]=PreviewImg[opos+2];
-             PreviewImg[opos+2]=tmpb;
-           }
-         }
-   }
-
-  }
-
- return;
-}
-
 static void set_border_pixels(unsigned char bval)
 // Set the pixels all round the border of the preview image to bval.
 // This is only done on the 'green' pixel and is designed to be used after a
@@ -6186,692 +7860,440 @@ static void set_border_pixels(unsigned char bval)
  return;
 }
 
-static int colour_convert(const unsigned short *p)
-// This function converts the raw data from the frame grabber buffer p
-// (which will be in YUYV format) or from the JPEG frame grabber buffer
-// that will have been previously decoded into the global RGBimg buffer,
-// into a format that can be more easily manipulated in this program
-// (e.g. for frame averaging, saving or generating a preview image).
+//\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\////////////////////////////////////
+ //                                                                  // 
+  //                  ROW BAND WORKERS                              //
+   //                                                              //
+    //\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\////////////////////////////////
+
+// The full-frame pass of colour_convert() (conversion, dark and flat
+// field correction, mean scaling and averaging) is run on all cores.
+// The image is cut into row bands and a pool of worker threads, along
+// with the calling thread, take bands in turn until all are done.
+// How the image is cut depends only on its height, never on the number
+// of threads, and any sums are kept per band and added up in band order
+// at the end, so the results are exactly the same however many threads
+// there are (or if there is only one).
+
+static void band_worker_loop(void)
+// Take bands of the current job until there are none left
 {
- double r,g,b,fval,mn_r,mn_g,mn_b,dval1,dval2,dval3;
- int ipos,rgbpos,prow,pcol,iposp,fidx,ival,pipos,mskpos;
- unsigned short pixval,y1,y2,cb,cr;
- unsigned char uy1,uy2,uy3,max;
- unsigned char bval=3; // 3 is used as a placeholder - if it gets changed then
-                       // we know some pre-processing has been done and boundary
-                       // pixel setting must be performed.
- 
-        
- if(Need_to_preview==PREVIEW_ON){// We need a preview image only, not
-                                 // a full-frame conversion.
-                                 
-    if(Preview_impossible) return 0; // No point continuing but return
-                                     // without error because there was
-                                     // no problem in this function.
+ int band,r0,r1;
+
+ FOREVER {
+     band = __atomic_fetch_add(&Bands.next, 1, __ATOMIC_ACQ_REL);
+     if(band >= Bands.nbands) break;
+     r0 = band*Bands.rows;
+     r1 = r0 + Bands.rows;
+     if(r1 > ImHeight) r1 = ImHeight;
+     Bands.fn(band, r0*ImWidth, r1*ImWidth, Bands.arg);
+    }
+}
 
-     // Let the preview display timeout function know we are making a preview
-     // image so it doesn't try to update it again till this one is ready.
-     // This flag will be reset back to zero at the end of all preview image
-     // modifications (such as adding histogram and focus bar overlays) in the
-     // function 'process_image' (which calls this function).
-     Preparing_preview=1;
-
-     // Some initialisations
-     PrevStat.usat_r=PrevStat.lsat_r=0;
-     PrevStat.usat_g=PrevStat.lsat_g=0;
-     PrevStat.usat_b=PrevStat.lsat_b=0;
-     PrevStat.max_r=PrevStat.max_g=PrevStat.max_b=0;
-     PrevStat.min_r=PrevStat.min_g=PrevStat.min_b=255;
-     PrevStat.intgl_r=PrevStat.intgl_g=PrevStat.intgl_b=0.0;
-     PrevStat.af_laplace_r=0.0;
-     PrevStat.af_laplace_g=0.0;
-     PrevStat.af_laplace_b=0.0;
-
-     memset(PrevStat.hgm_r, 0, 256*sizeof(unsigned int));
-     memset(PrevStat.hgm_g, 0, 256*sizeof(unsigned int));
-     memset(PrevStat.hgm_b, 0, 256*sizeof(unsigned int));
-         
-    // Now make the colour or greyscale preview image from the full-size image                            
-    switch(CamFormat){
-        case V4L2_PIX_FMT_YUYV:
-         switch(col_conv_type){
-          case CCOL_TO_Y:    // Just extract the Y component (a fast op)
-               rgbpos=Prev_startrow+Prev_startcol;
-               if(PreviewIDX>=Preview_integral) PreviewIDX=0;
- 
-               for(prow=0;prow<PreviewHt;prow++){ 
-                  if(SSrow[prow]<0){rgbpos+=PreviewWd_stride; continue;}
-                     for(pcol=0;pcol<PreviewWd;pcol++,rgbpos+=3){
-                        if(SScol[pcol]<0) continue;
-
-                           ipos=SSrow[prow]+SScol[pcol];
-
-                           pipos=rgbpos/3;
-                           PreviewBuff[PreviewIDX][pipos]=(int)(p[ipos] & 0xff);
-                           for(fidx=0,dval1=(double)Preview_bias;fidx<Preview_integral;fidx++){
-                              dval2=(double)(PreviewBuff[fidx][pipos])-Preview_dark[pipos];
-                              dval2/=Preview_flat[pipos];
-                              dval1+=dval2;
-                             }
-
-                           // Invert intensities if that is the user's choice
-                           if(PrevStat.pp_invert) uy1=255-uchar_from_d(dval1);
-                             else uy1=uchar_from_d(dval1);
-   
-                           // Only need to set the red channel for now
-                           PreviewImg[rgbpos]=uy1; 
-
-                     }
-                 }
-
-               PreviewIDX++;
-               preview_stored = PREVIEW_STORED_MONO;
-          break;
-          case CCOL_TO_RGB:  // Convert to full RGB
-          case CCOL_TO_BGR:  // Convert to full RGB (for preview)
-              rgbpos=Prev_startrow+Prev_startcol; 
-
-              for(prow=0;prow<PreviewHt;prow++){ 
-                  if(SSrow[prow]<0){rgbpos+=PreviewWd_stride; continue;}
-                  // The following only applies to making a colour
-                  // preview from a YUYV image stream:
-
-                  // If the preview is scaling UP the original image
-                  // instead of scaling it down to a smaller size
-                  // we need to scan a full row of the original and then
-                  // then up-scale that (because YUYV pixels contain
-                  // overlapping colour information)
-                  if(Prev_scaledim<1.0){
-                     ival=(SSrow[prow]+ImWidth);
-                     for(ipos=SSrow[prow],pipos=0;ipos<ival;ipos+=2){
-                         if(ipos%2) ipos--;
-                         iposp=ipos+1;
-                         //First pixel
-                         pixval=p[ipos];
-                         y1= pixval & 0xff; // Y1
-                         cb= pixval >> 8;   // Cb1
-                         // Second pixel
-                         pixval=p[iposp];
-                         y2= pixval & 0xff; // Y2
-                         cr= pixval >> 8;   // Cr1
-                         // The following is common to both pixels so
-                         // calculate it only once:
-                         fval = lut_crG[cr] + lut_cbG[cb]; 
-                         // Get RGB from first pixel via the LUTs
-                         r = lut_yR[y1] + lut_crR[cr];
-                         g = lut_yG[y1] - fval; 
-                         b = lut_yB[y1] + lut_cbB[cb];
-                         r=r<0.0?0.0:r;g=g<0.0?0.0:g;b=b<0.0?0.0:b;
-                        // Invert intensities if that is the user's choice
-                        if(PrevStat.pp_invert){
-                          uy1=255-(unsigned char)(r>255.0?255:r);
-                          uy2=255-(unsigned char)(g>255.0?255:g);
-                          uy3=255-(unsigned char)(b>255.0?255:b);
-                         } else {
-                          uy1=(unsigned char)(r>255.0?255:r);
-                          uy2=(unsigned char)(g>255.0?255:g);
-                          uy3=(unsigned char)(b>255.0?255:b);
-                         }
-
-                         PreviewRow[pipos++]=uy1;
-                         PreviewRow[pipos++]=uy2;
-                         PreviewRow[pipos++]=uy3;
-                         // Get RGB from second pixel via the LUTs
-                         r = lut_yR[y2] + lut_crR[cr];
-                         g = lut_yG[y2] - fval; 
-                         b = lut_yB[y2] + lut_cbB[cb];
-                         r=r<0.0?0.0:r;g=g<0.0?0.0:g;b=b<0.0?0.0:b;
-                        // Invert intensities if that is the user's choice
-                        if(PrevStat.pp_invert){
-                          uy1=255-(unsigned char)(r>255.0?255:r);
-                          uy2=255-(unsigned char)(g>255.0?255:g);
-                          uy3=255-(unsigned char)(b>255.0?255:b);
-                         } else {
-                          uy1=(unsigned char)(r>255.0?255:r);
-                          uy2=(unsigned char)(g>255.0?255:g);
-                          uy3=(unsigned char)(b>255.0?255:b);
-                         }
-                         PreviewRow[pipos++]=uy1;
-                         PreviewRow[pipos++]=uy2;
-                         PreviewRow[pipos++]=uy3;
-                        }
-                     for(pcol=0,ipos=0;pcol<PreviewWd;pcol++,rgbpos+=3){
-                         if(SScol[pcol]<0) continue;
-                         ipos=SScol[pcol]; ipos*=3;
-                         uy1=PreviewRow[ipos++];
-                         uy2=PreviewRow[ipos++];
-                         uy3=  PreviewRow[ipos];
-
-                         PreviewImg[rgbpos]   = uy1; // R
-                         PreviewImg[rgbpos+1] = uy2; // G
-                         PreviewImg[rgbpos+2] = uy3; // B
-
-                     // Gather stats (only under mask, if used)
-
-                     if(PrevStat.mask_status){
-                       mskpos=rgbpos/3;
-                       if(PrevStat.MaskIm[mskpos]) {
-                         if(uy1<=PrevStat.llim_r) PrevStat.lsat_r++;
-                         if(uy1>=PrevStat.ulim_r) PrevStat.usat_r++;
-                         if(uy1>PrevStat.max_r) PrevStat.max_r=uy1;
-                         if(uy1<PrevStat.min_r) PrevStat.min_r=uy1;
-                         PrevStat.hgm_r[uy1]++;
-                         PrevStat.intgl_r+=(double)uy1;
-
-                         if(uy2<=PrevStat.llim_g) PrevStat.lsat_g++;
-                         if(uy2>=PrevStat.ulim_g) PrevStat.usat_g++;
-                         if(uy2>PrevStat.max_g) PrevStat.max_g=uy2;
-                         if(uy2<PrevStat.min_g) PrevStat.min_g=uy2;
-                         PrevStat.hgm_g[uy2]++;
-                         PrevStat.intgl_g+=(double)uy2;
-
-                         if(uy3<=PrevStat.llim_b) PrevStat.lsat_b++;
-                         if(uy3>=PrevStat.ulim_b) PrevStat.usat_b++;
-                         if(uy3>PrevStat.max_b) PrevStat.max_b=uy3;
-                         if(uy3<PrevStat.min_b) PrevStat.min_b=uy3;
-                         PrevStat.hgm_b[uy3]++;
-                         PrevStat.intgl_b+=(double)uy3;
-                        }
-                       } else {
-                         if(uy1<=PrevStat.llim_r) PrevStat.lsat_r++;
-                         if(uy1>=PrevStat.ulim_r) PrevStat.usat_r++;
-                         if(uy1>PrevStat.max_r) PrevStat.max_r=uy1;
-                         if(uy1<PrevStat.min_r) PrevStat.min_r=uy1;
-                         PrevStat.hgm_r[uy1]++;
-                         PrevStat.intgl_r+=(double)uy1;
-
-                         if(uy2<=PrevStat.llim_g) PrevStat.lsat_g++;
-                         if(uy2>=PrevStat.ulim_g) PrevStat.usat_g++;
-                         if(uy2>PrevStat.max_g) PrevStat.max_g=uy2;
-                         if(uy2<PrevStat.min_g) PrevStat.min_g=uy2;
-                         PrevStat.hgm_g[uy2]++;
-                         PrevStat.intgl_g+=(double)uy2;
-
-                         if(uy3<=PrevStat.llim_b) PrevStat.lsat_b++;
-                         if(uy3>=PrevStat.ulim_b) PrevStat.usat_b++;
-                         if(uy3>PrevStat.max_b) PrevStat.max_b=uy3;
-                         if(uy3<PrevStat.min_b) PrevStat.min_b=uy3;
-                         PrevStat.hgm_b[uy3]++;
-                         PrevStat.intgl_b+=(double)uy3;
-                       }
-                      }
-                    } else {
-
-                     for(pcol=0;pcol<PreviewWd;pcol+=2,rgbpos+=6){
-
-                     if(SScol[pcol]<0) continue;
-                     ipos=SSrow[prow]+SScol[pcol];
-
-                     // For colour conversion, we must start at an even
-                     // number or we will split YUYV pixels in the wrong
-                     // reading frame to get YVYU) and so switch Cr,Cb
-                     // order (the colour will look wrong).
-                     if(ipos%2) ipos--; 
-                     iposp=ipos+1;
-
-                     //First pixel
-                     pixval=p[ipos];
-                     y1= pixval & 0xff; // Y1
-                     cb= pixval >> 8;   // Cb1
-
-                     // Second pixel
-                     pixval=p[iposp];
-                     y2= pixval & 0xff; // Y2
-                     cr= pixval >> 8;   // Cr1
-
-                     // The following is common to both pixels so
-                     // calculate it only once:
-                     fval = lut_crG[cr] + lut_cbG[cb]; 
-                     
-                     // Get RGB from first pixel via the LUTs
-                     r = lut_yR[y1] + lut_crR[cr];
-                     g = lut_yG[y1] - fval; 
-                     b = lut_yB[y1] + lut_cbB[cb];
-            
-                     // Clamp the values between 0 and 255 inclusive,
-                     // convert to unsigned char and output to preview: 
-                     r=r<0.0?0.0:r;g=g<0.0?0.0:g;b=b<0.0?0.0:b;
-                     // Invert the values if the user wants that
-                     if(PrevStat.pp_invert){
-                          uy1=255-(unsigned char)(r>255.0?255:r);
-                          uy2=255-(unsigned char)(g>255.0?255:g);
-                          uy3=255-(unsigned char)(b>255.0?255:b);
-                       } else {
-                          uy1=(unsigned char)(r>255.0?255:r);
-                          uy2=(unsigned char)(g>255.0?255:g);
-                          uy3=(unsigned char)(b>255.0?255:b);
-                       }
-
-                     PreviewImg[rgbpos] =uy1;
-                     PreviewImg[rgbpos+1] =uy2; 
-                     PreviewImg[rgbpos+2] =uy3;
-
-                     // Gather stats for the first pixel (under mask, if used)
-                     if(PrevStat.mask_status){
-                       mskpos=rgbpos/3;
-                       if(PrevStat.MaskIm[mskpos]) {
-                         if(uy1<=PrevStat.llim_r) PrevStat.lsat_r++;
-                         if(uy1>=PrevStat.ulim_r) PrevStat.usat_r++;
-                         if(uy1>PrevStat.max_r) PrevStat.max_r=uy1;
-                         if(uy1<PrevStat.min_r) PrevStat.min_r=uy1;
-                         PrevStat.hgm_r[uy1]++;
-                         PrevStat.intgl_r+=(double)uy1;
-
-                         if(uy2<=PrevStat.llim_g) PrevStat.lsat_g++;
-                         if(uy2>=PrevStat.ulim_g) PrevStat.usat_g++;
-                         if(uy2>PrevStat.max_g) PrevStat.max_g=uy2;
-                         if(uy2<PrevStat.min_g) PrevStat.min_g=uy2;
-                         PrevStat.hgm_g[uy2]++;
-                         PrevStat.intgl_g+=(double)uy2;
-
-                         if(uy3<=PrevStat.llim_b) PrevStat.lsat_b++;
-                         if(uy3>=PrevStat.ulim_b) PrevStat.usat_b++;
-                         if(uy3>PrevStat.max_b) PrevStat.max_b=uy3;
-                         if(uy3<PrevStat.min_b) PrevStat.min_b=uy3;
-                         PrevStat.hgm_b[uy3]++;
-                         PrevStat.intgl_b+=(double)uy3;
-                        }
-                       } else {
-                         if(uy1<=PrevStat.llim_r) PrevStat.lsat_r++;
-                         if(uy1>=PrevStat.ulim_r) PrevStat.usat_r++;
-                         if(uy1>PrevStat.max_r) PrevStat.max_r=uy1;
-                         if(uy1<PrevStat.min_r) PrevStat.min_r=uy1;
-                         PrevStat.hgm_r[uy1]++;
-                         PrevStat.intgl_r+=(double)uy1;
-
-                         if(uy2<=PrevStat.llim_g) PrevStat.lsat_g++;
-                         if(uy2>=PrevStat.ulim_g) PrevStat.usat_g++;
-                         if(uy2>PrevStat.max_g) PrevStat.max_g=uy2;
-                         if(uy2<PrevStat.min_g) PrevStat.min_g=uy2;
-                         PrevStat.hgm_g[uy2]++;
-                         PrevStat.intgl_g+=(double)uy2;
-
-                         if(uy3<=PrevStat.llim_b) PrevStat.lsat_b++;
-                         if(uy3>=PrevStat.ulim_b) PrevStat.usat_b++;
-                         if(uy3>PrevStat.max_b) PrevStat.max_b=uy3;
-                         if(uy3<PrevStat.min_b) PrevStat.min_b=uy3;
-                         PrevStat.hgm_b[uy3]++;
-                         PrevStat.intgl_b+=(double)uy3;
-                       }
-
-                     // Only calculate the second pixel if we are not
-                     // oversampling the main image (otherwise it would
-                     // take a lot of work to get the oversmpling right
-                     // in YUYV colour conversion mode.
-
-                     // Get RGB from second pixel via the LUTs
-                     r = lut_yR[y2] + lut_crR[cr];
-                     g = lut_yG[y2] - fval; 
-                     b = lut_yB[y2] + lut_cbB[cb];
-
-                     // Clamp the values between 0 and 255 inclusive,
-                     // convert to unsigned char and output to preview: 
-                     r=r<0.0?0.0:r;g=g<0.0?0.0:g;b=b<0.0?0.0:b;
-                     // Invert the values if the user wants that
-                     if(PrevStat.pp_invert){
-                          uy1=255-(unsigned char)(r>255.0?255:r);
-                          uy2=255-(unsigned char)(g>255.0?255:g);
-                          uy3=255-(unsigned char)(b>255.0?255:b);
-                       } else {
-                          uy1=(unsigned char)(r>255.0?255:r);
-                          uy2=(unsigned char)(g>255.0?255:g);
-                          uy3=(unsigned char)(b>255.0?255:b);
-                       }
-                     PreviewImg[rgbpos+3]=uy1;
-                     PreviewImg[rgbpos+4]=uy2; 
-                     PreviewImg[rgbpos+5]=uy3;
-
-                     // Gather stats for the second pixel (under mask, if used)
-                     if(PrevStat.mask_status){
-                       mskpos++;
-                       if(PrevStat.MaskIm[mskpos]) {
-                         if(uy1<=PrevStat.llim_r) PrevStat.lsat_r++;
-                         if(uy1>=PrevStat.ulim_r) PrevStat.usat_r++;
-                         if(uy1>PrevStat.max_r) PrevStat.max_r=uy1;
-                         if(uy1<PrevStat.min_r) PrevStat.min_r=uy1;
-                         PrevStat.hgm_r[uy1]++;
-                         PrevStat.intgl_r+=(double)uy1;
-
-                         if(uy2<=PrevStat.llim_g) PrevStat.lsat_g++;
-                         if(uy2>=PrevStat.ulim_g) PrevStat.usat_g++;
-                         if(uy2>PrevStat.max_g) PrevStat.max_g=uy2;
-                         if(uy2<PrevStat.min_g) PrevStat.min_g=uy2;
-                         PrevStat.hgm_g[uy2]++;
-                         PrevStat.intgl_g+=(double)uy2;
-
-                         if(uy3<=PrevStat.llim_b) PrevStat.lsat_b++;
-                         if(uy3>=PrevStat.ulim_b) PrevStat.usat_b++;
-                         if(uy3>PrevStat.max_b) PrevStat.max_b=uy3;
-                         if(uy3<PrevStat.min_b) PrevStat.min_b=uy3;
-                         PrevStat.hgm_b[uy3]++;
-                         PrevStat.intgl_b+=(double)uy3;
-                        }
-                       } else {
-                         if(uy1<=PrevStat.llim_r) PrevStat.lsat_r++;
-                         if(uy1>=PrevStat.ulim_r) PrevStat.usat_r++;
-                         if(uy1>PrevStat.max_r) PrevStat.max_r=uy1;
-                         if(uy1<PrevStat.min_r) PrevStat.min_r=uy1;
-                         PrevStat.hgm_r[uy1]++;
-                         PrevStat.intgl_r+=(double)uy1;
-
-                         if(uy2<=PrevStat.llim_g) PrevStat.lsat_g++;
-                         if(uy2>=PrevStat.ulim_g) PrevStat.usat_g++;
-                         if(uy2>PrevStat.max_g) PrevStat.max_g=uy2;
-                         if(uy2<PrevStat.min_g) PrevStat.min_g=uy2;
-                         PrevStat.hgm_g[uy2]++;
-                         PrevStat.intgl_g+=(double)uy2;
-
-                         if(uy3<=PrevStat.llim_b) PrevStat.lsat_b++;
-                         if(uy3>=PrevStat.ulim_b) PrevStat.usat_b++;
-                         if(uy3>PrevStat.max_b) PrevStat.max_b=uy3;
-                         if(uy3<PrevStat.min_b) PrevStat.min_b=uy3;
-                         PrevStat.hgm_b[uy3]++;
-                         PrevStat.intgl_b+=(double)uy3;
-                       }
-            
-                  }
-
-                    }
-
-             }
-             preview_stored = PREVIEW_STORED_RGB;
-            break;
-            default: break;
-          }
-        break;
-        case V4L2_PIX_FMT_MJPEG:
+static void *band_worker(void *arg)
+// A band worker thread. Waits for a job from run_bands(), helps with it
+// and goes back to waiting, until told to quit.
+{
+ unsigned long seen = 0;
+
+ pthread_mutex_lock(&Bands.lock);
+ FOREVER {
+     while(Bands.job == seen && !Bands.quit) pthread_cond_wait(&Bands.go, &Bands.lock);
+     if(Bands.quit) break;
+     seen = Bands.job;
+     Bands.busy++;
+     pthread_mutex_unlock(&Bands.lock);
+     band_worker_loop();
+     pthread_mutex_lock(&Bands.lock);
+     if(--Bands.busy == 0) pthread_cond_signal(&Bands.done);
+    }
+ pthread_mutex_unlock(&Bands.lock);
+ return NULL;
+}
 
-         switch(col_conv_type){
-          case CCOL_TO_Y:    // Calculate the Y component from RGB
-              rgbpos=Prev_startrow+Prev_startcol;
+static void band_pool_start(void)
+// Start the band workers: one fewer than the number of cores (the
+// caller makes up the rest) or Band_threads-1 if that was set with -j.
+// If they can't be started the work is simply all done by the caller.
+{
+ long ncpu;
+ int n;
+
+ if(Bands.up) return;
+ pthread_mutex_init(&Bands.lock, NULL);
+ pthread_cond_init(&Bands.go, NULL);
+ pthread_cond_init(&Bands.done, NULL);
+ Bands.up = 1;
+ Bands.nworkers = 0;
+ Bands.quit = 0;
+ n = Band_threads;
+ if(n < 1){
+   ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+   n = (ncpu > 0) ? (int)ncpu : 1;
+  }
+ if(n > BAND_MAX_THREADS) n = BAND_MAX_THREADS;
+ for(; Bands.nworkers < n-1; Bands.nworkers++)
+   if(pthread_create(&Bands.tid[Bands.nworkers], NULL, band_worker, NULL)) break;
+}
 
-              if(PreviewIDX>=Preview_integral) PreviewIDX=0;        
+static void band_pool_stop(void)
+// Tell the band workers to quit and wait for them
+{
+ int k;
+
+ if(!Bands.up) return;
+ pthread_mutex_lock(&Bands.lock);
+ Bands.quit = 1;
+ pthread_cond_broadcast(&Bands.go);
+ pthread_mutex_unlock(&Bands.lock);
+ for(k = 0; k < Bands.nworkers; k++) pthread_join(Bands.tid[k], NULL);
+ Bands.nworkers = 0;
+ Bands.up = 0;
+ for(k = 0; k < BAND_COUNT; k++){
+    free(Band_grn[k].g);
+    Band_grn[k].g = NULL;
+    Band_grn[k].wd = 0;
+   }
+}
 
-              for(prow=0;prow<PreviewHt;prow++){ 
-                 if(SSrow[prow]<0){rgbpos+=PreviewWd_stride; continue;}
-                    for(pcol=0;pcol<PreviewWd;pcol++,rgbpos+=3){
-                        if(SScol[pcol]<0) continue;
+static void run_bands(band_fn_t fn, void *arg)
+// Run fn over the whole ImWidth x ImHeight image in row bands and return
+// when it has been done for every band. fn(band, p0, p1, arg) must deal
+// with pixels p0 to p1-1 and may keep results in Band_part[band].
+{
+ int nbands,rows;
+
+ if(!Bands.up) band_pool_start();
+ nbands = (ImHeight < BAND_COUNT) ? ImHeight : BAND_COUNT;
+ if(nbands < 1) return;
+ rows = (ImHeight + nbands - 1) / nbands;
+ nbands = (ImHeight + rows - 1) / rows;
+ // A worker that was late waking up for the last job may still be
+ // looking at it so wait for that before setting up this one.
+ if(Bands.nworkers){
+   pthread_mutex_lock(&Bands.lock);
+   while(Bands.busy) pthread_cond_wait(&Bands.done, &Bands.lock);
+  }
+ Bands.nbands = nbands;
+ Bands.rows = rows;
+ Bands.fn = fn;
+ Bands.arg = arg;
+ Bands.next = 0;
+ if(Bands.nworkers){
+   Bands.job++;
+   pthread_cond_broadcast(&Bands.go);
+   pthread_mutex_unlock(&Bands.lock);
+  }
+ band_worker_loop();
+ if(Bands.nworkers){
+   // Bands are all taken but some may still be being worked on
+   pthread_mutex_lock(&Bands.lock);
+   while(Bands.busy) pthread_cond_wait(&Bands.done, &Bands.lock);
+   pthread_mutex_unlock(&Bands.lock);
+  }
+}
 
-                        ipos=SSrow[prow]+SScol[pcol];
-                        uy1= RGBimg[ipos++]; // R
-                        uy2= RGBimg[ipos++]; // G
-                        uy3= RGBimg[ipos];   // B
+static void band_means(double *mn_r, double *mn_g, double *mn_b)
+// Add up the per-band sums left by convert_span in band order
+{
+ long long isum[3] = {0,0,0};
+ double dsum[3] = {0.0,0.0,0.0};
+ int band,c;
+
+ for(band = 0; band < Bands.nbands; band++)
+   for(c = 0; c < 3; c++){
+      isum[c] += Band_part[band].isum[c];
+      dsum[c] += Band_part[band].dsum[c];
+     }
+ *mn_r = dsum[0] + (double)isum[0]/(double)(1<<YFX_SHIFT);
+ *mn_g = dsum[1] + (double)isum[1]/(double)(1<<YFX_SHIFT);
+ *mn_b = dsum[2] + (double)isum[2]/(double)(1<<YFX_SHIFT);
+}
 
-                        max=(uy2>uy1)?uy2:uy1;
-                        if(uy3>=max) max=uy3;
+static inline int bayer_sample(const void *p, int bits, int row, int col)
+// The sample at (row,col) of the Bayer frame p (of unsigned shorts for
+// more than 8 bits, otherwise bytes). Off the edges of the frame it is
+// reflected back by two rows or columns, so onto a site of the same
+// colour.
+{
+ if(row<0) row+=2; else if(row>=ImHeight) row-=2;
+ if(col<0) col+=2; else if(col>=ImWidth) col-=2;
+ if(bits>8) return ((const unsigned short *)p)[row*ImWidth+col];
+ return ((const unsigned char *)p)[row*ImWidth+col];
+}
 
-                        pipos=rgbpos/3;
-                        PreviewBuff[PreviewIDX][pipos]=(int)max;
-                        for(fidx=0,dval1=(double)Preview_bias;fidx<Preview_integral;fidx++){
-                           dval2=(double)(PreviewBuff[fidx][pipos])-Preview_dark[pipos];
-                           dval2/=Preview_flat[pipos];
-                           dval1+=dval2;
-                          }
+static double bayer_green(const void *p, int bits, int cfa, int row, int col)
+// Green at (row,col) of the Bayer frame p for BAYER_EDGE. At a red or
+// blue site it comes from the two greens along the row or the two along
+// the column, whichever change least there (counting the curvature of
+// the site's own colour, which also corrects the estimate, as Hamilton
+// and Adams do), or from all four if neither way is smoother.
+{
+ int c,gl,gr,gu,gd,lh,lv,dh,dv;
+
+ // Reflect a site off the edge of the frame (a neighbour of an edge
+ // pixel) first, so that its own neighbours are no more than two off
+ if(row<0) row+=2; else if(row>=ImHeight) row-=2;
+ if(col<0) col+=2; else if(col>=ImWidth) col-=2;
+ c = bayer_sample(p,bits,row,col);
+ if(BAYER_SITE(cfa,row,col)==1 || BAYER_SITE(cfa,row,col)==2) return (double)c;
+ gl = bayer_sample(p,bits,row,col-1); gr = bayer_sample(p,bits,row,col+1);
+ gu = bayer_sample(p,bits,row-1,col); gd = bayer_sample(p,bits,row+1,col);
+ lh = 2*c - bayer_sample(p,bits,row,col-2) - bayer_sample(p,bits,row,col+2);
+ lv = 2*c - bayer_sample(p,bits,row-2,col) - bayer_sample(p,bits,row+2,col);
+ dh = abs(gl-gr) + abs(lh);
+ dv = abs(gu-gd) + abs(lv);
+ if(dh<dv) return 0.5*(gl+gr) + 0.25*lh;
+ if(dv<dh) return 0.5*(gu+gd) + 0.25*lv;
+ return 0.25*(gl+gr+gu+gd) + 0.125*(lh+lv);
+}
 
-                        // Invert intensities if that is the user's choice
-                        if(PrevStat.pp_invert) uy1=255-uchar_from_d(dval1);
-                             else uy1=uchar_from_d(dval1);
+static void bayer_pixel(const void *p, int bits, int cfa, int row, int col, double *rgb)
+// Demosaic pixel (row,col) of the Bayer frame p (pattern cfa, see
+// camfmt_bayer) into rgb[0], rgb[1] and rgb[2], in the camera's sample
+// units, with the Bayer_demosaic kernel. Only the pixel and its
+// neighbours are read, so any part of a frame can be done on its own.
+{
+ int site = BAYER_SITE(cfa,row,col);
+ int edge = (Bayer_demosaic==BAYER_EDGE);
+ double c,g,h,v,d,vmax;
+ int k;
+
+ c = (double)bayer_sample(p,bits,row,col);
+ if(site==1 || site==2){ 
+   // Green: the other two colours are either side along the row and
+   // along the column. The edge-aware kernel interpolates their
+   // difference from green instead of the colours themselves.
+   g = c;
+   h = bayer_sample(p,bits,row,col-1) + bayer_sample(p,bits,row,col+1);
+   v = bayer_sample(p,bits,row-1,col) + bayer_sample(p,bits,row+1,col);
+   if(edge){
+     h = g + 0.5*(h - bayer_green(p,bits,cfa,row,col-1) - bayer_green(p,bits,cfa,row,col+1));
+     v = g + 0.5*(v - bayer_green(p,bits,cfa,row-1,col) - bayer_green(p,bits,cfa,row+1,col));
+    } else { h*=0.5; v*=0.5; }
+   rgb[0] = (site==1) ? h : v;
+   rgb[2] = (site==1) ? v : h;
+  } else {
+   // Red or blue: green is all round and the other colour is on the
+   // diagonals
+   d = bayer_sample(p,bits,row-1,col-1) + bayer_sample(p,bits,row-1,col+1) +
+       bayer_sample(p,bits,row+1,col-1) + bayer_sample(p,bits,row+1,col+1);
+   if(edge){
+     g = bayer_green(p,bits,cfa,row,col);
+     d = g + 0.25*(d - bayer_green(p,bits,cfa,row-1,col-1) - bayer_green(p,bits,cfa,row-1,col+1)
+                     - bayer_green(p,bits,cfa,row+1,col-1) - bayer_green(p,bits,cfa,row+1,col+1));
+    } else {
+     g = 0.25*(bayer_sample(p,bits,row,col-1) + bayer_sample(p,bits,row,col+1) +
+               bayer_sample(p,bits,row-1,col) + bayer_sample(p,bits,row+1,col));
+     d *= 0.25;
+    }
+   rgb[0] = (site==0) ? c : d;
+   rgb[2] = (site==0) ? d : c;
+  }
+ rgb[1] = g;
 
-                        // Only need to set the red channel for now
-                        PreviewImg[rgbpos]=uy1; 
+ // The edge-aware estimates can overshoot the sample range
+ vmax = (double)((1<<bits)-1);
+ for(k=0;k<3;k++) rgb[k] = rgb[k]<0.0 ? 0.0 : (rgb[k]>vmax ? vmax : rgb[k]);
+}
 
-                     }
-                }
+static double *bayer_green_row(const void *p, int bits, int cfa, int band, int row)
+// The BAYER_EDGE greens of the whole of row 'row' of the Bayer frame p,
+// kept in one of the three rows of Band_grn[band] so that each row's
+// greens are only worked out once however many pixels need them. NULL
+// if there is no memory for them. Inside the two pixel border nothing
+// needs reflecting, so there green is worked out without bayer_green's
+// tests, a colour of site at a time.
+{
+ const int wide = (bits>8);
+ const unsigned char *b[5];
+ const unsigned short *w[5];
+ double *out,*grn;
+ int k,col,c0,c,gl,gr,gu,gd,lh,lv,dh,dv;
+
+ if(row<0) row+=2; else if(row>=ImHeight) row-=2;
+ if(Band_grn[band].wd<ImWidth){
+   grn = (double *)realloc(Band_grn[band].g, 3*(size_t)ImWidth*sizeof(double));
+   if(grn==NULL) return NULL;
+   Band_grn[band].g = grn;
+   Band_grn[band].wd = ImWidth;
+   memset(Band_part[band].grow, 0, sizeof(Band_part[band].grow));
+  }
+ out = Band_grn[band].g + (row%3)*ImWidth;
+ if(Band_part[band].grow[row%3]==row+1) return out;
+ Band_part[band].grow[row%3] = row+1;
+ if(row<2 || row>=ImHeight-2 || ImWidth<5){
+   for(col=0;col<ImWidth;col++) out[col] = bayer_green(p,bits,cfa,row,col);
+   return out;
+  }
+ for(k=0;k<5;k++){
+    b[k] = (const unsigned char *)p + (row+k-2)*ImWidth;
+    w[k] = (const unsigned short *)p + (row+k-2)*ImWidth;
+   }
+#define BAYER_AT(k,col) (wide ? (int)w[k][col] : (int)b[k][col])
+ for(c0=2;c0<4;c0++){
+    if(BAYER_SITE(cfa,row,c0)==1 || BAYER_SITE(cfa,row,c0)==2){
+      for(col=c0;col<ImWidth-2;col+=2) out[col] = (double)BAYER_AT(2,col);
+      continue;
+     }
+    for(col=c0;col<ImWidth-2;col+=2){
+       c = BAYER_AT(2,col);
+       gl = BAYER_AT(2,col-1); gr = BAYER_AT(2,col+1);
+       gu = BAYER_AT(1,col);   gd = BAYER_AT(3,col);
+       lh = 2*c - BAYER_AT(2,col-2) - BAYER_AT(2,col+2);
+       lv = 2*c - BAYER_AT(0,col) - BAYER_AT(4,col);
+       dh = abs(gl-gr) + abs(lh);
+       dv = abs(gu-gd) + abs(lv);
+       out[col] = (dh<dv) ? 0.5*(gl+gr) + 0.25*lh :
+                  (dv<dh) ? 0.5*(gu+gd) + 0.25*lv :
+                            0.25*(gl+gr+gu+gd) + 0.125*(lh+lv);
+      }
+   }
+#undef BAYER_AT
+ for(col=0;col<2;col++) out[col] = bayer_green(p,bits,cfa,row,col);
+ for(col=ImWidth-2;col<ImWidth;col++) out[col] = bayer_green(p,bits,cfa,row,col);
+ return out;
+}
 
-              PreviewIDX++;
-              preview_stored = PREVIEW_STORED_MONO;
-          break;
-          case CCOL_TO_RGB:  // Convert to full RGB
-          case CCOL_TO_BGR:  // Convert to full RGB (for preview)
-              rgbpos=Prev_startrow+Prev_startcol; 
-
-              for(prow=0;prow<PreviewHt;prow++){ 
-                  if(SSrow[prow]<0){rgbpos+=PreviewWd_stride; continue;}
-                  for(pcol=0;pcol<PreviewWd;pcol++,rgbpos+=3){
-                     if(SScol[pcol]<0) continue;
-                     ipos=SSrow[prow]+SScol[pcol];
-                     uy1 = RGBimg[ipos++];
-                     uy2 = RGBimg[ipos++];
-                     uy3 = RGBimg[ipos];
-                     // Invert intensities if that is the user's choice
-                     if(PrevStat.pp_invert){
-                       PreviewImg[rgbpos]   = 255-uy1; // R
-                       PreviewImg[rgbpos+1] = 255-uy2; // G
-                       PreviewImg[rgbpos+2] = 255-uy3; // B
-                      } else {
-                       PreviewImg[rgbpos]   = uy1; // R
-                       PreviewImg[rgbpos+1] = uy2; // G
-                       PreviewImg[rgbpos+2] = uy3; // B
-                      }
-
-                     // Gather stats (only under mask, if used)
-
-                     if(PrevStat.mask_status){
-                       mskpos=rgbpos/3;
-                       if(PrevStat.MaskIm[mskpos]) {
-                         if(uy1<=PrevStat.llim_r) PrevStat.lsat_r++;
-                         if(uy1>=PrevStat.ulim_r) PrevStat.usat_r++;
-                         if(uy1>PrevStat.max_r) PrevStat.max_r=uy1;
-                         if(uy1<PrevStat.min_r) PrevStat.min_r=uy1;
-                         PrevStat.hgm_r[uy1]++;
-                         PrevStat.intgl_r+=(double)uy1;
-
-                         if(uy2<=PrevStat.llim_g) PrevStat.lsat_g++;
-                         if(uy2>=PrevStat.ulim_g) PrevStat.usat_g++;
-                         if(uy2>PrevStat.max_g) PrevStat.max_g=uy2;
-                         if(uy2<PrevStat.min_g) PrevStat.min_g=uy2;
-                         PrevStat.hgm_g[uy2]++;
-                         PrevStat.intgl_g+=(double)uy2;
-
-                         if(uy3<=PrevStat.llim_b) PrevStat.lsat_b++;
-                         if(uy3>=PrevStat.ulim_b) PrevStat.usat_b++;
-                         if(uy3>PrevStat.max_b) PrevStat.max_b=uy3;
-                         if(uy3<PrevStat.min_b) PrevStat.min_b=uy3;
-                         PrevStat.hgm_b[uy3]++;
-                         PrevStat.intgl_b+=(double)uy3;
-                       }
-                      } else {
-                         if(uy1<=PrevStat.llim_r) PrevStat.lsat_r++;
-                         if(uy1>=PrevStat.ulim_r) PrevStat.usat_r++;
-                         if(uy1>PrevStat.max_r) PrevStat.max_r=uy1;
-                         if(uy1<PrevStat.min_r) PrevStat.min_r=uy1;
-                         PrevStat.hgm_r[uy1]++;
-                         PrevStat.intgl_r+=(double)uy1;
-
-                         if(uy2<=PrevStat.llim_g) PrevStat.lsat_g++;
-                         if(uy2>=PrevStat.ulim_g) PrevStat.usat_g++;
-                         if(uy2>PrevStat.max_g) PrevStat.max_g=uy2;
-                         if(uy2<PrevStat.min_g) PrevStat.min_g=uy2;
-                         PrevStat.hgm_g[uy2]++;
-                         PrevStat.intgl_g+=(double)uy2;
-
-                         if(uy3<=PrevStat.llim_b) PrevStat.lsat_b++;
-                         if(uy3>=PrevStat.ulim_b) PrevStat.usat_b++;
-                         if(uy3>PrevStat.max_b) PrevStat.max_b=uy3;
-                         if(uy3<PrevStat.min_b) PrevStat.min_b=uy3;
-                         PrevStat.hgm_b[uy3]++;
-                         PrevStat.intgl_b+=(double)uy3;
-                      }
-                  }
-              }
-             preview_stored = PREVIEW_STORED_RGB;
-            break;
-            default: break;
-           }
+static inline __attribute__((always_inline))
+void bayer_mid(const void *p, const int wide, const int edge, int bits, int cfa,
+               int row, int c0, int c1, const double *gm, const double *g0,
+               const double *gp, double *ro, double *go, double *bo)
+// bayer_pixel for columns c0 to c1-1 of row 'row', all of them at least
+// two pixels in from the edges of the frame, into ro, go and bo (which
+// hold column c0 at index 0). gm, g0 and gp are the greens of the rows
+// above, at and below (see bayer_green_row) for the edge-aware kernel.
+// wide and edge are constants where it is called, so each variant comes
+// out without tests and, a colour of site at a time, without branches.
+{
+ const unsigned char *b[3];
+ const unsigned short *w[3];
+ const double vmax = (double)((1<<bits)-1);
+ double *ho,*vo,*so,*dout,h,v,d,g;
+ int k,s,col;
+
+ for(k=0;k<3;k++){
+    b[k] = (const unsigned char *)p + (row+k-1)*ImWidth;
+    w[k] = (const unsigned short *)p + (row+k-1)*ImWidth;
+   }
+#define BAYER_AT(k,col) (wide ? (int)w[k][col] : (int)b[k][col])
+#define BAYER_CLAMP(x) ((x)<0.0 ? 0.0 : ((x)>vmax ? vmax : (x)))
+ for(s=c0;s<c0+2 && s<c1;s++){
+    k = BAYER_SITE(cfa,row,s);
+    if(k==1 || k==2){
+      ho = (k==1) ? ro : bo;
+      vo = (k==1) ? bo : ro;
+      for(col=s;col<c1;col+=2){
+         g = (double)BAYER_AT(1,col);
+         h = BAYER_AT(1,col-1) + BAYER_AT(1,col+1);
+         v = BAYER_AT(0,col) + BAYER_AT(2,col);
+         if(edge){
+           h = g + 0.5*(h - g0[col-1] - g0[col+1]);
+           v = g + 0.5*(v - gm[col] - gp[col]);
+           h = BAYER_CLAMP(h); v = BAYER_CLAMP(v);
+          } else { h*=0.5; v*=0.5; }
+         go[col-c0] = g; ho[col-c0] = h; vo[col-c0] = v;
         }
-
-    // Do any requested pre- and post-processes  
-
-   
-    switch(col_conv_type){
-       case CCOL_TO_Y:
-
-          // Perform any user-requested pre-processing: 
- 
-          // Make a Laplacian image if that is requested
-          if(PrevStat.pp_laplace){ PrevStat.af_laplace_r=Prev_Laplace(CCHAN_Y); bval=0;}
-          // Otherwise just calculate the mean absolute Laplacian if chosen
-          else if(PrevStat.focuser_param_varabslap || PrevStat.focuser_param_abslap){
-               PrevStat.af_laplace_r=Prev_Laplace(CCHAN_R);
-            }
-          // If a convolution was done, set the border pixels to the required
-          // value:
-          if(bval!=3) set_border_pixels(bval);
-          // Gather stats and distribute the red channel to G and B according to
-          // the current LUT
-          rgbpos=Prev_startcol+Prev_startrow; mskpos=rgbpos/3;
-
-          for(prow=0;prow<PreviewHt;prow++){ 
-           if(SSrow[prow]<0){mskpos+=PreviewWd; rgbpos+=PreviewWd_stride; continue;}
-             for(pcol=0;pcol<PreviewWd;pcol++,mskpos++,rgbpos+=3){
-                if(SScol[pcol]<0) continue;
-                uy1=PreviewImg[rgbpos]; // Red channel value
-                // Gather the stats (masked or not)
-                if(PrevStat.mask_status){
-                  if(PrevStat.MaskIm[mskpos]) {
-                    if(uy1<=PrevStat.llim_r) PrevStat.lsat_r++;
-                    if(uy1>=PrevStat.ulim_r) PrevStat.usat_r++;
-                    if(uy1>PrevStat.max_r) PrevStat.max_r=uy1;
-                    if(uy1<PrevStat.min_r) PrevStat.min_r=uy1;
-                    PrevStat.hgm_r[uy1]++;
-                    PrevStat.intgl_r+=(double)uy1;
-                   }
-                 } else {
-                  if(uy1<=PrevStat.llim_r) PrevStat.lsat_r++;
-                  if(uy1>=PrevStat.ulim_r) PrevStat.usat_r++;
-                  if(uy1>PrevStat.max_r) PrevStat.max_r=uy1;
-                  if(uy1<PrevStat.min_r) PrevStat.min_r=uy1;
-                  PrevStat.hgm_r[uy1]++;
-                  PrevStat.intgl_r+=(double)uy1;
-                 }
-                // Implement the display LUT
-                PreviewImg[rgbpos]  =PrevStat.rlut[uy1];
-                PreviewImg[rgbpos+1]=PrevStat.glut[uy1];
-                PreviewImg[rgbpos+2]=PrevStat.blut[uy1];
-                // Display mask if required
-                if(PrevStat.mask_show){
-                  if(!PrevStat.MaskIm[mskpos]) PreviewImg[rgbpos+1]=128;
-                  }
-               }
-             }
-       break;
-       case CCOL_TO_RGB:
-       case CCOL_TO_BGR:
-
-          // Colour preview dark field subtraction
-          if(PrevCD_Perform==MASK_YES){
-
-             for(ipos=0;ipos<PreviewImg_rgb_size;ipos++){
-                 if(Preview_ColDark[ipos]>PreviewImg[ipos])PreviewImg[ipos]=0;
-                 else PreviewImg[ipos]-=Preview_ColDark[ipos];
-                }
-
-            } 
-
-          // Stats
-          if(PrevStat.focuser_param_varabslap || PrevStat.focuser_param_abslap){
-            switch(Prev_overlay_focus){
-              case CCHAN_R:
-                 PrevStat.af_laplace_r=Prev_Laplace(CCHAN_R);
-              break;
-              case CCHAN_G:
-                PrevStat.af_laplace_g=Prev_Laplace(CCHAN_G);
-              break;
-              case CCHAN_B:
-                PrevStat.af_laplace_b=Prev_Laplace(CCHAN_B);
-              break;
-              case CCHAN_Y: // 'Y' means all channels in this setting
-                 PrevStat.af_laplace_r=Prev_Laplace(CCHAN_R);
-                 PrevStat.af_laplace_g=Prev_Laplace(CCHAN_G);
-                 PrevStat.af_laplace_b=Prev_Laplace(CCHAN_B);
-              break;
-              default: // Focusser bar overlay not requested
-              break;
-            }
-           }
-
-          // Now implement the current preview display LUT and mask as required
-          rgbpos=Prev_startrow+Prev_startcol; 
-          if(Preview_LUT){
-            if(PrevStat.mask_show){ 
-
-              for(prow=0;prow<PreviewHt;prow++){ 
-                  if(SSrow[prow]<0){rgbpos+=PreviewWd_stride; continue;}
-                  for(pcol=0;pcol<PreviewWd;pcol++,rgbpos+=3){
-                     if(SScol[pcol]<0) continue;
-                     mskpos=rgbpos/3;
-                     PreviewImg[rgbpos]= PrevStat.rlut[PreviewImg[rgbpos]]; // R
-                     ipos=rgbpos+1;
-                     PreviewImg[ipos]= (PrevStat.MaskIm[mskpos])?PrevStat.glut[PreviewImg[ipos]]:128; // G
-                     ipos++;
-                     PreviewImg[ipos]= PrevStat.blut[PreviewImg[ipos]]; // B
-                }   }
-
-              } else {
-
-             for(prow=0;prow<PreviewHt;prow++){ 
-                  if(SSrow[prow]<0){rgbpos+=PreviewWd_stride; continue;}
-                  for(pcol=0;pcol<PreviewWd;pcol++,rgbpos+=3){
-                     if(SScol[pcol]<0) continue;
-                     mskpos=rgbpos/3;
-                     PreviewImg[rgbpos]= PrevStat.rlut[PreviewImg[rgbpos]]; // R
-                     ipos=rgbpos+1;
-                     PreviewImg[ipos]= PrevStat.glut[PreviewImg[ipos]]; // G
-                     ipos++;
-                     PreviewImg[ipos]= PrevStat.blut[PreviewImg[ipos]]; // B
-                }  }
-
-              }
-           } else if(PrevStat.mask_show){
-            // Display mask if required (without LUT)
-             for(ipos=1,mskpos=0;ipos<PreviewImg_rgb_size;ipos+=3,mskpos++){
-                     if(!PrevStat.MaskIm[mskpos])PreviewImg[ipos]=128;
-                }
+     } else {
+      so = (k==0) ? ro : bo;
+      dout = (k==0) ? bo : ro;
+      for(col=s;col<c1;col+=2){
+         d = BAYER_AT(0,col-1) + BAYER_AT(0,col+1) + BAYER_AT(2,col-1) + BAYER_AT(2,col+1);
+         if(edge){
+           g = g0[col];
+           d = g + 0.25*(d - gm[col-1] - gm[col+1] - gp[col-1] - gp[col+1]);
+           g = BAYER_CLAMP(g); d = BAYER_CLAMP(d);
+          } else {
+           g = 0.25*(BAYER_AT(1,col-1) + BAYER_AT(1,col+1) + BAYER_AT(0,col) + BAYER_AT(2,col));
+           d *= 0.25;
           }
-
-
-       break;
-       default: break;
+         so[col-c0] = (double)BAYER_AT(1,col); go[col-c0] = g; dout[col-c0] = d;
+        }
      }
+   }
+#undef BAYER_CLAMP
+#undef BAYER_AT
+}
 
-    // Flip as required         
-    Prev_Flip();
-
-
-      return 0; // Preview image created, so return.
+static void bayer_row(const void *p, int bits, int cfa, int band, int row,
+                      int c0, int c1, double *ro, double *go, double *bo)
+// Demosaic columns c0 to c1-1 of row 'row' of the Bayer frame p into ro,
+// go and bo (which hold column c0 at index 0), just as bayer_pixel would
+// one pixel at a time. Only the two pixel border goes through
+// bayer_pixel, the rest through bayer_mid.
+{
+ const double *gm=NULL,*g0=NULL,*gp=NULL;
+ double rgb[3];
+ int i0,i1,col;
+
+ i0 = (c0<2) ? 2 : c0;
+ i1 = (c1>ImWidth-2) ? ImWidth-2 : c1;
+ if(row<2 || row>=ImHeight-2 || i0>=i1) i0 = i1 = c1;
+ else if(Bayer_demosaic==BAYER_EDGE){
+   gm = bayer_green_row(p,bits,cfa,band,row-1);
+   g0 = bayer_green_row(p,bits,cfa,band,row);
+   gp = bayer_green_row(p,bits,cfa,band,row+1);
+   if(gm==NULL || g0==NULL || gp==NULL) i0 = i1 = c1;
+  }
+ for(col=c0;col<i0;col++){
+    bayer_pixel(p,bits,cfa,row,col,rgb);
+    ro[col-c0] = rgb[0]; go[col-c0] = rgb[1]; bo[col-c0] = rgb[2];
+   }
+ if(i0<i1){
+   if(Bayer_demosaic==BAYER_EDGE){
+     if(bits>8) bayer_mid(p,1,1,bits,cfa,row,i0,i1,gm,g0,gp,ro+i0-c0,go+i0-c0,bo+i0-c0);
+     else bayer_mid(p,0,1,bits,cfa,row,i0,i1,gm,g0,gp,ro+i0-c0,go+i0-c0,bo+i0-c0);
+    } else {
+     if(bits>8) bayer_mid(p,1,0,bits,cfa,row,i0,i1,NULL,NULL,NULL,ro+i0-c0,go+i0-c0,bo+i0-c0);
+     else bayer_mid(p,0,0,bits,cfa,row,i0,i1,NULL,NULL,NULL,ro+i0-c0,go+i0-c0,bo+i0-c0);
+    }
+  }
+ for(col=i1;col<c1;col++){
+    bayer_pixel(p,bits,cfa,row,col,rgb);
+    ro[col-c0] = rgb[0]; go[col-c0] = rgb[1]; bo[col-c0] = rgb[2];
    }
+}
 
- // Anything more than PREVIEW_ON requires a full size conversion.
+static void convert_span(const unsigned short *p, int q0, int q1,
+                         fpix_t *fr, fpix_t *fg, fpix_t *fb, int band)
+// Convert pixels q0 to q1-1 of the frame into fr, fg and fb (which hold
+// pixel q0 at index 0) and add each channel within the support of the
+// mask to the sums in Band_part[band] (for the frame means). For MJPEG
+// the frame has already been decoded into RGBimg, for the other formats
+// it is in p.
+{
+ const unsigned char *pb = (const unsigned char *)p; // For 8-bit samples
+ double r,g,b,fval,dval1,dval2,dval3;
+ double dr[FUSE_CHUNK],dg[FUSE_CHUNK],db[FUSE_CHUNK]; // A demosaiced row
+ int ipos,iposp,rgbpos,row,col,cfa,bits,iq,iend;
+ unsigned short pixval,y1,y2,cb,cr;
 
- // First, get the single frame into the Frm[r,g,b] frame buffers and
- // calculate the mean average of each frame while we do it:
+ // Carry on from the sums so far (so they come out the same however
+ // the band is cut into spans)
+ r = Band_part[band].dsum[0];
+ g = Band_part[band].dsum[1];
+ b = Band_part[band].dsum[2];
  switch(CamFormat){
-       
     case V4L2_PIX_FMT_YUYV:
-    
       switch(col_conv_type){
         case CCOL_TO_Y:    // Just extract the Y component - a quick op.
-              rgbpos=0;    // We only use the 'red' channel of the 
+                           // We only use the 'red' channel of the 
                            // Frame buffer arrays to store this.
-              mn_r=0.0;
-              for(ipos=0;ipos<ImSize;ipos+=2){ 
-                  // Y1 - intensity value of first pixel
+              for(ipos=q0;ipos<q1;ipos++){ 
                   dval1=(double)(p[ipos] & 0xff);
-                  Frmr[rgbpos++] = dval1; 
-                  // Calculate the mean within the support of the mask
-                  if(MaskIm[ipos]>0) mn_r=+ dval1; 
-                  // Y2 - intensity value of second pixel
-                  dval2=(double)(p[ipos+1] & 0xff);  
-                  Frmr[rgbpos++] = dval2;
-                  // Calculate the mean within the support of the mask
-                  if(MaskIm[ipos+1]>0) mn_r=+ dval2; 
+                  fr[ipos-q0] = dval1; 
+                  if(MaskIm[ipos]>0) r+=dval1; 
                  }
-              mn_r/=Mask_supp_size;
           break;
         case CCOL_TO_RGB : // Convert to full RGB
         case CCOL_TO_BGR:  // Convert to full RGB for saving as BMP file
-              mn_r=0.0; mn_g=0.0; mn_b=0.0;
-              for(ipos=0;ipos<ImSize;ipos+=2){ iposp=ipos+1; 
+              // Use the fixed point (maybe SIMD) kernel unless the gain
+              // and bias are too big for it
+              if(Yfx.ok && Yuyv_kernel!=NULL){
+                 Yuyv_kernel(p+q0, q1-q0, MaskIm+q0, fr, fg, fb, Band_part[band].isum);
+                 break;
+                }
+              for(ipos=q0;ipos<q1;ipos+=2){ iposp=ipos+1; 
                  //First pixel
                  pixval=p[ipos];
                  y1= pixval & 0xff; // Y1
@@ -6887,176 +8309,1056 @@ static int colour_convert(const unsigned short *p)
                  dval1=(lut_yR[y1] + lut_crR[cr]);
                  dval2=(lut_yG[y1] - fval);
                  dval3=(lut_yB[y1] + lut_cbB[cb]);
-                 Frmr[ipos] = dval1;
-                 Frmg[ipos] = dval2; 
-                 Frmb[ipos] = dval3;
-                 // Calculate the mean within the support of the mask
-                 if(MaskIm[ipos]>0){
-                    mn_r+=dval1;
-                    mn_g+=dval2;
-                    mn_b+=dval3;
-                  }
+                 fr[ipos-q0] = dval1;
+                 fg[ipos-q0] = dval2; 
+                 fb[ipos-q0] = dval3;
+                 if(MaskIm[ipos]>0){ r+=dval1; g+=dval2; b+=dval3; }
                  // Get RGB from second pixel via the LUTs
                  dval1=(lut_yR[y2] + lut_crR[cr]);
                  dval2=(lut_yG[y2] - fval);
                  dval3=(lut_yB[y2] + lut_cbB[cb]);
-                 Frmr[iposp] = dval1;
-                 Frmg[iposp] = dval2; 
-                 Frmb[iposp] = dval3;
-                 // Calculate the mean within the support of the mask
-                 if(MaskIm[iposp]>0){
-                    mn_r+=dval1;
-                    mn_g+=dval2;
-                    mn_b+=dval3;
-                  }
+                 fr[iposp-q0] = dval1;
+                 fg[iposp-q0] = dval2; 
+                 fb[iposp-q0] = dval3;
+                 if(MaskIm[iposp]>0){ r+=dval1; g+=dval2; b+=dval3; }
                }
-              mn_r/=Mask_supp_size;
-              mn_g/=Mask_supp_size;
-              mn_b/=Mask_supp_size;
             break;
           default: break;
         }
-        
     break;
     case V4L2_PIX_FMT_MJPEG:
-    
       switch(col_conv_type){
         case CCOL_TO_Y:    // Convert from RGB to Y
-                           // We only use the 'red' channel of the 
-                           // frame buffer to store this.
         // Because all JPEG images are RGB we convert the RGB data to
         // intensity data using the 'I' part of an HSI transform i.e.
-        // I=(R+G+B)/3.
-              mn_r=0.0;
-              for(ipos=rgbpos=0;ipos<ImSize;ipos++){ 
-                  uy1= RGBimg[rgbpos++]; // R
-                  uy2= RGBimg[rgbpos++]; // G
-                  uy3= RGBimg[rgbpos++]; // B
-                  dval1=(double)uy1+(double)uy2+(double)uy3;
+        // I=(R+G+B)/3. Unless only the luma was decoded, which is
+        // used as it is.
+              if(Jpeg_luma_rgbimg){
+                for(ipos=q0;ipos<q1;ipos++){
+                    dval1=(double)RGBimg[ipos];
+                    fr[ipos-q0] = dval1;
+                    if(MaskIm[ipos]>0) r+=dval1;
+                   }
+                break;
+               }
+              for(ipos=q0,rgbpos=3*q0;ipos<q1;ipos++,rgbpos+=3){ 
+                  dval1=(double)RGBimg[rgbpos]+(double)RGBimg[rgbpos+1]+(double)RGBimg[rgbpos+2];
                   dval1/=3.0;
-                  Frmr[ipos] = dval1;
-                  // Calculate the mean within the support of the mask
-                  if(MaskIm[ipos]>0) mn_r=+ dval1; 
+                  fr[ipos-q0] = dval1;
+                  if(MaskIm[ipos]>0) r+=dval1; 
                  }
-              mn_r/=Mask_supp_size;
           break;
         case CCOL_TO_RGB : // Convert to full RGB
         case CCOL_TO_BGR:  // Convert to full RGB for saving as BMP file
-              mn_r=0.0; mn_g=0.0; mn_b=0.0;
-              for(ipos=rgbpos=0;ipos<ImSize;ipos++){
-                 dval1=(double)RGBimg[rgbpos++];
-                 dval2=(double)RGBimg[rgbpos++];
-                 dval3=(double)RGBimg[rgbpos++];
-                 Frmr[ipos] = dval1; // R
-                 Frmg[ipos] = dval2; // G 
-                 Frmb[ipos] = dval3; // B
-                 // Calculate the mean within the support of the mask
-                 if(MaskIm[ipos]>0){
-                    mn_r+=dval1;
-                    mn_g+=dval2;
-                    mn_b+=dval3;
-                  }
+              for(ipos=q0,rgbpos=3*q0;ipos<q1;ipos++,rgbpos+=3){
+                 dval1=(double)RGBimg[rgbpos];
+                 dval2=(double)RGBimg[rgbpos+1];
+                 dval3=(double)RGBimg[rgbpos+2];
+                 fr[ipos-q0] = dval1; // R
+                 fg[ipos-q0] = dval2; // G 
+                 fb[ipos-q0] = dval3; // B
+                 if(MaskIm[ipos]>0){ r+=dval1; g+=dval2; b+=dval3; }
                }
-              mn_r/=Mask_supp_size;
-              mn_g/=Mask_supp_size;
-              mn_b/=Mask_supp_size;
             break;
           default: break;
         }
-        
-    default: break;
-      
-   }
- 
- // Now we apply dark field correction if requested:
- if(do_df_correction){
-
-   switch(CamFormat){
-       
-    case V4L2_PIX_FMT_YUYV:
-    case V4L2_PIX_FMT_MJPEG:
-   
-      switch(col_conv_type){
-        case CCOL_TO_Y:
-              for(ipos=0;ipos<ImSize;ipos++){
-                 // Only correct within the support of the mask
-                 if(MaskIm[ipos]>0) Frmr[ipos] -= DF_Image[ipos];
-                }
-          break;
-        case CCOL_TO_RGB: 
-        case CCOL_TO_BGR:
-              for(ipos=rgbpos=0;ipos<ImSize;ipos++,rgbpos+=3){ 
-                 // Only correct within the support of the mask
-                 if(MaskIm[ipos]>0){
-                    Frmr[ipos] -= DF_Image[rgbpos];
-                    Frmg[ipos] -= DF_Image[rgbpos+1];
-                    Frmb[ipos] -= DF_Image[rgbpos+2];
-                   }
-               }
-            break;
-          default: break;
+    break;
+    case V4L2_PIX_FMT_GREY:
+    case V4L2_PIX_FMT_Y10:
+    case V4L2_PIX_FMT_Y12:
+    case V4L2_PIX_FMT_Y16:
+      // Monochrome: the sample is Y and, for colour, R, G and B alike.
+      // Deeper samples are scaled to 0-255 (see camfmt_scale).
+      fval = camfmt_scale();
+      for(ipos=q0;ipos<q1;ipos++){
+         dval1 = (CamFormat==V4L2_PIX_FMT_GREY) ? (double)pb[ipos] : fval*(double)p[ipos];
+         fr[ipos-q0] = dval1;
+         if(col_conv_type!=CCOL_TO_Y){ fg[ipos-q0] = dval1; fb[ipos-q0] = dval1; }
+         if(MaskIm[ipos]>0){ r+=dval1; g+=dval1; b+=dval1; }
+        }
+    break;
+    case V4L2_PIX_FMT_NV12:
+      // The Y plane (ImSize bytes) is followed by a plane of Cb,Cr pairs,
+      // one pair for each 2x2 block of pixels
+      if(col_conv_type==CCOL_TO_Y){
+        for(ipos=q0;ipos<q1;ipos++){ 
+            dval1=(double)pb[ipos];
+            fr[ipos-q0] = dval1; 
+            if(MaskIm[ipos]>0) r+=dval1; 
+           }
+        break;
+       }
+      row = q0/ImWidth; col = q0 - row*ImWidth;
+      for(ipos=q0;ipos<q1;ipos++){
+         rgbpos = ImSize + (row>>1)*ImWidth + (col & ~1);
+         if(++col==ImWidth){ col=0; row++; }
+         y1 = pb[ipos];
+         cb = pb[rgbpos];
+         cr = pb[rgbpos+1];
+         fval = lut_crG[cr] + lut_cbG[cb];
+         dval1=(lut_yR[y1] + lut_crR[cr]);
+         dval2=(lut_yG[y1] - fval);
+         dval3=(lut_yB[y1] + lut_cbB[cb]);
+         fr[ipos-q0] = dval1;
+         fg[ipos-q0] = dval2; 
+         fb[ipos-q0] = dval3;
+         if(MaskIm[ipos]>0){ r+=dval1; g+=dval2; b+=dval3; }
+        }
+    break;
+    case V4L2_PIX_FMT_SRGGB8:
+    case V4L2_PIX_FMT_SGRBG8:
+    case V4L2_PIX_FMT_SGBRG8:
+    case V4L2_PIX_FMT_SBGGR8:
+    case V4L2_PIX_FMT_SRGGB10:
+    case V4L2_PIX_FMT_SGRBG10:
+    case V4L2_PIX_FMT_SGBRG10:
+    case V4L2_PIX_FMT_SBGGR10:
+      // Demosaic a row at a time from the neighbours (which may be in
+      // other bands, but p is only read). 10 bit samples are scaled to
+      // 0-255 as for the monochrome formats. Y is the I of an HSI
+      // transform, as for MJPEG.
+      fval = camfmt_scale();
+      cfa = camfmt_bayer(); bits = camfmt_bits();
+      for(iq=q0;iq<q1;iq=iend){
+         row = iq/ImWidth; col = iq - row*ImWidth;
+         iend = (q1-iq > ImWidth-col) ? iq+ImWidth-col : q1;
+         if(iend-iq > FUSE_CHUNK) iend = iq+FUSE_CHUNK;
+         bayer_row(p,bits,cfa,band,row,col,col+iend-iq,dr,dg,db);
+         for(ipos=iq;ipos<iend;ipos++){
+            dval1 = fval*dr[ipos-iq];
+            dval2 = fval*dg[ipos-iq];
+            dval3 = fval*db[ipos-iq];
+            if(col_conv_type==CCOL_TO_Y){
+              dval1 = (dval1+dval2+dval3)/3.0;
+              fr[ipos-q0] = dval1;
+              if(MaskIm[ipos]>0) r+=dval1;
+              continue;
+             }
+            fr[ipos-q0] = dval1;
+            fg[ipos-q0] = dval2; 
+            fb[ipos-q0] = dval3;
+            if(MaskIm[ipos]>0){ r+=dval1; g+=dval2; b+=dval3; }
+           }
         }
-        
     break;
     default: break;
-      
    }
+ Band_part[band].dsum[0] = r;
+ Band_part[band].dsum[1] = g;
+ Band_part[band].dsum[2] = b;
+}
 
-  }
-
- // Now we apply flat field correction if requested:
- if(do_ff_correction){
+static void band_sums(int band, int p0, int p1, void *arg)
+// Just sum each channel of pixels p0 to p1-1 within the mask (for the
+// frame means) without keeping the converted pixels. This only reads
+// the camera frame so it is much lighter on memory than band_frame.
+{
+ struct band_job *job = (struct band_job *)arg;
+ fpix_t fr[FUSE_CHUNK],fg[FUSE_CHUNK],fb[FUSE_CHUNK];
+ int q0,q1;
+
+ memset(&Band_part[band], 0, sizeof(Band_part[band]));
+ for(q0=p0;q0<p1;q0=q1){
+    q1 = (p1-q0 > FUSE_CHUNK) ? q0+FUSE_CHUNK : p1;
+    convert_span(job->p, q0, q1, fr, fg, fb, band);
+   }
+}
 
-   switch(CamFormat){
-       
-    case V4L2_PIX_FMT_YUYV:
-    case V4L2_PIX_FMT_MJPEG:
-   
-      switch(col_conv_type){
-        case CCOL_TO_Y:
-              for(ipos=0;ipos<ImSize;ipos++){
-                 // Only correct within the support of the mask
-                 if(MaskIm[ipos]>0) Frmr[ipos] /= FF_Image[ipos];
-                }
-          break;
-        case CCOL_TO_RGB: 
-        case CCOL_TO_BGR:
-              for(ipos=rgbpos=0;ipos<ImSize;ipos++,rgbpos+=3){ 
-                 // Only correct within the support of the mask
-                 if(MaskIm[ipos]>0){
-                    Frmr[ipos] /= FF_Image[rgbpos];
-                    Frmg[ipos] /= FF_Image[rgbpos+1];
-                    Frmb[ipos] /= FF_Image[rgbpos+2];
-                   }
-               }
-            break;
-          default: break;
+static void band_frame(int band, int p0, int p1, void *arg)
+// The whole of the full-frame processing of pixels p0 to p1-1 in one
+// pass: conversion, dark and flat field correction and mean scaling
+// (within the mask) and then either adding them to the Av[r,g,b] stores
+// or putting them in the Frm[r,g,b] frame stores, which is where the
+// file writers take them from. It goes a chunk at a time so that each pixel is
+// still in the cache when it is corrected, and when averaging the
+// converted chunk never leaves the stack. What is done is set in job.
+{
+ struct band_job *job = (struct band_job *)arg;
+ fpix_t lr[FUSE_CHUNK],lg[FUSE_CHUNK],lb[FUSE_CHUNK];
+ fpix_t *fr,*fg,*fb;
+ double r,g,b;
+ const int dark = job->dark, flat = job->flat, scale = job->scale;
+ const int mono = (col_conv_type==CCOL_TO_Y);
+ int q0,q1,i,ipos,rgbpos;
+
+ memset(&Band_part[band], 0, sizeof(Band_part[band]));
+ for(q0=p0;q0<p1;q0=q1){
+    q1 = (p1-q0 > FUSE_CHUNK) ? q0+FUSE_CHUNK : p1;
+    if(job->accumulate){ fr = lr; fg = lg; fb = lb; }
+    else { fr = Frmr+q0; fg = Frmg+q0; fb = Frmb+q0; }
+    convert_span(job->p, q0, q1, fr, fg, fb, band);
+    if(mono){
+      for(i=0,ipos=q0;ipos<q1;i++,ipos++){
+         r = fr[i];
+         if(MaskIm[ipos]>0){
+           if(dark) r -= DF_Image[ipos];
+           if(flat) r /= FF_Image[ipos];
+           if(scale) r *= job->k[0];
+          }
+         if(job->accumulate) Avr[ipos] += r;
+         else fr[i] = r;
+        }
+      continue;
+     }
+    for(i=0,ipos=q0,rgbpos=3*q0;ipos<q1;i++,ipos++,rgbpos+=3){
+       r = fr[i]; g = fg[i]; b = fb[i];
+       if(MaskIm[ipos]>0){
+         if(dark){
+           r -= DF_Image[rgbpos];
+           g -= DF_Image[rgbpos+1];
+           b -= DF_Image[rgbpos+2];
+          }
+         if(flat){
+           r /= FF_Image[rgbpos];
+           g /= FF_Image[rgbpos+1];
+           b /= FF_Image[rgbpos+2];
+          }
+         if(scale){ r *= job->k[0]; g *= job->k[1]; b *= job->k[2]; }
+        }
+       if(job->accumulate){
+         Avr[ipos] += r;
+         Avg[ipos] += g;
+         Avb[ipos] += b;
+        } else {
+         fr[i] = r; fg[i] = g; fb[i] = b;
+        }
+      }
+   }
+}
+
+static void band_average_out(int band, int p0, int p1, void *arg)
+// At the end of multi-frame averaging, divide pixels p0 to p1-1 of the
+// Av[r,g,b] stores by the number of frames added (Av_added) and put the
+// averages, unaltered, into the Frm[r,g,b] frame stores.
+{
+ const double den = (Av_added > 0) ? (double)Av_added : 1.0;
+ int ipos;
+
+ if(col_conv_type==CCOL_TO_Y){
+   for(ipos=p0;ipos<p1;ipos++) Frmr[ipos] = Avr[ipos]/den;
+   return;
+  }
+ for(ipos=p0;ipos<p1;ipos++){
+    Frmr[ipos] = Avr[ipos]/den;
+    Frmg[ipos] = Avg[ipos]/den;
+    Frmb[ipos] = Avb[ipos]/den;
+   }
+}
+
+static void add_bytes(void *acc, const unsigned char *src, size_t n, int wide)
+// Add n bytes from src to the n unsigned shorts (or, if wide, unsigned
+// ints) in acc. 16 at a time with SSE2 where there is SSE2.
+{
+ unsigned short *a16 = (unsigned short *)acc;
+ unsigned int *a32 = (unsigned int *)acc;
+ size_t i = 0;
+#if defined(YUYV_X86_KERNELS) && defined(__SSE2__)
+ const __m128i zero = _mm_setzero_si128();
+ __m128i v,lo,hi;
+
+ for(;i+16<=n;i+=16){
+    v = _mm_loadu_si128((const __m128i *)(src+i));
+    lo = _mm_unpacklo_epi8(v, zero);
+    hi = _mm_unpackhi_epi8(v, zero);
+    if(wide){
+      _mm_storeu_si128((__m128i *)(a32+i),    _mm_add_epi32(_mm_loadu_si128((__m128i *)(a32+i)),    _mm_unpacklo_epi16(lo, zero)));
+      _mm_storeu_si128((__m128i *)(a32+i+4),  _mm_add_epi32(_mm_loadu_si128((__m128i *)(a32+i+4)),  _mm_unpackhi_epi16(lo, zero)));
+      _mm_storeu_si128((__m128i *)(a32+i+8),  _mm_add_epi32(_mm_loadu_si128((__m128i *)(a32+i+8)),  _mm_unpacklo_epi16(hi, zero)));
+      _mm_storeu_si128((__m128i *)(a32+i+12), _mm_add_epi32(_mm_loadu_si128((__m128i *)(a32+i+12)), _mm_unpackhi_epi16(hi, zero)));
+     } else {
+      _mm_storeu_si128((__m128i *)(a16+i),   _mm_add_epi16(_mm_loadu_si128((__m128i *)(a16+i)),   lo));
+      _mm_storeu_si128((__m128i *)(a16+i+8), _mm_add_epi16(_mm_loadu_si128((__m128i *)(a16+i+8)), hi));
+     }
+   }
+#endif
+ if(wide) for(;i<n;i++) a32[i] += src[i];
+ else for(;i<n;i++) a16[i] += src[i];
+}
+
+static void add_luma(void *acc, const unsigned short *p, size_t n, int wide)
+// Add the Y bytes of n YUYV pixels from p to the n unsigned shorts (or,
+// if wide, unsigned ints) in acc. 8 at a time with SSE2 where there is
+// SSE2.
+{
+ unsigned short *a16 = (unsigned short *)acc;
+ unsigned int *a32 = (unsigned int *)acc;
+ size_t i = 0;
+#if defined(YUYV_X86_KERNELS) && defined(__SSE2__)
+ const __m128i zero = _mm_setzero_si128();
+ const __m128i lo8 = _mm_set1_epi16(0xff);
+ __m128i y;
+
+ for(;i+8<=n;i+=8){
+    y = _mm_and_si128(_mm_loadu_si128((const __m128i *)(p+i)), lo8);
+    if(wide){
+      _mm_storeu_si128((__m128i *)(a32+i),   _mm_add_epi32(_mm_loadu_si128((__m128i *)(a32+i)),   _mm_unpacklo_epi16(y, zero)));
+      _mm_storeu_si128((__m128i *)(a32+i+4), _mm_add_epi32(_mm_loadu_si128((__m128i *)(a32+i+4)), _mm_unpackhi_epi16(y, zero)));
+     } else {
+      _mm_storeu_si128((__m128i *)(a16+i), _mm_add_epi16(_mm_loadu_si128((__m128i *)(a16+i)), y));
+     }
+   }
+#endif
+ if(wide) for(;i<n;i++) a32[i] += p[i] & 0xff;
+ else for(;i<n;i++) a16[i] += p[i] & 0xff;
+}
+
+static void add_words(unsigned int *acc, const unsigned short *src, size_t n)
+// Add n unsigned shorts from src to the n unsigned ints in acc. 8 at a
+// time with SSE2 where there is SSE2.
+{
+ size_t i = 0;
+#if defined(YUYV_X86_KERNELS) && defined(__SSE2__)
+ const __m128i zero = _mm_setzero_si128();
+ __m128i v;
+
+ for(;i+8<=n;i+=8){
+    v = _mm_loadu_si128((const __m128i *)(src+i));
+    _mm_storeu_si128((__m128i *)(acc+i),   _mm_add_epi32(_mm_loadu_si128((__m128i *)(acc+i)),   _mm_unpacklo_epi16(v, zero)));
+    _mm_storeu_si128((__m128i *)(acc+i+4), _mm_add_epi32(_mm_loadu_si128((__m128i *)(acc+i+4)), _mm_unpackhi_epi16(v, zero)));
+   }
+#endif
+ for(;i<n;i++) acc[i] += src[i];
+}
+
+static size_t avi_count(void)
+// The number of sums in Avi for the current camera format and 'save as'
+// format: one per pixel for a Y-only image from YUYV (or from the luma
+// of MJPEG frames), two per pixel (Y and Cb or Cr) for colour from YUYV,
+// three (R, G and B) for anything else from MJPEG and one per pixel for
+// the monochrome formats and for a Y-only image from NV12 (colour from
+// NV12 is not added up in Avi).
+{
+ if(CamFormat==V4L2_PIX_FMT_MJPEG) return (Av_luma ? 1 : 3)*(size_t)ImSize;
+ if(CamFormat!=V4L2_PIX_FMT_YUYV) return (size_t)ImSize;
+ if(saveas_fmt==SAF_YP5 || saveas_fmt==SAF_BM8) return (size_t)ImSize;
+ return 2*(size_t)ImSize;
+}
+
+static void band_accumulate_int(int band, int p0, int p1, void *arg)
+// Add the samples of pixels p0 to p1-1 of the frame to Avi
+{
+ struct band_job *job = (struct band_job *)arg;
+ size_t sz = Avi_wide ? sizeof(unsigned int) : sizeof(unsigned short);
+
+ if(camfmt_bits()>8) // Avi is always wide for these
+   add_words((unsigned int *)Avi + p0, job->p + p0, (size_t)(p1-p0));
+ else if(CamFormat==V4L2_PIX_FMT_GREY || CamFormat==V4L2_PIX_FMT_NV12) // Just the Y plane of NV12
+   add_bytes((char *)Avi + (size_t)p0*sz, (const unsigned char *)job->p + p0, (size_t)(p1-p0), Avi_wide);
+ else if(CamFormat==V4L2_PIX_FMT_MJPEG && Av_luma)
+   add_bytes((char *)Avi + (size_t)p0*sz, RGBimg + p0, (size_t)(p1-p0), Avi_wide);
+ else if(CamFormat==V4L2_PIX_FMT_MJPEG)
+   add_bytes((char *)Avi + 3*(size_t)p0*sz, RGBimg + 3*(size_t)p0, 3*(size_t)(p1-p0), Avi_wide);
+ else if(col_conv_type==CCOL_TO_Y)
+   add_luma((char *)Avi + (size_t)p0*sz, job->p + p0, (size_t)(p1-p0), Avi_wide);
+ else
+   add_bytes((char *)Avi + 2*(size_t)p0*sz, (const unsigned char *)(job->p + p0), 2*(size_t)(p1-p0), Avi_wide);
+}
+
+static double avi_sum(size_t k)
+// Sum k of Avi as a double
+{
+ return Avi_wide ? (double)((const unsigned int *)Avi)[k] : (double)((const unsigned short *)Avi)[k];
+}
+
+static void band_average_int(int band, int p0, int p1, void *arg)
+// As band_average_out but from the integer sums in Avi: the mean of
+// each sample is worked out and then, for YUYV, converted to RGB just
+// as each frame would have been (the conversion is linear so this gives
+// the mean of the converted frames).
+{
+ const double den = (Av_added > 0) ? (double)Av_added : 1.0;
+ double r,g,b,y,y1,y2,cb,cr;
+ int ipos,rgbpos,k;
+
+ if(CamFormat==V4L2_PIX_FMT_MJPEG && !Av_luma){
+   for(ipos=p0,rgbpos=3*p0;ipos<p1;ipos++,rgbpos+=3){
+      r = avi_sum(rgbpos)/den;
+      g = avi_sum(rgbpos+1)/den;
+      b = avi_sum(rgbpos+2)/den;
+      if(col_conv_type==CCOL_TO_Y){
+        Frmr[ipos] = (r+g+b)/3.0;
+        continue;
+       }
+      Frmr[ipos] = r; Frmg[ipos] = g; Frmb[ipos] = b;
+     }
+  } else if(CamFormat!=V4L2_PIX_FMT_YUYV && CamFormat!=V4L2_PIX_FMT_MJPEG){
+   // One sum per pixel (see avi_count), scaled as in convert_span
+   y = camfmt_scale()/den;
+   for(ipos=p0;ipos<p1;ipos++){
+      Frmr[ipos] = y*avi_sum(ipos);
+      if(col_conv_type!=CCOL_TO_Y) Frmg[ipos] = Frmb[ipos] = Frmr[ipos];
+     }
+  } else if(col_conv_type==CCOL_TO_Y){
+   for(ipos=p0;ipos<p1;ipos++) Frmr[ipos] = avi_sum(ipos)/den;
+  } else {
+   for(ipos=p0;ipos<p1;ipos+=2){
+      y1 = avi_sum(2*ipos)/den;   cb = avi_sum(2*ipos+1)/den;
+      y2 = avi_sum(2*ipos+2)/den; cr = avi_sum(2*ipos+3)/den;
+      r = Ydbl.kcrR*cr + Ydbl.conr;
+      g = Ydbl.cong - Ydbl.kcrG*cr - Ydbl.kcbG*cb;
+      b = Ydbl.kcbB*cb + Ydbl.conb;
+      for(k=0;k<2;k++){ // The colour terms are common to both pixels
+         y = Ydbl.ky*(k ? y2 : y1);
+         Frmr[ipos+k] = y + r;
+         Frmg[ipos+k] = y + g;
+         Frmb[ipos+k] = y + b;
+        }
+     }
+  }
+}
+
+static void preview_sum_reset(void)
+// Make PreviewSum the sum of the Preview_integral integration buffers
+// again (after they have been reallocated)
+{
+ int fidx,pipos;
+
+ memset(PreviewSum, 0, (size_t)PreviewImg_size*sizeof(int));
+ for(fidx=0;fidx<Preview_integral;fidx++)
+   for(pipos=0;pipos<PreviewImg_size;pipos++) PreviewSum[pipos]+=PreviewBuff[fidx][pipos];
+ if(PreviewIDX>=Preview_integral) PreviewIDX=0;
+}
+
+static inline double preview_integrate(int pipos, unsigned char val)
+// Put val in place of the oldest integrated value of Y preview pixel
+// pipos (in PreviewBuff[PreviewIDX]) and return the dark and flat
+// corrected, biased sum of its last Preview_integral values. As the sum
+// of (v-dark)/flat over the frames is (sum of v - frames x dark)/flat
+// only a running sum of the values is kept, so this costs the same
+// whatever Preview_integral is.
+{
+ unsigned char *oldest = &PreviewBuff[PreviewIDX][pipos];
+
+ PreviewSum[pipos] += (int)val - (int)*oldest;
+ *oldest = val;
+ return (double)Preview_bias +
+        ((double)PreviewSum[pipos] - Preview_integral*(double)Preview_dark[pipos])/(double)Preview_flat[pipos];
+}
+
+static void prev_pixel_bayer(const void *p, int ipos, unsigned char *rgb8)
+// The 8-bit R, G and B of pixel ipos of a Bayer frame p for the preview
+{
+ double rgb[3],fval;
+ int row,k;
+
+ row = ipos/ImWidth;
+ bayer_pixel(p,camfmt_bits(),camfmt_bayer(),row,ipos-row*ImWidth,rgb);
+ fval = camfmt_scale();
+ for(k=0;k<3;k++){
+    rgb[k] *= fval;
+    rgb8[k] = (unsigned char)(rgb[k]>255.0 ? 255 : rgb[k]);
+   }
+}
+
+static unsigned char prev_pixel_y(const void *p, int ipos)
+// The 8-bit Y of pixel ipos of a GREY, Y10, Y12, Y16, NV12 or Bayer
+// frame p for the preview (just the top 8 bits of deeper samples, or
+// the mean of R, G and B for Bayer)
+{
+ unsigned char rgb8[3];
+ unsigned int val;
+
+ if(camfmt_bayer()>=0){
+   prev_pixel_bayer(p,ipos,rgb8);
+   return (unsigned char)(((unsigned int)rgb8[0]+rgb8[1]+rgb8[2])/3);
+  }
+ if(camfmt_bits()==8) return ((const unsigned char *)p)[ipos]; // GREY or the NV12 Y plane
+ val = ((const unsigned short *)p)[ipos] >> (camfmt_bits()-8);
+ return (unsigned char)(val>255 ? 255 : val);
+}
+
+static void prev_pixel_rgb(const void *p, int ipos, unsigned char *uy1, unsigned char *uy2, unsigned char *uy3)
+// The 8-bit R, G and B of pixel ipos of a GREY, Y10, Y12, Y16, NV12 or
+// Bayer frame p for the preview. The NV12 colour is got via the LUTs,
+// as for YUYV.
+{
+ const unsigned char *pb = (const unsigned char *)p;
+ double r,g,b,fval;
+ int row,col,cpos;
+ unsigned char y,cb,cr,rgb8[3];
+
+ if(camfmt_mono()){
+   *uy1 = *uy2 = *uy3 = prev_pixel_y(p,ipos);
+   return;
+  }
+ if(CamFormat!=V4L2_PIX_FMT_NV12){
+   prev_pixel_bayer(p,ipos,rgb8);
+   *uy1 = rgb8[0]; *uy2 = rgb8[1]; *uy3 = rgb8[2];
+   return;
+  }
+ row = ipos/ImWidth; col = ipos - row*ImWidth;
+ cpos = ImSize + (row>>1)*ImWidth + (col & ~1); // Its Cb,Cr pair
+ y = pb[ipos]; cb = pb[cpos]; cr = pb[cpos+1];
+ fval = lut_crG[cr] + lut_cbG[cb]; 
+ r = lut_yR[y] + lut_crR[cr];
+ g = lut_yG[y] - fval; 
+ b = lut_yB[y] + lut_cbB[cb];
+ // Clamp the values between 0 and 255 inclusive
+ r=r<0.0?0.0:r;g=g<0.0?0.0:g;b=b<0.0?0.0:b;
+ *uy1=(unsigned char)(r>255.0?255:r);
+ *uy2=(unsigned char)(g>255.0?255:g);
+ *uy3=(unsigned char)(b>255.0?255:b);
+}
+
+static inline void prev_stats_add(const unsigned char *rgb)
+// Add the colour preview pixel rgb to the preview stats
+{
+ if(rgb[0]<=PrevStat.llim_r) PrevStat.lsat_r++;
+ if(rgb[0]>=PrevStat.ulim_r) PrevStat.usat_r++;
+ if(rgb[0]>PrevStat.max_r) PrevStat.max_r=rgb[0];
+ if(rgb[0]<PrevStat.min_r) PrevStat.min_r=rgb[0];
+ PrevStat.hgm_r[rgb[0]]++;
+ PrevStat.intgl_r+=(double)rgb[0];
+
+ if(rgb[1]<=PrevStat.llim_g) PrevStat.lsat_g++;
+ if(rgb[1]>=PrevStat.ulim_g) PrevStat.usat_g++;
+ if(rgb[1]>PrevStat.max_g) PrevStat.max_g=rgb[1];
+ if(rgb[1]<PrevStat.min_g) PrevStat.min_g=rgb[1];
+ PrevStat.hgm_g[rgb[1]]++;
+ PrevStat.intgl_g+=(double)rgb[1];
+
+ if(rgb[2]<=PrevStat.llim_b) PrevStat.lsat_b++;
+ if(rgb[2]>=PrevStat.ulim_b) PrevStat.usat_b++;
+ if(rgb[2]>PrevStat.max_b) PrevStat.max_b=rgb[2];
+ if(rgb[2]<PrevStat.min_b) PrevStat.min_b=rgb[2];
+ PrevStat.hgm_b[rgb[2]]++;
+ PrevStat.intgl_b+=(double)rgb[2];
+}
+
+static inline void prev_yuyv_rgb(unsigned short y, unsigned short cb, unsigned short cr, double fval, const int invert, unsigned char *rgb)
+// Put the 8-bit RGB of YUYV pixel y (with colour cb,cr, and fval the
+// green term of that) into rgb, inverted if invert
+{
+ double r,g,b;
+
+ // Get RGB via the LUTs
+ r = lut_yR[y] + lut_crR[cr];
+ g = lut_yG[y] - fval; 
+ b = lut_yB[y] + lut_cbB[cb];
+ // Clamp the values between 0 and 255 inclusive
+ r=r<0.0?0.0:r;g=g<0.0?0.0:g;b=b<0.0?0.0:b;
+ rgb[0]=(unsigned char)(r>255.0?255:r);
+ rgb[1]=(unsigned char)(g>255.0?255:g);
+ rgb[2]=(unsigned char)(b>255.0?255:b);
+ if(invert){ rgb[0]=255-rgb[0]; rgb[1]=255-rgb[1]; rgb[2]=255-rgb[2]; }
+}
+
+// The preview kernels. Each is written once with its configuration
+// (invert the intensities, gather stats only under the mask, ...) as
+// arguments but only ever called with constants for those, from the
+// variants that PREVK_VARIANTS makes, so the compiler builds a copy of
+// the loop for each setting with no tests of it inside. colour_convert
+// picks the variant for the current settings from the kernel's _tab
+// once per preview frame. They all cover the Prev_nrows x Prev_ncols
+// preview pixels that have a sample point, in the order SSrow and SScol
+// give (so flipped as required) and look the mask (and the preview
+// dark, flat and integration buffers) up at mskpos, where each pixel
+// would be unflipped.
+
+static inline __attribute__((always_inline)) void prevk_yuyv_pairs(const unsigned short *p, const int invert, const int masked)
+// Colour preview from YUYV, scaled down or as a full resolution tile.
+// Each pair of preview pixels is made from the pair of YUYV pixels at
+// the first one's sample point (scaling up would take a lot more work to
+// get right, see prevk_yuyv_up).
+{
+ int prow,pcol,ipos,rgbpos,mskpos,o1,o2;
+ unsigned short y1,y2,cb,cr;
+ double fval;
+
+ // Where the 2 pixels of the pair go (swapped if flipped horizontally)
+ o1 = prev_flip_h ? 3 : 0;
+ o2 = 3-o1;
+ for(prow=0;prow<Prev_nrows;prow++){ 
+    rgbpos=Prev_startrow+Prev_startcol+prow*PreviewWd_stride;
+    mskpos=Prev_mskstart+prow*Prev_mskrowstep;
+    for(pcol=0;pcol<Prev_ncols;pcol+=2,rgbpos+=6,mskpos+=2*Prev_mskcolstep){
+       ipos=SSrow[prow]+SScol[pcol];
+       // For colour conversion, we must start at an even number or we
+       // will split YUYV pixels in the wrong reading frame to get YVYU)
+       // and so switch Cr,Cb order (the colour will look wrong).
+       if(ipos%2) ipos--; 
+       y1 = p[ipos] & 0xff;   // Y1
+       cb = p[ipos] >> 8;     // Cb1
+       y2 = p[ipos+1] & 0xff; // Y2
+       cr = p[ipos+1] >> 8;   // Cr1
+       // The following is common to both pixels so calculate it only
+       // once:
+       fval = lut_crG[cr] + lut_cbG[cb]; 
+       prev_yuyv_rgb(y1,cb,cr,fval,invert,PreviewImg+rgbpos+o1);
+       prev_yuyv_rgb(y2,cb,cr,fval,invert,PreviewImg+rgbpos+o2);
+       // Gather stats (only under mask, if used)
+       if(!masked || PrevStat.MaskIm[mskpos]) prev_stats_add(PreviewImg+rgbpos);
+       if(!masked || PrevStat.MaskIm[mskpos+Prev_mskcolstep]) prev_stats_add(PreviewImg+rgbpos+3);
+      }
+   }
+}
+
+static inline __attribute__((always_inline)) void prevk_yuyv_up(const unsigned short *p, const int invert, const int masked)
+// Colour preview from YUYV scaled up. Because YUYV pixels share their
+// colour information a whole row of the frame is converted (into
+// PreviewRow) and the preview row is sampled from that.
+{
+ int prow,pcol,ipos,rgbpos,mskpos,pipos,ival;
+ unsigned short y1,y2,cb,cr;
+ double fval;
+
+ for(prow=0;prow<Prev_nrows;prow++){ 
+    rgbpos=Prev_startrow+Prev_startcol+prow*PreviewWd_stride;
+    mskpos=Prev_mskstart+prow*Prev_mskrowstep;
+    ival=(SSrow[prow]+ImWidth);
+    for(ipos=SSrow[prow],pipos=0;ipos<ival;ipos+=2,pipos+=6){
+       if(ipos%2) ipos--;
+       y1 = p[ipos] & 0xff;   // Y1
+       cb = p[ipos] >> 8;     // Cb1
+       y2 = p[ipos+1] & 0xff; // Y2
+       cr = p[ipos+1] >> 8;   // Cr1
+       fval = lut_crG[cr] + lut_cbG[cb]; 
+       prev_yuyv_rgb(y1,cb,cr,fval,invert,PreviewRow+pipos);
+       prev_yuyv_rgb(y2,cb,cr,fval,invert,PreviewRow+pipos+3);
+      }
+    for(pcol=0;pcol<Prev_ncols;pcol++,rgbpos+=3,mskpos+=Prev_mskcolstep){
+       ipos=3*SScol[pcol];
+       PreviewImg[rgbpos]   = PreviewRow[ipos];   // R
+       PreviewImg[rgbpos+1] = PreviewRow[ipos+1]; // G
+       PreviewImg[rgbpos+2] = PreviewRow[ipos+2]; // B
+       if(!masked || PrevStat.MaskIm[mskpos]) prev_stats_add(PreviewImg+rgbpos);
+      }
+   }
+}
+
+static inline __attribute__((always_inline)) void prevk_mjpeg_rgb(const unsigned short *p, const int invert, const int masked)
+// Colour preview from the decoded MJPEG frame in RGBimg (p is not
+// used). The stats are of the image before any inversion.
+{
+ int prow,pcol,ipos,rgbpos,mskpos;
+ const int *ssr,*ssc;
+ const unsigned char *rgb;
+
+ // Use the index arrays for the scale RGBimg was decoded at
+ ssr = (Jpeg_rgbimg_denom>1) ? SSrow_j : SSrow;
+ ssc = (Jpeg_rgbimg_denom>1) ? SScol_j : SScol;
+
+ for(prow=0;prow<Prev_nrows;prow++){ 
+    rgbpos=Prev_startrow+Prev_startcol+prow*PreviewWd_stride;
+    mskpos=Prev_mskstart+prow*Prev_mskrowstep;
+    for(pcol=0;pcol<Prev_ncols;pcol++,rgbpos+=3,mskpos+=Prev_mskcolstep){
+       ipos=ssr[prow]+ssc[pcol];
+       rgb=RGBimg+ipos;
+       if(invert){
+         PreviewImg[rgbpos]   = 255-rgb[0]; // R
+         PreviewImg[rgbpos+1] = 255-rgb[1]; // G
+         PreviewImg[rgbpos+2] = 255-rgb[2]; // B
+        } else {
+         PreviewImg[rgbpos]   = rgb[0]; // R
+         PreviewImg[rgbpos+1] = rgb[1]; // G
+         PreviewImg[rgbpos+2] = rgb[2]; // B
+        }
+       if(!masked || PrevStat.MaskIm[mskpos]) prev_stats_add(rgb);
+      }
+   }
+}
+
+static inline __attribute__((always_inline)) void prevk_pixel_rgb(const unsigned short *p, const int invert, const int masked)
+// Colour preview from the formats whose pixels are each got on their own
+// (see prev_pixel_rgb), so scaling up needs nothing special. The stats
+// are of the image before any inversion.
+{
+ int prow,pcol,rgbpos,mskpos;
+ unsigned char rgb[3];
+
+ for(prow=0;prow<Prev_nrows;prow++){ 
+    rgbpos=Prev_startrow+Prev_startcol+prow*PreviewWd_stride;
+    mskpos=Prev_mskstart+prow*Prev_mskrowstep;
+    for(pcol=0;pcol<Prev_ncols;pcol++,rgbpos+=3,mskpos+=Prev_mskcolstep){
+       prev_pixel_rgb(p,SSrow[prow]+SScol[pcol],rgb,rgb+1,rgb+2);
+       if(invert){
+         PreviewImg[rgbpos]   = 255-rgb[0]; // R
+         PreviewImg[rgbpos+1] = 255-rgb[1]; // G
+         PreviewImg[rgbpos+2] = 255-rgb[2]; // B
+        } else {
+         PreviewImg[rgbpos]   = rgb[0]; // R
+         PreviewImg[rgbpos+1] = rgb[1]; // G
+         PreviewImg[rgbpos+2] = rgb[2]; // B
+        }
+       if(!masked || PrevStat.MaskIm[mskpos]) prev_stats_add(rgb);
+      }
+   }
+}
+
+static inline __attribute__((always_inline)) void prevk_yuyv_y(const unsigned short *p, const int invert, const int unused)
+// Y preview from YUYV: just the Y of each sample point, integrated (see
+// preview_integrate) into the red channel of the preview
+{
+ int prow,pcol,rgbpos,mskpos;
+ double dval;
+
+ for(prow=0;prow<Prev_nrows;prow++){ 
+    rgbpos=Prev_startrow+Prev_startcol+prow*PreviewWd_stride;
+    mskpos=Prev_mskstart+prow*Prev_mskrowstep;
+    for(pcol=0;pcol<Prev_ncols;pcol++,rgbpos+=3,mskpos+=Prev_mskcolstep){
+       dval=preview_integrate(mskpos,(unsigned char)(p[SSrow[prow]+SScol[pcol]] & 0xff));
+       PreviewImg[rgbpos] = invert ? 255-uchar_from_d(dval) : uchar_from_d(dval);
+      }
+   }
+}
+
+static inline __attribute__((always_inline)) void prevk_mjpeg_y(const unsigned short *p, const int invert, const int luma)
+// Y preview from the decoded MJPEG frame in RGBimg (p is not used): the
+// decoded luma if that is all there is, otherwise the biggest of R, G
+// and B, integrated (see preview_integrate) into the red channel of the
+// preview
+{
+ int prow,pcol,ipos,rgbpos,mskpos;
+ const int *ssr,*ssc;
+ unsigned char max;
+ double dval;
+
+ // Use the index arrays for the scale RGBimg was decoded at
+ ssr = (Jpeg_rgbimg_denom>1) ? SSrow_j : SSrow;
+ ssc = (Jpeg_rgbimg_denom>1) ? SScol_j : SScol;
+
+ for(prow=0;prow<Prev_nrows;prow++){ 
+    rgbpos=Prev_startrow+Prev_startcol+prow*PreviewWd_stride;
+    mskpos=Prev_mskstart+prow*Prev_mskrowstep;
+    for(pcol=0;pcol<Prev_ncols;pcol++,rgbpos+=3,mskpos+=Prev_mskcolstep){
+       ipos=ssr[prow]+ssc[pcol];
+       if(luma) max=RGBimg[ipos/3]; // Y
+       else {
+         max=(RGBimg[ipos+1]>RGBimg[ipos])?RGBimg[ipos+1]:RGBimg[ipos];
+         if(RGBimg[ipos+2]>=max) max=RGBimg[ipos+2];
         }
+       dval=preview_integrate(mskpos,max);
+       PreviewImg[rgbpos] = invert ? 255-uchar_from_d(dval) : uchar_from_d(dval);
+      }
+   }
+}
+
+static inline __attribute__((always_inline)) void prevk_pixel_y(const unsigned short *p, const int invert, const int unused)
+// Y preview from the formats whose pixels are each got on their own
+// (see prev_pixel_y), integrated (see preview_integrate) into the red
+// channel of the preview
+{
+ int prow,pcol,rgbpos,mskpos;
+ double dval;
+
+ for(prow=0;prow<Prev_nrows;prow++){ 
+    rgbpos=Prev_startrow+Prev_startcol+prow*PreviewWd_stride;
+    mskpos=Prev_mskstart+prow*Prev_mskrowstep;
+    for(pcol=0;pcol<Prev_ncols;pcol++,rgbpos+=3,mskpos+=Prev_mskcolstep){
+       dval=preview_integrate(mskpos,prev_pixel_y(p,SSrow[prow]+SScol[pcol]));
+       PreviewImg[rgbpos] = invert ? 255-uchar_from_d(dval) : uchar_from_d(dval);
+      }
+   }
+}
+
+static inline __attribute__((always_inline)) void prevk_y_out(const unsigned short *p, const int masked, const int show)
+// Finish a Y preview (in the red channel): gather its stats (only under
+// the mask, if used), spread it over R, G and B through the display LUT
+// and, if show, mark the pixels outside the mask (p is not used)
+{
+ int prow,pcol,rgbpos,mskpos;
+ unsigned char uy1;
+
+ for(prow=0;prow<Prev_nrows;prow++){ 
+    rgbpos=Prev_startrow+Prev_startcol+prow*PreviewWd_stride;
+    mskpos=Prev_mskstart+prow*Prev_mskrowstep;
+    for(pcol=0;pcol<Prev_ncols;pcol++,rgbpos+=3,mskpos+=Prev_mskcolstep){
+       uy1=PreviewImg[rgbpos]; // Red channel value
+       if(!masked || PrevStat.MaskIm[mskpos]){
+         if(uy1<=PrevStat.llim_r) PrevStat.lsat_r++;
+         if(uy1>=PrevStat.ulim_r) PrevStat.usat_r++;
+         if(uy1>PrevStat.max_r) PrevStat.max_r=uy1;
+         if(uy1<PrevStat.min_r) PrevStat.min_r=uy1;
+         PrevStat.hgm_r[uy1]++;
+         PrevStat.intgl_r+=(double)uy1;
+        }
+       // Implement the display LUT
+       PreviewImg[rgbpos]  =PrevStat.rlut[uy1];
+       PreviewImg[rgbpos+1]=PrevStat.glut[uy1];
+       PreviewImg[rgbpos+2]=PrevStat.blut[uy1];
+       // Display mask if required
+       if(show && !PrevStat.MaskIm[mskpos]) PreviewImg[rgbpos+1]=128;
+      }
+   }
+}
+
+static inline __attribute__((always_inline)) void prevk_rgb_out(const unsigned short *p, const int lut, const int show)
+// Finish a colour preview: put it through the display LUT, if lut, and,
+// if show, mark the pixels outside the mask (p is not used)
+{
+ int prow,pcol,rgbpos,mskpos;
+
+ if(!lut && !show) return;
+ for(prow=0;prow<Prev_nrows;prow++){ 
+    rgbpos=Prev_startrow+Prev_startcol+prow*PreviewWd_stride;
+    mskpos=Prev_mskstart+prow*Prev_mskrowstep;
+    for(pcol=0;pcol<Prev_ncols;pcol++,rgbpos+=3,mskpos+=Prev_mskcolstep){
+       if(lut){ // Implement the display LUT
+         PreviewImg[rgbpos]  = PrevStat.rlut[PreviewImg[rgbpos]];   // R
+         PreviewImg[rgbpos+1]= PrevStat.glut[PreviewImg[rgbpos+1]]; // G
+         PreviewImg[rgbpos+2]= PrevStat.blut[PreviewImg[rgbpos+2]]; // B
+        }
+       // Display mask if required
+       if(show && !PrevStat.MaskIm[mskpos]) PreviewImg[rgbpos+1]=128;
+      }
+   }
+}
+
+// Make the 4 variants of preview kernel k, for its two settings being 0
+// or 1, and the table of them, kernel_tab[2*setting1+setting2]
+#define PREVK_VARIANTS(k) \
+ static void k##_00(const unsigned short *p){ k(p,0,0); } \
+ static void k##_01(const unsigned short *p){ k(p,0,1); } \
+ static void k##_10(const unsigned short *p){ k(p,1,0); } \
+ static void k##_11(const unsigned short *p){ k(p,1,1); } \
+ static void (*const k##_tab[4])(const unsigned short *) = {k##_00, k##_01, k##_10, k##_11};
+// The same for a kernel with only one setting
+#define PREVK_VARIANTS1(k) \
+ static void k##_0(const unsigned short *p){ k(p,0,0); } \
+ static void k##_1(const unsigned short *p){ k(p,1,0); } \
+ static void (*const k##_tab[2])(const unsigned short *) = {k##_0, k##_1};
+
+PREVK_VARIANTS(prevk_yuyv_pairs)
+PREVK_VARIANTS(prevk_yuyv_up)
+PREVK_VARIANTS(prevk_mjpeg_rgb)
+PREVK_VARIANTS(prevk_pixel_rgb)
+PREVK_VARIANTS1(prevk_yuyv_y)
+PREVK_VARIANTS(prevk_mjpeg_y)
+PREVK_VARIANTS1(prevk_pixel_y)
+PREVK_VARIANTS(prevk_y_out)
+PREVK_VARIANTS(prevk_rgb_out)
+
+static int colour_convert(const unsigned short *p)
+// This function converts the raw data from the frame grabber buffer p
+// (which will be in YUYV format) or from the JPEG frame grabber buffer
+// that will have been previously decoded into the global RGBimg buffer,
+// into a format that can be more easily manipulated in this program
+// (e.g. for frame averaging, saving or generating a preview image).
+{
+ double mn_r,mn_g,mn_b;
+ int ipos,inv,msk;
+ struct band_job job;
+ unsigned char bval=3; // 3 is used as a placeholder - if it gets changed then
+                       // we know some pre-processing has been done and boundary
+                       // pixel setting must be performed.
+ 
         
-    break;
-    default: break;
-      
+ if(Need_to_preview==PREVIEW_ON){// We need a preview image only, not
+                                 // a full-frame conversion.
+                                 
+    if(Preview_impossible) return 0; // No point continuing but return
+                                     // without error because there was
+                                     // no problem in this function.
+
+     // Let the preview display timeout function know we are making a preview
+     // image so it doesn't try to update it again till this one is ready.
+     // This flag will be reset back to zero at the end of all preview image
+     // modifications (such as adding histogram and focus bar overlays) in the
+     // function 'process_image' (which calls this function).
+     Preparing_preview=1;
+
+     // Some initialisations
+     PrevStat.usat_r=PrevStat.lsat_r=0;
+     PrevStat.usat_g=PrevStat.lsat_g=0;
+     PrevStat.usat_b=PrevStat.lsat_b=0;
+     PrevStat.max_r=PrevStat.max_g=PrevStat.max_b=0;
+     PrevStat.min_r=PrevStat.min_g=PrevStat.min_b=255;
+     PrevStat.intgl_r=PrevStat.intgl_g=PrevStat.intgl_b=0.0;
+     PrevStat.af_laplace_r=0.0;
+     PrevStat.af_laplace_g=0.0;
+     PrevStat.af_laplace_b=0.0;
+
+     memset(PrevStat.hgm_r, 0, 256*sizeof(unsigned int));
+     memset(PrevStat.hgm_g, 0, 256*sizeof(unsigned int));
+     memset(PrevStat.hgm_b, 0, 256*sizeof(unsigned int));
+         
+    // Now make the colour or greyscale preview image from the full-size
+    // image with the preview kernel for the format and current settings
+    inv = (PrevStat.pp_invert!=0);
+    msk = (PrevStat.mask_status!=0);
+    if(col_conv_type==CCOL_TO_Y && PreviewIDX>=Preview_integral) PreviewIDX=0;
+    switch(CamFormat){
+        case V4L2_PIX_FMT_YUYV:
+         switch(col_conv_type){
+          case CCOL_TO_Y:    // Just extract the Y component (a fast op)
+               prevk_yuyv_y_tab[inv](p);
+               PreviewIDX++;
+               preview_stored = PREVIEW_STORED_MONO;
+          break;
+          case CCOL_TO_RGB:  // Convert to full RGB
+          case CCOL_TO_BGR:  // Convert to full RGB (for preview)
+               // If the preview is scaling UP the original image
+               // instead of scaling it down to a smaller size
+               // we need to convert a full row of the original and then
+               // then up-scale that (because YUYV pixels contain
+               // overlapping colour information)
+               if(Prev_scaledim<1.0) prevk_yuyv_up_tab[2*inv+msk](p);
+               else prevk_yuyv_pairs_tab[2*inv+msk](p);
+               preview_stored = PREVIEW_STORED_RGB;
+          break;
+          default: break;
+          }
+        break;
+        case V4L2_PIX_FMT_MJPEG:
+         // A scaled decode made before the preview settings changed does
+         // not fit the index arrays now, so leave the preview as it is.
+         if(Jpeg_rgbimg_denom>1 && (Jpeg_rgbimg_denom!=Jpeg_prev_denom || Jpeg_rgbimg_wd!=Jpeg_prev_wd)) break;
+         switch(col_conv_type){
+          case CCOL_TO_Y:    // Calculate the Y component from RGB
+               prevk_mjpeg_y_tab[2*inv+(Jpeg_luma_rgbimg!=0)](p);
+               PreviewIDX++;
+               preview_stored = PREVIEW_STORED_MONO;
+          break;
+          case CCOL_TO_RGB:  // Convert to full RGB
+          case CCOL_TO_BGR:  // Convert to full RGB (for preview)
+               prevk_mjpeg_rgb_tab[2*inv+msk](p);
+               preview_stored = PREVIEW_STORED_RGB;
+          break;
+          default: break;
+          }
+        break;
+        case V4L2_PIX_FMT_GREY:
+        case V4L2_PIX_FMT_Y10:
+        case V4L2_PIX_FMT_Y12:
+        case V4L2_PIX_FMT_Y16:
+        case V4L2_PIX_FMT_NV12:
+        case V4L2_PIX_FMT_SRGGB8:
+        case V4L2_PIX_FMT_SGRBG8:
+        case V4L2_PIX_FMT_SGBRG8:
+        case V4L2_PIX_FMT_SBGGR8:
+        case V4L2_PIX_FMT_SRGGB10:
+        case V4L2_PIX_FMT_SGRBG10:
+        case V4L2_PIX_FMT_SGBRG10:
+        case V4L2_PIX_FMT_SBGGR10:
+         switch(col_conv_type){
+          case CCOL_TO_Y:    // Just take the Y
+               prevk_pixel_y_tab[inv](p);
+               PreviewIDX++;
+               preview_stored = PREVIEW_STORED_MONO;
+          break;
+          case CCOL_TO_RGB:  // Convert to full RGB
+          case CCOL_TO_BGR:  // Convert to full RGB (for preview)
+               prevk_pixel_rgb_tab[2*inv+msk](p);
+               preview_stored = PREVIEW_STORED_RGB;
+          break;
+          default: break;
+          }
+        break;
+        default: break;
+        }
+
+    // Do any requested pre- and post-processes  
+
+   
+    switch(col_conv_type){
+       case CCOL_TO_Y:
+
+          // Perform any user-requested pre-processing: 
+ 
+          // Make a Laplacian image if that is requested
+          if(PrevStat.pp_laplace){ PrevStat.af_laplace_r=Prev_Laplace(CCHAN_Y); bval=0;}
+          // Otherwise just calculate the mean absolute Laplacian if chosen
+          else if(PrevStat.focuser_param_varabslap || PrevStat.focuser_param_abslap){
+               PrevStat.af_laplace_r=Prev_Laplace(CCHAN_R);
+            }
+          // If a convolution was done, set the border pixels to the required
+          // value:
+          if(bval!=3) set_border_pixels(bval);
+          // Gather stats and distribute the red channel to G and B according to
+          // the current LUT
+          prevk_y_out_tab[2*msk+(PrevStat.mask_show!=0)](p);
+       break;
+       case CCOL_TO_RGB:
+       case CCOL_TO_BGR:
+
+          // Colour preview dark field subtraction
+          if(PrevCD_Perform==MASK_YES){
+
+             for(ipos=0;ipos<PreviewImg_rgb_size;ipos++){
+                 if(Preview_ColDark[ipos]>PreviewImg[ipos])PreviewImg[ipos]=0;
+                 else PreviewImg[ipos]-=Preview_ColDark[ipos];
+                }
+
+            } 
+
+          // Stats
+          if(PrevStat.focuser_param_varabslap || PrevStat.focuser_param_abslap){
+            switch(Prev_overlay_focus){
+              case CCHAN_R:
+                 PrevStat.af_laplace_r=Prev_Laplace(CCHAN_R);
+              break;
+              case CCHAN_G:
+                PrevStat.af_laplace_g=Prev_Laplace(CCHAN_G);
+              break;
+              case CCHAN_B:
+                PrevStat.af_laplace_b=Prev_Laplace(CCHAN_B);
+              break;
+              case CCHAN_Y: // 'Y' means all channels in this setting
+                 PrevStat.af_laplace_r=Prev_Laplace(CCHAN_R);
+                 PrevStat.af_laplace_g=Prev_Laplace(CCHAN_G);
+                 PrevStat.af_laplace_b=Prev_Laplace(CCHAN_B);
+              break;
+              default: // Focusser bar overlay not requested
+              break;
+            }
+           }
+
+          // Now implement the current preview display LUT and mask as required
+          prevk_rgb_out_tab[2*(Preview_LUT!=0)+(PrevStat.mask_show!=0)](p);
+
+       break;
+       default: break;
+     }
+
+      return 0; // Preview image created, so return.
    }
 
+ // Anything more than PREVIEW_ON requires a full size conversion. This
+ // is done in a single pass over the frame (band_frame) in row bands on
+ // all cores (see run_bands).
+ if(camfmt_index(CamFormat)<0) return 0;
+ memset(&job, 0, sizeof(job));
+ job.p = p;
+ job.dark = do_df_correction;
+ job.flat = do_ff_correction;
+ job.k[0] = job.k[1] = job.k[2] = 1.0;
+
+ // If we are doing multiframe averaging the frame goes straight into
+ // the average stores. Otherwise it goes into the Frm frame stores,
+ // from which the file writers take it (clipping each value into the
+ // range [0-255] as they go - see iv_row).
+ job.accumulate = (Av_limit>1 && Accumulator_status==ACC_ALLOCED);
+
+ // An MJPEG frame that failed to decode (RGBimg then holds whatever was
+ // there before) or was decoded differently from the rest of the
+ // average (Av_luma, which sized the stores) is left out of it.
+ if(job.accumulate && CamFormat==V4L2_PIX_FMT_MJPEG &&
+    (!Jpeg_rgbimg_ok || Jpeg_luma_rgbimg!=Av_luma)){
+   show_message("Frame left out of the average as it could not be decoded.","Warning: ",MT_ERR,0);
+   return 0;
   }
 
- // If we are doing multiframe averaging, do any mean scaling and then
- // accumulate the values in the average stores. 
- if(Av_limit>1 && Accumulator_status==ACC_ALLOCED){
+ // An average with nothing to correct or scale just adds up the 8-bit
+ // samples of each frame (see Avi)
+ if(job.accumulate && Avi_active){
+   run_bands(band_accumulate_int, &job);
+   Av_added++;
+   return 0;
+  }
 
  // Scale the mean of each frame to the same value as the mean of the
- // very first frame (if the user asked for this):
- if(Av_scalemean){
-  
-    // If we are at the very first frame just copy its mean into the
-    // global variables:
-    if(Av_denom_idx==1){  
-      Av_meanr = mn_r;
-      Av_meang = mn_g;
-      Av_meanb = mn_b;
-     } else {
-     // For all subsequent frames calculate the scale factor and do the
-     // the scaling.
+ // very first frame added (if the user asked for this). The means are
+ // those of the frames before any dark or flat field correction, and
+ // for all but the first frame they are needed before the pass that
+ // does the scaling, so get them first with a pass that only reads the
+ // frame:
+ if(job.accumulate && Av_scalemean && Av_added>0){
+ 
+     run_bands(band_sums, &job);
+     band_means(&mn_r, &mn_g, &mn_b);
+     mn_r/=Mask_supp_size;
+     mn_g/=Mask_supp_size;
+     mn_b/=Mask_supp_size;
 
      // First check to avoid divide-by-zero). For practcal reasons I use
      // a small number instead of absolute zero and I use 1.0e-10. This
@@ -7096,134 +9398,632 @@ static int colour_convert(const unsigned short *p)
           default: break;
         }
 
+      job.scale = 1;
+      job.k[0]=Av_meanr/mn_r;
+      job.k[1]=Av_meang/mn_g;
+      job.k[2]=Av_meanb/mn_b;
+   }
 
-      switch(CamFormat){
-       
-       case V4L2_PIX_FMT_YUYV:
-       case V4L2_PIX_FMT_MJPEG:
-   
-         switch(col_conv_type){
-           case CCOL_TO_Y:
-              r=Av_meanr/mn_r;
-              for(ipos=0;ipos<ImSize;ipos++){
-                 // Only correct within the support of the mask
-                 if(MaskIm[ipos]>0) Frmr[ipos] *= r;
-                }
-           break;
-           case CCOL_TO_RGB: 
-           case CCOL_TO_BGR:
-              r=Av_meanr/mn_r;
-              g=Av_meang/mn_g;
-              b=Av_meanb/mn_b;
-              for(ipos=0;ipos<ImSize;ipos++){ 
-                 // Only correct within the support of the mask
-                 if(MaskIm[ipos]>0){
-                    Frmr[ipos] *= r;
-                    Frmg[ipos] *= g;
-                    Frmb[ipos] *= b;
-                   }
-               }
-           break;
-           default: break;
-         }
-        
-       break;
-       default: break;
-      
-      }
+ // Now convert, correct, scale and accumulate or store the frame 
+ run_bands(band_frame, &job);
+
+ // If we are at the very first frame of a mean scaled average just
+ // copy its mean (worked out in the pass above) into the global
+ // variables:
+ if(job.accumulate && Av_scalemean && Av_added==0){
+    band_means(&mn_r, &mn_g, &mn_b);
+    Av_meanr = mn_r/Mask_supp_size;
+    Av_meang = mn_g/Mask_supp_size;
+    Av_meanb = mn_b/Mask_supp_size;
+   }
+ if(job.accumulate) Av_added++;
+ 
+ return 0; // success   
+}
 
+static int next_windex(void)
+{
+  windex++;
+  if(windex==MAX_CAM_SETTINGS){
+     show_message("There are too many settings to display them all!","Error: ",MT_ERR,1);
+     return 1;
+    }
+ return 0; 
+}
+
+//\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\////////////////////////////////////
+ //                                                                  // 
+  //                  VIRTUAL FRAME SOURCES                         //
+   //                                                              //
+    //\\\\\\\\\\\\\\\\\\\\\\\\\\\\\\////////////////////////////////
+
+// A virtual source stands in for the camera as a V4L2 device that only
+// does read i/o. The device fd is a timerfd ticking at Vsrc_rate so the
+// capture thread can select() on it as usual, each read() hands over
+// the next frame and the few ioctls the program uses are answered by
+// vsrc_ioctl(). Everything downstream (process_image() and so on) sees
+// ordinary YUYV or MJPEG frames.
+
+static FILE *vsrc_open_file(int idx)
+// Open replay file number idx (ignored unless Vsrc_file is a pattern)
+{
+ char fname[PATH_MAX+32];
 
+ if(Vsrc_numbered) snprintf(fname,sizeof(fname),Vsrc_file,idx);
+  else snprintf(fname,sizeof(fname),"%s",Vsrc_file);
+ return fopen(fname,"rb");
+}
+
+static int vsrc_next_file(void)
+// Move the replay on to the start of the next file, going back to the
+// first one (or the start of the only one) at the end.
+// Returns 0 on success, 1 if there is nothing left to read.
+{
+ if(!Vsrc_numbered){
+    rewind(Vsrc_fp);
+    return 0;
+   }
+ fclose(Vsrc_fp);
+ Vsrc_file_idx++;
+ Vsrc_fp = vsrc_open_file(Vsrc_file_idx);
+ if(Vsrc_fp != NULL) return 0;
+ Vsrc_file_idx = Vsrc_first_idx;
+ Vsrc_fp = vsrc_open_file(Vsrc_file_idx);
+ return (Vsrc_fp == NULL);
+}
+
+static long vsrc_read_mjpeg(FILE *fp, unsigned char *dst, size_t max)
+// Copy the next JPEG image (SOI to EOI marker) in fp to dst.
+// Returns its length, 0 at the end of the file or -1 if it would not
+// fit in max bytes (in which case it is skipped).
+{
+ int c,prev;
+ size_t n;
+
+ // Find the start of image marker
+ prev = 0;
+ while((c = getc(fp)) != EOF){
+      if(prev == 0xFF && c == 0xD8) break;
+      prev = c;
      }
+ if(c == EOF) return 0;
+ dst[0] = 0xFF; dst[1] = 0xD8;
+ n = 2; prev = 0;
+ // Copy up to and including the end of image marker. A 0xFF byte in
+ // the entropy coded data is always stuffed with 0x00 so this can not
+ // be fooled by the image data.
+ while((c = getc(fp)) != EOF){
+      if(n < max) dst[n] = (unsigned char)c;
+      n++;
+      if(prev == 0xFF && c == 0xD9) break;
+      prev = c;
+     }
+ if(c == EOF) return 0; // A partial last frame
+ if(n > max) return -1;
+ return (long)n;
+}
+
+static int vsrc_jpeg_size(const unsigned char *p, size_t len, unsigned int *wd, unsigned int *ht)
+// Get the image size from the start of frame marker of a JPEG image.
+// Returns 0 on success, 1 if there was no such marker.
+{
+ size_t pos;
+
+ pos = 2;
+ while(pos + 9 < len){
+      if(p[pos] != 0xFF){ pos++; continue; }
+      // SOF0 to SOF15 except DHT (C4), JPG (C8) and DAC (CC)
+      if(p[pos+1] >= 0xC0 && p[pos+1] <= 0xCF &&
+         p[pos+1] != 0xC4 && p[pos+1] != 0xC8 && p[pos+1] != 0xCC){
+         *ht = ((unsigned int)p[pos+5] << 8) | p[pos+6];
+         *wd = ((unsigned int)p[pos+7] << 8) | p[pos+8];
+         return 0;
+        }
+      if(p[pos+1] == 0xFF || p[pos+1] == 0x00 || p[pos+1] == 0x01 ||
+        (p[pos+1] >= 0xD0 && p[pos+1] <= 0xD9)){ pos++; continue; } // No length field
+      pos += 2 + (((size_t)p[pos+2] << 8) | p[pos+3]);
+     }
+ return 1;
+}
 
+int vsrc_parse_spec(const char *spec)
+// Set up the virtual frame source selected by the -s command line
+// argument spec. It takes one of these forms:
+//
+//   synth[:WxH][:FPS]        A test pattern, W x H (default 640 x 480)
+//                            at FPS frames/s (default 30) in whichever
+//                            of YUYV and MJPEG is selected.
+//   replay:FILE[:WxH][:FPS]  Replay the frames in FILE, going back to
+//                            the start at the end.
+//
+// FILE may hold any number of YUYV frames (e.g. the *_yuyv.raw images
+// saved in the 'YUYV' format) or concatenated MJPEG frames. If it has a
+// %d conversion in it (e.g. shot_%04d_yuyv.raw) then the numbered files
+// are replayed in turn. The format is found from the first frame as is
+// the size of MJPEG frames. YUYV frames need WxH to be given.
+// This is called before the GUI is up so errors go to stderr.
+// Returns 0 on success, 1 on error.
+{
+ char buf[PATH_MAX],*field,*pc;
+ unsigned char *frame;
+ unsigned int wd,ht,jwd,jht;
+ double rate;
+ int c1,c2,idx,nfld;
+ long len;
+ char ch;
+
+ if(strlen(spec) >= PATH_MAX){
+   fprintf(stderr,"\nFrame source specification is too long\n");
+   return 1;
   }
+ sprintf(buf,"%s",spec);
+ sprintf(Vsrc_spec,"%s",spec);
+ wd = ht = 0; rate = 30.0;
+
+ // Take the optional size and rate fields off the end
+ for(nfld = 0; nfld < 2; nfld++){
+    field = strrchr(buf,':');
+    if(field == NULL) break;
+    if(sscanf(field+1,"%ux%u%c",&jwd,&jht,&ch) == 2){
+      wd = jwd; ht = jht;
+     } else if(sscanf(field+1,"%lf%c",&rate,&ch) != 1) break;
+    *field = '\0';
+   }
+ if(rate <= 0.0 || rate > 1000.0){
+   fprintf(stderr,"\nFrame source rate must be more than 0 and no more than 1000 per second\n");
+   return 1;
+  }
+ Vsrc_rate = rate;
 
- // Now accumulate the frame into the average buffer
-   switch(CamFormat){
-       
-    case V4L2_PIX_FMT_YUYV:
-    case V4L2_PIX_FMT_MJPEG:
-   
-      switch(col_conv_type){
-        case CCOL_TO_Y:
-              for(ipos=0;ipos<ImSize;ipos++) Avr[ipos] += Frmr[ipos];
-          break;
-        case CCOL_TO_RGB: 
-        case CCOL_TO_BGR:
-              for(ipos=0;ipos<ImSize;ipos++){ 
-                    Avr[ipos] += Frmr[ipos];
-                    Avg[ipos] += Frmg[ipos];
-                    Avb[ipos] += Frmb[ipos];
-               }
-            break;
-          default: break;
-        }
-        
-    break;
-    default: break;
-      
+ if(!strcmp(buf,"synth")){
+   if(wd == 0){ wd = 640; ht = 480; }
+   if(wd < 16 || ht < 16 || wd > VSRC_MAXDIM || ht > VSRC_MAXDIM || (wd & 1)){
+     fprintf(stderr,"\nSynthetic frame size must be 16 to %d pixels each way with an even width\n",VSRC_MAXDIM);
+     return 1;
+    }
+   Vsrc_wd = wd; Vsrc_ht = ht;
+   Vsrc_type = VSRC_SYNTH;
+   return 0;
+  }
+
+ if(strncmp(buf,"replay:",7) || buf[7] == '\0'){
+   fprintf(stderr,"\nUnrecognised frame source: %s\n",spec);
+   return 1;
+  }
+ sprintf(Vsrc_file,"%s",buf+7);
+
+ // Only a single %d (with flags and width) is allowed in the file name
+ // as it is used as a printf format.
+ Vsrc_numbered = 0;
+ for(pc = Vsrc_file; *pc; pc++){
+    if(*pc != '%') continue;
+    if(*(pc+1) == '%'){ pc++; continue; }
+    pc++;
+    while(*pc == '0' || *pc == '-' || *pc == '+' || *pc == ' ' || isdigit((unsigned char)*pc)) pc++;
+    if(*pc != 'd' || Vsrc_numbered){
+      fprintf(stderr,"\nReplay file name can only have one %%d conversion: %s\n",Vsrc_file);
+      return 1;
+     }
+    Vsrc_numbered = 1;
    }
+ // Find the first numbered file
+ Vsrc_first_idx = 0;
+ if(Vsrc_numbered){
+   for(idx = 0; idx < 10000; idx++){
+      Vsrc_fp = vsrc_open_file(idx);
+      if(Vsrc_fp != NULL) break;
+     }
+   Vsrc_first_idx = idx;
+  } else Vsrc_fp = vsrc_open_file(0);
+ if(Vsrc_fp == NULL){
+   fprintf(stderr,"\nCannot open replay file %s\n",Vsrc_file);
+   return 1;
+  }
 
+ // Find the format from the first two bytes
+ c1 = getc(Vsrc_fp); c2 = getc(Vsrc_fp);
+ rewind(Vsrc_fp);
+ if(c1 == 0xFF && c2 == 0xD8){
+   Vsrc_fmt = V4L2_PIX_FMT_MJPEG;
+   frame = (unsigned char *)malloc(VSRC_PROBE_SIZE);
+   if(frame == NULL){
+     fprintf(stderr,"\nNo RAM to read the first replay frame\n");
+     goto fail;
+    }
+   len = vsrc_read_mjpeg(Vsrc_fp, frame, VSRC_PROBE_SIZE);
+   if(len <= 0 || vsrc_jpeg_size(frame,(size_t)len,&jwd,&jht)){
+     free(frame);
+     fprintf(stderr,"\nNo usable JPEG frame at the start of %s\n",Vsrc_file);
+     goto fail;
+    }
+   free(frame);
+   rewind(Vsrc_fp);
+   if(wd && (wd != jwd || ht != jht)){
+     fprintf(stderr,"\nReplay frames are %u x %u not %u x %u\n",jwd,jht,wd,ht);
+     goto fail;
+    }
+   wd = jwd; ht = jht;
+  } else {
+   Vsrc_fmt = V4L2_PIX_FMT_YUYV;
+   if(wd == 0){
+     fprintf(stderr,"\nThe frame size (WxH) must be given to replay YUYV frames\n");
+     goto fail;
+    }
+  }
+ if(wd < 2 || ht < 1 || wd > VSRC_MAXDIM || ht > VSRC_MAXDIM || (wd & 1)){
+   fprintf(stderr,"\nReplay frame size %u x %u is not usable\n",wd,ht);
+   goto fail;
+  }
+ fclose(Vsrc_fp); Vsrc_fp = NULL; // vsrc_open() opens it again
+ Vsrc_wd = wd; Vsrc_ht = ht;
+ Vsrc_type = VSRC_REPLAY;
+ return 0;
 
- } else {
- // If we are NOT doing multiframe averging, ensure the Frm frame store
- // image is placed into the RGBim unsigned char array ready for output
- // with suitable clipping into the range [0-255] for each colour
- // channel.
-     
-   switch(CamFormat){
-       
-    case V4L2_PIX_FMT_YUYV:
-    case V4L2_PIX_FMT_MJPEG:
-    
-     switch(col_conv_type){
-        case CCOL_TO_Y:
-              for(ipos=0;ipos<ImSize;ipos++){ 
-                  RGBimg[ipos] = uchar_from_d(Frmr[ipos]);
-                 }
-          break;
-        case CCOL_TO_RGB :  // Convert to full RGB
-              rgbpos=0; 
-              for(ipos=0;ipos<ImSize;ipos++){ 
-                  RGBimg[rgbpos++] = uchar_from_d(Frmr[ipos]);
-                  RGBimg[rgbpos++] = uchar_from_d(Frmg[ipos]);
-                  RGBimg[rgbpos++] = uchar_from_d(Frmb[ipos]);
-               }
-            break;
-        case CCOL_TO_BGR:  // Convert to full RGB for saving as BMP file
-              rgbpos=0; 
-              for(ipos=0;ipos<ImSize;ipos++){ 
-                  RGBimg[rgbpos++] = uchar_from_d(Frmb[ipos]);
-                  RGBimg[rgbpos++] = uchar_from_d(Frmg[ipos]);
-                  RGBimg[rgbpos++] = uchar_from_d(Frmr[ipos]);
-               }
-            break;
-          default: break;
+fail:
+ fclose(Vsrc_fp); Vsrc_fp = NULL;
+ return 1;
+}
+
+static void vsrc_box(int phase, unsigned int *bs, unsigned int *bx, unsigned int *by)
+// Size and position of the white box that steps across the test
+// pattern from frame to frame (so stale or repeated frames show up).
+{
+ unsigned int w,h;
+
+ w = Vsrc_cur_wd; h = Vsrc_cur_ht;
+ *bs = ((w < h ? w : h) / 8) & ~1u;
+ *bx = ((unsigned int)phase * (w - *bs) / (VSRC_PHASES - 1)) & ~1u;
+ *by = (h - *bs) / 2;
+}
+
+static void vsrc_pattern_rgb(unsigned int x, unsigned int y, int phase, unsigned char *rgb)
+// The RGB test pattern pixel at x,y: eight 75% colour bars over a grey
+// ramp with the box for the given phase (no box if phase < 0).
+{
+ static const unsigned char bars[8][3] = {{191,191,191},{191,191,0},{0,191,191},{0,191,0},
+                                         {191,0,191},{191,0,0},{0,0,191},{0,0,0}};
+ unsigned int bs,bx,by;
+
+ if(phase >= 0){
+   vsrc_box(phase,&bs,&bx,&by);
+   if(x >= bx && x < bx+bs && y >= by && y < by+bs){
+     rgb[0] = rgb[1] = rgb[2] = 255;
+     return;
+    }
+  }
+ if(y < 2*Vsrc_cur_ht/3){
+   memcpy(rgb, bars[8*x/Vsrc_cur_wd], 3);
+   return;
+  }
+ rgb[0] = rgb[1] = rgb[2] = (unsigned char)(255*x/(Vsrc_cur_wd-1));
+}
+
+static void vsrc_free_pattern(void)
+// Free the test pattern frames
+{
+ int phase;
+
+ if(Vsrc_bg != NULL){ free(Vsrc_bg); Vsrc_bg = NULL; }
+ for(phase = 0; phase < VSRC_PHASES; phase++){
+    if(Vsrc_jpg[phase] != NULL){ free(Vsrc_jpg[phase]); Vsrc_jpg[phase] = NULL; }
+    Vsrc_jpgsz[phase] = 0;
+   }
+}
+
+static int vsrc_prepare(void)
+// Make the test pattern for the current format and size. The YUYV one
+// is drawn without the box (that is added to each frame as it goes) and
+// the MJPEG ones are compressed once for each box position so that the
+// frame rate is not limited by the time taken to encode them.
+// This runs in the capture thread. Returns 0 on success, 1 on error.
+{
+ struct jpeg_compress_struct info;
+ struct my_error_mgr err;
+ unsigned char *row = NULL;
+ unsigned char rgb0[3],rgb1[3];
+ unsigned char *p;
+ unsigned int x,y,w,h;
+ double r,g,b;
+ volatile int phase;
+
+ vsrc_free_pattern();
+ if(Vsrc_type != VSRC_SYNTH){
+   Vsrc_ready = 1;
+   return 0;
+  }
+ w = Vsrc_cur_wd; h = Vsrc_cur_ht;
+
+ if(Vsrc_cur_fmt == V4L2_PIX_FMT_YUYV){
+   Vsrc_bg = (unsigned char *)malloc((size_t)w*h*2);
+   if(Vsrc_bg == NULL) return 1;
+   p = Vsrc_bg;
+   for(y = 0; y < h; y++)
+      for(x = 0; x < w; x += 2){
+         // BT.601 studio range, the chroma from the mean of the pair
+         vsrc_pattern_rgb(x,y,-1,rgb0);
+         vsrc_pattern_rgb(x+1,y,-1,rgb1);
+         *p++ = (unsigned char)(16.5 + 0.257*rgb0[0] + 0.504*rgb0[1] + 0.098*rgb0[2]);
+         r = 0.5*(rgb0[0]+rgb1[0]); g = 0.5*(rgb0[1]+rgb1[1]); b = 0.5*(rgb0[2]+rgb1[2]);
+         *p++ = (unsigned char)(128.5 - 0.148*r - 0.291*g + 0.439*b);
+         *p++ = (unsigned char)(16.5 + 0.257*rgb1[0] + 0.504*rgb1[1] + 0.098*rgb1[2]);
+         *p++ = (unsigned char)(128.5 + 0.439*r - 0.368*g - 0.071*b);
         }
-        
-    break;
-    default: break;
-      
+   Vsrc_ready = 1;
+   return 0;
+  }
+
+ row = (unsigned char *)malloc((size_t)w*3);
+ if(row == NULL) return 1;
+ info.err = jpeg_std_error(&err.pub);
+ err.pub.error_exit = my_error_exit;
+ if(setjmp(err.setjmp_buffer)){
+   jpeg_destroy_compress(&info);
+   free(row);
+   vsrc_free_pattern();
+   return 1;
+  }
+ jpeg_create_compress(&info);
+ for(phase = 0; phase < VSRC_PHASES; phase++){
+    jpeg_mem_dest(&info, &Vsrc_jpg[phase], &Vsrc_jpgsz[phase]);
+    info.image_width = (JDIMENSION)w;
+    info.image_height = (JDIMENSION)h;
+    info.input_components = 3;
+    info.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&info);
+    jpeg_set_quality(&info, 85, TRUE);
+    jpeg_start_compress(&info, TRUE);
+    while(info.next_scanline < info.image_height){
+        for(x = 0; x < w; x++) vsrc_pattern_rgb(x,info.next_scanline,phase,row+3*x);
+        jpeg_write_scanlines(&info, &row, 1);
+       }
+    jpeg_finish_compress(&info);
    }
+ jpeg_destroy_compress(&info);
+ free(row);
+ Vsrc_ready = 1;
+ return 0;
+}
+
+static ssize_t vsrc_replay_frame(void *start, size_t length)
+// Read the next recorded frame into start. A file with no usable frame
+// in it at all ends the replay.
+// Returns the frame size or -1 with errno set.
+{
+ size_t fsize;
+ long len;
+ int nfiles;
+
+ fsize = (size_t)Vsrc_wd*Vsrc_ht*2;
+ nfiles = 0;
+ FOREVER {
+    if(Vsrc_fmt == V4L2_PIX_FMT_MJPEG){
+       len = vsrc_read_mjpeg(Vsrc_fp, (unsigned char *)start, length);
+       if(len > 0) return (ssize_t)len;
+       if(len < 0) continue; // Too big for the buffer - skip it
+      } else {
+       if(fsize > length){ errno = ENOSPC; return -1; }
+       if(fread(start, 1, fsize, Vsrc_fp) == fsize) return (ssize_t)fsize;
+      }
+    if(++nfiles > 1 || vsrc_next_file()){
+       errno = EIO;
+       return -1;
+      }
+   }
+}
+
+static ssize_t vsrc_read(void *start, size_t length, unsigned int *vseq)
+// The read() of a virtual source. The capture thread calls this when fd
+// is readable (i.e. a frame period has ended). The frame goes in start
+// (length bytes) and its sequence number in vseq. That counts frame
+// periods so a reader that falls behind sees a gap in the sequence, and
+// a replay skips the frames it missed, just as with a real camera.
+// Returns the frame size or -1 with errno set (EAGAIN if not yet time).
+{
+ unsigned long long ticks;
+ unsigned int bs,bx,by,row,col;
+ unsigned char *p;
+ size_t fsize;
+ ssize_t nread;
+ int phase;
+
+ if(read(fd, &ticks, sizeof(ticks)) != (ssize_t)sizeof(ticks)) return -1;
+ Vsrc_ticks += ticks;
+ *vseq = (unsigned int)Vsrc_ticks;
+ if(!Vsrc_ready && vsrc_prepare()){
+   errno = ENOMEM;
+   return -1;
+  }
+
+ if(Vsrc_type == VSRC_REPLAY){
+   nread = -1;
+   while(ticks--) if((nread = vsrc_replay_frame(start, length)) < 0) break;
+   return nread;
+  }
+
+ phase = (int)(Vsrc_ticks % VSRC_PHASES);
+ if(Vsrc_cur_fmt == V4L2_PIX_FMT_MJPEG){
+   if(Vsrc_jpgsz[phase] > length){ errno = ENOSPC; return -1; }
+   memcpy(start, Vsrc_jpg[phase], Vsrc_jpgsz[phase]);
+   return (ssize_t)Vsrc_jpgsz[phase];
+  }
+ fsize = (size_t)Vsrc_cur_wd*Vsrc_cur_ht*2;
+ if(fsize > length){ errno = ENOSPC; return -1; }
+ memcpy(start, Vsrc_bg, fsize);
+ vsrc_box(phase,&bs,&bx,&by);
+ for(row = by; row < by+bs; row++){
+    p = (unsigned char *)start + ((size_t)row*Vsrc_cur_wd + bx)*2;
+    for(col = 0; col < bs; col += 2){ *p++ = 235; *p++ = 128; *p++ = 235; *p++ = 128; }
+   }
+ return (ssize_t)fsize;
+}
+
+static int vsrc_ioctl(int request, void *arg)
+// Answer the V4L2 ioctls that this program uses as a read i/o capture
+// device with no controls would. A test pattern can be any size (the
+// usual ones are listed along with the one given with -s) in YUYV or
+// MJPEG format but a replay only has its recorded format and size.
+// Returns 0 on success, -1 with errno set on failure.
+{
+ static const unsigned int std_sizes[][2] = {{320,240},{640,480},{800,600},{1280,720},
+                                            {1280,1024},{1920,1080},{2592,1944},{3840,2160}};
+ unsigned int sizes[9][2];
+ unsigned int req,pf,w,h,idx,nsizes;
+ struct v4l2_capability *cap;
+ struct v4l2_format *fmt;
+ struct v4l2_frmsizeenum *fsz;
+ struct v4l2_frmivalenum *fiv;
+
+ req = (unsigned int)request;
+ switch(req){
+    case VIDIOC_QUERYCAP:
+         cap = (struct v4l2_capability *)arg;
+         memset(cap, 0, sizeof(*cap));
+         snprintf((char *)cap->driver, sizeof(cap->driver), "pardcap");
+         snprintf((char *)cap->card, sizeof(cap->card), "%s", Vsrc_type == VSRC_SYNTH ? "Test pattern" : "Replay");
+         snprintf((char *)cap->bus_info, sizeof(cap->bus_info), "virtual");
+         cap->capabilities = cap->device_caps = V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_READWRITE;
+     return 0;
+
+    case VIDIOC_G_FMT:
+    case VIDIOC_S_FMT:
+    case VIDIOC_TRY_FMT:
+         fmt = (struct v4l2_format *)arg;
+         if(fmt->type != V4L2_BUF_TYPE_VIDEO_CAPTURE) break;
+         pf = Vsrc_cur_fmt; w = Vsrc_cur_wd; h = Vsrc_cur_ht;
+         if(req != VIDIOC_G_FMT){
+           if(Vsrc_type == VSRC_REPLAY){
+             pf = Vsrc_fmt; w = Vsrc_wd; h = Vsrc_ht;
+            } else {
+             pf = fmt->fmt.pix.pixelformat;
+             w = fmt->fmt.pix.width & ~1u;
+             h = fmt->fmt.pix.height;
+             if(pf != V4L2_PIX_FMT_YUYV && pf != V4L2_PIX_FMT_MJPEG) pf = V4L2_PIX_FMT_YUYV;
+             if(w < 16 || h < 16 || w > VSRC_MAXDIM || h > VSRC_MAXDIM){ w = Vsrc_wd; h = Vsrc_ht; }
+            }
+           if(req == VIDIOC_S_FMT && (pf != Vsrc_cur_fmt || w != Vsrc_cur_wd || h != Vsrc_cur_ht)){
+             Vsrc_cur_fmt = pf; Vsrc_cur_wd = w; Vsrc_cur_ht = h;
+             Vsrc_ready = 0;
+            }
+          }
+         memset(&fmt->fmt.pix, 0, sizeof(fmt->fmt.pix));
+         fmt->fmt.pix.width = w;
+         fmt->fmt.pix.height = h;
+         fmt->fmt.pix.pixelformat = pf;
+         fmt->fmt.pix.field = V4L2_FIELD_NONE;
+         fmt->fmt.pix.bytesperline = (pf == V4L2_PIX_FMT_YUYV) ? 2*w : 0;
+         fmt->fmt.pix.sizeimage = 2*w*h; // Plenty for MJPEG too
+         fmt->fmt.pix.colorspace = (pf == V4L2_PIX_FMT_YUYV) ? V4L2_COLORSPACE_SMPTE170M : V4L2_COLORSPACE_JPEG;
+     return 0;
+
+    case VIDIOC_ENUM_FRAMESIZES:
+         fsz = (struct v4l2_frmsizeenum *)arg;
+         sizes[0][0] = Vsrc_wd; sizes[0][1] = Vsrc_ht;
+         nsizes = 1;
+         if(Vsrc_type == VSRC_REPLAY){
+           if(fsz->pixel_format != Vsrc_fmt) break;
+          } else {
+           if(fsz->pixel_format != V4L2_PIX_FMT_YUYV && fsz->pixel_format != V4L2_PIX_FMT_MJPEG) break;
+           for(idx = 0; idx < 8; idx++){
+              if(std_sizes[idx][0] == Vsrc_wd && std_sizes[idx][1] == Vsrc_ht) continue;
+              sizes[nsizes][0] = std_sizes[idx][0];
+              sizes[nsizes][1] = std_sizes[idx][1];
+              nsizes++;
+             }
+          }
+         if(fsz->index >= nsizes) break;
+         fsz->type = V4L2_FRMSIZE_TYPE_DISCRETE;
+         fsz->discrete.width = sizes[fsz->index][0];
+         fsz->discrete.height = sizes[fsz->index][1];
+     return 0;
+
+    case VIDIOC_ENUM_FRAMEINTERVALS:
+         fiv = (struct v4l2_frmivalenum *)arg;
+         if(fiv->index > 0) break;
+         fiv->type = V4L2_FRMIVAL_TYPE_DISCRETE;
+         fiv->discrete.numerator = 1000;
+         fiv->discrete.denominator = (unsigned int)(1000.0*Vsrc_rate + 0.5);
+     return 0;
+
+    case VIDIOC_STREAMON:
+    case VIDIOC_STREAMOFF:
+     return 0;
+
+    case VIDIOC_QUERYCTRL: // No controls
+    case VIDIOC_CROPCAP:   // No cropping
+     break;
+
+    default:
+         errno = ENOTTY;
+     return -1;
+   }
+ errno = EINVAL;
+ return -1;
+}
+
+static int vsrc_open(void)
+// open_device() for a virtual source: start its frame clock (which is
+// what fd will be) and open the replay file.
+// Returns 0 on success, 1 on failure.
+{
+ struct itimerspec its;
+ long long period_ns;
+ char msgtxt[PATH_MAX+64];
+
+ if(Vsrc_type == VSRC_REPLAY){
+   Vsrc_file_idx = Vsrc_first_idx;
+   Vsrc_fp = vsrc_open_file(Vsrc_file_idx);
+   if(Vsrc_fp == NULL){
+     sprintf(msgtxt,"Cannot open replay file '%s':\n%d, %s", Vsrc_file, errno, strerror(errno));
+     show_message(msgtxt,"Camera Error: ",MT_ERR,1);
+     return 1;
+    }
+  }
+
+ fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+ if(-1 == fd){
+   sprintf(msgtxt,"%s error %d, %s", "timerfd_create", errno, strerror(errno));
+   goto fail;
+  }
+ period_ns = (long long)(1.0e9/Vsrc_rate + 0.5);
+ its.it_interval.tv_sec = (time_t)(period_ns / 1000000000LL);
+ its.it_interval.tv_nsec = (long)(period_ns % 1000000000LL);
+ its.it_value = its.it_interval;
+ if(-1 == timerfd_settime(fd, 0, &its, NULL)){
+   sprintf(msgtxt,"%s error %d, %s", "timerfd_settime", errno, strerror(errno));
+   close(fd);
+   fd = -1;
+   goto fail;
+  }
+ Vsrc_ticks = 0;
+ Vsrc_cur_fmt = (Vsrc_type == VSRC_REPLAY) ? Vsrc_fmt : V4L2_PIX_FMT_YUYV;
+ Vsrc_cur_wd = Vsrc_wd; Vsrc_cur_ht = Vsrc_ht;
+ Vsrc_ready = 0;
+ // Only read i/o is on offer
+ Vsrc_dev_io = io;
+ io = IO_METHOD_READ;
+ return 0;
 
- }
- 
- return 0; // success   
+fail:
+ show_message(msgtxt,"Camera Error: ",MT_ERR,1);
+ if(Vsrc_fp != NULL){ fclose(Vsrc_fp); Vsrc_fp = NULL; }
+ return 1;
 }
 
-static int next_windex(void)
+static void vsrc_close(void)
+// close_device() for a virtual source (after fd is closed)
 {
-  windex++;
-  if(windex==MAX_CAM_SETTINGS){
-     show_message("There are too many settings to display them all!","Error: ",MT_ERR,1);
-     return 1;
-    }
- return 0; 
+ if(Vsrc_fp != NULL){ fclose(Vsrc_fp); Vsrc_fp = NULL; }
+ vsrc_free_pattern();
+ Vsrc_ready = 0;
+ io = Vsrc_dev_io;
 }
 
 static int xioctl(int fh, int request, void *arg)
 {
  int r;
 
+ if(Vsrc_type != VSRC_NONE && fh == fd) return vsrc_ioctl(request, arg);
+
  do {
      r = ioctl(fh, request, arg);
     } while (-1 == r && EINTR == errno);
@@ -7776,6 +10576,23 @@ static void process_image(const void *p, int size)
     if(Av_limit>1 && Av_denom_idx==1){  
        // If we are at the very first frame ...                                     
 
+       // Whether MJPEG frames are added up as luma only is settled here,
+       // for both sizing and adding to the stores.
+       Av_added=0;
+       Av_luma=(CamFormat==V4L2_PIX_FMT_MJPEG && jpeg_luma_wanted());
+       // Without dark or flat field correction or mean scaling only the
+       // camera's samples need adding up, which is done exactly in
+       // integer stores of a half or a quarter of the size:
+       Avi_active=0;
+       if(!do_df_correction && !do_ff_correction && !Av_scalemean && saveas_fmt!=SAF_YUYV &&
+          !(CamFormat==V4L2_PIX_FMT_NV12 && saveas_fmt!=SAF_YP5 && saveas_fmt!=SAF_BM8) && camfmt_bayer()<0){
+         Avi_wide = (Av_limit > 65535/255 || camfmt_bits() > 8);
+         if(resize_memblk(&Avi,avi_count(),Avi_wide ? sizeof(unsigned int) : sizeof(unsigned short),"the integer averaging store")) goto av_fail;
+         Avi_active=1;
+         Accumulator_status=ACC_ALLOCED;
+         goto colour_calcs;
+        }
+
        switch(saveas_fmt){
            case SAF_YUYV:// Not yet supported for multiframe averaging
                 show_message("No multi-frame averging will be done because YUYV save-as format does not support it.","Error: ",MT_ERR,0);
@@ -7820,15 +10637,30 @@ static void process_image(const void *p, int size)
        Av_denom_idx=Av_limit=1;
        averaging_done=0;
        Accumulator_status=ACC_FREED;
+       Avi_active=0;
        resize_memblk((void **)&Avr,1, sizeof(double),"Avr");
        resize_memblk((void **)&Avg,1, sizeof(double),"Avg");
        resize_memblk((void **)&Avb,1, sizeof(double),"Avb");
+       resize_memblk(&Avi,1, sizeof(unsigned int),"the integer averaging store");
      } 
       
     // Now do the appropriate RGB conversion for the 'save as' format 
     colour_calcs:
     switch(CamFormat){ // Perform any YUYV conversion required by the save as format.
           case V4L2_PIX_FMT_YUYV:
+          case V4L2_PIX_FMT_GREY: // The raw formats all convert the
+          case V4L2_PIX_FMT_Y10:  // same way (see convert_span), and
+          case V4L2_PIX_FMT_Y12:  // a 'YUYV' save writes their frame
+          case V4L2_PIX_FMT_Y16:  // unaltered.
+          case V4L2_PIX_FMT_NV12:
+          case V4L2_PIX_FMT_SRGGB8:
+          case V4L2_PIX_FMT_SGRBG8:
+          case V4L2_PIX_FMT_SGBRG8:
+          case V4L2_PIX_FMT_SBGGR8:
+          case V4L2_PIX_FMT_SRGGB10:
+          case V4L2_PIX_FMT_SGRBG10:
+          case V4L2_PIX_FMT_SGBRG10:
+          case V4L2_PIX_FMT_SBGGR10:
            switch(saveas_fmt){
                case SAF_YUYV:// Requires no conversion at all - quickest method
                break;
@@ -7841,8 +10673,9 @@ static void process_image(const void *p, int size)
                    Need_to_save=0; // Abort save process if colour conversion failed
                   }
                break;
-               case SAF_BMP: // Requires YUYV to BGR conversion
-                 col_conv_type=CCOL_TO_BGR;// Change current conversion type to full RGB conversion - ordered as BGR
+               case SAF_BMP: // Requires YUYV to RGB conversion (the BMP
+                             // writer puts it in B,G,R order)
+                 col_conv_type=CCOL_TO_RGB;
                  goto convert_rgb;
                case SAF_RGB: // These require YUYV to RGB conversion
                case SAF_JPG:
@@ -7863,8 +10696,10 @@ static void process_image(const void *p, int size)
             }
           break;
           case V4L2_PIX_FMT_MJPEG:
-           // Decode the MJPEG stream image (which is in JPEG format)
-           if(jpeg_convert((const unsigned char *)p,size)){
+           // Decode the MJPEG stream image (which is in JPEG format),
+           // only its luma if that will do (see Mjpeg_luma), unless a
+           // decode worker already has (see mjdec_take)
+           if(!Mjpeg_predecoded && jpeg_convert((const unsigned char *)p,size,jpeg_luma_wanted(),1,NULL)){
             sprintf(imsg,"Failed to decode the JPEG image from the camera.");
             show_message(imsg,"Error: ",MT_ERR,0);
            }
@@ -7875,7 +10710,7 @@ static void process_image(const void *p, int size)
                    Need_to_save=0;          // Abort the save process
                break;
                case SAF_YP5: // Need Y-calculation from JPEG decoded RGB
-               case SAF_BM8: // Need Y-calculation from JPEG decoded RGB
+               case SAF_BM8: // (or just the decoded luma)
                  col_conv_type=CCOL_TO_Y;  // Change to Y-only
                  cresult = colour_convert(NULL); // Do the conversion
                  // Test for success - can only proceed to saving the
@@ -7885,8 +10720,9 @@ static void process_image(const void *p, int size)
                    Need_to_save=0;          // Abort the save process
                   }
                break;
-               case SAF_BMP: // Requires JPEG to BGR conversion
-                 col_conv_type=CCOL_TO_BGR;// Ensure full BGR conversion
+               case SAF_BMP: // Requires JPEG to RGB conversion (the BMP
+                             // writer puts it in B,G,R order)
+                 col_conv_type=CCOL_TO_RGB;
                  goto convert_jrgb;
                case SAF_JPG:
                 // Only need convert a JPEG if we are doing averaging 
@@ -7925,8 +10761,8 @@ static void process_image(const void *p, int size)
                                     // file to disc just yet. 
                                     
    else if(Av_denom_idx==Av_limit){ // However, if we have accumulated
-     int ipos,rgbpos;               // the last frame then do the final 
-     double r,g,b;                  // division and transfer the
+                                    // the last frame then do the final 
+                                    // division and transfer the
                                     // resulting averages to the write
                                     // buffer.
      averaging_done=1; // Lets the file save code know that we have an
@@ -7938,68 +10774,16 @@ static void process_image(const void *p, int size)
        break;
        case SAF_YP5: // Only the first ImSize bytes of RGBimg are used
        case SAF_BM8: // Only the first ImSize bytes of RGBimg are used
-          // First divide by accumulation array by the average
-          // denominator so it holds the average pixel values:
-          for(ipos=0;ipos<ImSize;ipos++) Avr[ipos]/=(double)Av_limit;
-          // Now transfer the result, unaltered, into the doubles frame
-          // buffer and clamp the values between 0 and 255 and insert
-          // them into the unsigned char write buffer:
-          for(ipos=0;ipos<ImSize;ipos++){
-              r=Avr[ipos];
-              Frmr[ipos]=r; // Original value goes here
-              RGBimg[ipos]=uchar_from_d(r); // Clipped value goes here
-            }
-       break;
        case SAF_RGB: // The whole RGBimg array is used
        case SAF_PNG: // 
        case SAF_JPG: //
        case SAF_INT: //
-          // First divide by accumulation arrays by the average
-          // denominator so they hold the average pixel values:
-          for(ipos=0;ipos<ImSize;ipos++){ 
-              Avr[ipos]/=(double)Av_limit;
-              Avg[ipos]/=(double)Av_limit;
-              Avb[ipos]/=(double)Av_limit;
-            }
-          // Now transfer the result, unaltered, into the doubles frame
-          // buffers and clamp the values between 0 and 255 and insert
-          // them into the unsigned char write buffer:
-          rgbpos=0; 
-          for(ipos=0;ipos<ImSize;ipos++){ 
-              r=Avr[ipos];
-              g=Avg[ipos];
-              b=Avb[ipos];
-              Frmr[ipos]=r; // Original value goes here
-              Frmg[ipos]=g; // Original value goes here
-              Frmb[ipos]=b; // Original value goes here
-              RGBimg[rgbpos++]=uchar_from_d(r); // Clipped value goes here 
-              RGBimg[rgbpos++]=uchar_from_d(g); // Clipped value goes here
-              RGBimg[rgbpos++]=uchar_from_d(b); // Clipped value goes here
-             }
-       break;
-       case SAF_BMP: // Same as for the RGB procedure but reorder to BGR
-          // First divide by accumulation arrays by the average
-          // denominator so they hold the average pixel values:
-          for(ipos=0;ipos<ImSize;ipos++){ 
-              Avr[ipos]/=(double)Av_limit;
-              Avg[ipos]/=(double)Av_limit;
-              Avb[ipos]/=(double)Av_limit;
-            }
-          // Now transfer the result, unaltered, into the doubles frame
-          // buffers and clamp the values between 0 and 255 and insert
-          // them into the unsigned char write buffer:
-          rgbpos=0; 
-          for(ipos=0;ipos<ImSize;ipos++){ 
-              r=Avr[ipos];
-              g=Avg[ipos];
-              b=Avb[ipos];
-              Frmr[ipos]=r; // Original value goes here
-              Frmg[ipos]=g; // Original value goes here
-              Frmb[ipos]=b; // Original value goes here
-              RGBimg[rgbpos++]=uchar_from_d(b); // Clipped value goes here 
-              RGBimg[rgbpos++]=uchar_from_d(g); // Clipped value goes here
-              RGBimg[rgbpos++]=uchar_from_d(r); // Clipped value goes here
-             }
+       case SAF_BMP: // Same as for the RGB procedure but reordered to BGR
+          // Divide the accumulation arrays by the average denominator
+          // and transfer the result, unaltered, into the frame stores
+          // that the file writers take it from (see band_average_out,
+          // or band_average_int if the sums are integers).
+          run_bands(Avi_active ? band_average_int : band_average_out, NULL);
        break;
        default:
        break;
@@ -8014,6 +10798,8 @@ static void process_image(const void *p, int size)
     resize_memblk((void **)&Avr,1, sizeof(double),"Avr");
     resize_memblk((void **)&Avg,1, sizeof(double),"Avg");
     resize_memblk((void **)&Avb,1, sizeof(double),"Avb");
+    resize_memblk(&Avi,1, sizeof(unsigned int),"the integer averaging store");
+    Avi_active=0;
 
 
    } // End of if...else we are at the last frame of multi-frame averaging
@@ -8023,17 +10809,25 @@ static void process_image(const void *p, int size)
     // Construct the appropriate file name using ImRoot, frame_number
     // and the save as format then write the data to disk.
     FILE *fp;                                           
+    ImgView iv;
     
+    // The mosaic of a Bayer stream is got back from the colour frame
+    // stores (see write_fits), so write it before anything (such as
+    // rgb_to_int) changes them:
+    if(Save_as_FITS && Bayer_mosaic_fits && camfmt_bayer()>=0 &&
+       saveas_fmt!=SAF_YUYV && saveas_fmt!=SAF_YP5 && saveas_fmt!=SAF_BM8){
+      sprintf(Ser_name, "%s_%04d_mosaic.fit",ImRoot,frame_number);
+      write_fits(Ser_name,CCHAN_MOSAIC,averaging_done);
+     }
+
     // Save image to local disk.
-    // Note: Always do the 'if(Save_as_FITS)' option last because the
-    // FITS save function may byte-swap the original image data.
     switch(saveas_fmt){
           case SAF_YUYV:
             // In YUYV mode we just save the frame buffer as it comes
             // out of the camera, no masking, dark field, flat field or
             // averaging process are applied and we do not allow saving
             // as raw doubles or FITS so no need to check for those:
-            sprintf(Ser_name, "%s_%04d_yuyv.raw",ImRoot,frame_number);fnum_used=1;
+            sprintf(Ser_name, "%s_%04d_%s.raw",ImRoot,frame_number,camfmt_rawtag[camfmt_index(CamFormat)]);fnum_used=1;
             fp=fopen(Ser_name,"wb");
             if(fp==NULL){
                show_message("Failed to open file for writing raw YUYV image.","File Save FAILED: ",MT_ERR,1); 
@@ -8043,7 +10837,8 @@ static void process_image(const void *p, int size)
           break;
           case SAF_YP5:
             sprintf(Ser_name, "%s_%04d_Y.pgm",ImRoot,frame_number);fnum_used=1;
-            if(raw_to_pgm(Ser_name,ImHeight,ImWidth,(void *)RGBimg)) break;
+            frame_view(&iv,1);
+            if(raw_to_pgm(Ser_name,&iv)) break;
             // If the user requested to save raw doubles, do it now:
             if(Save_raw_doubles){
               sprintf(Ser_name, "%s_%04d_Y.dou",ImRoot,frame_number);fnum_used=1;
@@ -8056,7 +10851,8 @@ static void process_image(const void *p, int size)
           break;
           case SAF_BM8:
             sprintf(Ser_name, "%s_%04d_Y.bmp",ImRoot,frame_number);fnum_used=1;
-            if(raw_to_bmp((unsigned int)ImHeight,(unsigned int)ImWidth,&RGBimg,Ser_name,BM8)){ show_message("Failed to save 8 bpp BMP image.","File Save FAILED: ",MT_ERR,1); break;}
+            frame_view(&iv,1);
+            if(raw_to_bmp(&iv,Ser_name)){ show_message("Failed to save 8 bpp BMP image.","File Save FAILED: ",MT_ERR,1); break;}
             // If the user requested to save raw doubles, do it now:
             if(Save_raw_doubles){
               sprintf(Ser_name, "%s_%04d_Y.dou",ImRoot,frame_number);
@@ -8069,7 +10865,8 @@ static void process_image(const void *p, int size)
           break;
           case SAF_PNG:
             sprintf(Ser_name, "%s_%04d.png",ImRoot,frame_number);fnum_used=1;
-            if(write_png_image(Ser_name, ImWidth, ImHeight, RGBimg, Ser_name))
+            frame_view(&iv,0);
+            if(write_png_image(Ser_name, &iv, Ser_name))
                { show_message("Error writing PNG image.\n","File Save FAILED: ",MT_ERR,1); break;}
             // If the user requested to save raw doubles, do it now:
             if(Save_raw_doubles){
@@ -8091,7 +10888,8 @@ static void process_image(const void *p, int size)
           break;
           case SAF_RGB:
             sprintf(Ser_name, "%s_%04d_rgb.ppm",ImRoot,frame_number);fnum_used=1;
-            if(raw_to_ppm(Ser_name,ImHeight,ImWidth,(void *)RGBimg)) break;
+            frame_view(&iv,0);
+            if(raw_to_ppm(Ser_name,&iv)) break;
             // If the user requested to save raw doubles, do it now:
             if(Save_raw_doubles){
               sprintf(Ser_name, "%s_%04d_R.dou",ImRoot,frame_number);
@@ -8128,7 +10926,8 @@ static void process_image(const void *p, int size)
           break;
           case SAF_BMP:
             sprintf(Ser_name, "%s_%04d_rgb.bmp",ImRoot,frame_number);fnum_used=1;
-            if(raw_to_bmp((unsigned int)ImHeight,(unsigned int)ImWidth,&RGBimg,Ser_name,BMP)){ show_message("Failed to save 24 bpp BMP image.","File Save FAILED: ",MT_ERR,1); break;}
+            frame_view(&iv,0);
+            if(raw_to_bmp(&iv,Ser_name)){ show_message("Failed to save 24 bpp BMP image.","File Save FAILED: ",MT_ERR,1); break;}
             if(Save_raw_doubles){
               sprintf(Ser_name, "%s_%04d_R.dou",ImRoot,frame_number);
               if(write_rawdou(Ser_name,CCHAN_R)) break;
@@ -8149,10 +10948,11 @@ static void process_image(const void *p, int size)
           case SAF_JPG:
             sprintf(Ser_name, "%s_%04d.jpg",ImRoot,frame_number);fnum_used=1;
             // If the camera was not in MJPEG stream mode or if we did
-            // multi-frame averaging, the image data will be in RGBim
-            // and the Frm stores, so save those as appropriate:
+            // multi-frame averaging, the image data will be in the Frm
+            // stores, so save those as appropriate:
             if(averaging_done || CamFormat!=V4L2_PIX_FMT_MJPEG){
-              if(raw_to_jpeg(ImHeight,ImWidth,&RGBimg,Ser_name,JPG_Quality)){
+              frame_view(&iv,0);
+              if(raw_to_jpeg(&iv,Ser_name,JPG_Quality)){
                  show_message("Failed to save JPEG image.","File Save FAILED: ",MT_ERR,1);
                  break;
                 }
@@ -8194,7 +10994,11 @@ static void process_image(const void *p, int size)
 
 skip_write:
  col_conv_type=tmp_colconvtype; // Restore current preview colour conversion type
- if(fnum_used) frame_number++;  // Increment the frame counter.
+ if(fnum_used){
+    // The additional cameras save their images with the same number
+    if(N_auxcams) auxcam_save_all(frame_number);
+    frame_number++;  // Increment the frame counter.
+   }
    
  if(Need_to_preview){
     if(preview_stored==PREVIEW_STORED_NONE){
@@ -8203,8 +11007,11 @@ skip_write:
        switch(CamFormat){
          case V4L2_PIX_FMT_MJPEG:   
            // Decode the MJPEG stream image (which is in JPEG format)
-           // to an uncompressed bitmap form for previewing.
-           if(jpeg_convert((const unsigned char *)p,size)){
+           // to an uncompressed bitmap form for previewing, only as big
+           // as the preview needs or, for a full resolution tile, only
+           // the tile.
+           if(jpeg_convert((const unsigned char *)p,size,0,Jpeg_prev_denom,
+                           (Jpeg_prev_tile[1]>Jpeg_prev_tile[0]) ? Jpeg_prev_tile : NULL)){
             sprintf(imsg,"Failed to decode a JPEG preview image. Previewing will be turned off.");
             show_message(imsg,"Error: ",MT_ERR,1);
             // Switch off the preview
@@ -8218,8 +11025,21 @@ skip_write:
            }
          break; 
          case V4L2_PIX_FMT_YUYV:
+         case V4L2_PIX_FMT_GREY:
+         case V4L2_PIX_FMT_Y10:
+         case V4L2_PIX_FMT_Y12:
+         case V4L2_PIX_FMT_Y16:
+         case V4L2_PIX_FMT_NV12:
+         case V4L2_PIX_FMT_SRGGB8:
+         case V4L2_PIX_FMT_SGRBG8:
+         case V4L2_PIX_FMT_SGBRG8:
+         case V4L2_PIX_FMT_SBGGR8:
+         case V4L2_PIX_FMT_SRGGB10:
+         case V4L2_PIX_FMT_SGRBG10:
+         case V4L2_PIX_FMT_SGBRG10:
+         case V4L2_PIX_FMT_SBGGR10:
           if(colour_convert((const unsigned short *)p)){
-            sprintf(imsg,"Failed to subsample a YUYV preview image. Previewing will be turned off.");
+            sprintf(imsg,"Failed to subsample a %s preview image. Previewing will be turned off.",camfmt_options[camfmt_index(CamFormat)]);
             show_message(imsg,"Error: ",MT_ERR,1);
             // Switch off the preview
             gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(chk_cam_preview),FALSE);
@@ -8227,7 +11047,7 @@ skip_write:
          break; 
          default:
           if(preview_only_once){
-              sprintf(imsg,"Preview is only available for YUYV and MJPEG image streams");
+              sprintf(imsg,"Preview is not available for this image stream");
               show_message(imsg,"FYI: ",MT_INFO,0);
             }
           preview_only_once = 0;
@@ -8258,127 +11078,1231 @@ skip_write:
        update_prevstat_channel(CCHAN_B);
        Prev_blank_gb=1;
       }
-     // Now overlay the histogram and limit lines if the user wants it
-     if(Prev_overlay_hgm) overlay_histogram();
-     // Now paint the preview image in its window area
-     gtk_image_set_from_pixbuf (GTK_IMAGE(Img_preview),gdkpb_preview);
-     // Preview image updates are complete so the display timeout can have
-     // another go at updating and displaying it.
-     Preparing_preview=0;
+     // Now overlay the histogram and limit lines if the user wants it
+     if(Prev_overlay_hgm) overlay_histogram();
+     // Now paint the preview image in its window area
+     gtk_image_set_from_pixbuf (GTK_IMAGE(Img_preview),gdkpb_preview);
+     // Preview image updates are complete so the display timeout can have
+     // another go at updating and displaying it.
+     Preparing_preview=0;
+
+    }
+ }
+
+ return;
+}
+
+static int cap_requeue(unsigned int idx)
+// Give buffer idx back to the driver (or, for read i/o, mark it free to
+// be read into again). Only the capture thread calls this.
+// Returns 0 on success or a GRAB_ERR_ code.
+{
+ __atomic_store_n(&buffers[idx].state, LEASE_QUEUED, __ATOMIC_SEQ_CST);
+ if(io == IO_METHOD_READ) return 0;
+ if(-1 == xioctl(fd, VIDIOC_QBUF, &buffers[idx].vbuf)){
+    Cap_thread_errno = errno;
+    return (io == IO_METHOD_MMAP) ? GRAB_ERR_MMAPQ : GRAB_ERR_USERPQ;
+   }
+ return 0;
+}
+
+static void cap_note_sequence(unsigned int vseq)
+// Keep count of any frames the driver had to skip (because it had no
+// buffer to put them in) from gaps in the v4l2 sequence numbers.
+// Only the capture thread calls this.
+{
+ if(Cap_vseq_valid && vseq > Cap_last_vseq + 1)
+   __atomic_add_fetch(&Cap_seq_gaps, vseq - Cap_last_vseq - 1, __ATOMIC_RELAXED);
+ Cap_last_vseq = vseq;
+ Cap_vseq_valid = 1;
+}
+
+static int cap_publish(unsigned int idx, size_t size)
+// Publish the frame just dequeued into buffer idx as the newest one and,
+// if that means more than Cap_hold_max frames are now held out of the
+// driver queue, retire the oldest. Only the capture thread calls this.
+// Returns 0 on success or a GRAB_ERR_ code.
+{
+ unsigned long seq,oldest;
+ unsigned int i,nheld,old_idx;
+ int r;
+ struct timespec mono_now,real_now;
+ long long now_us;
+ double dt,mean,jit;
+
+ seq = Cap_head + 1;
+ buffers[idx].bytesused = size;
+
+ // Tag the frame with its sequence number and time. The driver's own
+ // timestamp is used if it is on the monotonic clock (the usual case)
+ // otherwise the time it was dequeued has to do. Either way the UTC
+ // time follows from how long ago that was.
+ clock_gettime(CLOCK_MONOTONIC,&mono_now);
+ clock_gettime(CLOCK_REALTIME,&real_now);
+ now_us = (long long)mono_now.tv_sec*1000000LL + mono_now.tv_nsec/1000;
+ if(io != IO_METHOD_READ || Vsrc_type != VSRC_NONE){
+    buffers[idx].vseq = buffers[idx].vbuf.sequence;
+    cap_note_sequence(buffers[idx].vseq);
+   } else buffers[idx].vseq = (unsigned int)seq;
+ if(io != IO_METHOD_READ &&
+    (buffers[idx].vbuf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+   buffers[idx].mono_us = (long long)buffers[idx].vbuf.timestamp.tv_sec*1000000LL + buffers[idx].vbuf.timestamp.tv_usec;
+  else buffers[idx].mono_us = now_us;
+ buffers[idx].wall_us = (long long)real_now.tv_sec*1000000LL + real_now.tv_nsec/1000 - (now_us - buffers[idx].mono_us);
+
+ // Running frame rate and jitter (smoothed as per RFC 3550). The GUI
+ // thread reads these for display.
+ if(Cap_last_mono_us){
+    dt = (double)(buffers[idx].mono_us - Cap_last_mono_us);
+    mean = Cap_mean_dt_us; jit = Cap_jitter_us;
+    if(mean == 0.0) mean = dt;
+     else mean += (dt - mean)/16.0;
+    jit += (fabs(dt - mean) - jit)/16.0;
+    __atomic_store(&Cap_mean_dt_us, &mean, __ATOMIC_RELAXED);
+    __atomic_store(&Cap_jitter_us, &jit, __ATOMIC_RELAXED);
+   }
+ Cap_last_mono_us = buffers[idx].mono_us;
+
+ __atomic_store_n(&buffers[idx].seq, seq, __ATOMIC_SEQ_CST);
+ __atomic_store_n(&buffers[idx].state, LEASE_HELD, __ATOMIC_SEQ_CST);
+ __atomic_store_n(&Cap_head, seq, __ATOMIC_SEQ_CST);
+
+ FOREVER {
+     nheld = 0; oldest = seq; old_idx = idx;
+     for(i = 0; i < n_buffers; ++i)
+       if(buffers[i].state == LEASE_HELD){
+          nheld++;
+          if(buffers[i].seq < oldest){ oldest = buffers[i].seq; old_idx = i; }
+         }
+     if(nheld <= (__atomic_load_n(&Cap_fresh_only, __ATOMIC_ACQUIRE) ? 1 : Cap_hold_max)) break;
+     // Retire it first, then see if anyone is reading it. If a consumer
+     // got its lease in first it will be re-queued later, once released.
+     __atomic_store_n(&buffers[old_idx].state, LEASE_RETIRED, __ATOMIC_SEQ_CST);
+     if(0 == __atomic_load_n(&buffers[old_idx].refs, __ATOMIC_SEQ_CST))
+       if((r = cap_requeue(old_idx))) return r;
+   }
+ return 0;
+}
+
+static int cap_requeue_released(void)
+// Re-queue any retired buffers that consumers have finished with.
+// Only the capture thread calls this.
+// Returns 0 on success or a GRAB_ERR_ code.
+{
+ unsigned int i;
+ int r;
+
+ for(i = 0; i < n_buffers; ++i)
+   if(__atomic_load_n(&buffers[i].state, __ATOMIC_SEQ_CST) == LEASE_RETIRED &&
+      __atomic_load_n(&buffers[i].refs, __ATOMIC_SEQ_CST) == 0)
+      if((r = cap_requeue(i))) return r;
+ return 0;
+}
+
+static int cap_lease_acquire(unsigned long want)
+// Take out a lease on the buffer holding frame number 'want'. While the
+// lease is held the capture thread will not give that buffer back to
+// the driver so its contents can be read in place. Every successful
+// call must be matched by cap_lease_release().
+// Returns the buffer index, -1 if that frame has not arrived yet or -2
+// if it has already been re-queued.
+{
+ unsigned int i;
+
+ if(want > __atomic_load_n(&Cap_head, __ATOMIC_SEQ_CST)) return -1;
+ for(i = 0; i < n_buffers; ++i){
+    if(__atomic_load_n(&buffers[i].seq, __ATOMIC_SEQ_CST) != want) continue;
+    __atomic_add_fetch(&buffers[i].refs, 1, __ATOMIC_SEQ_CST);
+    // Make sure it was not retired (or even re-used) before we got it:
+    if(__atomic_load_n(&buffers[i].state, __ATOMIC_SEQ_CST) == LEASE_HELD &&
+       __atomic_load_n(&buffers[i].seq, __ATOMIC_SEQ_CST) == want) return (int)i;
+    __atomic_sub_fetch(&buffers[i].refs, 1, __ATOMIC_SEQ_CST);
+    break;
+   }
+ return -2;
+}
+
+static void cap_lease_release(int idx)
+// Finished reading buffer idx. The capture thread re-queues it if it
+// has since been retired.
+{
+ __atomic_sub_fetch(&buffers[idx].refs, 1, __ATOMIC_SEQ_CST);
+}
+
+static int read_frame(void)
+// Dequeue one frame from the driver and publish it for the consumers.
+// This runs in the capture thread so it must not use the GUI (and that
+// includes show_message). Errors are returned as GRAB_ERR_ codes with
+// errno noted in Cap_thread_errno for the GUI thread to report.
+// Returns 0 if there was no frame ready yet.
+{
+ struct v4l2_buffer buf;
+ unsigned int i;
+ ssize_t nread;
+ int r;
+
+  switch (io) {
+        case IO_METHOD_READ:
+                // Read into any buffer not held by the consumers
+                for(i = 0; i < n_buffers; ++i)
+                   if(__atomic_load_n(&buffers[i].state, __ATOMIC_SEQ_CST) == LEASE_QUEUED) break;
+                if(i == n_buffers) return 0; // None free - try again later
+                if(Vsrc_type != VSRC_NONE)
+                  nread = vsrc_read(buffers[i].start, buffers[i].length, &buffers[i].vbuf.sequence);
+                 else nread = read(fd, buffers[i].start, buffers[i].length);
+                if(-1 == nread){
+                   switch (errno) {
+                        case EAGAIN: return 0; // Need to try again
+                        case EIO: // Could ignore EIO, see spec. Fall through.
+                        default:
+                            Cap_thread_errno = errno;
+                            return GRAB_ERR_READIO; 
+                    }
+                }
+                if(cap_publish(i, (size_t)nread)) return GRAB_ERR_READIO;
+                break;
+
+        case IO_METHOD_MMAP:
+                CLEAR(buf);
+                buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+                buf.memory = V4L2_MEMORY_MMAP;
+                if(-1 == xioctl(fd, VIDIOC_DQBUF, &buf)){
+                   switch (errno) {
+                        case EAGAIN: return 0; // Need to try again
+                        case EIO: // Could ignore EIO, see spec. Fall through.
+                        default:
+                            Cap_thread_errno = errno;
+                            return GRAB_ERR_MMAPD; 
+                    }
+                }
+                assert(buf.index < n_buffers);
+                buffers[buf.index].vbuf = buf;
+                if((r = cap_publish(buf.index, buf.bytesused))) return r;
+                break;
+
+        case IO_METHOD_USERPTR:
+                CLEAR(buf);
+                buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+                buf.memory = V4L2_MEMORY_USERPTR;
+                if (-1 == xioctl(fd, VIDIOC_DQBUF, &buf)) {
+                   switch (errno) {
+                        case EAGAIN: return 0; // Need to try again
+                        case EIO: // Could ignore EIO, see spec. Fall through.
+                        default:
+                            // This error can happen if the camera is
+                            // accidentally disconnected (e.g. the USB
+                            // cable is dislodged by accident). See
+                            // report_capture_error().
+                            Cap_thread_errno = errno;
+                            return GRAB_ERR_USERPD; 
+                    }
+                }
+
+                for(i = 0; i < n_buffers; ++i)
+                    if (buf.m.userptr == (unsigned long)buffers[i].start && buf.length == buffers[i].length) break;
+                assert(i < n_buffers);
+                buffers[i].vbuf = buf;
+                if((r = cap_publish(i, buf.bytesused))) return r;
+                break;
+    }
+  
+ return GRAB_ERR_NONE; 
+}
+
+int auxcam_parse_spec(const char *spec)
+// Add the additional camera given by the -c command line argument spec:
+//
+//   DEVICE[:WxH][:yuyv|:mjpeg][:N][:ROOT]
+//
+// e.g. /dev/video2:1280x720:mjpeg:4:/data/fluor. The defaults are
+// 640x480 YUYV, no averaging (N=1) and a save root made from the main
+// one with _camN on the end.
+// This is called before the GUI is up so errors go to stderr.
+// Returns 0 on success, 1 on error.
+{
+ struct auxcam *ac;
+ char buf[PATH_MAX],*field,*next;
+ unsigned int wd,ht;
+ int navg;
+ char ch;
+
+ if(N_auxcams == MAX_AUXCAMS){
+   fprintf(stderr,"\nNo more than %d additional cameras can be used\n",MAX_AUXCAMS);
+   return 1;
+  }
+ if(strlen(spec) >= PATH_MAX){
+   fprintf(stderr,"\nCamera specification is too long\n");
+   return 1;
+  }
+ ac = &Auxcams[N_auxcams];
+ memset(ac, 0, sizeof(*ac));
+ ac->fmt = V4L2_PIX_FMT_YUYV; ac->wd = 640; ac->ht = 480; ac->navg = 1;
+ ac->fd = -1;
+
+ snprintf(buf, sizeof buf, "%s",spec);
+ next = strchr(buf,':');
+ if(next != NULL) *next++ = '\0';
+ snprintf(ac->name, sizeof ac->name, "%s",buf);
+ while(next != NULL){
+      field = next;
+      next = strchr(field,':');
+      if(next != NULL) *next++ = '\0';
+      if(sscanf(field,"%ux%u%c",&wd,&ht,&ch) == 2){
+        if(wd < 2 || ht < 1 || (wd & 1)){
+          fprintf(stderr,"\nUnusable frame size for %s: %s\n",ac->name,field);
+          return 1;
+         }
+        ac->wd = wd; ac->ht = ht;
+       } else if(!strcmp(field,"yuyv")) ac->fmt = V4L2_PIX_FMT_YUYV;
+        else if(!strcmp(field,"mjpeg")) ac->fmt = V4L2_PIX_FMT_MJPEG;
+         else if(sscanf(field,"%d%c",&navg,&ch) == 1){
+           if(navg < 1 || navg > 1000){
+             fprintf(stderr,"\nFrames to average for %s must be 1 to 1000\n",ac->name);
+             return 1;
+            }
+           ac->navg = navg;
+          } else {
+           if(next != NULL){ // The root is the last field and may contain ':'
+             *(next-1) = ':';
+             next = NULL;
+            }
+           snprintf(ac->root, sizeof ac->root, "%s",field);
+          }
+     }
+ if(ac->name[0] == '\0'){
+   fprintf(stderr,"\nNo device given for additional camera: %s\n",spec);
+   return 1;
+  }
+ pthread_mutex_init(&ac->lock, NULL);
+ pthread_cond_init(&ac->cond, NULL);
+ N_auxcams++;
+ return 0;
+}
+
+static void auxcam_stop(struct auxcam *ac)
+// Stop the save worker of an additional camera (any saves it has not
+// done fail), switch off its stream and close it
+{
+ struct auxjob *job;
+ enum v4l2_buf_type type;
+ unsigned int i;
+
+ if(ac->worker_up){
+   pthread_mutex_lock(&ac->lock);
+   ac->worker_run = 0;
+   pthread_cond_broadcast(&ac->cond);
+   pthread_mutex_unlock(&ac->lock);
+   pthread_join(ac->worker, NULL);
+   ac->worker_up = 0;
+  }
+ pthread_mutex_lock(&ac->lock);
+ for(; ac->jobs_done != ac->jobs_queued; ac->jobs_done++){
+    job = &ac->jobs[ac->jobs_done % AUX_JOBS];
+    job->failed = 1;
+    snprintf(job->txt, sizeof job->txt, "Image %d was not saved because the camera was stopped.", job->fnum);
+   }
+ pthread_mutex_unlock(&ac->lock);
+
+ if(ac->fd != -1){
+   type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+   if(ac->running) xioctl(ac->fd, VIDIOC_STREAMOFF, &type);
+   for(i = 0; i < ac->nbufs; ++i) munmap(ac->bufs[i].start, ac->bufs[i].length);
+   close(ac->fd);
+   ac->fd = -1;
+  }
+ if(ac->bufs != NULL){ free(ac->bufs); ac->bufs = NULL; }
+ ac->nbufs = 0;
+ ac->running = 0;
+ pthread_mutex_lock(&ac->lock);
+ for(i = 0; i < AUX_RING; i++){ free(ac->ring[i]); ac->ring[i] = NULL; }
+ pthread_mutex_unlock(&ac->lock);
+}
+
+static void *auxcam_worker(void *arg);
+
+static int auxcam_start(struct auxcam *ac)
+// Open an additional camera, set its format, start it streaming into
+// AUX_NBUFS memory mapped buffers and start its save worker.
+// Returns 0 on success, 1 on failure (after telling the user).
+{
+ struct v4l2_capability cap;
+ struct v4l2_format fmt;
+ struct v4l2_requestbuffers req;
+ struct v4l2_buffer buf;
+ enum v4l2_buf_type type;
+ unsigned int i;
+ char msgtxt[PATH_MAX+128];
+ char *what;
+
+ ac->fd = open(ac->name, O_RDWR | O_NONBLOCK, 0);
+ if(-1 == ac->fd){ what = "open"; goto fail; }
+ if(-1 == xioctl(ac->fd, VIDIOC_QUERYCAP, &cap)){ what = "VIDIOC_QUERYCAP"; goto fail; }
+ if(!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE) || !(cap.capabilities & V4L2_CAP_STREAMING)){
+   snprintf(msgtxt, sizeof msgtxt, "%.256s is not a streaming video capture device.",ac->name);
+   goto fail_msg;
+  }
+
+ CLEAR(fmt);
+ fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+ fmt.fmt.pix.width = ac->wd;
+ fmt.fmt.pix.height = ac->ht;
+ fmt.fmt.pix.pixelformat = ac->fmt;
+ fmt.fmt.pix.field = V4L2_FIELD_ANY;
+ if(-1 == xioctl(ac->fd, VIDIOC_S_FMT, &fmt)){ what = "VIDIOC_S_FMT"; goto fail; }
+ if(fmt.fmt.pix.width != ac->wd || fmt.fmt.pix.height != ac->ht || fmt.fmt.pix.pixelformat != ac->fmt){
+   snprintf(msgtxt, sizeof msgtxt, "%.256s can not do %u x %u %.256s.",ac->name,ac->wd,ac->ht,(ac->fmt == V4L2_PIX_FMT_MJPEG) ? "MJPEG" : "YUYV");
+   goto fail_msg;
+  }
+
+ CLEAR(req);
+ req.count = AUX_NBUFS;
+ req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+ req.memory = V4L2_MEMORY_MMAP;
+ if(-1 == xioctl(ac->fd, VIDIOC_REQBUFS, &req)){ what = "VIDIOC_REQBUFS"; goto fail; }
+ if(req.count < 2){
+   snprintf(msgtxt, sizeof msgtxt, "Insufficient MMAP buffer memory on %.256s",ac->name);
+   goto fail_msg;
+  }
+ ac->bufs = (struct buffer *)calloc(req.count, sizeof(*ac->bufs));
+ if(ac->bufs == NULL){
+   snprintf(msgtxt, sizeof msgtxt, "No RAM for the buffer list of %.256s",ac->name);
+   goto fail_msg;
+  }
+ for(ac->nbufs = 0; ac->nbufs < req.count; ++ac->nbufs){
+    CLEAR(buf);
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = ac->nbufs;
+    if(-1 == xioctl(ac->fd, VIDIOC_QUERYBUF, &buf)){ what = "VIDIOC_QUERYBUF"; goto fail; }
+    ac->bufs[ac->nbufs].length = buf.length;
+    ac->bufs[ac->nbufs].start = mmap(NULL, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, ac->fd, buf.m.offset);
+    if(MAP_FAILED == ac->bufs[ac->nbufs].start){ what = "mmap"; goto fail; }
+   }
+
+ pthread_mutex_lock(&ac->lock);
+ for(i = 0, what = NULL; i < AUX_RING; i++)
+    if((ac->ring[i] = (unsigned char *)malloc(ac->bufs[0].length)) == NULL) what = "malloc";
+ ac->frames = ac->dropped = 0;
+ ac->held = -1;
+ ac->vseq_valid = 0;
+ ac->last_mono_us = 0;
+ ac->mean_dt_us = ac->jitter_us = 0.0;
+ pthread_mutex_unlock(&ac->lock);
+ if(what != NULL){
+   snprintf(msgtxt, sizeof msgtxt, "No RAM for frames from %.256s",ac->name);
+   goto fail_msg;
+  }
+
+ for(i = 0; i < ac->nbufs; ++i){
+    CLEAR(buf);
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = i;
+    if(-1 == xioctl(ac->fd, VIDIOC_QBUF, &buf)){ what = "VIDIOC_QBUF"; goto fail; }
+   }
+ type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+ if(-1 == xioctl(ac->fd, VIDIOC_STREAMON, &type)){ what = "VIDIOC_STREAMON"; goto fail; }
+ ac->running = 1;
+ ac->worker_run = 1;
+ if(pthread_create(&ac->worker, NULL, auxcam_worker, ac)){
+   ac->worker_run = 0;
+   snprintf(msgtxt, sizeof msgtxt, "Could not start the save worker of %.256s",ac->name);
+   goto fail_msg;
+  }
+ ac->worker_up = 1;
+ return 0;
+
+fail:
+ ac->err_errno = errno;
+ snprintf(msgtxt, sizeof msgtxt, "%.256s: %s error %d, %.256s",ac->name, what, errno, strerror(errno));
+fail_msg:
+ show_message(msgtxt,"Camera Error: ",MT_ERR,1);
+ auxcam_stop(ac);
+ ac->failed = 1;
+ return 1;
+}
+
+static void auxcam_keep(struct auxcam *ac, unsigned int idx, unsigned int bytes, long long t_us)
+// Copy the frame in driver buffer idx of an additional camera into its
+// ring of newest frames (with ac->lock held)
+{
+ if(bytes > ac->bufs[0].length) return;
+ memcpy(ac->ring[ac->frames % AUX_RING], ac->bufs[idx].start, bytes);
+ ac->ring_size[ac->frames % AUX_RING] = bytes;
+ ac->ring_us[ac->frames % AUX_RING] = t_us;
+ ac->frames++;
+ pthread_cond_broadcast(&ac->cond);
+}
+
+static int auxcam_read(struct auxcam *ac)
+// Dequeue a frame from an additional camera. While a save may want it
+// (see auxcam_arm_all) keep a copy of it in the ring of newest frames
+// and give the buffer straight back to the driver. Otherwise there is
+// no need to copy it, so just keep it back in its buffer in place of
+// the one kept before (which goes back to the driver), ready to be
+// copied if a save wants the frame before its first one.
+// This runs in the capture thread so it must not use the GUI.
+// Returns 0 if all is well (or there was no frame yet), 1 on error
+// with errno noted in ac->err_errno.
+{
+ struct v4l2_buffer buf;
+ struct timespec mono_now;
+ long long t_us;
+ double dt;
+ int old,keep;
+
+ CLEAR(buf);
+ buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+ buf.memory = V4L2_MEMORY_MMAP;
+ if(-1 == xioctl(ac->fd, VIDIOC_DQBUF, &buf)){
+   if(EAGAIN == errno) return 0;
+   ac->err_errno = errno;
+   return 1;
+  }
+ if((buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+   t_us = (long long)buf.timestamp.tv_sec*1000000LL + buf.timestamp.tv_usec;
+  else {
+   clock_gettime(CLOCK_MONOTONIC,&mono_now);
+   t_us = (long long)mono_now.tv_sec*1000000LL + mono_now.tv_nsec/1000;
+  }
+
+ pthread_mutex_lock(&ac->lock);
+ old = ac->held;
+ keep = ac->armed || ac->jobs_queued != ac->jobs_done;
+ if(keep){
+   if(old >= 0) auxcam_keep(ac, (unsigned int)old, ac->held_bytes, ac->held_us);
+   auxcam_keep(ac, buf.index, buf.bytesused, t_us);
+   ac->held = -1;
+  } else {
+   ac->held = (int)buf.index;
+   ac->held_bytes = buf.bytesused;
+   ac->held_us = t_us;
+  }
+ if(ac->vseq_valid && buf.sequence - ac->last_vseq > 1) ac->dropped += buf.sequence - ac->last_vseq - 1;
+ ac->last_vseq = buf.sequence;
+ ac->vseq_valid = 1;
+ if(ac->last_mono_us){ // Smoothed as for the main camera in cap_publish()
+   dt = (double)(t_us - ac->last_mono_us);
+   if(ac->mean_dt_us == 0.0) ac->mean_dt_us = dt;
+    else ac->mean_dt_us += (dt - ac->mean_dt_us)/16.0;
+   ac->jitter_us += (fabs(dt - ac->mean_dt_us) - ac->jitter_us)/16.0;
+  }
+ ac->last_mono_us = t_us;
+ pthread_mutex_unlock(&ac->lock);
+
+ if(keep && -1 == xioctl(ac->fd, VIDIOC_QBUF, &buf)){
+   ac->err_errno = errno;
+   return 1;
+  }
+ if(old >= 0){
+   buf.index = (unsigned int)old;
+   if(-1 == xioctl(ac->fd, VIDIOC_QBUF, &buf)){
+     ac->err_errno = errno;
+     return 1;
+    }
+  }
+ return 0;
+}
+
+static void auxcam_arm_all(int on)
+// Have the additional cameras keep their frames in their rings from now
+// on (on=1), from the start of a grab that will be saved so that the
+// frames nearest its first one are there for auxcam_save, or only while
+// they have save jobs to do (on=0)
+{
+ struct auxcam *ac;
+ int k;
+
+ for(k = 0; k < N_auxcams; k++){
+    ac = &Auxcams[k];
+    pthread_mutex_lock(&ac->lock);
+    ac->armed = on;
+    pthread_mutex_unlock(&ac->lock);
+   }
+}
+
+static void auxcam_start_all(void)
+// Start streaming from the additional cameras (any that have failed
+// before are left alone) and add them to the capture thread's epoll set
+{
+ struct epoll_event ev;
+ int k;
+
+ for(k = 0; k < N_auxcams; k++){
+    if(Auxcams[k].failed || auxcam_start(&Auxcams[k])) continue;
+    CLEAR(ev);
+    ev.events = EPOLLIN;
+    ev.data.u32 = (uint32_t)k;
+    if(-1 == epoll_ctl(Cap_epfd, EPOLL_CTL_ADD, Auxcams[k].fd, &ev)){
+      Auxcams[k].err_errno = errno;
+      auxcam_stop(&Auxcams[k]);
+      Auxcams[k].failed = 1;
+     }
+   }
+}
+
+static void auxcam_stop_all(void)
+// Stop all the additional cameras (the capture thread must be stopped)
+{
+ int k;
+
+ for(k = 0; k < N_auxcams; k++) auxcam_stop(&Auxcams[k]);
+}
+
+static int auxcam_add_frame(struct auxcam *ac, const unsigned char *p, size_t size, double *acc, unsigned char *row)
+// Convert a frame from an additional camera to RGB and add it to the
+// accumulator acc (3 doubles per pixel). YUYV is converted using the
+// same LUTs as the main camera. row is scratch space for one RGB row.
+// Returns 0 on success, 1 if an MJPEG frame could not be decoded.
+{
+ struct jpeg_decompress_struct info;
+ struct my_error_mgr err;
+ unsigned int x;
+ size_t pos,npix;
+ int y1,y2,cb,cr;
+ double fval;
+
+ if(ac->fmt == V4L2_PIX_FMT_YUYV){
+   npix = (size_t)ac->wd*ac->ht;
+   if(size < 2*npix) return 1;
+   for(pos = 0; pos < npix; pos += 2, p += 4, acc += 6){
+      y1 = p[0]; cb = p[1]; y2 = p[2]; cr = p[3];
+      fval = lut_crG[cr] + lut_cbG[cb];
+      acc[0] += lut_yR[y1] + lut_crR[cr];
+      acc[1] += lut_yG[y1] - fval;
+      acc[2] += lut_yB[y1] + lut_cbB[cb];
+      acc[3] += lut_yR[y2] + lut_crR[cr];
+      acc[4] += lut_yG[y2] - fval;
+      acc[5] += lut_yB[y2] + lut_cbB[cb];
+     }
+   return 0;
+  }
+
+ info.err = jpeg_std_error(&err.pub);
+ err.pub.error_exit = my_error_exit;
+ if(setjmp(err.setjmp_buffer)){
+   jpeg_destroy_decompress(&info);
+   return 1;
+  }
+ jpeg_create_decompress(&info);
+ jpeg_mem_src(&info, p, (unsigned long int)size);
+ if(jpeg_read_header(&info, TRUE) != JPEG_HEADER_OK) goto fail;
+ info.out_color_space = JCS_RGB;
+ jpeg_start_decompress(&info);
+ if(info.output_width != ac->wd || info.output_height != ac->ht || info.output_components != 3){
+   jpeg_abort_decompress(&info);
+   goto fail;
+  }
+ while(info.output_scanline < info.output_height){
+      jpeg_read_scanlines(&info, &row, 1);
+      for(x = 0; x < 3*ac->wd; x++) *acc++ += row[x];
+     }
+ jpeg_finish_decompress(&info);
+ jpeg_destroy_decompress(&info);
+ return 0;
+
+fail:
+ jpeg_destroy_decompress(&info);
+ return 1;
+}
+
+static int auxcam_wait_frame(struct auxcam *ac, unsigned long n, const struct timespec *until)
+// Wait, with ac->lock held, for frame n of an additional camera to
+// arrive (it may have been overwritten in the ring by then).
+// Returns 0 when it has, 1 on timeout, if the worker is stopped or if
+// the camera has failed.
+{
+ while(ac->frames <= n){
+      if(!ac->worker_run || ac->failed) return 1;
+      if(ETIMEDOUT == pthread_cond_timedwait(&ac->cond, &ac->lock, until)) return 1;
+     }
+ return 0;
+}
+
+static void auxcam_save(struct auxcam *ac, struct auxjob *job)
+// Do a save job of an additional camera (in its save worker): make the
+// image from the frame nearest in time to the main camera's, averaged
+// with the frames that follow it if the camera was given more than one
+// frame to average, and write it to job->fname as a PNG file. What
+// became of it is left in job->failed and job->txt for auxcam_report().
+{
+ struct timespec until;
+ unsigned char *frame,*row;
+ double *acc;
+ unsigned long n;
+ long long offset_us = 0;
+ size_t size,pos,nval;
+ char title[PATH_MAX+64];
+ int k;
+ ImgView iv;
+
+ job->failed = 1;
+ nval = (size_t)ac->wd*ac->ht*3;
+ frame = (unsigned char *)malloc(ac->bufs[0].length);
+ acc = (double *)calloc(nval, sizeof(double));
+ row = (unsigned char *)malloc((size_t)ac->wd*3);
+ if(frame == NULL || acc == NULL || row == NULL){
+   snprintf(job->txt, sizeof job->txt, "No RAM to save image %d.", job->fnum);
+   goto end_of;
+  }
+ clock_gettime(CLOCK_REALTIME, &until);
+ until.tv_sec += Gb_Timeout;
+
+ pthread_mutex_lock(&ac->lock);
+ if(job->t_us == 0){ // No time to match so take the newest frame
+   n = ac->frames ? ac->frames-1 : 0;
+   if(auxcam_wait_frame(ac, n, &until)) goto timed_out;
+  } else {
+   // Find the first frame at or after the main camera's (waiting for it
+   // if need be) and then take it or the one before, whichever is nearer.
+   n = (ac->frames > AUX_RING) ? ac->frames-AUX_RING : 0;
+   FOREVER {
+       if(auxcam_wait_frame(ac, n, &until)) goto timed_out;
+       if(n + AUX_RING < ac->frames) n = ac->frames-AUX_RING;
+        else if(ac->ring_us[n % AUX_RING] >= job->t_us) break;
+         else n++;
+      }
+   if(n > 0 && n-1 + AUX_RING >= ac->frames &&
+      job->t_us - ac->ring_us[(n-1) % AUX_RING] < ac->ring_us[n % AUX_RING] - job->t_us) n--;
+   offset_us = ac->ring_us[n % AUX_RING] - job->t_us;
+  }
+ for(k = 0; k < ac->navg; k++, n++){
+    if(auxcam_wait_frame(ac, n, &until)) goto timed_out;
+    if(n + AUX_RING < ac->frames) n = ac->frames-AUX_RING; // Fell behind
+    size = ac->ring_size[n % AUX_RING];
+    memcpy(frame, ac->ring[n % AUX_RING], size);
+    pthread_mutex_unlock(&ac->lock);
+    if(auxcam_add_frame(ac, frame, size, acc, row)){
+      snprintf(job->txt, sizeof job->txt, "Could not decode a frame for image %d.", job->fnum);
+      goto end_of;
+     }
+    pthread_mutex_lock(&ac->lock);
+   }
+ pthread_mutex_unlock(&ac->lock);
+
+ // The averages are written straight from acc (as R,G,B doubles)
+ for(pos = 0; pos < nval; pos++) acc[pos] /= (double)ac->navg;
+ iv.wd = (int)ac->wd; iv.ht = (int)ac->ht;
+ iv.nchan = 3; iv.type = IV_DOUBLE;
+ iv.plane[0] = acc; iv.plane[1] = acc+1; iv.plane[2] = acc+2;
+ iv.step = 3; iv.stride = 3*(size_t)ac->wd;
+ snprintf(title, sizeof title, "PARD Capture %s frame %d", ac->name, job->fnum);
+ if(write_png_image(job->fname, &iv, title)){
+   snprintf(job->txt, sizeof job->txt, "Could not write %s.", job->fname);
+   goto end_of;
+  }
+ job->failed = 0;
+ if(job->t_us)
+   snprintf(job->txt, sizeof job->txt, "Saved %s (%+.1f ms from the main camera's frame)", job->fname, offset_us/1000.0);
+  else snprintf(job->txt, sizeof job->txt, "Saved %s", job->fname);
+ goto end_of;
+
+timed_out:
+ pthread_mutex_unlock(&ac->lock);
+ snprintf(job->txt, sizeof job->txt, "Timed out waiting for a frame for image %d.", job->fnum);
+end_of:
+ free(frame); free(acc); free(row);
+}
+
+static void *auxcam_worker(void *arg)
+// The save worker of an additional camera. Does the save jobs that
+// auxcam_save_all() queues, in turn, until auxcam_stop() stops it. It
+// must not use the GUI.
+{
+ struct auxcam *ac = (struct auxcam *)arg;
+
+ pthread_mutex_lock(&ac->lock);
+ while(ac->worker_run){
+      if(ac->jobs_done == ac->jobs_queued){
+        pthread_cond_wait(&ac->cond, &ac->lock);
+        continue;
+       }
+      pthread_mutex_unlock(&ac->lock);
+      auxcam_save(ac, &ac->jobs[ac->jobs_done % AUX_JOBS]);
+      pthread_mutex_lock(&ac->lock);
+      ac->jobs_done++;
+      pthread_cond_broadcast(&ac->cond);
+     }
+ pthread_mutex_unlock(&ac->lock);
+ return NULL;
+}
 
+static void auxcam_log(int k, const char *txt, int failed)
+// Tell the user about a save of additional camera k and put it in the
+// series log if a series is being captured
+{
+ char msgtxt[PATH_MAX+256];
+
+ snprintf(msgtxt, sizeof msgtxt, "Camera %d (%.40s): %s", k+2, Auxcams[k].name, txt);
+ if(failed){
+   __atomic_add_fetch(&Auxcams[k].failures, 1, __ATOMIC_RELAXED);
+   show_message(msgtxt,"Image Capture FAILED: ",MT_ERR,0);
+  } else show_message(msgtxt,"FYI: ",MT_INFO,0);
+ if(Ser_active){
+   FPseries=fopen(Ser_logname,"ab");
+   if(FPseries!=NULL){
+     fprintf(FPseries,"# %s%s\n",failed ? "FAILED - " : "",msgtxt);
+     fflush(FPseries); fclose(FPseries);
     }
- }
+  }
+}
 
- return;
+static int auxcam_report(void)
+// Report the save jobs the additional cameras have done since the last
+// call (from the GUI thread, the workers can't).
+// Returns the number of them that failed.
+{
+ struct auxcam *ac;
+ char txt[PATH_MAX+192];
+ int k,failed,failures=0;
+
+ for(k = 0; k < N_auxcams; k++){
+    ac = &Auxcams[k];
+    pthread_mutex_lock(&ac->lock);
+    while(ac->jobs_reported != ac->jobs_done){
+         failed = ac->jobs[ac->jobs_reported % AUX_JOBS].failed;
+         snprintf(txt, sizeof txt, "%s", ac->jobs[ac->jobs_reported % AUX_JOBS].txt);
+         ac->jobs_reported++;
+         pthread_mutex_unlock(&ac->lock);
+         auxcam_log(k, txt, failed);
+         failures += failed;
+         pthread_mutex_lock(&ac->lock);
+        }
+    pthread_mutex_unlock(&ac->lock);
+   }
+ return failures;
 }
 
-static int read_frame(void)
+static void auxcam_finish_all(void)
+// Wait for the save workers of the additional cameras to do the jobs
+// they have been given (while the capture thread is still bringing
+// them frames)
 {
- struct v4l2_buffer buf;
+ struct auxcam *ac;
+ int k;
+
+ for(k = 0; k < N_auxcams; k++){
+    ac = &Auxcams[k];
+    if(!ac->worker_up) continue;
+    pthread_mutex_lock(&ac->lock);
+    while(ac->jobs_done != ac->jobs_queued && !ac->failed)
+         pthread_cond_wait(&ac->cond, &ac->lock);
+    pthread_mutex_unlock(&ac->lock);
+   }
+}
+
+static int auxcam_save_all(int fnum)
+// Give the save worker of each additional camera the job of saving an
+// image to go with image number fnum of the main camera, as
+// <root>_<fnum>.png, from its frame nearest in time to the first frame
+// of that image. Reports any saves done since the last call first.
+// Returns the number of cameras that could not take the job.
+{
+ struct auxcam *ac;
+ struct auxjob *job;
+ char msgtxt[128];
+ int k,k2,failures;
+
+ auxcam_report();
+ failures = 0;
+ for(k = 0; k < N_auxcams; k++){
+    ac = &Auxcams[k];
+    if(!ac->worker_up || __atomic_load_n(&ac->failed, __ATOMIC_ACQUIRE)) continue;
+    pthread_mutex_lock(&ac->lock);
+    if(ac->jobs_queued - ac->jobs_reported == AUX_JOBS){
+      pthread_mutex_unlock(&ac->lock);
+      snprintf(msgtxt, sizeof msgtxt, "Image %d was not saved because the earlier ones are still being saved.", fnum);
+      auxcam_log(k, msgtxt, 1);
+      failures++;
+      continue;
+     }
+    job = &ac->jobs[ac->jobs_queued % AUX_JOBS];
+    job->fnum = fnum;
+    job->t_us = Obs_mono_us;
+    if(ac->root[0]) k2 = snprintf(job->fname, sizeof job->fname, "%s_%04d.png", ac->root, fnum);
+     else k2 = snprintf(job->fname, sizeof job->fname, "%s_cam%d_%04d.png", ImRoot, k+2, fnum);
+    if(k2 < 0 || k2 >= (int)sizeof job->fname){
+      pthread_mutex_unlock(&ac->lock);
+      snprintf(msgtxt, sizeof msgtxt, "Image %d was not saved because its file name is too long.", fnum);
+      auxcam_log(k, msgtxt, 1);
+      failures++;
+      continue;
+     }
+    ac->jobs_queued++;
+    pthread_cond_broadcast(&ac->cond);
+    pthread_mutex_unlock(&ac->lock);
+   }
+ return failures;
+}
+
+static void auxcam_stats_text(char *txt)
+// Append a line of stats (as for the main camera) for each additional
+// camera to txt
+{
+ struct auxcam *ac;
+ double mean_us,jit_us;
+ unsigned long dropped,failures;
+ int k;
+
+ for(k = 0; k < N_auxcams; k++){
+    ac = &Auxcams[k];
+    txt += strlen(txt);
+    if(__atomic_load_n(&ac->failed, __ATOMIC_ACQUIRE)){
+      sprintf(txt,"\nCamera %d (%.40s): stopped - %s",k+2,ac->name,ac->err_errno ? strerror(ac->err_errno) : "could not start");
+      continue;
+     }
+    if(!ac->running){
+      sprintf(txt,"\nCamera %d (%.40s): -",k+2,ac->name);
+      continue;
+     }
+    pthread_mutex_lock(&ac->lock);
+    mean_us = ac->mean_dt_us; jit_us = ac->jitter_us; dropped = ac->dropped;
+    pthread_mutex_unlock(&ac->lock);
+    failures = __atomic_load_n(&ac->failures, __ATOMIC_RELAXED);
+    sprintf(txt,"\nCamera %d (%.40s): %.2f fps  |  Jitter %.2f ms  |  Dropped %lu",
+           k+2, ac->name, (mean_us > 0.0) ? 1.0e6/mean_us : 0.0, jit_us/1000.0, dropped);
+    if(failures) sprintf(txt+strlen(txt),"  |  Saves FAILED %lu",failures);
+   }
+}
+
+static void *capture_thread(void *arg)
+// The capture thread. Services the v4l2 buffer queue for as long as the
+// camera is streaming so frames are dequeued at the camera's own rate
+// whatever the GUI happens to be doing at the time. If something goes
+// wrong the error is latched in Cap_thread_err and the thread ends.
+// Any additional cameras are serviced too. If one of those fails it is
+// dropped from the epoll set and marked as failed but the others carry
+// on.
+{
+ struct epoll_event ev[1 + MAX_AUXCAMS];
+ struct auxcam *ac;
+ int r,n,returnval;
+
+ while(__atomic_load_n(&Cap_thread_run, __ATOMIC_ACQUIRE)){
+
+     // Buffers the consumers have finished with go back to the driver
+     // first so it always has as many as possible to fill.
+     if((returnval = cap_requeue_released())) goto latch;
+
+     // Wake up regularly even if the camera has stopped sending frames
+     // so that released buffers are re-queued and a request to stop the
+     // thread is noticed promptly.
+     r = epoll_wait(Cap_epfd, ev, 1 + MAX_AUXCAMS, 20);
+
+     if(-1 == r){
+        if(EINTR == errno) continue;
+        Cap_thread_errno = errno;
+        returnval = GRAB_ERR_SELECT; // Error selecting frame
+        goto latch;
+       }
+
+     for(n = 0; n < r; n++){
+        if(ev[n].data.u32 == AUX_PRIMARY){
+           returnval = read_frame();
+           if(returnval > GRAB_ERR_NONE) goto latch;
+           continue;
+          }
+        ac = &Auxcams[ev[n].data.u32];
+        if(auxcam_read(ac)){
+           epoll_ctl(Cap_epfd, EPOLL_CTL_DEL, ac->fd, NULL);
+           pthread_mutex_lock(&ac->lock); // (Its worker may be waiting)
+           __atomic_store_n(&ac->failed, 1, __ATOMIC_RELEASE);
+           pthread_cond_broadcast(&ac->cond);
+           pthread_mutex_unlock(&ac->lock);
+          }
+       }
+   }
+ return NULL;
+
+latch:
+ __atomic_store_n(&Cap_thread_err, returnval, __ATOMIC_RELEASE);
+ return NULL;
+}
+
+static int start_capture_thread(void)
+// Reset the buffer leases and start the capture thread (and any
+// additional cameras). Called once the stream has been switched on (so
+// all buffers are queued).
+// Returns 0 on success, 1 on failure.
+{
+ struct epoll_event ev;
  unsigned int i;
+
+ if(Cap_thread_up) return 0;
+
+ for(i = 0; i < n_buffers; ++i){
+    buffers[i].state = LEASE_QUEUED;
+    buffers[i].refs = 0;
+    buffers[i].seq = 0;
+    buffers[i].bytesused = 0;
+   }
+ Cap_hold_max = n_buffers/2;
+ if(Cap_hold_max + CAP_MIN_QUEUED > n_buffers) Cap_hold_max = (n_buffers > CAP_MIN_QUEUED) ? n_buffers - CAP_MIN_QUEUED : 1;
+ if(Cap_hold_max > CAP_HOLD_FRAMES) Cap_hold_max = CAP_HOLD_FRAMES;
+ if(Cap_hold_max < 1) Cap_hold_max = 1;
+ Cap_head = Cap_prev_seq = Cap_grab_seq = 0;
+ Cap_thread_err = Cap_err_reported = 0;
+ Cap_thread_errno = 0;
+ Cap_seq_gaps = Cap_gaps_seen = 0;
+ Cap_vseq_valid = 0;
+ Cap_last_adapt = time(NULL);
+ Cap_last_mono_us = 0;
+ Cap_mean_dt_us = Cap_jitter_us = 0.0;
+
+ // One epoll set for the main camera and any additional ones
+ Cap_epfd = epoll_create1(0);
+ if(-1 == Cap_epfd){
+    show_message("Could not create the capture epoll set.","Camera Error: ",MT_ERR,1);
+    return 1;
+   }
+ CLEAR(ev);
+ ev.events = EPOLLIN;
+ ev.data.u32 = AUX_PRIMARY;
+ if(-1 == epoll_ctl(Cap_epfd, EPOLL_CTL_ADD, fd, &ev)){
+    show_message("Could not add the camera to the capture epoll set.","Camera Error: ",MT_ERR,1);
+    goto fail;
+   }
+ auxcam_start_all();
+
+ Cap_thread_run = 1;
+ if(pthread_create(&Cap_thread, NULL, capture_thread, NULL)){
+    Cap_thread_run = 0;
+    show_message("Could not start the capture thread.","Camera Error: ",MT_ERR,1);
+    auxcam_stop_all();
+    goto fail;
+   }
+ Cap_thread_up = 1;
+ return 0;
+
+fail:
+ close(Cap_epfd);
+ Cap_epfd = -1;
+ return 1;
+}
+
+static void stop_capture_thread(void)
+// Ask the capture thread to finish and wait for it, then stop any
+// additional cameras. Any saves their workers have been given are done
+// first, if the capture thread is still bringing them frames, and then
+// reported. This must be done before the stream is switched off or the
+// buffers are freed.
+{
+ if(!Cap_thread_up) return;
+ if(!__atomic_load_n(&Cap_thread_err, __ATOMIC_ACQUIRE)) auxcam_finish_all();
+ __atomic_store_n(&Cap_thread_run, 0, __ATOMIC_RELEASE);
+ pthread_join(Cap_thread, NULL);
+ Cap_thread_up = 0;
+ auxcam_stop_all();
+ auxcam_report();
+ close(Cap_epfd);
+ Cap_epfd = -1;
+}
+
+static void report_capture_error(int code)
+// The capture thread cannot use the GUI so, when grab_image() finds it
+// has stopped with an error, this is called (from the GUI thread) to
+// tell the user - once only.
+{
  char msgtxt[1024];
+ char *what;
+
+ if(Cap_err_reported) return;
+ Cap_err_reported = 1;
+
+ switch(code){
+    case GRAB_ERR_READIO: what = "read";         break;
+    case GRAB_ERR_MMAPD:
+    case GRAB_ERR_USERPD: what = "VIDIOC_DQBUF"; break;
+    case GRAB_ERR_MMAPQ:
+    case GRAB_ERR_USERPQ: what = "VIDIOC_QBUF";  break;
+    default:              what = NULL;           break; // The caller
+                                      // has its own message for these.
+   }
+ if(what != NULL){
+   sprintf(msgtxt,"%s error %d, %s.\nYou may need to quit the program, check the camera connection and re-start.", what, Cap_thread_errno, strerror(Cap_thread_errno));
+   // No popup if we are saving - the camera is about to be re-opened.
+   show_message(msgtxt,"Camera Error: ",MT_ERR,(Need_to_save && Reopen_tries) ? 0 : 1);
+  }
+ // This can happen if the camera is accidentally disconnected (e.g. the
+ // USB cable is dislodged by accident). No more frames will arrive, so
+ // to give the user the chance to exit gracefully, switch off previewing
+ // if it is active rather than have it keep trying:
+ Need_to_preview=PREVIEW_OFF;
+ if(gui_up){
+   gtk_label_set_text(GTK_LABEL(Label_preview)," Preview is OFF ");
+   gtk_widget_show(Ebox_lab_preview);
+  }
+}
 
-  switch (io) {
-        case IO_METHOD_READ:
-                if(-1 == read(fd, buffers[0].start, buffers[0].length)){
-                   switch (errno) {
-                        case EAGAIN: return 0; // Need to try again
-                        case EIO: // Could ignore EIO, see spec. Fall through.
-                        default:
-                            sprintf(msgtxt,"%s error %d, %s", "read", errno, strerror(errno));
-                            show_message(msgtxt,"Camera Error: ",MT_ERR,1);
-                            return GRAB_ERR_READIO; 
-                    }
-                }
-                if(skipframe==skiplim)
-                 process_image(buffers[0].start, buffers[0].length);
-                break;
+static int wait_for_grab_frame(int *idx)
+// Wait for frame number Cap_grab_seq to be published by the capture
+// thread and take out a lease on it, returning its buffer index in *idx
+// (the caller must cap_lease_release() it). If idx is NULL the frame is
+// just waited for and skipped. Then move the grab cursor on to the next
+// frame. Gives up after frame_timeout_sec / frame_timeout_usec.
+// If the grab stage has fallen so far behind that the frame has already
+// been re-queued, the cursor is moved on to the oldest frame still held
+// and the loss is counted in Cap_dropped.
+// Returns a GRAB_ERR_ code.
+{
+ struct timeval t0,t1;
+ long long limit_us,waited_us;
+ unsigned long head,oldest;
+ int r;
 
-        case IO_METHOD_MMAP:
-                CLEAR(buf);
-                buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-                buf.memory = V4L2_MEMORY_MMAP;
-                if(-1 == xioctl(fd, VIDIOC_DQBUF, &buf)){
-                   switch (errno) {
-                        case EAGAIN: return 0; // Need to try again
-                        case EIO: // Could ignore EIO, see spec. Fall through.
-                        default:
-                            sprintf(msgtxt,"%s error %d, %s", "VIDIOC_DQBUF", errno, strerror(errno));
-                            show_message(msgtxt,"Camera Error: ",MT_ERR,1);
-                            return GRAB_ERR_MMAPD; 
-                    }
-                }
-                assert(buf.index < n_buffers);
-                if(skipframe==skiplim)
-                 process_image(buffers[buf.index].start, buf.bytesused);
-                if(-1 == xioctl(fd, VIDIOC_QBUF, &buf)){
-                   sprintf(msgtxt,"%s error %d, %s", "VIDIOC_QBUF", errno, strerror(errno));
-                   show_message(msgtxt,"Camera Error: ",MT_ERR,1);
-                   return GRAB_ERR_MMAPQ;
-                  }
-                break;
+ limit_us = (long long)frame_timeout_sec*1000000LL + frame_timeout_usec;
+ gettimeofday(&t0,NULL);
+ FOREVER {
+     head = __atomic_load_n(&Cap_head, __ATOMIC_SEQ_CST);
+     if(idx != NULL) r = cap_lease_acquire(Cap_grab_seq);
+      else           r = (Cap_grab_seq > head) ? -1 : 0;
+     if(r >= 0) break;
+     if(r == -2){
+        oldest = (head > Cap_hold_max) ? head - Cap_hold_max + 1 : 1;
+        if(oldest <= Cap_grab_seq) oldest = Cap_grab_seq + 1;
+        Cap_dropped += oldest - Cap_grab_seq;
+        Cap_grab_seq = oldest;
+        continue;
+       }
+     // Not arrived yet. Anything already held is still usable but if
+     // the capture thread has stopped nothing more is coming.
+     r = __atomic_load_n(&Cap_thread_err, __ATOMIC_ACQUIRE);
+     if(r) return r;
+     gettimeofday(&t1,NULL);
+     waited_us = (long long)(t1.tv_sec - t0.tv_sec)*1000000LL + (t1.tv_usec - t0.tv_usec);
+     if(waited_us >= limit_us) return GRAB_ERR_TIMEOUT;
+     usleep(500);
+   }
+ if(idx != NULL) *idx = r;
+ Cap_grab_seq++;
+ return GRAB_ERR_NONE;
+}
 
-        case IO_METHOD_USERPTR:
-                CLEAR(buf);
-                buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-                buf.memory = V4L2_MEMORY_USERPTR;
-                if (-1 == xioctl(fd, VIDIOC_DQBUF, &buf)) {
-                   switch (errno) {
-                        case EAGAIN: return 0; // Need to try again
-                        case EIO: // Could ignore EIO, see spec. Fall through.
-                        default:
-                            sprintf(msgtxt,"%s error %d, %s.\nYou may need to quit the program, check the camera connection and re-start.", "VIDIOC_DQBUF", errno, strerror(errno));
-                            show_message(msgtxt,"Camera Error: ",MT_ERR,1);
-                            // This error can happen if the camera is
-                            // accidentally disconnected (e.g. the USB
-                            // cable is dislodged by accident). In this
-                            // case the user cannot recover and if live
-                            // preview is happening this error popup
-                            // will just continue endlessly with every
-                            // attempt to read a preview image. So, to
-                            // give the user the change to exit
-                            // gracefully, switch off previewing if it
-                            // is active:
-                            Need_to_preview=PREVIEW_OFF;
-                            gtk_label_set_text(GTK_LABEL(Label_preview)," Preview is OFF ");
-                            gtk_widget_show(Ebox_lab_preview);
-                            
-                            return GRAB_ERR_USERPD; 
-                    }
-                }
+static long long cap_frame_start_us(int idx)
+// Best estimate of when buffer idx's frame began to be exposed. Most
+// drivers stamp frames at the start of exposure but if the stamp is
+// from the end of the frame (or is just when it was dequeued) go back
+// one frame period.
+{
+ double mean_us;
 
-                for(i = 0; i < n_buffers; ++i)
-                    if (buf.m.userptr == (unsigned long)buffers[i].start && buf.length == buffers[i].length) break;
-                assert(i < n_buffers);
-                if(skipframe==skiplim)
-                 process_image((void *)buf.m.userptr, buf.bytesused);
-                if(-1 == xioctl(fd, VIDIOC_QBUF, &buf)){
-                   sprintf(msgtxt,"%s error %d, %s.\nYou may need to quit the program, check the camera connection and re-start.", "VIDIOC_QBUF", errno, strerror(errno));
-                   show_message(msgtxt,"Camera Error: ",MT_ERR,1);
-                    // This error can happen if the camera is
-                    // accidentally disconnected (e.g. the USB
-                    // cable is dislodged by accident). In this
-                    // case the user cannot recover and if live
-                    // preview is happening this error popup
-                    // will just continue endlessly with every
-                    // attempt to read a preview image. So, to
-                    // give the user the change to exit
-                    // gracefully, switch off previewing if it
-                    // is active:
-                    Need_to_preview=PREVIEW_OFF;
-                    gtk_label_set_text(GTK_LABEL(Label_preview)," Preview is OFF ");
-                    gtk_widget_show(Ebox_lab_preview);
-                   return GRAB_ERR_USERPQ;
-                  }
-                break;
-    }
-  
- return GRAB_ERR_NONE; 
+ if(io != IO_METHOD_READ &&
+    (buffers[idx].vbuf.flags & V4L2_BUF_FLAG_TSTAMP_SRC_MASK) == V4L2_BUF_FLAG_TSTAMP_SRC_SOE)
+   return buffers[idx].mono_us;
+ __atomic_load(&Cap_mean_dt_us, &mean_us, __ATOMIC_RELAXED);
+ return buffers[idx].mono_us - (long long)mean_us;
+}
+
+static int wait_for_fresh_frame(int *idx)
+// The 'Grab freshest frame' alternative to waiting for frames in turn.
+// Frames exposed before the grab was asked for, or before the camera
+// had a frame period to take up the last control change (e.g. focus or
+// exposure), are stale. While waiting the capture thread holds only the
+// newest frame, giving every other buffer straight back to the driver,
+// and only that newest frame is looked at, so any number of stale
+// frames are passed over without being waited for or decoded one at a
+// time. The first fresh one is leased and its buffer index returned in
+// *idx (the caller must cap_lease_release() it) with the grab cursor
+// moved on past it so any further frames for averaging follow on.
+// Gives up after frame_timeout_sec / frame_timeout_usec.
+// Returns a GRAB_ERR_ code.
+{
+ struct timeval t0,t1;
+ struct timespec mono_now;
+ long long limit_us,waited_us,after_us;
+ double mean_us;
+ unsigned long head;
+ int r;
+
+ clock_gettime(CLOCK_MONOTONIC,&mono_now);
+ after_us = (long long)mono_now.tv_sec*1000000LL + mono_now.tv_nsec/1000;
+ __atomic_load(&Cap_mean_dt_us, &mean_us, __ATOMIC_RELAXED);
+ if(Cap_ctrl_us + (long long)mean_us > after_us) after_us = Cap_ctrl_us + (long long)mean_us;
+
+ limit_us = (long long)frame_timeout_sec*1000000LL + frame_timeout_usec;
+ __atomic_store_n(&Cap_fresh_only, 1, __ATOMIC_RELEASE);
+ gettimeofday(&t0,NULL);
+ FOREVER {
+     head = __atomic_load_n(&Cap_head, __ATOMIC_SEQ_CST);
+     if(head >= Cap_grab_seq){
+        r = cap_lease_acquire(head);
+        if(r == -2) continue; // Already superseded by a newer frame
+        if(cap_frame_start_us(r) >= after_us) break;
+        cap_lease_release(r);
+        Cap_grab_seq = head + 1; // Stale - don't look at it again
+       }
+     r = __atomic_load_n(&Cap_thread_err, __ATOMIC_ACQUIRE);
+     if(r) goto end_of;
+     gettimeofday(&t1,NULL);
+     waited_us = (long long)(t1.tv_sec - t0.tv_sec)*1000000LL + (t1.tv_usec - t0.tv_usec);
+     if(waited_us >= limit_us){
+        r = GRAB_ERR_TIMEOUT;
+        goto end_of;
+       }
+     usleep(500);
+   }
+ *idx = r;
+ Cap_grab_seq = head + 1;
+ r = GRAB_ERR_NONE;
+
+end_of:
+ __atomic_store_n(&Cap_fresh_only, 0, __ATOMIC_RELEASE);
+ return r;
+}
+
+static void note_grab_frame(int bufidx, int first)
+// Note the number and time of the frame in buffer bufidx (the first of
+// the grab if first is 1) for the record before it is processed (and
+// maybe saved).
+{
+ if(first){
+   Obs_wall_us = buffers[bufidx].wall_us;
+   Obs_mono_us = buffers[bufidx].mono_us;
+   Obs_first_vseq = buffers[bufidx].vseq;
+  }
+ Obs_last_vseq = buffers[bufidx].vseq;
+ Obs_dropped = __atomic_load_n(&Cap_seq_gaps, __ATOMIC_RELAXED) - Obs_gaps_start + Cap_dropped;
+}
+
+static int mjdec_next(unsigned long need, struct mjdec_slot **next)
+// Get the next frame of an MJPEG average, in the order they were taken,
+// decoded by the decode workers (see Mjdec) and return its slot in
+// *next. need is how many frames the average needs in all. While it
+// waits for the frame to be decoded, every frame the capture thread
+// publishes is copied to a free slot and its buffer given straight
+// back, so the camera is kept up with as long as the workers are.
+// Returns a GRAB_ERR_ code.
+{
+ struct mjdec_slot *sl;
+ int r,bufidx;
+
+ FOREVER {
+     // Hand on the frames that have come in, waiting for one only when
+     // none are being decoded
+     while(Mjdec.nsub < need){
+         if(mjdec_state(&Mjdec.slot[Mjdec.nsub % Mjdec.nslots]) != MJSLOT_FREE) break;
+         if(Mjdec.nsub > Mjdec.nacc && Cap_grab_seq > __atomic_load_n(&Cap_head, __ATOMIC_SEQ_CST)) break;
+         if(Gb_Freshest && Mjdec.nsub==0) r = wait_for_fresh_frame(&bufidx);
+          else r = wait_for_grab_frame(&bufidx);
+         if(r != GRAB_ERR_NONE) return r;
+         note_grab_frame(bufidx, Mjdec.nsub==0);
+         mjdec_submit((const unsigned char *)buffers[bufidx].start, (int)buffers[bufidx].bytesused);
+         cap_lease_release(bufidx);
+       }
+     sl = &Mjdec.slot[Mjdec.nacc % Mjdec.nslots];
+     if(mjdec_state(sl) == MJSLOT_DONE) break;
+     usleep(500);
+   }
+ Mjdec.nacc++;
+ *next = sl;
+ return GRAB_ERR_NONE;
 }
 
 static int grab_image(void)
 {
- int returnval,tmp_av_denom;
+ int returnval,tmp_av_denom,bufidx,pipelined=0;
+ struct mjdec_slot *sl;
+ unsigned long head;
  char imsg[64];
  
  if(image_being_grabbed) return GRAB_ERR_BUSY;
@@ -8396,17 +12320,24 @@ static int grab_image(void)
  image_being_grabbed = 1; // We mark the grabber as busy now ...
  
  // If this grab operation is called from the live preview timeout
- // function then we ignore any averaging and frame skips. Also we don't
- // want to hang the GUI waiting for a frame for the live preview so
- // give up after 100 microseconds if no frame could be grabbed in that
- // time. We also ignore any request for multi-frame averaging.
- // These special measures are taken because we don't use a separate
- // thread for our live preview window:
+ // function then we ignore any averaging and frame skips and just take
+ // the newest frame the capture thread has published, if it is one we
+ // have not already shown. We never wait for a frame here - the capture
+ // thread keeps the camera serviced so there is no reason to hold up
+ // the GUI.
  if(from_preview_timeout){ 
-      skipframe=skiplim;  
-      frame_timeout_sec  = 0;
-      frame_timeout_usec = 100;
-      goto just_the_one;   // Skip any averaging - just get one frame.
+      head = __atomic_load_n(&Cap_head, __ATOMIC_SEQ_CST);
+      if(head != Cap_prev_seq && (bufidx = cap_lease_acquire(head)) >= 0){
+         Cap_prev_seq = head;
+         process_image(buffers[bufidx].start, buffers[bufidx].bytesused);
+         cap_lease_release(bufidx);
+         returnval = GRAB_ERR_NONE;
+       } else {
+         returnval = __atomic_load_n(&Cap_thread_err, __ATOMIC_ACQUIRE);
+         if(returnval) report_capture_error(returnval);
+          else returnval = GRAB_ERR_TIMEOUT; // Nothing new to show yet
+       }
+      goto end_of;
   } 
   
  Av_limit=Av_denom; // Set the frame averaging limit to the desired
@@ -8415,12 +12346,28 @@ static int grab_image(void)
  // If we are going into a muti-frame average loop then activate the
  // 'Cancel averaging' button so the user can get out of it if they need
  // to:
- if(Av_limit>1){
+ if(Av_limit>1 && gui_up){
     gtk_widget_show(btn_av_interrupt);
     // Update the GUI
     UPDATE_GUI
   }
 
+ // Start from the next frame to be published so the picture is taken
+ // after the moment it was asked for. From then on every frame the
+ // camera delivers is consumed in turn.
+ Cap_grab_seq = __atomic_load_n(&Cap_head, __ATOMIC_SEQ_CST) + 1;
+ Cap_dropped = 0;
+ Obs_gaps_start = __atomic_load_n(&Cap_seq_gaps, __ATOMIC_RELAXED);
+ Obs_dropped = 0;
+ Obs_wall_us = Obs_mono_us = 0;
+ // The additional cameras need their frames from now on if it is saved
+ if(N_auxcams && Need_to_save) auxcam_arm_all(1);
+
+ // The frames of an MJPEG average are decoded in parallel by the decode
+ // workers, ahead of being added to the average, if they can be:
+ if(CamFormat==V4L2_PIX_FMT_MJPEG && Av_limit>1 && Need_to_save && skiplim==0)
+   pipelined = !mjdec_start();
+
  // Loop for multi-frame averaging ...
  for(Av_denom_idx=1;Av_denom_idx<=Av_limit;Av_denom_idx++){ 
 
@@ -8429,45 +12376,38 @@ static int grab_image(void)
      sprintf(imsg,"Accumulating frame: %d",Av_denom_idx);
      show_message(imsg,"FYI: ",MT_INFO,0);
    }
-  for(skipframe=0;skipframe<=skiplim;skipframe++) // Loop for buffer clearing
-     just_the_one:
-     FOREVER {
-         fd_set fds;
-         struct timeval tv;
-         int r;
-    
-         FD_ZERO(&fds);
-         FD_SET(fd, &fds);
-
-         // Seconds and microseconds to wait before giving a timout
-         // error signal
-         tv.tv_sec = frame_timeout_sec;   
-         tv.tv_usec = frame_timeout_usec; 
-    
-         r = select(fd + 1, &fds, NULL, NULL, &tv);
-    
-         if(-1 == r){
-            //if (EINTR == errno) continue;
-            returnval = GRAB_ERR_SELECT; // Error selecting frame
-            goto end_of;
-           }
-    
-         // Timeout error
-         if (0 == r) {returnval = GRAB_ERR_TIMEOUT; goto end_of;} 
-
-         returnval = read_frame();
-
-         if (returnval)  break; // This could be success or an error
-                                // sent from read_frame(). Either way
-                                // exit the forever loop and return it.
-        }
+  if(pipelined){
+     returnval = mjdec_next(Mjdec.nacc + (unsigned long)(Av_limit-Av_denom_idx+1), &sl);
+     if(returnval != GRAB_ERR_NONE){
+        if(returnval != GRAB_ERR_TIMEOUT) report_capture_error(returnval);
+        goto end_of;
+       }
+     mjdec_take(sl);
+     process_image(sl->jpg, sl->size);
+     mjdec_release(sl);
+   } else
+  // In 'Grab freshest frame' mode there is no need to clear out the
+  // buffers: the first frame is the freshest one (stale ones are passed
+  // over by their timestamps) and the rest follow on from it in turn.
+  for(skipframe=(Gb_Freshest && Av_denom_idx==1) ? skiplim : 0;skipframe<=skiplim;skipframe++){ // Loop for buffer clearing
+     if(Gb_Freshest && Av_denom_idx==1) returnval = wait_for_fresh_frame(&bufidx);
+      else returnval = wait_for_grab_frame((skipframe==skiplim) ? &bufidx : NULL);
+     if(returnval != GRAB_ERR_NONE){
+        if(returnval != GRAB_ERR_TIMEOUT) report_capture_error(returnval);
+        goto end_of;
+       }
+     if(skipframe==skiplim){
+        note_grab_frame(bufidx, Av_denom_idx==1);
+        process_image(buffers[bufidx].start, buffers[bufidx].bytesused);
+        cap_lease_release(bufidx);
+       }
+    }
 
     // Keep the GUI updated (so it does not freeze and be unresponsive)
     // if we are doing multi-frame averaging so the user can have a 
     // chance to click the 'Cancel averaging' button:
     if(Av_limit>1) UPDATE_GUI
 
-    if(from_preview_timeout) break;
     // If user cancelled averaging, force the next capture to be the
     // last (unless we are already at the last).
     tmp_av_denom=Av_denom_idx;
@@ -8480,11 +12420,17 @@ static int grab_image(void)
       }
 
   }
+ if(Obs_dropped){
+   sprintf(imsg,"%lu frame(s) were dropped during this capture.",Obs_dropped);
+   show_message(imsg,"Warning: ",MT_INFO,0);
+  }
  
 end_of:
+ if(pipelined) mjdec_finish();
+ if(N_auxcams) auxcam_arm_all(0); // Any saves are queued by now
  Av_limit=0; // Reset the averaging flag (in case it was used).
  // Hide the 'Cancel averaging' button if it was shown:
- if(Av_denom>1){
+ if(Av_denom>1 && gui_up){
     gtk_widget_hide(btn_av_interrupt);
     // Update the GUI
     UPDATE_GUI
@@ -8505,6 +12451,9 @@ static int stop_streaming(void)
  enum v4l2_buf_type type;
  char msgtxt[1024];
 
+ // The capture thread must not be left servicing a stream we are about
+ // to switch off:
+ stop_capture_thread();
 
  switch (io) {
         case IO_METHOD_READ: break; // Nothing to do.
@@ -8578,6 +12527,14 @@ static int start_streaming(void)
                   }
                 break;
         }
+ // Now the stream is on, start servicing it:
+ if(start_capture_thread()){
+    if(io != IO_METHOD_READ){
+      type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+      xioctl(fd, VIDIOC_STREAMOFF, &type);
+     }
+    return 1;
+   }
  change_cam_status(CS_STREAMING,1);
  return 0;  
 }
@@ -8589,19 +12546,21 @@ static int uninit_device(void)
 
  switch (io) {
     case IO_METHOD_READ:
-      free(buffers[0].start);
+      for (i = 0; i < n_buffers; ++i) big_free(buffers[i].start);
      break;
     case IO_METHOD_MMAP:
-      for (i = 0; i < n_buffers; ++i)
+      for (i = 0; i < n_buffers; ++i){
+        if (buffers[i].dmabuf_fd != -1) close(buffers[i].dmabuf_fd);
         if (-1 == munmap(buffers[i].start, buffers[i].length)){ // This is messy. The user should save their work and re-start.
           sprintf(msgtxt,"%s error %d, %s\nYou should save your work\nand re-start the program.", "munmap", errno, strerror(errno));
           show_message(msgtxt,"Camera Error: ",MT_ERR,1);
           free(buffers);
           return 1;
          }
+       }
      break;
     case IO_METHOD_USERPTR:
-      for (i = 0; i < n_buffers; ++i) free(buffers[i].start);
+      for (i = 0; i < n_buffers; ++i) big_free(buffers[i].start);
      break;
   }
  free(buffers);
@@ -8611,30 +12570,78 @@ static int uninit_device(void)
 }
 
 static int init_read(unsigned int buffer_size)
+// Several buffers are used even for read i/o so the capture thread has
+// one to read into while the consumers hold leases on the others.
 {
- buffers = calloc(1, sizeof(*buffers));
+ char msgtxt[1024];
+
+ buffers = calloc(READ_NBUFS, sizeof(*buffers));
  if(!buffers){
      show_message("Memory allocation failed\non Read i/o video buffers.","Camera Error: ",MT_ERR,1);
      return 1;
    }
- buffers[0].length = buffer_size;
- buffers[0].start = malloc(buffer_size);
-
- if(!buffers[0].start){
-     show_message("Memory allocation failed\non Read buffer[0].","Camera Error: ",MT_ERR,1);
-     free(buffers);
-     return 1;
-   }
+ for(n_buffers = 0; n_buffers < READ_NBUFS; ++n_buffers){
+     buffers[n_buffers].length = buffer_size;
+     buffers[n_buffers].dmabuf_fd = -1;
+     buffers[n_buffers].start = big_alloc(buffer_size,"a capture buffer");
+     if(!buffers[n_buffers].start){
+        sprintf(msgtxt,"Memory allocation failed\non Read buffer[%d].",n_buffers);
+        show_message(msgtxt,"Camera Error: ",MT_ERR,1);
+        while(n_buffers) big_free(buffers[--n_buffers].start);
+        free(buffers);
+        return 1;
+       }
+    }
  return 0;
 }
 
+static unsigned int capture_buffer_count(void)
+// The number of v4l2 buffers to ask the driver for.
+{
+ return Gb_Buffers ? (unsigned int)Gb_Buffers : Cap_nbuf_adapt;
+}
+
+static void capture_buffers_granted(unsigned int got)
+// The driver may give more or fewer buffers than were asked for (many
+// allow no more than 32). Say so, and in adaptive mode carry on from
+// the number it gave so the depth adapt_buffer_depth() works from, and
+// the one shown, is the real one.
+{
+ char msgtxt[128];
+ unsigned int asked;
+
+ asked = capture_buffer_count();
+ if(got == asked) return;
+ sprintf(msgtxt,"The camera driver gave %u capture buffers (%u were asked for).",got,asked);
+ show_message(msgtxt,"FYI: ",MT_INFO,0);
+ if(got < asked) Cap_nbuf_drvmax = got;
+ if(!Gb_Buffers) Cap_nbuf_adapt = got;
+}
+
+static void mmap_unwind(void)
+// Let go of the n_buffers MMAP buffers (and their DMABUF exports) set up
+// so far when init_mmap() fails part way through.
+{
+ while(n_buffers){
+     --n_buffers;
+     if(buffers[n_buffers].dmabuf_fd != -1) close(buffers[n_buffers].dmabuf_fd);
+     munmap(buffers[n_buffers].start, buffers[n_buffers].length);
+    }
+ free(buffers);
+}
+
 static int init_mmap(void)
+// Map the driver's buffers and export each as a DMABUF file descriptor
+// (see struct buffer) so the frame memory can be shared with other
+// devices and APIs without being copied.
 {
  struct v4l2_requestbuffers req;
+ struct v4l2_exportbuffer expbuf;
+ unsigned int n_unexported = 0;
  char msgtxt[1024];
 
  CLEAR(req);
- req.count = 4;
+ req.count = capture_buffer_count();
  req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
  req.memory = V4L2_MEMORY_MMAP;
  if(-1 == xioctl(fd, VIDIOC_REQBUFS, &req)){
@@ -8653,6 +12660,7 @@ static int init_mmap(void)
      show_message(msgtxt,"Camera Error: ",MT_ERR,1);
      return 1;
    }
+ capture_buffers_granted(req.count);
 
  buffers = calloc(req.count, sizeof(*buffers));
  if(!buffers) {
@@ -8671,7 +12679,7 @@ static int init_mmap(void)
      if(-1 == xioctl(fd, VIDIOC_QUERYBUF, &buf)){ // Because complete memory cleanup may not be possible, advise the user to re-start
         sprintf(msgtxt,"%s error %d, %s\nYou should save your work\nand re-start the program.", "VIDIOC_QUERYBUF", errno, strerror(errno));
         show_message(msgtxt,"Camera Error: ",MT_ERR,1);
-        free(buffers);
+        mmap_unwind();
         return 1;
        }
 
@@ -8681,10 +12689,24 @@ static int init_mmap(void)
      if (MAP_FAILED == buffers[n_buffers].start){
         sprintf(msgtxt,"%s error %d, %s\nYou should save your work\nand re-start the program.", "mmap", errno, strerror(errno));
         show_message(msgtxt,"Camera Error: ",MT_ERR,1);
-        free(buffers);
+        mmap_unwind();
         return 1;
        }
+
+     // Not all drivers can export so it is not an error if this fails
+     CLEAR(expbuf);
+     expbuf.type  = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+     expbuf.index = n_buffers;
+     expbuf.flags = O_RDONLY | O_CLOEXEC;
+     if(-1 == xioctl(fd, VIDIOC_EXPBUF, &expbuf)){
+        buffers[n_buffers].dmabuf_fd = -1;
+        n_unexported++;
+       } else buffers[n_buffers].dmabuf_fd = expbuf.fd;
    }
+ if(n_unexported){
+   sprintf(msgtxt,"%u of %u capture buffers could not be exported as DMABUF.",n_unexported,n_buffers);
+   show_message(msgtxt,"FYI: ",MT_INFO,0);
+  }
    
  return 0;
 }
@@ -8695,7 +12717,7 @@ static int init_userp(unsigned int buffer_size)
  char msgtxt[1024];
 
  CLEAR(req);
- req.count  = 4;
+ req.count  = capture_buffer_count();
  req.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
  req.memory = V4L2_MEMORY_USERPTR;
  if(-1 == xioctl(fd, VIDIOC_REQBUFS, &req)) {
@@ -8709,30 +12731,27 @@ static int init_userp(unsigned int buffer_size)
      return 1;
     }
   }
- buffers = calloc(4, sizeof(*buffers));
+ // The driver may have adjusted the count
+ if(req.count < 2){
+     sprintf(msgtxt,"Insufficient user pointer buffers on %s",Dev_Name);
+     show_message(msgtxt,"Camera Error: ",MT_ERR,1);
+     return 1;
+   }
+ capture_buffers_granted(req.count);
+ buffers = calloc(req.count, sizeof(*buffers));
  if(!buffers) {
      sprintf(msgtxt,"Memory allocation failed\nfor video userptr buffers array");
      show_message(msgtxt,"Camera Error: ",MT_ERR,1);
      return 1;
     }
- for(n_buffers = 0; n_buffers < 4; ++n_buffers){
+ for(n_buffers = 0; n_buffers < req.count; ++n_buffers){
      buffers[n_buffers].length = buffer_size;
-     buffers[n_buffers].start = malloc(buffer_size);
+     buffers[n_buffers].dmabuf_fd = -1; // Only MMAP buffers are exported
+     buffers[n_buffers].start = big_alloc(buffer_size,"a capture buffer");
      if(!buffers[n_buffers].start) {
         sprintf(msgtxt,"Memory allocation failed\nfor video userptr buffer[%d]",n_buffers);
         show_message(msgtxt,"Camera Error: ",MT_ERR,1);
-        switch(n_buffers){
-            case 3:
-             free(buffers[2].start);free(buffers[1].start);free(buffers[0].start);
-            break;
-            case 2:
-             free(buffers[1].start);free(buffers[0].start);
-            break;
-            case 1:
-             free(buffers[0].start);
-            break;
-            default: break;
-           }
+        while(n_buffers) big_free(buffers[--n_buffers].start);
         free(buffers);
         return 1;
        }
@@ -8740,6 +12759,66 @@ static int init_userp(unsigned int buffer_size)
  return 0;
 }
 
+// The formats found by camera_formats() for the last device probed
+static int  Fmtcache_valid = 0;
+static int  Fmtcache_forbidden;
+static char Fmtcache_dev[PATH_MAX];
+static char Fmtcache_bus[32];
+
+static int camera_formats(const struct v4l2_capability *cap)
+// Find which of the camera formats this program can use are not
+// supported by the open device and return the CAF_BIT mask of them.
+// The driver's list is read with VIDIOC_ENUM_FMT, or, if it can not give
+// one, each format is tried with VIDIOC_TRY_FMT (so nothing is changed)
+// and one the driver errors on or swaps for another counts as not
+// supported. The answer is kept for the device (by name and bus) so
+// reopening or re-initialising it does not probe it again.
+{
+ struct v4l2_fmtdesc fdesc;
+ struct v4l2_format tfmt;
+ char msgtxt[256];
+ int idx,forbidden,listed;
+
+ if(Fmtcache_valid && !strncmp(Fmtcache_dev, Dev_Name, sizeof Fmtcache_dev) &&
+    !strncmp(Fmtcache_bus, (const char *)cap->bus_info, sizeof Fmtcache_bus))
+   return Fmtcache_forbidden;
+
+ forbidden = CAF_ALLBAD;
+ listed = 0;
+ CLEAR(fdesc);
+ fdesc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+ while(0 == xioctl(fd, VIDIOC_ENUM_FMT, &fdesc)){
+    listed = 1;
+    for(idx=0;idx<Ncamfs;idx++)
+       if(fdesc.pixelformat == camfmt_fourcc[idx]) forbidden &= ~CAF_BIT(idx);
+    fdesc.index++;
+   }
+ if(!listed){
+   show_message("The camera driver does not list its formats. Trying each in turn.","FYI: ",MT_INFO,0);
+   for(idx=0;idx<Ncamfs;idx++){
+      CLEAR(tfmt);
+      tfmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+      tfmt.fmt.pix.width       = ImWidth;
+      tfmt.fmt.pix.height      = ImHeight;
+      tfmt.fmt.pix.pixelformat = camfmt_fourcc[idx];
+      tfmt.fmt.pix.field       = V4L2_FIELD_ANY;
+      if(0 == xioctl(fd, VIDIOC_TRY_FMT, &tfmt) && tfmt.fmt.pix.pixelformat == camfmt_fourcc[idx])
+        forbidden &= ~CAF_BIT(idx);
+     }
+  }
+ for(idx=0;idx<Ncamfs;idx++){
+    if(forbidden & CAF_BIT(idx)) sprintf(msgtxt,"The camera driver does not support %s format.",camfmt_options[idx]);
+     else sprintf(msgtxt,"%s support is OK.",camfmt_options[idx]);
+    show_message(msgtxt,"FYI: ",MT_INFO,0);
+   }
+
+ snprintf(Fmtcache_dev, sizeof Fmtcache_dev, "%s", Dev_Name);
+ snprintf(Fmtcache_bus, sizeof Fmtcache_bus, "%s", (const char *)cap->bus_info);
+ Fmtcache_forbidden = forbidden;
+ Fmtcache_valid = 1;
+ return forbidden;
+}
+
 static int init_device(void)
 {
  struct v4l2_capability cap;
@@ -8748,9 +12827,7 @@ static int init_device(void)
  struct v4l2_format fmt;
  unsigned int uinum;
  char msgtxt[1024];
- int returnval;
- int formats_exhausted = 0;
- int forbidden_format = CAF_ALLOK;
+ int returnval,idx,fdx;
 
             sprintf(msgtxt,"Running Init Device");
             show_message(msgtxt,"Camera Init: ",MT_INFO,0);
@@ -8773,6 +12850,8 @@ static int init_device(void)
    show_message(msgtxt,"Camera Error: ",MT_ERR,1);
    return 1;
   }
+ snprintf(Cam_card, sizeof Cam_card, "%s", (const char *)cap.card);
+ snprintf(Cam_bus, sizeof Cam_bus, "%s", (const char *)cap.bus_info);
 
  switch (io) {
         case IO_METHOD_READ:
@@ -8821,73 +12900,38 @@ static int init_device(void)
    }
  // Now modify those settings that the user is given control over in
  // this program via the GUI to the current user choices (or program
- // defaults if user has not yet modified them)
- fmt.fmt.pix.width       = ImWidth;
- fmt.fmt.pix.height      = ImHeight;
- fmt.fmt.pix.field = V4L2_FIELD_ANY; // Let the driver decide about field interlacing
-
- // Now test whether either or both of the YUYV and MJPEG camera formats
- // are not supported:
- show_message("Testing for YUYV format support ...","FYI: ",MT_INFO,0);
- fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
- if(-1 == xioctl(fd, VIDIOC_S_FMT, &fmt)){
-    sprintf(msgtxt,"%s error %d, %s", "VIDIOC_S_FMT", errno, strerror(errno));
-    show_message(msgtxt,"Camera Error: ",MT_ERR,1);
-    return 1;
-   }
- if(fmt.fmt.pix.pixelformat != V4L2_PIX_FMT_YUYV){
-   show_message("The camera driver does not support YUYV format.","FYI: ",MT_INFO,0);
-   formats_exhausted++;
-   forbidden_format=CAF_YUYV;
-  } else show_message("YUYV support is OK.","FYI: ",MT_INFO,0);
- show_message("Testing for MJPEG format support ...","FYI: ",MT_INFO,0);
- fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_MJPEG;
- if(-1 == xioctl(fd, VIDIOC_S_FMT, &fmt)){
-    sprintf(msgtxt,"%s error %d, %s", "VIDIOC_S_FMT", errno, strerror(errno));
-    show_message(msgtxt,"Camera Error: ",MT_ERR,1);
-    return 1;
-   }
- if(fmt.fmt.pix.pixelformat != V4L2_PIX_FMT_MJPEG){
-   show_message("The camera driver does not support MJPEG format.","FYI: ",MT_INFO,0);
-   formats_exhausted++;
-   forbidden_format=CAF_MJPEG;
-  } else show_message("MJPEG support is OK.","FYI: ",MT_INFO,0);
- FormatForbidden=forbidden_format;
- if(formats_exhausted==2){
-   FormatForbidden=CAF_ALLBAD;
-   show_message("The Camera driver does not support YUYV or MJPEG format.\nPlease save your work and restart the program with a different camera.","Camera Error: ",MT_ERR,1);
-   return 1; 
- }
-
-
- switch(CamFormat){
-    case V4L2_PIX_FMT_YUYV:
-        if(FormatForbidden==CAF_YUYV){
-          show_message("YUYV not possible. Re-seting image output to MJPEG.","FYI: ",MT_INFO,0);
-           fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_MJPEG;
-           gtk_combo_box_set_active (GTK_COMBO_BOX (combo_camfmt), 1);
-           CamFormat=V4L2_PIX_FMT_MJPEG;
-          } else {
-          show_message("Seting image output to YUYV.","FYI: ",MT_INFO,0);
-          fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
-          }
-     break;
-    case V4L2_PIX_FMT_MJPEG:
-        if(FormatForbidden==CAF_MJPEG){
-           show_message("MJPEG not possible. Re-seting image output to YUYV.","FYI: ",MT_INFO,0);
-           fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
-           gtk_combo_box_set_active (GTK_COMBO_BOX (combo_camfmt), 0);
-           CamFormat=V4L2_PIX_FMT_YUYV;
-          } else {
-           show_message("Setting image output to MJPEG.","FYI: ",MT_INFO,0);
-           fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_MJPEG;
-          }
-     break;
-    default: // This should not happen unless this program (or a modification thereof) is buggy
-        show_message("Invalid camera image format selected","Program Error: ",MT_ERR,1);
-        return 1;
-     break;
-   }
+ // defaults if user has not yet modified them)
+ fmt.fmt.pix.width       = ImWidth;
+ fmt.fmt.pix.height      = ImHeight;
+ fmt.fmt.pix.field = V4L2_FIELD_ANY; // Let the driver decide about field interlacing
+
+ // Find which of the camera formats this program can use are not
+ // supported:
+ FormatForbidden=camera_formats(&cap);
+ if(FormatForbidden==CAF_ALLBAD){
+   show_message("The Camera driver does not support YUYV, MJPEG, GREY, Y10, Y12, Y16 or NV12 format.\nPlease save your work and restart the program with a different camera.","Camera Error: ",MT_ERR,1);
+   return 1; 
+ }
+
+ idx=camfmt_index(CamFormat);
+ if(idx<0){ // This should not happen unless this program (or a modification thereof) is buggy
+   show_message("Invalid camera image format selected","Program Error: ",MT_ERR,1);
+   return 1;
+  }
+ if(FormatForbidden & CAF_BIT(idx)){
+   // Fall back to the first format that is supported
+   for(fdx=0;fdx<Ncamfs;fdx++) if(!(FormatForbidden & CAF_BIT(fdx))) break;
+   sprintf(msgtxt,"%s not possible. Re-seting image output to %s.",camfmt_options[idx],camfmt_options[fdx]);
+   show_message(msgtxt,"FYI: ",MT_INFO,0);
+   if(gui_up) gtk_combo_box_set_active (GTK_COMBO_BOX (combo_camfmt), fdx);
+   CamFormat=camfmt_fourcc[fdx];
+  } else {
+   sprintf(msgtxt,"Setting image output to %s.",camfmt_options[idx]);
+   show_message(msgtxt,"FYI: ",MT_INFO,0);
+  }
+ fmt.fmt.pix.width       = ImWidth;
+ fmt.fmt.pix.height      = ImHeight;
+ fmt.fmt.pix.pixelformat = CamFormat;
  // Now to apply these settings to the capture device. Note VIDIOC_S_FMT may change width and height.
  if(-1 == xioctl(fd, VIDIOC_S_FMT, &fmt)){
     sprintf(msgtxt,"%s error %d, %s", "VIDIOC_S_FMT", errno, strerror(errno));
@@ -8908,24 +12952,21 @@ static int init_device(void)
     return 1;  
    }
 
- switch(CamFormat){
-    case V4L2_PIX_FMT_YUYV:
-        if(fmt.fmt.pix.pixelformat != V4L2_PIX_FMT_YUYV){
-               show_message("The Camera driver does not support YUYV or MJPEG format.\nPlease save your work and restart the program with a different camera.","Camera Error: ",MT_ERR,1);
-               FormatForbidden=CAF_ALLBAD;
-               return 1;  
-              }
-     break;
-    case V4L2_PIX_FMT_MJPEG:
-        if(fmt.fmt.pix.pixelformat != V4L2_PIX_FMT_MJPEG){
-               show_message("The Camera driver does not support MJPEG or YUYV format.\nPlease save your work and restart the program with a different camera.","Camera Error: ",MT_ERR,1);
-               FormatForbidden=CAF_ALLBAD;
-               return 1;  
-              }
-     break;
-    default: // We can't get see due to prior switch
-     break;
-   }
+ if(fmt.fmt.pix.pixelformat != CamFormat){
+   sprintf(msgtxt,"The Camera driver does not support %s format.\nPlease save your work and restart the program with a different camera.",camfmt_options[camfmt_index(CamFormat)]);
+   show_message(msgtxt,"Camera Error: ",MT_ERR,1);
+   FormatForbidden=CAF_ALLBAD;
+   return 1;  
+  }
+
+ // The frames of the uncompressed formats other than YUYV are read as
+ // packed rows, so any padding at the row ends can't be coped with:
+ if(CamFormat!=V4L2_PIX_FMT_YUYV && CamFormat!=V4L2_PIX_FMT_MJPEG && fmt.fmt.pix.bytesperline &&
+    fmt.fmt.pix.bytesperline != (unsigned int)(((camfmt_bits()>8) ? 2 : 1)*ImWidth)){
+   sprintf(msgtxt,"The Camera driver pads each row of a %s frame to %u bytes, which this program can not use.\nPlease choose a different stream format or image size.",camfmt_options[camfmt_index(CamFormat)],fmt.fmt.pix.bytesperline);
+   show_message(msgtxt,"Camera Error: ",MT_ERR,1);
+   return 1;
+  }
 
  // Ensure the driver has not messed up - try to avoid a seg fault.
  uinum = fmt.fmt.pix.bytesperline * fmt.fmt.pix.height;
@@ -8962,6 +13003,7 @@ static int close_device(void)
    return 1;
  }
  fd = -1;
+ if(Vsrc_type != VSRC_NONE) vsrc_close();
  if(gui_up) gtk_label_set_text (GTK_LABEL(lab_cam_tasks),"CAMERA TASKS (no device)");
  change_cam_status(CS_OPENED,0);
 
@@ -8973,6 +13015,11 @@ static int open_device(void)
  struct stat st;
  char msgtxt[1024];
 
+ if(Vsrc_type != VSRC_NONE){
+   if(vsrc_open()) return 1;
+   goto device_open;
+  }
+
  if(-1 == stat(Dev_Name, &st)) {
    sprintf(msgtxt,"Cannot identify '%s':\n%d, %s", Dev_Name, errno, strerror(errno));
    show_message(msgtxt,"Camera Error: ",MT_ERR,1);
@@ -8993,7 +13040,7 @@ static int open_device(void)
    return 1;
   }
   
-
+device_open:
  sprintf(msgtxt,"CAMERA TASKS (%s)",Dev_Name);
  if(gui_up) gtk_label_set_text (GTK_LABEL(lab_cam_tasks),msgtxt);
 
@@ -9037,6 +13084,14 @@ void tidy_up(void)
   if(camera_status.cs_initialised) uninit_device();
   close_device();
  }
+ if(Bands.up){
+   show_message("> Stopping row band workers.","",MT_INFO,0);
+   band_pool_stop();
+  }
+ if(Mjdec.up){
+   show_message("> Stopping MJPEG decode workers.","",MT_INFO,0);
+   mjdec_pool_stop();
+  }
  if(ImRoot!=NULL){
    show_message("> Freeing image file name.","",MT_INFO,0);
    free(ImRoot);
@@ -9077,6 +13132,8 @@ void tidy_up(void)
    show_message("> Freeing preview col sampler.","",MT_INFO,0);
    free(SScol);
   }
+ free(SSrow_j);
+ free(SScol_j);
  if(PreviewImg!=NULL){
    show_message("> Freeing preview image.","",MT_INFO,0);
    free(PreviewImg);
@@ -9103,7 +13160,7 @@ void tidy_up(void)
   }
  if(RGBimg!=NULL){
    show_message("> Freeing full-size image.","",MT_INFO,0);
-   free(RGBimg);
+   big_free(RGBimg);
   }
  if(FF_Image!=NULL){
    show_message("> Freeing flat field image.","",MT_INFO,0);
@@ -9145,11 +13202,12 @@ void tidy_up(void)
 
 
  show_message("> Freeing frame averaging accumultors.","",MT_INFO,0);
- free(Avr); free(Avg); free(Avb);
+ free(Avr); free(Avg); free(Avb); free(Avi);
  show_message("> Freeing frame stores.","",MT_INFO,0);
- free(Frmr); free(Frmg); free(Frmb);
+ big_free(Frmr); big_free(Frmg); big_free(Frmb);
  show_message("> Freeing preview integration buffers.","",MT_INFO,0);
  for(idx=0;idx<PREVINTMAX;idx++) free(PreviewBuff[idx]);
+ free(PreviewSum);
 
  show_message("\nPARD Capture says: Bye!","",MT_INFO,0);
   
@@ -9184,17 +13242,24 @@ void open_logfile(void)
 }
 
 void show_message(char *msg,char *title,int mtype,int popup) 
-// All written information to user is channelled through this function
+// All written information to user is channelled through this function.
+// Without a popup it may also be used from worker threads (e.g. by
+// write_png_image() in the additional camera save workers).
 {
+ static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+
  if(popup){ // User requests this to be a GUI popup message - but that
             // request should be denied in some circumstances ...
    if(!gui_up) popup=0; // ... such as if there is no GUI up and running
+   if(Cam_reopening) popup=0; // ... or while re-opening a lost camera
   } 
+ pthread_mutex_lock(&log_lock);
  open_logfile(); // if successful fplog will not be NULL
  if (fplog){
      fprintf(fplog,"%s%s\n",title,msg);
      close_logfile();
    }
+ pthread_mutex_unlock(&log_lock);
 
  switch(mtype){
     case MT_INFO : // Equivalent of printf - usually for info only
@@ -9401,6 +13466,162 @@ static void btn_cam_stream_click(GtkWidget *widget, gpointer data)
  return;
 }
 
+static int camera_gone(int code)
+// Whether grab error 'code' means the camera itself has gone (e.g. it
+// dropped off the USB bus), so that re-opening it is worth trying,
+// rather than that it was slow to send a frame or busy.
+// Returns 1 if it has gone, 0 if not.
+{
+ switch(code){
+    case GRAB_ERR_READIO:
+    case GRAB_ERR_MMAPD:
+    case GRAB_ERR_MMAPQ:
+    case GRAB_ERR_USERPD:
+    case GRAB_ERR_USERPQ: break;
+    default: return 0;
+   }
+ switch(Cap_thread_errno){
+    case ENODEV:
+    case ENXIO:
+    case EIO:
+    case ESHUTDOWN: return 1;
+    default: return 0;
+   }
+}
+
+static int is_lost_camera(const char *path)
+// Whether the V4L2 capture node at 'path' is the main camera, going by
+// the card name and bus it had when it was last initialised.
+// Returns 1 if it is, 0 if not.
+{
+ struct v4l2_capability cap;
+ unsigned int caps;
+ int tfd,same;
+
+ tfd = open(path, O_RDWR | O_NONBLOCK, 0);
+ if(-1 == tfd) return 0;
+ CLEAR(cap);
+ same = 0;
+ if(0 == xioctl(tfd, VIDIOC_QUERYCAP, &cap)){
+   caps = (cap.capabilities & V4L2_CAP_DEVICE_CAPS) ? cap.device_caps : cap.capabilities;
+   same = (caps & V4L2_CAP_VIDEO_CAPTURE) &&
+          !strncmp((const char *)cap.card, Cam_card, sizeof Cam_card) &&
+          !strncmp((const char *)cap.bus_info, Cam_bus, sizeof Cam_bus);
+  }
+ close(tfd);
+ return same;
+}
+
+static void find_lost_camera(void)
+// A camera that drops off the bus can come back as a different
+// /dev/video node. If Dev_Name is no longer the main camera then look
+// for it among the others and, if it is found, use that node instead.
+{
+ char path[32],msgtxt[FILENAME_MAX+64];
+ int n;
+
+ if(Vsrc_type != VSRC_NONE || !Cam_card[0]) return;
+ if(is_lost_camera(Dev_Name)) return;
+ for(n=0;n<64;n++){
+    snprintf(path, sizeof path, "/dev/video%d", n);
+    if(!strcmp(path, Dev_Name) || !is_lost_camera(path)) continue;
+    snprintf(msgtxt, sizeof msgtxt, "The camera is now %s (was %.1024s)", path, Dev_Name);
+    show_message(msgtxt,"FYI: ",MT_INFO,0);
+    snprintf(Dev_Name, FILENAME_MAX, "%s", path);
+    return;
+   }
+}
+
+static int reopen_camera(int code)
+// The camera stopped delivering frames part way through a capture (grab
+// error 'code'), typically because a USB glitch dropped it off the bus.
+// Tear down what is left of the stream and try to open it again (under
+// its new device node if it was re-enumerated), after
+// REOPEN_WAIT_MIN seconds at first and doubling the wait after each
+// failure (up to REOPEN_WAIT_MAX), for up to Reopen_tries attempts.
+// Once it is back the camera controls are set to the values last
+// applied (kept in CSlist). The image size, stream format and number of
+// buffers are all globals so re-initialising restores those by itself.
+// The length of the gap is logged, and in the series log if a series
+// is being captured.
+// Returns 0 if the camera is streaming again, 1 if not.
+{
+ struct timespec t0,t1;
+ enum v4l2_buf_type type;
+ time_t until;
+ double gap;
+ int attempt,wait_s,cdx,pass,fails;
+ char cname[64],msgtxt[256];
+
+ if(Reopen_tries<1) return 1;
+ clock_gettime(CLOCK_MONOTONIC,&t0);
+ sprintf(msgtxt,"Camera lost during capture (grab error %d). Trying to re-open it ...",code);
+ show_message(msgtxt,"Warning: ",MT_ERR,0);
+ Cam_reopening=1;
+
+ // The device may well have gone so errors are expected here and are
+ // ignored - just make sure everything is let go of.
+ stop_capture_thread();
+ if(camera_status.cs_streaming){
+   if(io != IO_METHOD_READ){
+     type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+     xioctl(fd, VIDIOC_STREAMOFF, &type);
+    }
+   change_cam_status(CS_STREAMING,0);
+  }
+ if(camera_status.cs_initialised) uninit_device();
+ if(camera_status.cs_opened && close_device()){
+   fd = -1;
+   change_cam_status(CS_OPENED,0);
+  }
+
+ wait_s=REOPEN_WAIT_MIN;
+ for(attempt=1;attempt<=Reopen_tries;attempt++){
+    // Keep the GUI alive while waiting so a series can still be
+    // cancelled.
+    until=time(NULL)+wait_s;
+    while(time(NULL)<until && !Ser_cancel){
+       UPDATE_GUI
+       usleep(10000);
+      }
+    if(Ser_cancel) break;
+    sprintf(msgtxt,"Re-opening the camera (attempt %d of %d)",attempt,Reopen_tries);
+    show_message(msgtxt,"FYI: ",MT_INFO,0);
+    find_lost_camera();
+    if(!try_running_camera()) goto reopened;
+    // Start from scratch on the next attempt
+    if(camera_status.cs_initialised) uninit_device();
+    if(camera_status.cs_opened) close_device();
+    wait_s = (2*wait_s > REOPEN_WAIT_MAX) ? REOPEN_WAIT_MAX : 2*wait_s;
+   }
+ Cam_reopening=0;
+ show_message("Could not re-open the camera.","Camera Error: ",MT_ERR,0);
+ return 1;
+
+reopened:
+ // Put the camera controls back. Two passes because some controls can
+ // only be set once another is (e.g. manual focus once auto focus is
+ // off) and those may come first in the list.
+ for(pass=0;pass<2;pass++)
+  for(cdx=fails=0;cdx<(int)NCSs;cdx++){
+    if(CSlist[cdx].minimum==0 && CSlist[cdx].maximum==0 && CSlist[cdx].step==0) continue;
+    if(set_camera_control(CSlist[cdx].ctrl_id,CSlist[cdx].currval,cname)) fails++;
+   }
+ Cam_reopening=0;
+ clock_gettime(CLOCK_MONOTONIC,&t1);
+ gap = (double)(t1.tv_sec - t0.tv_sec) + (double)(t1.tv_nsec - t0.tv_nsec)/1.0e9;
+ sprintf(msgtxt,"Camera re-opened after a %.1f s gap (%d attempt(s), %d control(s) not re-applied)",gap,attempt,fails);
+ show_message(msgtxt,"FYI: ",MT_INFO,0);
+ if(Ser_active){
+   FPseries=fopen(Ser_logname,"ab");
+   if(FPseries!=NULL){
+     fprintf(FPseries,"# Camera lost before image %d and re-opened after a %.1f s gap\n",Ser_lastidx+1,gap);
+     fflush(FPseries); fclose(FPseries);
+    }
+  }
+ return 0;
+}
+
 void series_end_status(void)
 // State the reason for terminating a capture series in a human-
 // readable string for signing off the series log file
@@ -9464,7 +13685,7 @@ int grab_n_save(void)
 // and user preferences
 {
  int preview_tmp,returnvalue;
- int retry;
+ int retry,reopened;
  
 // Save preview image: Experimental / debugging
 // raw_to_ppm("preview.ppm",PreviewHt, PreviewWd,(void *)PreviewImg);
@@ -9473,9 +13694,11 @@ int grab_n_save(void)
  // If we've got this far we know the camera is ready to take pictures
 
  // Disable changing control values while grabbing images to save:
- gtk_widget_set_sensitive (btn_cs_apply,FALSE);
- gtk_widget_set_sensitive (btn_cs_apply_nc,FALSE);
- gtk_widget_set_sensitive (ISlider,FALSE);
+ if(gui_up){
+   gtk_widget_set_sensitive (btn_cs_apply,FALSE);
+   gtk_widget_set_sensitive (btn_cs_apply_nc,FALSE);
+   gtk_widget_set_sensitive (ISlider,FALSE);
+  }
  
  // Initialise return value to all OK:
  returnvalue = GNS_OKIS;
@@ -9564,6 +13787,8 @@ int grab_n_save(void)
  preview_tmp=Need_to_preview;
  if(Need_to_preview) Need_to_preview=PREVIEW_OFF; 
 
+ reopened=0;
+ regrab:
  // Try grabbing the image upto Gb_Retry number of attempts ...
  for(retry=0;retry<=Gb_Retry;retry++){
     Need_to_save = 1; // Tell grabber to write the frame it grabs to disk.
@@ -9573,6 +13798,15 @@ int grab_n_save(void)
     if(grab_report!=GRAB_ERR_BUSY) break;
     UPDATE_GUI
    }
+ // If the camera was lost, re-open it and take the same picture again.
+ // Nothing was saved so frame_number and (in a series) Ser_idx have not
+ // moved on and the series carries on where it left off.
+ if(camera_gone(grab_report) && reopened<REOPEN_PER_GRAB && !Ser_cancel){
+   if(!reopen_camera(grab_report)){
+     reopened++;
+     goto regrab;
+    }
+  }
  
  Need_to_save = 0; // Tell grabber NOT to write further frames it grabs to disk.
  if(preview_tmp) Need_to_preview=PREVIEW_ON; // Restore preview mode if it was suspended
@@ -9614,12 +13848,18 @@ int grab_n_save(void)
 
  if(Ser_active){ // We are capturing a series
     time_t t1,t2;
+    char tstamp[32];
      
     Ser_idx++; // Increment the counter
-    // Write the log entry for last image captured
+    // Write the log entry for last image captured, including the
+    // camera's frame number, any frames dropped and the time of capture
+    // (to the microsecond) when we have them:
      FPseries=fopen(Ser_logname,"ab");
      if(FPseries!=NULL){
-      fprintf(FPseries,"%d\t%g\t%s\n",Ser_lastidx+1,difftime(time(NULL),Ser_ts),Ser_name);
+      if(grab_report==GRAB_ERR_NONE && Obs_wall_us && !utc_string_us(Obs_wall_us,tstamp))
+        fprintf(FPseries,"%d\t%g\t%s\t%u\t%lu\t%s\n",Ser_lastidx+1,difftime(time(NULL),Ser_ts),Ser_name,Obs_first_vseq,Obs_dropped,tstamp);
+       else
+        fprintf(FPseries,"%d\t%g\t%s\t-\t-\t-\n",Ser_lastidx+1,difftime(time(NULL),Ser_ts),Ser_name);
       fflush(FPseries); fclose(FPseries);
      }
     // Reset the clock
@@ -9637,6 +13877,7 @@ int grab_n_save(void)
                  while((t2=time(&Ser_tc))>=0){
                      if(difftime(t2,t1)>=(double)Ser_Delay) break;
                      UPDATE_GUI
+                     if(!gui_up) usleep(10000); // Don't spin when headless
                  }
           }
           UPDATE_GUI
@@ -9647,9 +13888,11 @@ int grab_n_save(void)
   } 
 
  // Re-enable changing control values:
- gtk_widget_set_sensitive (btn_cs_apply,TRUE);
- gtk_widget_set_sensitive (btn_cs_apply_nc,TRUE);
- gtk_widget_set_sensitive (ISlider,TRUE);
+ if(gui_up){
+   gtk_widget_set_sensitive (btn_cs_apply,TRUE);
+   gtk_widget_set_sensitive (btn_cs_apply_nc,TRUE);
+   gtk_widget_set_sensitive (ISlider,TRUE);
+  }
 
 
  return returnvalue;
@@ -9740,7 +13983,7 @@ static void btn_cam_save_click(GtkWidget *widget, gpointer data)
          } else {
           fprintf(FPseries, "Log for PARD Capture Series\n");
           fprintf(FPseries, "Start at: %s\n\n", ((time(&Ser_ts)) == -1) ? "[Time not available]" : ctime(&Ser_ts));
-          fprintf(FPseries, "Index\tInterval\tImage\n");
+          fprintf(FPseries, "Index\tInterval\tImage\tFrame\tDropped\tCaptured (UTC)\n");
           fflush(FPseries);  fclose(FPseries);
          } // Failure to log is not fatal to capturing a series.
        // Begin series capture. 
@@ -9904,8 +14147,9 @@ static gboolean img_preview_click(GtkWidget  *event_box,  GdkEventButton *event,
  if(prev_flip_h || prev_flip_v){
    click_x=(int)event->x;
    click_y=(int)event->y;
-   if(prev_flip_h) click_x=PreviewWd-click_x;
-   if(prev_flip_v) click_y=PreviewHt-click_y;
+   // (The preview is flipped within the part that has sample points)
+   if(prev_flip_h) click_x=2*(Prev_startcol/3)+Prev_ncols-1-click_x;
+   if(prev_flip_v) click_y=2*(Prev_startrow/PreviewWd_stride)+Prev_nrows-1-click_y;
    Prevclick_X=click_x;
    Prevclick_Y=click_y;
   } else {
@@ -10017,9 +14261,88 @@ endof:
  return TRUE;
 }
 
+static void update_capture_stats(void)
+// Show the capture buffer queue depth in use, the frame rate actually
+// being achieved, the jitter in the frame interval and the number of
+// frames the driver has dropped in the preview stats panel. The label
+// is refreshed at most once a second.
+{
+ static time_t shown_at = 0;
+ static int shown_streaming = -1;
+ time_t now;
+ double mean_us,jit_us;
+ char txt[160 + MAX_AUXCAMS*128];
+
+ now = time(NULL);
+ if(shown_streaming == camera_status.cs_streaming && now == shown_at) return;
+ shown_streaming = camera_status.cs_streaming;
+ shown_at = now;
+ auxcam_report(); // Saves the additional cameras have done meanwhile
+ if(shown_streaming){
+   __atomic_load(&Cap_mean_dt_us, &mean_us, __ATOMIC_RELAXED);
+   __atomic_load(&Cap_jitter_us, &jit_us, __ATOMIC_RELAXED);
+   sprintf(txt,"Capture buffers: %u (%u queued + %u held, %s)  |  %.2f fps  |  Jitter %.2f ms  |  Dropped %lu",
+          n_buffers, n_buffers - Cap_hold_max, Cap_hold_max, Gb_Buffers ? "fixed" : "adaptive", (mean_us > 0.0) ? 1.0e6/mean_us : 0.0,
+          jit_us/1000.0, __atomic_load_n(&Cap_seq_gaps, __ATOMIC_RELAXED));
+  } else sprintf(txt,"Capture buffers: -");
+ auxcam_stats_text(txt);
+ gtk_label_set_text(GTK_LABEL(PrevSt_capture),txt);
+}
+
+static void adapt_buffer_depth(void)
+// Adaptive capture buffer queue depth (Gb_Buffers==0).
+// If the driver has had to skip frames since we last looked then the
+// queue was too shallow so double it, and never shrink back to that
+// depth again. Gaps in the first NBUF_SETTLE_SECS after the stream
+// (re)starts are ignored as they come from the re-initialisation. If
+// live preview has then run for NBUF_QUIET_SECS with no skipped frames
+// latency is what matters (e.g. when focusing) so shrink, once, straight
+// to the shallowest depth not yet seen to drop frames. It does not
+// shrink again until it has had to grow again, so the depth settles
+// rather than cycling.
+// The queue can only be resized by re-initialising the camera so this
+// is never done while a capture is in progress.
+{
+ unsigned long gaps;
+ unsigned int want;
+ time_t now;
+ char msgtxt[128];
+
+ if(Gb_Buffers || io == IO_METHOD_READ || !camera_status.cs_streaming) return;
+ if(Need_to_save || image_being_grabbed || Ser_active || Delayed_start_in_progress) return;
+
+ now  = time(NULL);
+ want = Cap_nbuf_adapt;
+ gaps = __atomic_load_n(&Cap_seq_gaps, __ATOMIC_RELAXED);
+ if(gaps > Cap_gaps_seen){
+    Cap_gaps_seen  = gaps;
+    if(difftime(now,Cap_last_adapt) < NBUF_SETTLE_SECS) return;
+    Cap_last_adapt = now;
+    if(want >= Cap_nbuf_floor) Cap_nbuf_floor = (want < NBUF_MAX) ? want+1 : NBUF_MAX;
+    want = (2*want > NBUF_MAX) ? NBUF_MAX : 2*want;
+    if(want > Cap_nbuf_drvmax) want = Cap_nbuf_drvmax;
+    Cap_nbuf_shrunk = 0;
+  } else if(!Cap_nbuf_shrunk && Need_to_preview==PREVIEW_ON && difftime(now,Cap_last_adapt) >= NBUF_QUIET_SECS){
+    Cap_last_adapt = now;
+    Cap_nbuf_shrunk = 1;
+    if(want > Cap_nbuf_floor) want = Cap_nbuf_floor;
+  }
+ if(want == Cap_nbuf_adapt) return;
+
+ Cap_nbuf_adapt = want;
+ sprintf(msgtxt,"Adaptive capture queue: re-initialising with %u buffers.",want);
+ show_message(msgtxt,"FYI: ",MT_INFO,0);
+ if(re_init_device())
+   show_message("Failed to re-initialise the camera with the new number of capture buffers","Warning: ",MT_ERR,0);
+}
+
 static gboolean update_cam_preview(void)
 // Timeout function to update the preview window image
 {
+  // Let the capture queue depth adapt (if it is set to) and keep the
+  // display of it up to date:
+  adapt_buffer_depth();
+  update_capture_stats();
   // The save function will update the preview if needed so don't duplicate
   if(Need_to_save) return TRUE;
   // Wait till a new preview image is ready before trying to display it or you
@@ -10056,9 +14379,11 @@ int test_selected_df_filename(char *filename)
     
  sprintf(Selected_DF_filename,"%s",filename);
  df_pending=1;
- gtk_widget_set_sensitive (chk_usedfcor,TRUE);
- gtk_widget_set_sensitive (CamsetWidget[windex_ud],TRUE);
- gtk_widget_set_sensitive (CamsetWidget[windex_ud2],TRUE);
+ if(gui_up){
+   gtk_widget_set_sensitive (chk_usedfcor,TRUE);
+   gtk_widget_set_sensitive (CamsetWidget[windex_ud],TRUE);
+   gtk_widget_set_sensitive (CamsetWidget[windex_ud2],TRUE);
+  }
 
  sprintf(msgtxt,"You selected dark field image: %s (%d)\nWill attempt to load and process it when you click 'Apply',",name_from_path(Selected_DF_filename),imfmt);
  show_message(msgtxt,"FYI: ",MT_INFO,1);
@@ -10309,7 +14634,7 @@ void nullify_darkfield(void)
   // addressable and GTK errors will result. This situation may arise
   // during the running of a script if the camera settings window was
   // closed prior to running it.
-  if(gtk_widget_is_visible(win_cam_settings)==TRUE){
+  if(gui_up && gtk_widget_is_visible(win_cam_settings)==TRUE){
       gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(chk_usedfcor),FALSE);
       gtk_widget_set_sensitive (chk_usedfcor,FALSE);
       gtk_label_set_text(GTK_LABEL(CamsetWidget[windex_ud]),"No");
@@ -10363,7 +14688,7 @@ static int init_darkfield_image(void)
  imsz=(size_t)Selected_Ht*(size_t)width_stride; 
  rgbimsz=imsz;
  
- if(resize_memblk((void **)&DF_Image,rgbimsz,sizeof(double), "the dark field image"))
+ if(resize_memblk((void **)&DF_Image,rgbimsz,sizeof(fpix_t), "the dark field image"))
   {
    nullify_darkfield();
    return 1;
@@ -10382,8 +14707,8 @@ static int init_darkfield_image(void)
  sprintf(DFFile,"%s",Selected_DF_filename);
  sprintf(msgtxt,"Dark field correction image loaded: %s",DFFile);
  show_message(msgtxt,"FYI: ",MT_INFO,0);
- if(gtk_widget_is_visible(win_cam_settings)==TRUE){
-     dffile_loaded=imfmt;
+ dffile_loaded=imfmt;
+ if(gui_up && gtk_widget_is_visible(win_cam_settings)==TRUE){
      //set label to show filename
      gtk_label_set_text(GTK_LABEL(CamsetWidget[windex_rdfi]), name_from_path(DFFile));  
      gtk_widget_set_sensitive (chk_usedfcor,TRUE);
@@ -10430,9 +14755,11 @@ int test_selected_ff_filename(char *filename)
     sprintf(Selected_FF_filename,"%s",filename);
     ff_pending=1;
     
-    gtk_widget_set_sensitive (chk_useffcor,TRUE);
-    gtk_widget_set_sensitive (CamsetWidget[windex_uf],TRUE);
-    gtk_widget_set_sensitive (CamsetWidget[windex_uf2],TRUE);
+    if(gui_up){
+      gtk_widget_set_sensitive (chk_useffcor,TRUE);
+      gtk_widget_set_sensitive (CamsetWidget[windex_uf],TRUE);
+      gtk_widget_set_sensitive (CamsetWidget[windex_uf2],TRUE);
+     }
 
     sprintf(msgtxt,"You selected flat field image: %s (%d)\nWill attempt to load and process it when you click 'Apply',",name_from_path(Selected_FF_filename),imfmt);
     show_message(msgtxt,"FYI: ",MT_INFO,1);
@@ -10528,7 +14855,7 @@ void nullify_flatfield(void)
   // because the dynamically allocated GUI controls will not be addressable
   // and GTK errors will result. This situation may arise during the running
   // of a script if the camera settings window was closed prior to running it.
-  if(gtk_widget_is_visible(win_cam_settings)==TRUE){
+  if(gui_up && gtk_widget_is_visible(win_cam_settings)==TRUE){
       gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(chk_useffcor),FALSE);
       gtk_widget_set_sensitive (chk_useffcor,FALSE);
       gtk_label_set_text(GTK_LABEL(CamsetWidget[windex_uf]),"No");
@@ -10678,13 +15005,13 @@ if(rawdou==0){
   // The image is now loaded into an unsigned char array but corrections
   // are done in doubles. So make a raw doubles array and copy over the
   // values:
-  if(resize_memblk((void **)&FF_Image,rgbimsz,sizeof(double), "the flat field image (doubles)"))
+  if(resize_memblk((void **)&FF_Image,rgbimsz,sizeof(fpix_t), "the flat field image (doubles)"))
    {
     nullify_flatfield();
     free(tmploc);
     return 1;
    }
-  for(stdx=0;stdx<rgbimsz;stdx++) FF_Image[stdx]=(double)tmploc[stdx];
+  for(stdx=0;stdx<rgbimsz;stdx++) FF_Image[stdx]=(fpix_t)tmploc[stdx];
   // Now we are done with tmploc. Also we need to change flags to the
   // raw doubles version for the rest of this function. So ...
   free(tmploc);
@@ -10701,7 +15028,7 @@ if(rawdou==0){
     
  } else { // If the user wants to load a raw doubles flat field ...
      
- if(resize_memblk((void **)&FF_Image,rgbimsz,sizeof(double), "the flat field image (doubles)"))
+ if(resize_memblk((void **)&FF_Image,rgbimsz,sizeof(fpix_t), "the flat field image (doubles)"))
   {
    nullify_flatfield();
    return 1;
@@ -10833,7 +15160,7 @@ if(rawdou==0){
  sprintf(FFFile,"%s",Selected_FF_filename);
  sprintf(msgtxt,"Flat field correction image loaded: %s",FFFile);
  show_message(msgtxt,"FYI: ",MT_INFO,0);
- if(gtk_widget_is_visible(win_cam_settings)==TRUE){
+ if(gui_up && gtk_widget_is_visible(win_cam_settings)==TRUE){
      // fffile_loaded was set in the above switch block.
      // Set label to show filename and other GUI controls/labels:
      gtk_label_set_text(GTK_LABEL(CamsetWidget[windex_rffi]),name_from_path(FFFile));  
@@ -10972,7 +15299,7 @@ void nullify_pcd(void)
  // during the running of a script if the camera settings window was
  // closed prior to running it.
  sprintf(PCDFile,"[None]");
- if(gtk_widget_is_visible(win_cam_settings)==TRUE){
+ if(gui_up && gtk_widget_is_visible(win_cam_settings)==TRUE){
     gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(chk_usepcd),FALSE);
     gtk_widget_set_sensitive (chk_usepcd,FALSE);
     gtk_label_set_text(GTK_LABEL(CamsetWidget[windex_upc]),"No");
@@ -11007,7 +15334,7 @@ static int init_pcd_image(void)
 
  if(!strcmp(Selected_PCD_filename,"[None]") || !strcmp(Selected_PCD_filename,"[Full]") || !strcmp(Selected_PCD_filename,"[UNDF]")){
    PrevCD_Pending=0;
-   if(gtk_widget_is_visible(win_cam_settings)==TRUE){
+   if(gui_up && gtk_widget_is_visible(win_cam_settings)==TRUE){
      gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(chk_usepcd),FALSE);
      gtk_widget_set_sensitive (chk_usepcd,FALSE);
      gtk_widget_set_sensitive (CamsetWidget[windex_upc],FALSE);
@@ -11090,7 +15417,7 @@ static int init_pcd_image(void)
  sprintf(msgtxt,"Preview colour dark image loaded: %s",PCDFile);
  show_message(msgtxt,"FYI: ",MT_INFO,0);
  
- if(gtk_widget_is_visible(win_cam_settings)==TRUE){
+ if(gui_up && gtk_widget_is_visible(win_cam_settings)==TRUE){
      //set label to show filename
      gtk_label_set_text(GTK_LABEL(CamsetWidget[windex_pcdi]), name_from_path(PCDFile));  
      gtk_widget_set_sensitive (chk_usepcd,TRUE);
@@ -11259,7 +15586,7 @@ void nullify_pmask(void)
  // addressable and GTK errors will result. This situation may arise
  // during the running of a script if the camera settings window was
  // closed prior to running it.
- if(gtk_widget_is_visible(win_cam_settings)==TRUE){
+ if(gui_up && gtk_widget_is_visible(win_cam_settings)==TRUE){
     gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(chk_usepmsk),FALSE);
     gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(chk_dsppmsk),FALSE);
     gtk_widget_set_sensitive (chk_usepmsk,FALSE);
@@ -11301,7 +15628,7 @@ static int init_pmask_image(void)
 
  if(!strcmp(PrevStat.Selected_Mask_filename,"[None]") || !strcmp(PrevStat.Selected_Mask_filename,"[Full]") || !strcmp(PrevStat.Selected_Mask_filename,"[UNDF]")){
    PrevStat.mask_pending=0;
-   if(gtk_widget_is_visible(win_cam_settings)==TRUE){
+   if(gui_up && gtk_widget_is_visible(win_cam_settings)==TRUE){
      gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(chk_usepmsk),FALSE);
      gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(chk_dsppmsk),FALSE);
      gtk_widget_set_sensitive (chk_usepmsk,FALSE);
@@ -11443,7 +15770,7 @@ static int init_pmask_image(void)
  show_message(msgtxt,"FYI: ",MT_INFO,0);
  PrevStat.mskfile_loaded=MASK_YRGB;
  
- if(gtk_widget_is_visible(win_cam_settings)==TRUE){
+ if(gui_up && gtk_widget_is_visible(win_cam_settings)==TRUE){
      //set label to show filename
      gtk_label_set_text(GTK_LABEL(CamsetWidget[windex_pmski]), name_from_path(PrevStat.MaskFile));  
      gtk_widget_set_sensitive (chk_usepmsk,TRUE);
@@ -11472,10 +15799,12 @@ int test_selected_msk_filename(char *filename)
  if(!strcmp(filename,"[None]") || !strcmp(filename,"[Full]") || !strcmp(filename,"[UNDF]") || !strcmp(filename,"None.bmp")){
    mask_pending=0;
    if(!strcmp(filename,"None.bmp")) sprintf(Selected_Mask_filename,"[None]");
-   gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(chk_usemskcor),FALSE);
-   gtk_widget_set_sensitive (chk_usemskcor,FALSE);
-   gtk_widget_set_sensitive (CamsetWidget[windex_um],FALSE);
-   gtk_widget_set_sensitive (CamsetWidget[windex_um2],FALSE);
+   if(gui_up){
+     gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(chk_usemskcor),FALSE);
+     gtk_widget_set_sensitive (chk_usemskcor,FALSE);
+     gtk_widget_set_sensitive (CamsetWidget[windex_um],FALSE);
+     gtk_widget_set_sensitive (CamsetWidget[windex_um2],FALSE);
+    }
    return 1;
  }
 
@@ -11502,9 +15831,11 @@ int test_selected_msk_filename(char *filename)
 
     sprintf(Selected_Mask_filename,"%s",filename);
     mask_pending=1;
-    gtk_widget_set_sensitive (chk_usemskcor,TRUE);
-    gtk_widget_set_sensitive (CamsetWidget[windex_um],TRUE);
-    gtk_widget_set_sensitive (CamsetWidget[windex_um2],TRUE);
+    if(gui_up){
+      gtk_widget_set_sensitive (chk_usemskcor,TRUE);
+      gtk_widget_set_sensitive (CamsetWidget[windex_um],TRUE);
+      gtk_widget_set_sensitive (CamsetWidget[windex_um2],TRUE);
+     }
 
     sprintf(msgtxt,"You selected mask image: %s\nWill attempt to load and process it when you click 'Apply',",name_from_path(Selected_Mask_filename));
     show_message(msgtxt,"FYI: ",MT_INFO,1);
@@ -11619,7 +15950,7 @@ void nullify_mask(void)
   // addressable and GTK errors will result. This situation may arise
   // during the running of a script if the camera settings window was
   // closed prior to running it.
-  if(gtk_widget_is_visible(win_cam_settings)==TRUE){
+  if(gui_up && gtk_widget_is_visible(win_cam_settings)==TRUE){
       gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(chk_usemskcor),FALSE);
       gtk_widget_set_sensitive (chk_usemskcor,FALSE);
       gtk_label_set_text(GTK_LABEL(CamsetWidget[windex_um]),"No");
@@ -11656,7 +15987,7 @@ static int init_mask_image(void)
 
  if(!strcmp(Selected_Mask_filename,"[None]") || !strcmp(Selected_Mask_filename,"[Full]") || !strcmp(Selected_Mask_filename,"[UNDF]")){
    mask_pending=0;
-   if(gtk_widget_is_visible(win_cam_settings)==TRUE){
+   if(gui_up && gtk_widget_is_visible(win_cam_settings)==TRUE){
      gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(chk_usemskcor),FALSE);
      gtk_widget_set_sensitive (chk_usemskcor,FALSE);
      gtk_widget_set_sensitive (CamsetWidget[windex_um],FALSE);
@@ -11801,7 +16132,7 @@ static int init_mask_image(void)
  mask_alloced=MASK_YES;
  mskfile_loaded=MASK_YRGB;
  
- if(gtk_widget_is_visible(win_cam_settings)==TRUE){
+ if(gui_up && gtk_widget_is_visible(win_cam_settings)==TRUE){
      //set label to show filename
      gtk_label_set_text(GTK_LABEL(CamsetWidget[windex_rmski]), name_from_path(MaskFile));  
      gtk_widget_set_sensitive (chk_usemskcor,TRUE);
@@ -11928,7 +16259,7 @@ static void btn_cs_load_cset_click(GtkWidget *widget, gpointer data)
  gtk_widget_destroy(load_file_dialog);
 
  // Set the file name of the loaded settings file
-  if(gtk_widget_is_visible(win_cam_settings)==TRUE){
+  if(gui_up && gtk_widget_is_visible(win_cam_settings)==TRUE){
      // csetfile_loaded was set above.
      // Set label to show filename and other GUI controls/labels:
      if(csetfile_loaded==CSET_CUST){
@@ -12021,7 +16352,7 @@ static void btn_cs_save_cset_click(GtkWidget *widget, gpointer data)
  gtk_widget_destroy(save_file_dialog);
  
  // Set the file name of the loaded settings file
-  if(gtk_widget_is_visible(win_cam_settings)==TRUE){
+  if(gui_up && gtk_widget_is_visible(win_cam_settings)==TRUE){
      // csetfile_loaded was set above.
      // Set label to show filename and other GUI controls/labels:
      if(csetfile_loaded==CSET_CUST){
@@ -12045,11 +16376,11 @@ int get_camera_control(unsigned int id, int *ival)
  vd_queryctrl.id=vd_control.id;
  *ival=0;
 
- if(0 == ioctl(fd, VIDIOC_QUERYCTRL, &vd_queryctrl)) {
+ if(0 == xioctl(fd, VIDIOC_QUERYCTRL, &vd_queryctrl)) {
       if (!(vd_queryctrl.flags & V4L2_CTRL_FLAG_DISABLED)) {
          // Query the vd_control and get current value, name and ranges
          vd_control.id = vd_queryctrl.id;
-         if (0 == ioctl(fd, VIDIOC_G_CTRL, &vd_control)) *ival=vd_control.value; else return 1;
+         if (0 == xioctl(fd, VIDIOC_G_CTRL, &vd_control)) *ival=vd_control.value; else return 1;
      }
   } else return 1;
 
@@ -12061,13 +16392,18 @@ int set_camera_control(unsigned int id, int ival, char *cname)
 // and prints the vd_control name in 'cname' if it can't.
 // Returns 0 on success and 1 or 2 on failure.
 {
+ struct timespec ts;
+
  vd_control.id = id;
  vd_control.value = ival;
  vd_queryctrl.id=vd_control.id; 
- ioctl(fd, VIDIOC_QUERYCTRL, &vd_queryctrl);  
+ xioctl(fd, VIDIOC_QUERYCTRL, &vd_queryctrl);  
  sprintf(cname,"%s",vd_queryctrl.name);
 
- if(-1 == ioctl(fd, VIDIOC_S_CTRL, &vd_control)) {
+ // Frames exposed before now may not show the change:
+ clock_gettime(CLOCK_MONOTONIC,&ts);
+ Cap_ctrl_us = (long long)ts.tv_sec*1000000LL + ts.tv_nsec/1000;
+ if(-1 == xioctl(fd, VIDIOC_S_CTRL, &vd_control)) {
    // Identify if this an error setting the  manual focus value by
    // returning the special value '2'. This will allow us to determine
    // if this is really an error or whether this call to set the value
@@ -12115,7 +16451,7 @@ int update_framerate_resolutions(void)
  // as the current ImHeight and ImWidth (or 0 if none of the listed
  // formats match the current values).
  CurrDims_idx = VGA_idx = -1; comboidx=0;
- while(0 == ioctl(fd, VIDIOC_ENUM_FRAMESIZES, &frmsizeenum)){
+ while(0 == xioctl(fd, VIDIOC_ENUM_FRAMESIZES, &frmsizeenum)){
 
          sprintf(ctrl_name,"%u x %u",frmsizeenum.discrete.width,frmsizeenum.discrete.height);
          sprintf(msgtxt,"\t[%d]-> %s",fdx,ctrl_name);
@@ -12135,7 +16471,7 @@ int update_framerate_resolutions(void)
                                    // resolution entry in the combo list
          currfr=maxfr=0.0; // To evaluate the actual frame rate
          mdenom=mnum=1;    // Maximum frame rate integers
-         while(0 == ioctl(fd, VIDIOC_ENUM_FRAMEINTERVALS, &frmivalenum)){
+         while(0 == xioctl(fd, VIDIOC_ENUM_FRAMEINTERVALS, &frmivalenum)){
               sprintf(ctrl_name2," at %u/%u fps",frmivalenum.discrete.denominator,frmivalenum.discrete.numerator);
               sprintf(msgtxt,"\t\tFrame rate [%d]%s",fintdx,ctrl_name2);
               show_message(msgtxt,"",MT_INFO,0);
@@ -12227,7 +16563,8 @@ static void btn_cs_apply_click(GtkWidget *widget, gpointer data)
 // processing behaviours
 {
  int ctrlindex,idx,tdx,tmp_preview,tmp_avd,szidx,esdx;
- int cfchanged,requestedfmt,pmask_status_changed;
+ int cfchanged,requestedfmt,pmask_status_changed,nbchanged=0;
+ int pflip_changed=0;
  char msgtxt[320],cname[64],statmn[32],statvar[32];
  gchar *numstr,*markup;
  int MFidx,retval,manualfocus; // For correct manual focus warning
@@ -12366,44 +16703,24 @@ static void btn_cs_apply_click(GtkWidget *widget, gpointer data)
    // user's choice is not supported for the new camera stream format.
    numstr = gtk_combo_box_text_get_active_text(GTK_COMBO_BOX_TEXT(combo_camfmt));
    requestedfmt=camfmt_from_string(numstr);
-   if(FormatForbidden==requestedfmt){
+   if(requestedfmt>=0 && (FormatForbidden & CAF_BIT(requestedfmt))){
      show_message("The camera stream format you requested is not supported by your camera.","FYI: ",MT_INFO,1);
      // Reset the camera format combo box.
-     switch(CamFormat){
-        case V4L2_PIX_FMT_YUYV:
-          gtk_combo_box_set_active (GTK_COMBO_BOX (combo_camfmt), 0);
-          numstr = g_strdup_printf("Raw YUYV");
-        break;
-        case V4L2_PIX_FMT_MJPEG:
-          gtk_combo_box_set_active (GTK_COMBO_BOX (combo_camfmt), 1);
-          numstr = g_strdup_printf("MJPEG");
-        break;
-        default: // Should never get here.
-          show_message("Unrecognised camera format.","Program Error: ",MT_ERR,1);
-        break;
-      }
+     idx=camfmt_index(CamFormat);
+     if(idx>=0){
+       g_free(numstr);
+       gtk_combo_box_set_active (GTK_COMBO_BOX (combo_camfmt), idx);
+       numstr = g_strdup_printf("%s",camfmt_options[idx]);
+      } else show_message("Unrecognised camera format.","Program Error: ",MT_ERR,1); // Should never get here.
     } else {
-    switch(requestedfmt){
-      case CAF_YUYV:
-       if(CamFormat != V4L2_PIX_FMT_YUYV){
-          cfchanged=1;
-          CamFormat = V4L2_PIX_FMT_YUYV;
-         }
-      break;
-      case CAF_MJPEG:
-       if(CamFormat != V4L2_PIX_FMT_MJPEG){
-          cfchanged=1;
-          CamFormat = V4L2_PIX_FMT_MJPEG;
-         }
-      break;
-      default: // Should never get here. Set YUYV by default if you do.
-         show_message("Unrecognised camera format. Using YUYV","Program Error: ",MT_ERR,1);
-         if(CamFormat != V4L2_PIX_FMT_YUYV){
-           cfchanged=1;
-           CamFormat = V4L2_PIX_FMT_YUYV;
-          }
-      break;
-    }
+    if(requestedfmt<0){ // Should never get here. Set YUYV by default if you do.
+      show_message("Unrecognised camera format. Using YUYV","Program Error: ",MT_ERR,1);
+      requestedfmt=CAF_YUYV;
+     }
+    if(CamFormat != camfmt_fourcc[requestedfmt]){
+      cfchanged=1;
+      CamFormat = camfmt_fourcc[requestedfmt];
+     }
   }
 
    gtk_label_set_text(GTK_LABEL(CamsetWidget[windex_camfmt]),numstr);
@@ -12484,6 +16801,32 @@ static void btn_cs_apply_click(GtkWidget *widget, gpointer data)
   show_message(msgtxt,"FYI: ",MT_INFO,0);
   g_free(numstr);
 
+  // Get the 'Grab freshest frame?' selection 
+  if(gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(chk_freshest))==TRUE){
+       Gb_Freshest=1;
+       numstr = g_strdup_printf("Yes");
+   } else {
+       Gb_Freshest=0 ;
+       numstr = g_strdup_printf("No");
+   }
+  gtk_label_set_text(GTK_LABEL(CamsetWidget[windex_fsh]),numstr);
+  sprintf(msgtxt,"You chose: Grab freshest frame? - %s",numstr);
+  show_message(msgtxt,"FYI: ",MT_INFO,0);
+  g_free(numstr);
+
+  // Get the 'Y-only saves from MJPEG as JPEG luma?' selection 
+  if(gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(chk_jpeg_luma))==TRUE){
+       Mjpeg_luma=1;
+       numstr = g_strdup_printf("Yes");
+   } else {
+       Mjpeg_luma=0 ;
+       numstr = g_strdup_printf("No");
+   }
+  gtk_label_set_text(GTK_LABEL(CamsetWidget[windex_jly]),numstr);
+  sprintf(msgtxt,"You chose: Y-only saves from MJPEG as JPEG luma? - %s",numstr);
+  show_message(msgtxt,"FYI: ",MT_INFO,0);
+  g_free(numstr);
+
   // Get the 'Use cumulative histogram (Red/Grey)?' selection 
   if(gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(chk_usehcr))==TRUE){
        PrevStat.hgm_cum_r=1;
@@ -12576,6 +16919,7 @@ static void btn_cs_apply_click(GtkWidget *widget, gpointer data)
   g_free(numstr);
 
   // Get the 'Flip horizontal?' selection 
+  pflip_changed=prev_flip_h+2*prev_flip_v;
   if(gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(chk_usefph))==TRUE){
        prev_flip_h=1;
        numstr = g_strdup_printf("Yes");
@@ -12600,6 +16944,7 @@ static void btn_cs_apply_click(GtkWidget *widget, gpointer data)
   sprintf(msgtxt,"You chose: Preview pre-process - Flip vertical? - %s",numstr);
   show_message(msgtxt,"FYI: ",MT_INFO,0);
   g_free(numstr);
+  pflip_changed=(pflip_changed!=prev_flip_h+2*prev_flip_v)?1:0;
 
   // Get the 'Use mean abs. Laplacian?' selection 
   if(gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(chk_usefls))==TRUE){
@@ -12886,6 +17231,22 @@ static void btn_cs_apply_click(GtkWidget *widget, gpointer data)
                       idx++;
                      }
                      gtk_label_set_text(GTK_LABEL(CamsetWidget[ctrlindex+1]),msgtxt);
+             } else if(ctrlindex == windex_nb){  // Number of capture buffers
+                     sprintf(msgtxt,"%-7s",gtk_entry_get_text(GTK_ENTRY(CamsetWidget[ctrlindex])));
+                     tmp_avd=atoi(msgtxt);
+                     // Check this value is within acceptable limits
+                     // hard coded here as 0 (adaptive) or 2 to NBUF_MAX
+                     if(cs_int_range_check(-1, NBUF_MAX+1,"Capture buffers (0 = adaptive)", tmp_avd,1)){
+                      sprintf(msgtxt,"%-7d",Gb_Buffers);
+                     } else if(tmp_avd==1){
+                      show_message("At least 2 capture buffers are needed (or 0 for adaptive).\nThe value you chose will not be applied. Reverting to previous value.","Invalid Setting: ",MT_ERR,1);
+                      sprintf(msgtxt,"%-7d",Gb_Buffers);
+                     } else {//  Set the new number of buffers
+                      if(tmp_avd != Gb_Buffers) nbchanged=1;
+                      Gb_Buffers = tmp_avd;
+                      idx++;
+                     }
+                     gtk_label_set_text(GTK_LABEL(CamsetWidget[ctrlindex+1]),msgtxt);
              } else if(ctrlindex == windex_srn){ // Number of captures
                      sprintf(msgtxt,"%-7s",gtk_entry_get_text(GTK_ENTRY(CamsetWidget[ctrlindex])));
                      tmp_avd=atoi(msgtxt);
@@ -13102,6 +17463,14 @@ static void btn_cs_apply_click(GtkWidget *widget, gpointer data)
    }
  
  
+ // A new number of capture buffers only takes effect when the camera is
+ // re-initialised:
+ if(nbchanged && camera_status.cs_initialised){
+   if(re_init_device()){ 
+     sprintf(msgtxt,"Failed to re-initialise the camera with the new number of capture buffers");
+     show_message(msgtxt,"Warning: ",MT_ERR,0);
+    }
+  }
 
  // Update the colour conversion LUTs in case Gain_conv or Bias_conv were changed.
  calculate_yuyv_luts(); 
@@ -13422,6 +17791,12 @@ static void btn_cs_apply_click(GtkWidget *widget, gpointer data)
           gtk_widget_hide(Ebox_lab_preview);
         }
       }
+    } else if(pflip_changed){
+     // The flips are made by the preview index arrays, so just remake
+     // those (this recalculates the sample size too - see below). Blank
+     // the preview too because the padding may move by a pixel.
+     memset(PreviewImg, 127, PreviewImg_rgb_size*sizeof(unsigned char));
+     Preview_impossible=calculate_preview_params();
     } else if(pmask_status_changed) calc_preview_base_stats();
     // If the preview was changed then calc_preview_base_stats() would have
     // called (via calculate_preview_params() called from within 
@@ -13694,7 +18069,7 @@ static gboolean on_camset_show (GtkWidget *widget, GdkEvent  *event,  gpointer
 {
  char ctrl_name[64],ctrl_value[10];
  char fname[PATH_MAX];
- int fdx,szidx;
+ int fdx,szidx,idx;
  gchar *numstr;
  GtkInputPurpose ipurpose;
 
@@ -13705,7 +18080,7 @@ static gboolean on_camset_show (GtkWidget *widget, GdkEvent  *event,  gpointer
  // Entry box / Label windex handles (as opposed to check/combo box windexes)
  windex_gn = windex_bs = windex_camfmt = windex_safmt = 0;
  windex_fps = windex_plut = windex_imroot = windex_fit = 0;
- windex_fno = windex_sz = windex_avd = windex_to = windex_rt = 0;
+ windex_fno = windex_sz = windex_avd = windex_to = windex_rt = windex_nb = 0;
  windex_srn = windex_srd = windex_jpg = windex_del = 0;
  windex_lsr = windex_lsg = windex_lsb = 0;
  windex_usr = windex_usg = windex_usb = 0;
@@ -13812,18 +18187,12 @@ static gboolean on_camset_show (GtkWidget *widget, GdkEvent  *event,  gpointer
    gtk_widget_show(combo_camfmt);
    if(next_windex()) return TRUE;
    windex_camfmt = windex; // Make a note that this index is for the camera format combo value label
-   switch(CamFormat){
-       case V4L2_PIX_FMT_YUYV: // Raw YUYV 16 bpp array
-         numstr = g_strdup_printf("Raw YUYV");
-       break;
-       case V4L2_PIX_FMT_MJPEG: // MJPEG stream
-         numstr = g_strdup_printf("MJPEG");
-       break;
-       default: // This should not happen unless the programmer has made a mistake
-        show_message("Undefined camera format specified!","Program Error: ",MT_ERR,1);
-        return TRUE;
-       break;
-   }
+   idx=camfmt_index(CamFormat);
+   if(idx<0){ // This should not happen unless the programmer has made a mistake
+     show_message("Undefined camera format specified!","Program Error: ",MT_ERR,1);
+     return TRUE;
+    }
+   numstr = g_strdup_printf("%s",camfmt_options[idx]);
    CamsetWidget[windex_camfmt]=gtk_label_new (numstr);  cswt_id[windex_camfmt]= CS_WTYPE_LABEL;
    g_free(numstr);
    gtk_widget_set_halign (CamsetWidget[windex_camfmt], GTK_ALIGN_START);
@@ -13933,6 +18302,20 @@ static gboolean on_camset_show (GtkWidget *widget, GdkEvent  *event,  gpointer
    (gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(chk_scale_means)))?"Yes":"No",
    "Scale mean of each frame to first?")) return TRUE;
 
+// Now add the 'Grab freshest frame?' check box and make it
+// visible and create its current value and description labels
+   windex_new13=windex;
+   if(add_settings_custom_widget(chk_freshest, &windex_fsh, 
+   (gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(chk_freshest)))?"Yes":"No",
+   "Grab freshest frame?")) return TRUE;
+
+// Now add the 'Y-only saves from MJPEG as JPEG luma?' check box and make
+// it visible and create its current value and description labels
+   if(add_settings_custom_widget(chk_jpeg_luma, &windex_jly, 
+   (gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(chk_jpeg_luma)))?"Yes":"No",
+   "Y-only saves from MJPEG as JPEG luma?")) return TRUE;
+   windex_new13=windex-windex_new13; // (Widgets of the 2 rows above)
+
 // Now add grabber timeout setting
    sprintf(ctrl_value,"%-7d",Gb_Timeout);   windex_to = windex;
    add_settings_line_to_gui((const gchar *)ctrl_value, "Grabber timeout (seconds) [4-360]",GTK_INPUT_PURPOSE_NUMBER);rowdex++; 
@@ -13941,6 +18324,11 @@ static gboolean on_camset_show (GtkWidget *widget, GdkEvent  *event,  gpointer
    sprintf(ctrl_value,"%-7d",Gb_Retry);   windex_rt = windex;
    add_settings_line_to_gui((const gchar *)ctrl_value, "Frame capture (number of retries) [0-4096]",GTK_INPUT_PURPOSE_NUMBER);rowdex++; 
 
+// Now add number of capture buffers setting
+   sprintf(ctrl_value,"%-7d",Gb_Buffers);   windex_nb = windex;
+   add_settings_line_to_gui((const gchar *)ctrl_value, "Capture buffers (0 = adaptive) [0, 2-32]",GTK_INPUT_PURPOSE_NUMBER);rowdex++; 
+   windex_new13+=windex-windex_nb;
+
 // Now add series number of images setting
    sprintf(ctrl_value,"%-7d",Ser_Number);   windex_srn = windex;
    add_settings_line_to_gui((const gchar *)ctrl_value, "Series (number of images) [1-604800]",GTK_INPUT_PURPOSE_NUMBER);rowdex++; 
@@ -14376,6 +18764,10 @@ static gboolean on_camset_delete_event (GtkWidget *widget, GdkEvent  *event,  gp
   hide_remove_from_container(chk_sa_fits,GTK_CONTAINER(grid_camset)); 
   // Hide the Scale mean of each frame to first? selector check box
   hide_remove_from_container(chk_scale_means,GTK_CONTAINER(grid_camset)); 
+  // Hide the Grab freshest frame? selector check box
+  hide_remove_from_container(chk_freshest,GTK_CONTAINER(grid_camset)); 
+  // Hide the Y-only saves from MJPEG as JPEG luma? selector check box
+  hide_remove_from_container(chk_jpeg_luma,GTK_CONTAINER(grid_camset)); 
   // Hide the Use cumulative histogram (Red/Grey)? selector check box
   hide_remove_from_container(chk_usehcr,GTK_CONTAINER(grid_camset)); 
   // Hide the Use cumulative histogram (Green)? selector check box
@@ -14441,26 +18833,31 @@ static void grab_prev_adjust_value (GtkSpinButton *button, gpointer padjtype)
   case PADJUST_INTEGRAL:
    sprintf(msgtxt,"Integrating %d frames for preview",ival);
    show_message(msgtxt,"FYI: ",MT_INFO,0);
-   if(ival>1){
-   for(idx=1;idx<ival;idx++){
-     if(resize_memblk((void **)&PreviewBuff[idx],(size_t)PreviewImg_size,sizeof(int), "the integration buffer")){
+   // Only the buffers being added or dropped are (re)alloced, so the
+   // frames already in the rest carry on being integrated
+   for(idx=PreviewBuff_n;idx<ival;idx++){
+     if(resize_memblk((void **)&PreviewBuff[idx],(size_t)PreviewImg_size,sizeof(unsigned char), "the integration buffer")){
          show_message("No RAM available for prime preview buffer.","Error: ",MT_ERR,0);
+         PreviewBuff_n=idx;
          Preview_integral=1;
+         preview_sum_reset();
          return;
       }
     }
-   if(idx<PREVINTMAX){ // De-alloc memory from unused preview buffers
-     for(;idx<PREVINTMAX;idx++){
-       if(resize_memblk((void **)&PreviewBuff[idx],(size_t)1,sizeof(int), "the integration buffer")){
+   // De-alloc memory from unused preview buffers
+   for(idx=ival;idx<PreviewBuff_n;idx++){
+     if(resize_memblk((void **)&PreviewBuff[idx],(size_t)1,sizeof(unsigned char), "the integration buffer")){
          show_message("No RAM available to de-alloc prime preview buffer.","Error: ",MT_ERR,0);
+         PreviewBuff_n=idx;
          Preview_integral=1;
+         preview_sum_reset();
          return;
-        }
       }
-     }
     }
+   PreviewBuff_n=ival;
 
    Preview_integral=ival;
+   preview_sum_reset();
   break;
   case PADJUST_BIAS:
    sprintf(msgtxt,"Biasing preview by %d greyscale units",ival);
@@ -14485,7 +18882,7 @@ static void close_cam_with_query(char *query_message, int just_close)
  if(choice == GTK_RESPONSE_YES)
   {
 
-   if(gtk_widget_is_visible(win_cam_settings)==TRUE){
+   if(gui_up && gtk_widget_is_visible(win_cam_settings)==TRUE){
      on_camset_delete_event (win_cam_settings, NULL,  btn_cam_settings);
     }
    show_message("> Closing camera connection.","",MT_INFO,0);
@@ -14558,6 +18955,9 @@ static void combo_vnum_selected(GtkWidget * combovn, GdkEvent * event, gpointer
 
  DevNum=idx;
 
+ // Choosing a device number means leaving any virtual frame source
+ // (the camera is always closed by the time we get here).
+ Vsrc_type = VSRC_NONE;
  sprintf(Dev_Name,"/dev/video%d",DevNum);
 
  printf("\nSelecting device: %s\n",Dev_Name);
@@ -14759,6 +19159,465 @@ static void add_checkbox(GtkWidget **cbox)
  gtk_widget_set_halign (*cbox, GTK_ALIGN_CENTER);
 }
 
+#define MEMBENCH_FRAMES 100 // Frames timed for each allocation mode
+
+static double membench_ms(struct timespec *t0)
+// Milliseconds since *t0
+{
+ struct timespec t1;
+
+ clock_gettime(CLOCK_MONOTONIC,&t1);
+ return (double)(t1.tv_sec-t0->tv_sec)*1000.0 + (double)(t1.tv_nsec-t0->tv_nsec)/1.0e6;
+}
+
+static int run_membench(const char *size)
+// Time the large stores under each allocation mode (the --membench
+// option) for a wd x ht YUYV frame: the time to get them, the first
+// pass of frames through them (one per capture buffer, which is where
+// plain malloc pays for its page faults) and the mean per frame over
+// MEMBENCH_FRAMES after that. Each frame is
+// written into a capture buffer as the driver would, then unpacked to
+// RGBimg and the Frmr/g/b stores as process_image does.
+// The first row ('malloc') is how these stores were got before
+// big_alloc(). No camera is needed.
+// Returns 0 on success, 1 on error.
+{
+ const char *mname[] = {"malloc","page","page,pin","thp","thp,pin","huge","huge,pin"};
+ unsigned char *cbuf[READ_NBUFS],*rgb,*yuyv;
+ fpix_t *fr,*fg,*fb;
+ double t_get,t_first,t_run,check=0.0;
+ unsigned int wd,ht,frm,b;
+ size_t npix,i;
+ struct timespec t0;
+ int m,old_mode=Bigmem_mode,old_pin=Bigmem_pin;
+ char ch;
+
+ if(sscanf(size,"%ux%u%c",&wd,&ht,&ch)!=2 || wd<2 || ht<1 || (wd & 1)){
+   fprintf(stderr,"\nUnusable frame size for --membench: %s\n",size);
+   return 1;
+  }
+ npix=(size_t)wd*ht;
+ printf("\nLarge store timings for a %ux%u YUYV frame (%d capture buffers):\n",wd,ht,READ_NBUFS);
+ printf("\n%-9s %10s %15s %14s\n","mode","get (ms)","first pass (ms)","per frame (ms)");
+ for(m=0;m<7;m++){
+   Bigmem_mode = (m<3) ? BIGMEM_PAGE : ((m<5) ? BIGMEM_THP : BIGMEM_HUGE);
+   Bigmem_pin = (m==2 || m==4 || m==6);
+   clock_gettime(CLOCK_MONOTONIC,&t0);
+   for(b=0;b<READ_NBUFS;b++) cbuf[b] = m ? big_alloc(npix*2,"a capture buffer") : malloc(npix*2);
+   rgb = m ? big_alloc(npix*3,"RGBimg") : calloc(npix,3);
+   fr = m ? big_alloc(npix*sizeof(fpix_t),"Frmr") : calloc(npix,sizeof(fpix_t));
+   fg = m ? big_alloc(npix*sizeof(fpix_t),"Frmg") : calloc(npix,sizeof(fpix_t));
+   fb = m ? big_alloc(npix*sizeof(fpix_t),"Frmb") : calloc(npix,sizeof(fpix_t));
+   t_get = membench_ms(&t0);
+   for(b=0;b<READ_NBUFS;b++) if(cbuf[b]==NULL) break;
+   if(b<READ_NBUFS || rgb==NULL || fr==NULL || fg==NULL || fb==NULL){
+     printf("%-9s (not enough memory)\n",mname[m]);
+     goto next_mode;
+    }
+   t_first = t_run = 0.0;
+   for(frm=0;frm<READ_NBUFS+MEMBENCH_FRAMES;frm++){
+     clock_gettime(CLOCK_MONOTONIC,&t0);
+     yuyv = cbuf[frm%READ_NBUFS];
+     memset(yuyv,(int)(frm & 0xff),npix*2); // The driver's write
+     for(i=0;i<npix;i++){
+        rgb[3*i] = rgb[3*i+1] = rgb[3*i+2] = yuyv[2*i];
+        fr[i] = (fpix_t)rgb[3*i];
+        fg[i] = (fpix_t)rgb[3*i+1];
+        fb[i] = (fpix_t)rgb[3*i+2];
+       }
+     if(frm<READ_NBUFS) t_first += membench_ms(&t0);
+     else t_run += membench_ms(&t0);
+    }
+   check += fr[npix-1]+fg[0]+fb[npix/2];
+   printf("%-9s %10.2f %15.2f %14.2f\n",mname[m],t_get,t_first,t_run/MEMBENCH_FRAMES);
+next_mode:
+   for(b=0;b<READ_NBUFS;b++) if(m) big_free(cbuf[b]); else free(cbuf[b]);
+   if(m){ big_free(rgb); big_free(fr); big_free(fg); big_free(fb); }
+   else { free(rgb); free(fr); free(fg); free(fb); }
+  }
+ printf("\n(check sum %.0f)\n\n",check);
+ Bigmem_mode=old_mode;
+ Bigmem_pin=old_pin;
+ return 0;
+}
+
+static int bench_luts(void)
+// Set up the YUYV conversion LUTs (and fixed point coefficients) with
+// unit gain and no bias for the benchmarks, which run before the GUI
+// would have done so. Returns 0 on success, 1 on error.
+{
+ if(!luts_alloced){
+   lut_yR=(double *)calloc(256,sizeof(double)); lut_yG=(double *)calloc(256,sizeof(double));
+   lut_yB=(double *)calloc(256,sizeof(double)); lut_crR=(double *)calloc(256,sizeof(double));
+   lut_crG=(double *)calloc(256,sizeof(double)); lut_cbG=(double *)calloc(256,sizeof(double));
+   lut_cbB=(double *)calloc(256,sizeof(double));
+   if(!lut_yR || !lut_yG || !lut_yB || !lut_crR || !lut_crG || !lut_cbG || !lut_cbB){
+     fprintf(stderr,"\nNo RAM for the conversion LUTs\n");
+     return 1;
+    }
+   luts_alloced=1;
+   Gain_conv=1.0; Bias_conv=0.0;
+  }
+ calculate_yuyv_luts();
+ return 0;
+}
+
+#define CONVBENCH_FRAMES 20 // Frames timed for each YUYV kernel
+
+static int run_convbench(const char *size)
+// Time the full-frame YUYV to Frmr/g/b conversion (the --convbench
+// option) for a wd x ht frame of made up YUYV data, in megapixels per
+// second: first the double precision LUT loop colour_convert() used to
+// use then each fixed point kernel this CPU can run. Each kernel's
+// output is checked against yuyv_frames_c() (it must be identical) and
+// the largest difference from the LUT version is shown.
+// No camera is needed. Returns 0 on success, 1 on error.
+{
+ const char *kname[] = {"C","SSE4.1","AVX2"};
+ yuyv_kernel_t kern[3];
+ unsigned short *yuyv;
+ unsigned char *mask;
+ fpix_t *fr,*fg,*fb,*ref[3];
+ double *lut[3],secs,fval,dmax,mn[3];
+ long long sums[3],refsums[3];
+ unsigned int wd,ht,seed=12345;
+ int npix,ipos,frm,k,c,y1,y2,cb,cr,nkern,same,retval=1;
+ struct timespec t0;
+ char ch;
+
+ if(sscanf(size,"%ux%u%c",&wd,&ht,&ch)!=2 || wd<2 || ht<1 || (wd & 1)){
+   fprintf(stderr,"\nUnusable frame size for --convbench: %s\n",size);
+   return 1;
+  }
+ npix=(int)(wd*ht);
+ if(bench_luts()) return 1;
+ if(!Yfx.ok){
+   fprintf(stderr,"\nThe YUYV conversion gain and bias are too big for the fixed point kernels\n");
+   return 1;
+  }
+ yuyv=(unsigned short *)big_alloc((size_t)npix*2,"the test frame");
+ mask=(unsigned char *)big_alloc((size_t)npix,"the test mask");
+ fr=(fpix_t *)big_alloc((size_t)npix*sizeof(fpix_t),"Frmr");
+ fg=(fpix_t *)big_alloc((size_t)npix*sizeof(fpix_t),"Frmg");
+ fb=(fpix_t *)big_alloc((size_t)npix*sizeof(fpix_t),"Frmb");
+ for(c=0;c<3;c++){
+    ref[c]=(fpix_t *)big_alloc((size_t)npix*sizeof(fpix_t),"the reference");
+    lut[c]=(double *)big_alloc((size_t)npix*sizeof(double),"the LUT result");
+   }
+ if(!yuyv || !mask || !fr || !fg || !fb || !ref[0] || !ref[1] || !ref[2] || !lut[0] || !lut[1] || !lut[2]){
+   fprintf(stderr,"\nNo RAM for a %ux%u test frame\n",wd,ht);
+   goto finish;
+  }
+ // Noise for the frame (all Y, Cb and Cr values occur) and a mask that
+ // leaves out about one pixel in eight
+ for(ipos=0;ipos<npix;ipos++){
+    seed=seed*1103515245u+12345u;
+    yuyv[ipos]=(unsigned short)(seed>>12);
+    mask[ipos]=((seed>>8)&7) ? 1 : 0;
+   }
+
+ printf("\nFull-frame YUYV conversion of a %ux%u frame (%d frames each):\n\n",wd,ht,CONVBENCH_FRAMES);
+ // The double precision LUT loop as it was in colour_convert()
+ clock_gettime(CLOCK_MONOTONIC,&t0);
+ for(frm=0;frm<CONVBENCH_FRAMES;frm++){
+   mn[0]=mn[1]=mn[2]=0.0;
+   for(ipos=0;ipos<npix;ipos+=2){
+      y1=yuyv[ipos] & 0xff; cb=yuyv[ipos] >> 8;
+      y2=yuyv[ipos+1] & 0xff; cr=yuyv[ipos+1] >> 8;
+      fval=lut_crG[cr] + lut_cbG[cb];
+      for(k=0;k<2;k++){
+         y1=k ? y2 : y1;
+         lut[0][ipos+k]=lut_yR[y1] + lut_crR[cr];
+         lut[1][ipos+k]=lut_yG[y1] - fval;
+         lut[2][ipos+k]=lut_yB[y1] + lut_cbB[cb];
+         if(mask[ipos+k]>0){
+           mn[0]+=lut[0][ipos+k];
+           mn[1]+=lut[1][ipos+k];
+           mn[2]+=lut[2][ipos+k];
+          }
+        }
+     }
+  }
+ secs=membench_ms(&t0)/1000.0;
+ printf("%-14s %8.1f MP/s  (mean R %.2f)\n","LUT (double)",(double)npix*CONVBENCH_FRAMES/secs/1.0e6,mn[0]/npix);
+
+ // Reference output for the checks
+ refsums[0]=refsums[1]=refsums[2]=0;
+ yuyv_frames_c(yuyv, npix, mask, ref[0], ref[1], ref[2], refsums);
+
+ nkern=0;
+ kern[nkern++]=yuyv_frames_c;
+#ifdef YUYV_X86_KERNELS
+ __builtin_cpu_init();
+ kern[nkern++]=__builtin_cpu_supports("sse4.1") ? yuyv_frames_sse41 : NULL;
+ kern[nkern++]=__builtin_cpu_supports("avx2") ? yuyv_frames_avx2 : NULL;
+#endif
+ for(k=0;k<nkern;k++){
+    if(kern[k]==NULL){
+      printf("%-14s (not supported by this CPU)\n",kname[k]);
+      continue;
+     }
+    clock_gettime(CLOCK_MONOTONIC,&t0);
+    for(frm=0;frm<CONVBENCH_FRAMES;frm++){
+       sums[0]=sums[1]=sums[2]=0;
+       kern[k](yuyv, npix, mask, fr, fg, fb, sums);
+      }
+    secs=membench_ms(&t0)/1000.0;
+    same = !memcmp(fr,ref[0],(size_t)npix*sizeof(fpix_t)) && !memcmp(fg,ref[1],(size_t)npix*sizeof(fpix_t)) &&
+           !memcmp(fb,ref[2],(size_t)npix*sizeof(fpix_t)) && !memcmp(sums,refsums,sizeof(sums));
+    for(ipos=0,dmax=0.0;ipos<npix;ipos++){
+       if(fabs(fr[ipos]-lut[0][ipos])>dmax) dmax=fabs(fr[ipos]-lut[0][ipos]);
+       if(fabs(fg[ipos]-lut[1][ipos])>dmax) dmax=fabs(fg[ipos]-lut[1][ipos]);
+       if(fabs(fb[ipos]-lut[2][ipos])>dmax) dmax=fabs(fb[ipos]-lut[2][ipos]);
+      }
+    printf("%-14s %8.1f MP/s  %s C, max. difference from LUT %.4f\n",kname[k],
+           (double)npix*CONVBENCH_FRAMES/secs/1.0e6, same ? "same as" : "DIFFERS FROM", dmax);
+    if(!same) goto finish;
+   }
+ select_yuyv_kernel();
+ printf("\nThe %s kernel will be used.\n\n",Yuyv_kernel_name);
+ retval=0;
+
+finish:
+ big_free(yuyv); big_free(mask); big_free(fr); big_free(fg); big_free(fb);
+ for(c=0;c<3;c++){ big_free(ref[c]); big_free(lut[c]); }
+ return retval;
+}
+
+#define PROCBENCH_FRAMES 20 // Frames timed for each kind of full-size image
+
+static int run_procbench(const char *size)
+// Time the whole full-size processing of a frame in colour_convert()
+// (the --procbench option) for a wd x ht frame of made up YUYV data
+// with dark and flat field correction on: a single RGB frame, and each
+// frame of a mean scaled multi-frame average (plus the final division).
+// The frame stores and dark and flat field images are fpix_t, so a
+// build with -DPARD_FLOAT32 and one without can be compared. No camera
+// is needed. Returns 0 on success, 1 on error.
+{
+ unsigned short *yuyv;
+ unsigned int wd,ht,seed=12345;
+ size_t npix,ipos,fpix_mb,acc_mb;
+ int frm,retval=1;
+ double t_single,t_avg,t_out;
+ struct timespec t0;
+ char ch;
+
+ if(sscanf(size,"%ux%u%c",&wd,&ht,&ch)!=2 || wd<2 || ht<1 || (wd & 1)){
+   fprintf(stderr,"\nUnusable frame size for --procbench: %s\n",size);
+   return 1;
+  }
+ if(bench_luts()) return 1;
+ select_yuyv_kernel();
+ ImWidth=(int)wd; ImHeight=(int)ht; ImSize=ImWidth*ImHeight;
+ npix=(size_t)ImSize;
+ yuyv=(unsigned short *)big_alloc(npix*2,"the test frame");
+ MaskIm=(unsigned char *)big_alloc(npix,"the test mask");
+ RGBimg=(unsigned char *)big_alloc(npix*3,"RGBimg");
+ Frmr=(fpix_t *)big_alloc(npix*sizeof(fpix_t),"Frmr");
+ Frmg=(fpix_t *)big_alloc(npix*sizeof(fpix_t),"Frmg");
+ Frmb=(fpix_t *)big_alloc(npix*sizeof(fpix_t),"Frmb");
+ DF_Image=(fpix_t *)big_alloc(npix*3*sizeof(fpix_t),"the dark field image");
+ FF_Image=(fpix_t *)big_alloc(npix*3*sizeof(fpix_t),"the flat field image");
+ Avr=(double *)big_alloc(npix*sizeof(double),"Avr");
+ Avg=(double *)big_alloc(npix*sizeof(double),"Avg");
+ Avb=(double *)big_alloc(npix*sizeof(double),"Avb");
+ if(!yuyv || !MaskIm || !RGBimg || !Frmr || !Frmg || !Frmb || !DF_Image || !FF_Image || !Avr || !Avg || !Avb){
+   fprintf(stderr,"\nNo RAM for a %ux%u test frame\n",wd,ht);
+   goto finish;
+  }
+ // Noise for the frame, a mask that leaves out about one pixel in
+ // eight, a small dark level and a flat field near 1
+ Mask_supp_size=0.0;
+ for(ipos=0;ipos<npix;ipos++){
+    seed=seed*1103515245u+12345u;
+    yuyv[ipos]=(unsigned short)(seed>>12);
+    MaskIm[ipos]=((seed>>8)&7) ? 1 : 0;
+    if(MaskIm[ipos]) Mask_supp_size+=1.0;
+   }
+ for(ipos=0;ipos<3*npix;ipos++){
+    seed=seed*1103515245u+12345u;
+    DF_Image[ipos]=(fpix_t)((seed>>16)&7);
+    FF_Image[ipos]=(fpix_t)(0.9+(double)((seed>>8)&0xff)/1275.0);
+   }
+ Need_to_preview=PREVIEW_OFF;
+ CamFormat=V4L2_PIX_FMT_YUYV;
+ col_conv_type=CCOL_TO_RGB;
+ do_df_correction=do_ff_correction=1;
+
+ // Single frames
+ Av_limit=1;
+ Accumulator_status=ACC_FREED;
+ clock_gettime(CLOCK_MONOTONIC,&t0);
+ for(frm=0;frm<PROCBENCH_FRAMES;frm++) colour_convert(yuyv);
+ t_single=membench_ms(&t0)/PROCBENCH_FRAMES;
+
+ // A mean scaled average of PROCBENCH_FRAMES frames
+ memset(Avr,0,npix*sizeof(double));
+ memset(Avg,0,npix*sizeof(double));
+ memset(Avb,0,npix*sizeof(double));
+ Av_limit=PROCBENCH_FRAMES;
+ Av_scalemean=1;
+ Av_added=0;
+ Av_luma=0;
+ Accumulator_status=ACC_ALLOCED;
+ clock_gettime(CLOCK_MONOTONIC,&t0);
+ for(Av_denom_idx=1;Av_denom_idx<=Av_limit;Av_denom_idx++) colour_convert(yuyv);
+ t_avg=membench_ms(&t0)/PROCBENCH_FRAMES;
+ clock_gettime(CLOCK_MONOTONIC,&t0);
+ run_bands(band_average_out, NULL);
+ t_out=membench_ms(&t0);
+ Accumulator_status=ACC_FREED;
+
+ fpix_mb=(npix*9*sizeof(fpix_t)+(1<<19))>>20; // Frm + dark + flat
+ acc_mb=(npix*3*sizeof(double)+(1<<19))>>20;  // Av
+ printf("\nFull-size processing of a %ux%u YUYV frame with dark and flat field\n",wd,ht);
+ printf("correction (%s frame stores, %s kernel, %d frames each):\n\n",FPIX_NAME,Yuyv_kernel_name,PROCBENCH_FRAMES);
+ printf("%-26s %8.2f ms\n","single frame",t_single);
+ printf("%-26s %8.2f ms\n","each frame of an average",t_avg);
+ printf("%-26s %8.2f ms\n","final division",t_out);
+ printf("\nFrame stores, dark and flat: %zu MB (%s), average stores: %zu MB\n",fpix_mb,FPIX_NAME,acc_mb);
+ printf("(check value %.4f)\n\n",(double)Frmr[npix/2]+Avg[npix-1]);
+ retval=0;
+
+finish:
+ band_pool_stop();
+ big_free(yuyv); big_free(MaskIm); big_free(RGBimg);
+ big_free(Frmr); big_free(Frmg); big_free(Frmb);
+ big_free(DF_Image); big_free(FF_Image);
+ big_free(Avr); big_free(Avg); big_free(Avb);
+ return retval;
+}
+
+static int run_headless(char *csfname)
+// Capture without the GUI (the --headless option). The camera is
+// started, the settings file csfname is checked and applied as if it
+// had been loaded in the camera settings window and 'Apply' clicked,
+// then the image or image series it describes is captured and saved.
+// A series is logged just as it is by btn_cam_save_click.
+// Returns one of the HLS_ exit codes.
+{
+ FILE *fp;
+ unsigned int linenum;
+ int enumresult,returnvalue;
+ char msgtxt[512],errmsg[256];
+
+ // The camera must be open to list its controls, which the settings
+ // file is checked against:
+ if(try_running_camera()){
+    show_message("Could not start the camera.","Headless FAILED: ",MT_ERR,0);
+    return HLS_ECAM;
+   }
+ enumresult=enumerate_camera_settings();
+ if(enumresult!=CSE_SUCCESS){
+    sprintf(msgtxt,"Failed to get %s settings from camera (VIDIOC_QUERYCTRL, %d)",NCSs?"some":"any",enumresult);
+    show_message(msgtxt,"Error: ",MT_ERR,0);
+    if(!NCSs) return HLS_ECAM;
+   }
+
+ // Check then load the settings file
+ fp = fopen(csfname, "rb");
+ if(fp == NULL){
+    sprintf(msgtxt,"Could not open %s",csfname);
+    show_message(msgtxt, "FAILED to Load Settings: ", MT_ERR, 0);
+    return HLS_ESETS;
+   }
+ sprintf(errmsg, "None provided.");
+ if(csetfile_check(fp, &linenum, errmsg)!=PCHK_ALL_GOOD){
+    sprintf(msgtxt, "[%s][%d]: %s\n", name_from_path(csfname), linenum, errmsg);
+    show_message(msgtxt, "FAILED to verify settings file: ", MT_ERR, 0);
+    fclose(fp);
+    return HLS_ESETS;
+   }
+ rewind(fp);
+ if(csetfile_load_headless(fp, &linenum, errmsg)!=PCHK_ALL_GOOD){
+    sprintf(msgtxt, "[%s][%d]: %s\n", name_from_path(csfname), linenum, errmsg);
+    show_message(msgtxt, "FAILED to load settings file: ", MT_ERR, 0);
+    fclose(fp);
+    return HLS_ESETS;
+   }
+ fclose(fp);
+ sprintf(CSFile,"%s",csfname);
+ csetfile_loaded=CSET_CUST;
+ sprintf(msgtxt, "Settings file loaded: %s (%s)\n", csfname, errmsg);
+ show_message(msgtxt, "FYI: ", MT_INFO, 0);
+
+ // Restart the camera at the chosen image size, stream format and
+ // number of capture buffers:
+ if(Selected_Ht!=ImHeight || Selected_Wd!=ImWidth){
+    if(change_image_dimensions()!=CID_OK) return HLS_ECAM;
+   } else if(re_init_device()) return HLS_ECAM;
+
+ // Set up the corrections. The mask comes first because dark and flat
+ // field pre-processing is confined to its region of support.
+ if(Headless_corr & HLC_MSK){
+    set_mask_pending();
+    if(mask_pending) mask_pending=init_mask_image();
+    if(mskfile_loaded!=MASK_YRGB || MKht!=ImHeight || MKwd!=ImWidth){
+       show_message("The corrections mask asked for cannot be applied.","Headless FAILED: ",MT_ERR,0);
+       return HLS_ESETS;
+      }
+    mask_status=MASK_YES;
+   } else set_mask_full_support(ImHeight,ImWidth);
+ if(Headless_corr & HLC_DF){
+    if(!df_pending || mask_alloced==MASK_NO || init_darkfield_image()){
+       show_message("The dark field image asked for cannot be applied.","Headless FAILED: ",MT_ERR,0);
+       return HLS_ESETS;
+      }
+    dfcorr_status=DFCORR_ON;
+   }
+ if(Headless_corr & HLC_FF){
+    if(!ff_pending || mask_alloced==MASK_NO || init_flatfield_image(0) || init_flatfield_image(1)){
+       show_message("The flat field image asked for cannot be applied.","Headless FAILED: ",MT_ERR,0);
+       return HLS_ESETS;
+      }
+    ffcorr_status=FFCORR_ON;
+   }
+
+ if(Delayed_start_on){
+    sprintf(msgtxt,"Starting in %.0f (s)",Delayed_start_seconds);
+    show_message(msgtxt,"FYI: ",MT_INFO,0);
+    sleep((unsigned int)Delayed_start_seconds);
+   }
+
+ if(Ser_Number>1){ // This is a series capture
+    Ser_active=1;
+    Ser_lastidx=Ser_idx=0;
+    // Open the series log and register the start time
+    sprintf(Ser_logname, "Series_%s.txt",ImRoot);
+    FPseries=fopen(Ser_logname,"wb");
+    if(FPseries==NULL){
+       show_message("Failed to open the series log file.\nSeries capture will commence but without a log file.","Series FAILED: ",MT_ERR,0);
+      } else {
+       fprintf(FPseries, "Log for PARD Capture Series\n");
+       fprintf(FPseries, "Start at: %s\n\n", ((time(&Ser_ts)) == -1) ? "[Time not available]" : ctime(&Ser_ts));
+       fprintf(FPseries, "Index\tInterval\tImage\tFrame\tDropped\tCaptured (UTC)\n");
+       fflush(FPseries);  fclose(FPseries);
+      }
+    show_message("Series capture START ...","FYI: ",MT_INFO,0);
+   }
+
+ returnvalue = grab_n_save();
+ if(returnvalue==GNS_ECAM || grab_report!=GRAB_ERR_NONE) returnvalue=HLS_EGRAB;
+  else returnvalue=HLS_OK;
+
+ if(Ser_active>0){ // This is the end of a series capture
+    // A series only succeeds if every capture in it did
+    if(Ser_idx<Ser_Number) returnvalue=HLS_EGRAB;
+    series_end_status();
+    FPseries=fopen(Ser_logname,"ab");
+    if(FPseries!=NULL){
+      fprintf(FPseries, "\nEnd at: %s\n", ((time(&Ser_ts)) == -1) ? "[Time not available]" : ctime(&Ser_ts));
+      fflush(FPseries); fclose(FPseries);
+     }
+    Ser_active=0;
+    Ser_idx=0;
+    show_message("Series capture ENDED","FYI: ",MT_INFO,0);
+   }
+
+ return returnvalue;
+}
+
 int main(int argc,char *argv[])
 {
     GtkWidget *grid_main,*grid_camset_main;
@@ -14785,16 +19644,33 @@ int main(int argc,char *argv[])
     int prev_int,prev_bias;
     int       idx,gridrow;
     char msgtxt[128];
+    char *hl_csfile = NULL;
+    char *mb_size = NULL;
+    char *cb_size = NULL;
+    char *pb_size = NULL;
+    char ch;
     time_t ts;
 
 
 // Check command like options:
 
 // Error, wrong number of command arguments
-if(argc>3){
+if(argc>21+2*MAX_AUXCAMS){
 args_fail:
-  fprintf(stderr,"\nUsage: %s [option] [argument]\n",argv[0]);
-  fprintf(stderr,"\n[option] can be: -h for help or -l followed by a file name for logging\n");
+  fprintf(stderr,"\nUsage: %s [option] [argument] ...\n",argv[0]);
+  fprintf(stderr,"\n[option] can be: -h for help, -l followed by a file name for logging\n");
+  fprintf(stderr,"or -s followed by a virtual frame source to use instead of a camera\n");
+  fprintf(stderr,"and -c followed by an additional camera (up to %d of these)\n",MAX_AUXCAMS);
+  fprintf(stderr,"or --headless followed by a settings file to capture without the GUI\n");
+  fprintf(stderr,"and -m followed by page, thp or huge (optionally with ,pin) to choose\n");
+  fprintf(stderr,"how the large image buffers are allocated or --membench followed by\n");
+  fprintf(stderr,"a frame size (WxH) to time each of those choices\n");
+  fprintf(stderr,"or --convbench followed by a frame size (WxH) to time the YUYV conversion\n");
+  fprintf(stderr,"or --procbench followed by a frame size (WxH) to time full-size processing\n");
+  fprintf(stderr,"and --bitpix followed by -64, -32 or 16 for double, float or integer FITS files\n");
+  fprintf(stderr,"and --bayer followed by bilinear or edge (optionally with ,mosaic) to choose\n");
+  fprintf(stderr,"how Bayer streams are demosaiced (and to save their mosaic as FITS too)\n");
+  fprintf(stderr,"and -j followed by the number of threads for full-size frames (0 = one per core)\n");
   fprintf(stderr,"\nSee the GitHub site for links to a full user manual:\n");
   fprintf(stderr,"\nhttps://github.com/TadPath/PARDUS\n\n");
 
@@ -14807,8 +19683,51 @@ if(!strcmp(argv[1],"-h")){
   // Print intro and licence info
   printf("\nPARD Capture Stand Alone (%s)\nCopyright (c) 2020-2023 by Dr Paul J. Tadrous\n\n%s\n\n",argv[0],License_note);
   // Print command line options
-  printf("\nUsage: %s [option] [argument]\n",argv[0]);
-  printf("\n[option] can be: -h for help or -l followed by a file name for logging\n");
+  printf("\nUsage: %s [option] [argument] ...\n",argv[0]);
+  printf("\n[option] can be: -h for help, -l followed by a file name for logging\n");
+  printf("or -s followed by a virtual frame source to use instead of a camera:\n");
+  printf("\n  -s synth[:WxH][:FPS]        Test pattern (default 640x480 at 30 fps)\n");
+  printf("  -s replay:FILE[:WxH][:FPS]  Replay recorded YUYV or MJPEG frames\n");
+  printf("\nFILE may contain a %%d conversion to replay numbered files in turn.\n");
+  printf("WxH is needed for YUYV replays.\n");
+  printf("\nUp to %d additional cameras can stream and save images along with\nthe main one:\n",MAX_AUXCAMS);
+  printf("\n  -c DEVICE[:WxH][:yuyv|:mjpeg][:N][:ROOT]\n");
+  printf("\nwhere N is the number of frames to average per image (default 1)\n");
+  printf("and ROOT the file name root for its images (default <main root>_camK).\n");
+  printf("\nTo capture without the GUI (e.g. from a script or over ssh) use:\n");
+  printf("\n  --headless SETTINGS_FILE\n");
+  printf("\nThe camera settings file (as saved from the camera settings window)\n");
+  printf("is applied, the image or series it describes is captured and the\n");
+  printf("program exits with status 0 if all went well, 1 if the settings\n");
+  printf("could not be applied, 2 if the camera could not be started or 3\n");
+  printf("if any image failed to capture.\n");
+  printf("\nThe large image buffers are page aligned. To back them with huge pages\n");
+  printf("and/or lock them into RAM use:\n");
+  printf("\n  -m page|thp|huge[,pin]\n");
+  printf("\nwhere thp asks for transparent huge pages and huge uses the reserved\n");
+  printf("huge page pool (see /proc/sys/vm/nr_hugepages). To time each of these\n");
+  printf("for a given frame size (no camera needed) use:\n");
+  printf("\n  --membench WxH\n");
+  printf("\nTo time the YUYV to RGB conversion of full frames on this CPU use:\n");
+  printf("\n  --convbench WxH\n");
+  printf("\nTo time the whole processing of full frames (conversion, dark and\n");
+  printf("flat field correction and averaging) with this build's frame stores\n");
+  printf("(%s) use:\n",FPIX_NAME);
+  printf("\n  --procbench WxH\n");
+  printf("\nFull-size frames are processed on all cores. To use N threads instead\n");
+  printf("(the results are the same whatever N is) use:\n");
+  printf("\n  -j N\n");
+  printf("\nFITS files are saved as doubles. To save them as floats (half the\n");
+  printf("size) use:\n");
+  printf("\n  --bitpix -32\n");
+  printf("\nor, to save them as 16 bit integers in the camera's own sample\n");
+  printf("units (e.g. 0 to 4095 for a Y12 stream), use:\n");
+  printf("\n  --bitpix 16\n");
+  printf("\nFrames from Bayer streams are demosaiced bilinearly. To use the\n");
+  printf("edge-aware kernel instead (sharper, but slower) use:\n");
+  printf("\n  --bayer edge\n");
+  printf("\nAdd ,mosaic (e.g. --bayer bilinear,mosaic) to also save the\n");
+  printf("undemosaiced mosaic as a FITS file when saving FITS in colour.\n");
   printf("\nSee the GitHub site for links to a full user manual.\n");
   printf("\nhttps://github.com/TadPath/PARDUS\n\n");
   exit(0);
@@ -14820,11 +19739,14 @@ if(!strcmp(argv[1],"-v")){
   exit(0);
  }
 
-// Check if the user wants log entries and check the usability of their
-// chosen log file name
-if(!strcmp(argv[1],"-l")){
- if(argc==3){
-   sprintf(LogFilename, "%s", argv[2]);
+// The remaining options each take an argument
+for(idx=1;idx<argc;idx+=2){
+ if(idx+1==argc) goto args_fail;
+
+ // Check if the user wants log entries and check the usability of their
+ // chosen log file name
+ if(!strcmp(argv[idx],"-l")){
+   sprintf(LogFilename, "%s", argv[idx+1]);
    fplog = fopen(LogFilename, "wb");
    if (fplog) {
                 fprintf(fplog, "Log file for PARD Capture session\n");
@@ -14832,7 +19754,7 @@ if(!strcmp(argv[1],"-l")){
                 fflush(fplog); fclose(fplog);
                 Log_wanted=1; // User want's logging and they got it
              } else {
-                fprintf(stderr,"\nChosen log file could not be accessed for writing (%s)\n",argv[2]);
+                fprintf(stderr,"\nChosen log file could not be accessed for writing (%s)\n",argv[idx+1]);
                 Log_wanted = -1; // User wanted logging but the file
                                  // name they selected is unwritable.
                                  // This flag lets us know to send them
@@ -14841,15 +19763,70 @@ if(!strcmp(argv[1],"-l")){
              }
    fplog = NULL; // This is important. Log file open/close functions
                  // check if fplog is NULL.
+  } else if(!strcmp(argv[idx],"-s")){
+   // User wants a virtual frame source in place of a camera
+   if(vsrc_parse_spec(argv[idx+1])) exit(1);
+  } else if(!strcmp(argv[idx],"-c")){
+   // User wants another camera streaming alongside the main one
+   if(auxcam_parse_spec(argv[idx+1])) exit(1);
+  } else if(!strcmp(argv[idx],"--headless")){
+   // User wants to capture without the GUI
+   Headless=1;
+   hl_csfile=argv[idx+1];
+  } else if(!strcmp(argv[idx],"-m")){
+   // User wants huge pages and/or locked memory for the big buffers
+   if(bigmem_parse_spec(argv[idx+1])) exit(1);
+  } else if(!strcmp(argv[idx],"--membench")){
+   // User wants the big buffer allocation modes timed
+   mb_size=argv[idx+1];
+  } else if(!strcmp(argv[idx],"-j")){
+   // User wants a set number of threads for full-size frames
+   if(sscanf(argv[idx+1],"%d%c",&Band_threads,&ch)!=1 || Band_threads<0 || Band_threads>BAND_MAX_THREADS){
+     fprintf(stderr,"\nThe number of threads must be 0 (one per core) to %d\n",BAND_MAX_THREADS);
+     exit(1);
+    }
+  } else if(!strcmp(argv[idx],"--convbench")){
+   // User wants the YUYV conversion kernels timed
+   cb_size=argv[idx+1];
+  } else if(!strcmp(argv[idx],"--procbench")){
+   // User wants the full-size processing timed
+   pb_size=argv[idx+1];
+  } else if(!strcmp(argv[idx],"--bitpix")){
+   // User wants FITS files saved as doubles, floats or integers
+   if(sscanf(argv[idx+1],"%d%c",&Fits_bitpix,&ch)!=1 || (Fits_bitpix!=-64 && Fits_bitpix!=-32 && Fits_bitpix!=16)){
+     fprintf(stderr,"\nThe FITS BITPIX must be -64 (doubles), -32 (floats) or 16 (integers)\n");
+     exit(1);
+    }
+  } else if(!strcmp(argv[idx],"--bayer")){
+   // User wants a Bayer demosaic kernel and/or the mosaic saved
+   if(!strcmp(argv[idx+1],"bilinear") || !strcmp(argv[idx+1],"bilinear,mosaic")) Bayer_demosaic=BAYER_BILINEAR;
+   else if(!strcmp(argv[idx+1],"edge") || !strcmp(argv[idx+1],"edge,mosaic")) Bayer_demosaic=BAYER_EDGE;
+   else {
+     fprintf(stderr,"\nThe Bayer demosaic must be bilinear or edge (optionally with ,mosaic)\n");
+     exit(1);
+    }
+   Bayer_mosaic_fits = (strstr(argv[idx+1],",mosaic")!=NULL);
   } else goto args_fail;
  }
 }
 
+if(mb_size!=NULL) exit(run_membench(mb_size));
+if(cb_size!=NULL) exit(run_convbench(cb_size));
+if(pb_size!=NULL) exit(run_procbench(pb_size));
+
  // Print intro and licence info
  printf("\nPARD Capture Stand Alone (%s)\nCopyright (c) 2020-2022 by Dr Paul J. Tadrous\n\n%s\n\n",argv[0],License_note);
 
  if(Log_wanted==1) printf("\nWriting session info to log file: %s\n", LogFilename);
  else printf("\nNo log file will be written\n");                
+ if(Vsrc_type != VSRC_NONE) printf("\nUsing virtual frame source: %s\n", Vsrc_spec);
+ for(idx=0;idx<N_auxcams;idx++) printf("\nAdditional camera %d: %s\n", idx+2, Auxcams[idx].name);
+ if(Headless) printf("\nRunning headless with settings file: %s\n", hl_csfile);
+ select_yuyv_kernel();
+ printf("\nFull-frame YUYV conversion: %s\n", Yuyv_kernel_name);
+ printf("\nFrame stores: %s\n", FPIX_NAME);
+ if(Bigmem_mode!=BIGMEM_PAGE || Bigmem_pin)
+   printf("\nLarge image buffers: %s%s\n", (Bigmem_mode==BIGMEM_HUGE) ? "huge pages" : ((Bigmem_mode==BIGMEM_THP) ? "transparent huge pages" : "page aligned"), Bigmem_pin ? ", locked in RAM" : "");
 
 // Generate the program's icon
  create_icon();
@@ -14857,7 +19834,7 @@ if(!strcmp(argv[1],"-l")){
 // Set up the GUI
 
  gui_up=0;
- if(gui_up==0){ 
+ if(gui_up==0 && !Headless){ 
     gtk_init(&argc,&argv);
 
     screen = gdk_screen_get_default();                                   
@@ -14952,7 +19929,7 @@ if(!strcmp(argv[1],"-l")){
     g_signal_connect (btn_help_about, "clicked", G_CALLBACK (btn_help_about_click), btn_help_about);
     
    // Preview frame integration control
-   preview_integration_adjustment = gtk_adjustment_new (1.0, 1.0, PREVINTMAX, 1.0, 1.0, 0.0);
+   preview_integration_adjustment = gtk_adjustment_new (1.0, 1.0, PREVINTMAX, 1.0, 10.0, 0.0);
    preview_integration_sbutton = gtk_spin_button_new (preview_integration_adjustment, 1.0, 0);
    prev_int=PADJUST_INTEGRAL;
    g_signal_connect (GTK_SPIN_BUTTON (preview_integration_sbutton), "value-changed", G_CALLBACK (grab_prev_adjust_value), &prev_int);
@@ -15066,14 +20043,14 @@ if(!strcmp(argv[1],"-l")){
    PrevStat.npixels=(double)(PreviewWd*PreviewHt);
    PrevStat.hgm_max_r=PrevStat.hgm_max_g=PrevStat.hgm_max_b=0.0;
 
-   Preview_dark = (double *)calloc(PreviewImg_size,sizeof(double));
+   Preview_dark = (fpix_t *)calloc(PreviewImg_size,sizeof(fpix_t));
    if(Preview_dark==NULL){
          show_message("No RAM available for preview image master dark.","Error: ",MT_ERR,0);
          return 1;
     }
    for(idx=0;idx<PreviewImg_size;idx++) Preview_dark[idx]=0.0;
 
-   Preview_flat = (double *)calloc(PreviewImg_size,sizeof(double));
+   Preview_flat = (fpix_t *)calloc(PreviewImg_size,sizeof(fpix_t));
    if(Preview_flat==NULL){
          show_message("No RAM available for preview image master dark.","Error: ",MT_ERR,0);
          return 1;
@@ -15096,15 +20073,26 @@ if(!strcmp(argv[1],"-l")){
          show_message("No RAM available for preview col sampler.","Error: ",MT_ERR,0);
          return 1;
     }
+   SSrow_j = (int *)calloc(PreviewHt,sizeof(int));
+   SScol_j = (int *)calloc(PreviewWd,sizeof(int));
+   if(SSrow_j==NULL || SScol_j==NULL){
+         show_message("No RAM available for the scaled preview samplers.","Error: ",MT_ERR,0);
+         return 1;
+    }
    for(idx=0;idx<PREVINTMAX;idx++){
-    PreviewBuff[idx] = (int *)calloc(1,sizeof(int));
+    PreviewBuff[idx] = (unsigned char *)calloc(1,sizeof(unsigned char));
      if(PreviewBuff[idx]==NULL){
          show_message("No RAM available for preview buffers.","Error: ",MT_ERR,0);
          return 1;
       }
    }
+   PreviewSum = (int *)calloc(PreviewImg_size,sizeof(int));
+   if(PreviewSum==NULL){
+         show_message("No RAM available for the preview integration sum.","Error: ",MT_ERR,0);
+         return 1;
+    }
   // We must have at least one preview frame buffer alloced
-  if(resize_memblk((void **)&PreviewBuff[0],(size_t)PreviewImg_size,sizeof(int), "the integration buffer")){
+  if(resize_memblk((void **)&PreviewBuff[0],(size_t)PreviewImg_size,sizeof(unsigned char), "the integration buffer")){
        show_message("No RAM available for prime preview buffer.","Error: ",MT_ERR,0);
        return 1;
       }
@@ -15226,6 +20214,9 @@ if(!strcmp(argv[1],"-l")){
    gtk_label_set_markup(GTK_LABEL(lab_stats_title2), btn_markup);
    g_free (btn_markup);
 
+   PrevSt_capture=gtk_label_new ("Capture buffers: -");
+   gtk_widget_set_halign (PrevSt_capture, GTK_ALIGN_START);
+
    add_button(&Prev_btn_hgm,"Histogram",GTK_ALIGN_END);
    g_signal_connect (Prev_btn_hgm, "clicked", G_CALLBACK (Prev_btn_hgm_click), Prev_btn_hgm);
 
@@ -15284,6 +20275,7 @@ if(!strcmp(argv[1],"-l")){
   gtk_grid_attach (GTK_GRID (Grid_prevstats), lab_b, 0, gridrow, 1, 1);
   gtk_grid_attach (GTK_GRID (Grid_prevstats), PrevSt_sat_b, 1, gridrow, 1, 1);
   gtk_grid_attach (GTK_GRID (Grid_prevstats), PrevSt_sum_b, 2, gridrow++, 1, 1);
+  gtk_grid_attach (GTK_GRID (Grid_prevstats), PrevSt_capture, 0, gridrow++, 3, 1);
 
 // Show the widgets in the main window (and hide exceptions):
     gtk_widget_show_all(Win_main);
@@ -15414,6 +20406,12 @@ if(!strcmp(argv[1],"-l")){
     // Create the Scale mean of each frame to first? option check box
     add_checkbox(&chk_scale_means);
 
+    // Create the Grab freshest frame? option check box
+    add_checkbox(&chk_freshest);
+
+    // Create the Y-only saves from MJPEG as JPEG luma? option check box
+    add_checkbox(&chk_jpeg_luma);
+
     // Create the Use cumulative histogram (Red/Grey)? option check box
     add_checkbox(&chk_usehcr);
 
@@ -15505,10 +20503,14 @@ if(!strcmp(argv[1],"-l")){
   // Set size paramters and allocate memory for a basic VGA-sized image:
   Selected_Ht=480;
   Selected_Wd=640;
+  if(Vsrc_type != VSRC_NONE){ // Start at the size of the virtual source
+    Selected_Ht=(int)Vsrc_ht;
+    Selected_Wd=(int)Vsrc_wd;
+   }
   RGBimg=(unsigned char *)calloc(1,sizeof(unsigned char));
-  Frmr=(double *)calloc(1,sizeof(double));
-  Frmg=(double *)calloc(1,sizeof(double));
-  Frmb=(double *)calloc(1,sizeof(double));
+  Frmr=(fpix_t *)calloc(1,sizeof(fpix_t));
+  Frmg=(fpix_t *)calloc(1,sizeof(fpix_t));
+  Frmb=(fpix_t *)calloc(1,sizeof(fpix_t));
   Frame_status=FRM_FREED;
   if(RGBimg==NULL){
          show_message("No RAM available for main image.","Error: ",MT_ERR,0);
@@ -15534,7 +20536,8 @@ if(!strcmp(argv[1],"-l")){
   Avr=(double *)calloc(1,sizeof(double));
   Avg=(double *)calloc(1,sizeof(double));
   Avb=(double *)calloc(1,sizeof(double));
-  if(Avr==NULL || Avg==NULL || Avb==NULL){
+  Avi=calloc(1,sizeof(unsigned int));
+  if(Avr==NULL || Avg==NULL || Avb==NULL || Avi==NULL){
          show_message("No RAM available for averaging accumulators.","Error: ",MT_ERR,0);
          return 1;
    }
@@ -15596,7 +20599,7 @@ if(!strcmp(argv[1],"-l")){
                        // porting to non-*ix OS
 
   // Initialise memory for the flat field correction image
-  FF_Image = (double *)calloc(2,sizeof(double));
+  FF_Image = (fpix_t *)calloc(2,sizeof(fpix_t));
   if(FF_Image==NULL){
     show_message("No RAM available for flat field correction image.","Error: ",MT_ERR,0);
     return 1;
@@ -15607,7 +20610,7 @@ if(!strcmp(argv[1],"-l")){
   FFht=FFwd=0;
 
   // Initialise memory for the dark field correction image
-  DF_Image = (double *)calloc(2,sizeof(double));
+  DF_Image = (fpix_t *)calloc(2,sizeof(fpix_t));
   if(DF_Image==NULL){
     show_message("No RAM available for dark field correction image.","Error: ",MT_ERR,0);
     return 1;
@@ -15632,13 +20635,15 @@ if(!strcmp(argv[1],"-l")){
   mask_alloced=MASK_NO;
   sprintf(Selected_Mask_filename,"[None]");
   
-  // Set the default image capture device to (this will be /dev/video0)
+  // Set the default image capture device to (this will be /dev/video0
+  // unless a virtual frame source was chosen with the -s option)
   Dev_Name = (char *)calloc(FILENAME_MAX,sizeof(char));
   if(Dev_Name==NULL){
          show_message("No RAM available for device name.","Error: ",MT_ERR,1);
          return 1;
    }
-  sprintf(Dev_Name,"/dev/video%d",DevNum);
+  if(Vsrc_type != VSRC_NONE) sprintf(Dev_Name,"%s",Vsrc_spec);
+   else sprintf(Dev_Name,"/dev/video%d",DevNum);
 
   // Set preview geometry defaults
   prev_flip_h=0;
@@ -15725,6 +20730,13 @@ if(!strcmp(argv[1],"-l")){
       sine_buffer[idx] =  (uint8_t)(250.0 * sin(((double)idx/DPABUFSIZE) * M_PI * 2.0) );
      }
 
+// In headless mode there is no GUI: just capture and exit.
+ if(Headless){
+   idx=run_headless(hl_csfile);
+   tidy_up();
+   return idx;
+  }
+
 // Start the GUI main loop - no code beyond this point will be executed
 // until the main window is closed.
  gui_up=1;    // Let all functions know the GUI is up